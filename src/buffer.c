@@ -89,6 +89,26 @@ void buffer_resize(MOBIBuffer *buf, const size_t newlen) {
     buf->error = MOBI_SUCCESS;
 }
 
+/**
+ @brief Make sure there is room for len more bytes in buffer, enlarge it if needed
+ 
+ Buffer grows at least twice, so that repeated small additions are amortized.
+ On allocation failure buf->error is set to MOBI_MALLOC_FAILED.
+ 
+ @param[in,out] buf MOBIBuffer structure to be filled with data
+ @param[in] len Number of bytes to be added
+ */
+void buffer_reserve(MOBIBuffer *buf, const size_t len) {
+    if (buf->offset + len <= buf->maxlen) {
+        return;
+    }
+    size_t newlen = buf->maxlen * 2;
+    if (newlen < buf->offset + len) {
+        newlen = buf->offset + len;
+    }
+    buffer_resize(buf, newlen);
+}
+
 /**
  @brief Adds 8-bit value to MOBIBuffer
  
@@ -135,8 +155,8 @@ void buffer_add32(MOBIBuffer *buf, const uint32_t data) {
         return;
     }
     unsigned char *buftr = buf->data + buf->offset;
-    *buftr++ = (uint8_t)((uint32_t)(data & 0xff000000U) >> 16);
-    *buftr++ = (uint8_t)((uint32_t)(data & 0xff0000U) >> 12);
+    *buftr++ = (uint8_t)((uint32_t)(data & 0xff000000U) >> 24);
+    *buftr++ = (uint8_t)((uint32_t)(data & 0xff0000U) >> 16);
     *buftr++ = (uint8_t)((uint32_t)(data & 0xff00U) >> 8);
     *buftr = (uint8_t)((uint32_t)(data & 0xffU));
     buf->offset += 4;
@@ -186,6 +206,35 @@ void buffer_addzeros(MOBIBuffer *buf, const size_t count) {
     buf->offset += count;
 }
 
+/**
+ @brief Adds variable length value to MOBIBuffer
+ 
+ Counterpart of buffer_get_varlen().
+ Value is stored in 7-bit groups, most significant first, bit 7 is set in the last byte.
+ Values larger than 28 bits are truncated, as reader handles at most 4 bytes.
+ 
+ @param[in,out] buf MOBIBuffer structure to be filled with data
+ @param[in] data Value to be added
+ */
+void buffer_add_varlen(MOBIBuffer *buf, const uint32_t data) {
+    uint8_t bytes[4];
+    size_t count = 0;
+    uint32_t value = data & 0xfffffffU;
+    do {
+        bytes[count++] = (uint8_t) (value & 0x7f);
+        value >>= 7;
+    } while (value && count < 4);
+    if (buf->offset + count > buf->maxlen) {
+        debug_print("%s", "Buffer full\n");
+        buf->error = MOBI_BUFFER_END;
+        return;
+    }
+    bytes[0] |= 0x80;
+    while (count) {
+        buf->data[buf->offset++] = bytes[--count];
+    }
+}
+
 /**
  @brief Reads 8-bit value from MOBIBuffer
  
@@ -507,6 +556,11 @@ void buffer_copy(MOBIBuffer *dest, MOBIBuffer *source, const size_t len) {
 void buffer_move(MOBIBuffer *buf, const int offset, const size_t len) {
     size_t aoffset = (size_t) abs(offset);
     unsigned char *source = buf->data + buf->offset;
+    if (buf->offset + len > buf->maxlen) {
+        debug_print("%s", "End of buffer\n");
+        buf->error = MOBI_BUFFER_END;
+        return;
+    }
     if (offset >= 0) {
         if (buf->offset + aoffset + len > buf->maxlen) {
             debug_print("%s", "End of buffer\n");
@@ -27,12 +27,14 @@ typedef struct {
 MOBIBuffer * buffer_init(const size_t len);
 MOBIBuffer * buffer_init_null(const size_t len);
 void buffer_resize(MOBIBuffer *buf, const size_t newlen);
+void buffer_reserve(MOBIBuffer *buf, const size_t len);
 void buffer_add8(MOBIBuffer *buf, const uint8_t data);
 void buffer_add16(MOBIBuffer *buf, const uint16_t data);
 void buffer_add32(MOBIBuffer *buf, const uint32_t data);
 void buffer_addraw(MOBIBuffer *buf, const unsigned char* data, const size_t len);
 void buffer_addstring(MOBIBuffer *buf, const char *str);
 void buffer_addzeros(MOBIBuffer *buf, const size_t count);
+void buffer_add_varlen(MOBIBuffer *buf, const uint32_t data);
 uint8_t buffer_get8(MOBIBuffer *buf);
 uint16_t buffer_get16(MOBIBuffer *buf);
 uint32_t buffer_get32(MOBIBuffer *buf);
@@ -9,6 +9,7 @@
  * See <http://www.gnu.org/licenses/>
  */
 
+#include <stdlib.h>
 #include <string.h>
 #include "compression.h"
 #include "buffer.h"
@@ -73,7 +74,7 @@ MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_
         }
         /* char '\0', not modified */
         else {
-            buffer_copy8(buf_out, buf_in);
+            buffer_add8(buf_out, byte);
         }
         if (buf_in->error || buf_out->error) {
             ret = MOBI_BUFFER_END;
@@ -85,6 +86,129 @@ MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_
     return ret;
 }
 
+/**
+ @brief Hash of three bytes used by PalmDOC LZ77 compressor
+ 
+ @param[in] data Pointer to at least three bytes of data
+ @return Hash value, less than MOBI_LZ77_HASH_SIZE
+ */
+static MOBI_INLINE size_t mobi_lz77_hash(const unsigned char *data) {
+    return (size_t) ((data[0] << 8) ^ (data[1] << 4) ^ data[2]) & (MOBI_LZ77_HASH_SIZE - 1);
+}
+
+/**
+ @brief Compressor for PalmDOC version of LZ77 compression
+ 
+ Counterpart of mobi_decompress_lz77().
+ Finds back references with hash chains limited to the 2047 bytes window.
+ Bytes that can't be stored as literals (0x00-0x08 and 0x80-0xff) are stored
+ in runs of at most 8 bytes, so out must have room for len_in + len_in / 8 + 1 bytes.
+ 
+ @param[out] out Compressed destination data
+ @param[in,out] len_out Size of the memory reserved for compressed data.
+ On return it is set to actual size of compressed data
+ @param[in] in Source data
+ @param[in] len_in Size of source data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_compress_lz77(unsigned char *out, size_t *len_out, const unsigned char *in, const size_t len_in) {
+    if (out == NULL || len_out == NULL || (in == NULL && len_in > 0)) {
+        return MOBI_PARAM_ERR;
+    }
+    long head[MOBI_LZ77_HASH_SIZE];
+    long prev[MOBI_LZ77_WINDOW + 1];
+    for (size_t i = 0; i < MOBI_LZ77_HASH_SIZE; i++) {
+        head[i] = -1;
+    }
+    const size_t out_max = *len_out;
+    size_t o = 0;
+    size_t i = 0;
+    size_t inserted = 0;
+    while (i < len_in) {
+        /* update hash chains up to current position */
+        while (inserted < i && inserted + 3 <= len_in) {
+            const size_t hash = mobi_lz77_hash(in + inserted);
+            prev[inserted & MOBI_LZ77_WINDOW] = head[hash];
+            head[hash] = (long) inserted;
+            inserted++;
+        }
+        if (inserted < i) {
+            inserted = i;
+        }
+        size_t best_length = 0;
+        size_t best_distance = 0;
+        if (i + 3 <= len_in) {
+            size_t max_length = len_in - i;
+            if (max_length > MOBI_LZ77_MATCH_MAX) {
+                max_length = MOBI_LZ77_MATCH_MAX;
+            }
+            long candidate = head[mobi_lz77_hash(in + i)];
+            size_t chain = 0;
+            while (candidate >= 0 && i - (size_t) candidate <= MOBI_LZ77_WINDOW && chain++ < MOBI_LZ77_CHAIN_MAX) {
+                size_t length = 0;
+                while (length < max_length && in[(size_t) candidate + length] == in[i + length]) {
+                    length++;
+                }
+                if (length > best_length) {
+                    best_length = length;
+                    best_distance = i - (size_t) candidate;
+                    if (length == max_length) {
+                        break;
+                    }
+                }
+                const long next = prev[(size_t) candidate & MOBI_LZ77_WINDOW];
+                if (next >= candidate) {
+                    /* slot was reused by newer position */
+                    break;
+                }
+                candidate = next;
+            }
+        }
+        if (best_length >= 3) {
+            /* length, distance pair */
+            if (o + 2 > out_max) {
+                return MOBI_BUFFER_END;
+            }
+            const uint16_t pair = (uint16_t) (0x8000 | (best_distance << 3) | (best_length - 3));
+            out[o++] = (unsigned char) (pair >> 8);
+            out[o++] = (unsigned char) (pair & 0xff);
+            i += best_length;
+            continue;
+        }
+        const unsigned char byte = in[i];
+        if (byte == ' ' && i + 1 < len_in && in[i + 1] >= 0x40 && in[i + 1] <= 0x7f) {
+            /* byte pair: space + char */
+            if (o + 1 > out_max) {
+                return MOBI_BUFFER_END;
+            }
+            out[o++] = in[i + 1] ^ 0x80;
+            i += 2;
+        } else if (byte >= 0x09 && byte <= 0x7f) {
+            /* single char */
+            if (o + 1 > out_max) {
+                return MOBI_BUFFER_END;
+            }
+            out[o++] = byte;
+            i++;
+        } else {
+            /* run of at most 8 chars stored as they are */
+            size_t count = 1;
+            while (count < 8 && i + count < len_in && (in[i + count] < 0x09 || in[i + count] > 0x7f)) {
+                count++;
+            }
+            if (o + count + 1 > out_max) {
+                return MOBI_BUFFER_END;
+            }
+            out[o++] = (unsigned char) count;
+            memcpy(out + o, in + i, count);
+            o += count;
+            i += count;
+        }
+    }
+    *len_out = o;
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Read at most 8 bytes from buffer, big-endian
  
@@ -113,17 +237,25 @@ static MOBI_INLINE uint64_t buffer_fill64(MOBIBuffer *buf) {
  perl EBook::Tools::Mobipocket
  python mobiunpack.py, calibre
  
+ Compressed symbols expanded by mobi_expand_huffman_symbols() are copied
+ instead of being decompressed recursively, if they would fit in output buffer
+ and would not exceed recursion limit.
+ 
  @param[out] buf_out MOBIBuffer structure with decompressed data
  @param[in] buf_in MOBIBuffer structure with compressed data
  @param[in] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
  @param[in] depth Depth of current recursion level
+ @param[in,out] max_depth Maximal depth of recursion reached
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer *buf_in, const MOBIHuffCdic *huffcdic, size_t depth) {
+static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer *buf_in, const MOBIHuffCdic *huffcdic, size_t depth, size_t *max_depth) {
     if (depth > MOBI_HUFFMAN_MAXDEPTH) {
         debug_print("Too many levels of recursion: %zu\n", depth);
         return MOBI_DATA_CORRUPT;
     }
+    if (depth > *max_depth) {
+        *max_depth = depth;
+    }
     MOBI_RET ret = MOBI_SUCCESS;
     int8_t bitcount = 32;
     /* this cast should be safe: max record size is 4096 */
@@ -158,35 +290,151 @@ static MOBI_RET mobi_decompress_huffman_internal(MOBIBuffer *buf_out, MOBIBuffer
         uint32_t index = (uint32_t) (maxcode - code) >> (32 - code_length);
         /* check which part of cdic to use */
         uint8_t cdic_index = (uint8_t) ((uint32_t)index >> huffcdic->code_length);
-        if (index >= huffcdic->index_count) {
+        if (index >= huffcdic->index_read) {
             debug_print("Wrong symbol offsets index: %u\n", index);
             return MOBI_DATA_CORRUPT;
         }
         /* get offset */
         uint32_t offset = huffcdic->symbol_offsets[index];
+        if (offset + 2 > huffcdic->symbols_size[cdic_index]) {
+            debug_print("Wrong symbol offset: %u\n", offset);
+            return MOBI_DATA_CORRUPT;
+        }
         uint32_t symbol_length = (uint32_t) huffcdic->symbols[cdic_index][offset] << 8 | (uint32_t) huffcdic->symbols[cdic_index][offset + 1];
         /* 1st bit is is_decompressed flag */
         int is_decompressed = symbol_length >> 15;
         /* get rid of flag */
         symbol_length &= 0x7fff;
+        if (offset + 2 + symbol_length > huffcdic->symbols_size[cdic_index]) {
+            debug_print("Symbol too long: %u\n", symbol_length);
+            return MOBI_DATA_CORRUPT;
+        }
+        const MOBIHuffSymbol *expanded = huffcdic->expanded ? &huffcdic->expanded[index] : NULL;
         if (is_decompressed) {
             /* symbol is at (offset + 2), 2 bytes used earlier for symbol length */
             buffer_addraw(buf_out, (huffcdic->symbols[cdic_index] + offset + 2), symbol_length);
             ret = buf_out->error;
+        } else if (expanded && expanded->data
+                   && depth + expanded->depth <= MOBI_HUFFMAN_MAXDEPTH
+                   && buf_out->offset + expanded->length <= buf_out->maxlen) {
+            /* symbol was already expanded */
+            buffer_addraw(buf_out, expanded->data, expanded->length);
+            ret = buf_out->error;
+            if (depth + expanded->depth > *max_depth) {
+                *max_depth = depth + expanded->depth;
+            }
         } else {
             /* symbol is compressed */
-            /* TODO cache uncompressed symbols? */
             MOBIBuffer buf_sym;
             buf_sym.data = huffcdic->symbols[cdic_index] + offset + 2;
             buf_sym.offset = 0;
             buf_sym.maxlen = symbol_length;
             buf_sym.error = MOBI_SUCCESS;
-            ret = mobi_decompress_huffman_internal(buf_out, &buf_sym, huffcdic, depth + 1);
+            ret = mobi_decompress_huffman_internal(buf_out, &buf_sym, huffcdic, depth + 1, max_depth);
         }
     }
     return ret;
 }
 
+/**
+ @brief Expand compressed symbols of huff/cdic dictionary
+ 
+ Each compressed symbol is decompressed once and kept in huffcdic structure,
+ so that decompressor copies it instead of decoding it again on every use.
+ Symbols which fail to decompress, are longer than MOBI_HUFFMAN_SYMBOL_MAX
+ or exceed MOBI_HUFFMAN_CACHE_MAX in total are left for recursive decompression.
+ 
+ @param[in,out] huffcdic MOBIHuffCdic structure with parsed data from huff/cdic records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_expand_huffman_symbols(MOBIHuffCdic *huffcdic) {
+    if (huffcdic->index_read == 0) {
+        return MOBI_SUCCESS;
+    }
+    MOBIHuffSymbol *expanded = calloc(huffcdic->index_read, sizeof(MOBIHuffSymbol));
+    /* offsets of expanded data in storage, which may move while it grows */
+    size_t *offsets = malloc(huffcdic->index_read * sizeof(*offsets));
+    unsigned char *symbol = malloc(MOBI_HUFFMAN_SYMBOL_MAX);
+    if (expanded == NULL || offsets == NULL || symbol == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        free(expanded);
+        free(offsets);
+        free(symbol);
+        return MOBI_MALLOC_FAILED;
+    }
+    unsigned char *storage = NULL;
+    size_t storage_size = 0;
+    size_t storage_used = 0;
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t index = 0; index < huffcdic->index_read && ret == MOBI_SUCCESS; index++) {
+        const size_t cdic_index = index >> huffcdic->code_length;
+        const uint32_t offset = huffcdic->symbol_offsets[index];
+        if (offset + 2 > huffcdic->symbols_size[cdic_index]) {
+            continue;
+        }
+        const unsigned char *data = huffcdic->symbols[cdic_index] + offset;
+        const uint32_t symbol_length = (uint32_t) data[0] << 8 | (uint32_t) data[1];
+        if ((symbol_length >> 15) || offset + 2 + symbol_length > huffcdic->symbols_size[cdic_index]) {
+            continue;
+        }
+        MOBIBuffer buf_sym;
+        buf_sym.data = (unsigned char *) data + 2;
+        buf_sym.offset = 0;
+        buf_sym.maxlen = symbol_length;
+        buf_sym.error = MOBI_SUCCESS;
+        MOBIBuffer buf_out;
+        buf_out.data = symbol;
+        buf_out.offset = 0;
+        buf_out.maxlen = MOBI_HUFFMAN_SYMBOL_MAX;
+        buf_out.error = MOBI_SUCCESS;
+        /* same depth as symbol decompressed from top level */
+        size_t depth = 0;
+        if (mobi_decompress_huffman_internal(&buf_out, &buf_sym, huffcdic, 1, &depth) != MOBI_SUCCESS) {
+            continue;
+        }
+        if (storage_used + buf_out.offset > MOBI_HUFFMAN_CACHE_MAX) {
+            break;
+        }
+        if (storage_used + buf_out.offset > storage_size) {
+            size_t new_size = storage_size ? storage_size * 2 : MOBI_HUFFMAN_SYMBOL_MAX * 16;
+            while (new_size < storage_used + buf_out.offset) {
+                new_size *= 2;
+            }
+            unsigned char *tmp = realloc(storage, new_size);
+            if (tmp == NULL) {
+                debug_print("%s\n", "Memory allocation failed");
+                ret = MOBI_MALLOC_FAILED;
+                break;
+            }
+            storage = tmp;
+            storage_size = new_size;
+        }
+        memcpy(storage + storage_used, symbol, buf_out.offset);
+        offsets[index] = storage_used;
+        expanded[index].length = (uint32_t) buf_out.offset;
+        expanded[index].depth = (uint32_t) depth;
+        /* mark as expanded, pointer is set when storage stops moving */
+        expanded[index].data = symbol;
+        storage_used += buf_out.offset;
+    }
+    free(symbol);
+    if (ret != MOBI_SUCCESS) {
+        free(storage);
+        free(expanded);
+        free(offsets);
+        return ret;
+    }
+    for (size_t index = 0; index < huffcdic->index_read; index++) {
+        if (expanded[index].data) {
+            expanded[index].data = storage + offsets[index];
+        }
+    }
+    free(offsets);
+    huffcdic->expanded = expanded;
+    huffcdic->expanded_data = storage;
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Decompressor for huff/cdic compressed text records
  
@@ -218,7 +466,8 @@ MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, si
     /* or is there a better way? */
     buf_in->data = (unsigned char *) in;
     buf_out->data = out;
-    MOBI_RET ret = mobi_decompress_huffman_internal(buf_out, buf_in, huffcdic, 0);
+    size_t max_depth = 0;
+    MOBI_RET ret = mobi_decompress_huffman_internal(buf_out, buf_in, huffcdic, 0, &max_depth);
     *len_out = buf_out->offset;
     buffer_free_null(buf_out);
     buffer_free_null(buf_in);
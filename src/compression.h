@@ -21,11 +21,28 @@
 /* FIXME: what is the reasonable value? */
 #define MOBI_HUFFMAN_MAXDEPTH 20 /**< Maximal recursion level for huffman decompression routine */
 
+#define MOBI_HUFFMAN_SYMBOL_MAX 0x1000 /**< Maximal length of expanded huffman symbol kept in cache */
+#define MOBI_HUFFMAN_CACHE_MAX 0x800000 /**< Maximal total length of expanded huffman symbols kept in cache */
+
+#define MOBI_LZ77_WINDOW 0x7ff /**< Maximal LZ77 back reference distance, also mask for hash chain positions */
+#define MOBI_LZ77_MATCH_MAX 10 /**< Maximal LZ77 back reference length */
+#define MOBI_LZ77_HASH_SIZE 0x1000 /**< Size of LZ77 compressor hash table, power of two */
+#define MOBI_LZ77_CHAIN_MAX 64 /**< Maximal number of hash chain candidates checked by LZ77 compressor */
+
 
 /**
- @brief Parsed data from HUFF and CDIC records needed to unpack huffman compressed text
+ @brief Expanded compressed huffman symbol
  */
 typedef struct {
+    unsigned char *data; /**< Expanded symbol data, NULL if symbol is not compressed or was not expanded */
+    uint32_t length; /**< Length of expanded data */
+    uint32_t depth; /**< Recursion depth reached while expanding symbol, starting from 1 */
+} MOBIHuffSymbol;
+
+/**
+ @brief Parsed data from HUFF and CDIC records needed to unpack huffman compressed text
+ */
+typedef struct MOBIHuffCdic {
     size_t index_count; /**< Total number of indices in all CDIC records, stored in each CDIC record header */
     size_t index_read; /**< Number of indices parsed, used by parser */
     size_t code_length; /**< Code length value stored in CDIC record header */
@@ -34,9 +51,14 @@ typedef struct {
     uint32_t maxcode_table[33]; /**< Table of big-endian maxcodes from HUFF record data2 */
     uint16_t *symbol_offsets; /**< Index of symbol offsets parsed from CDIC records (index_count entries) */
     unsigned char **symbols; /**< Array of pointers to start of symbols data in each CDIC record (index = number of CDIC record) */
+    size_t *symbols_size; /**< Array of sizes of symbols data in each CDIC record */
+    MOBIHuffSymbol *expanded; /**< Expanded compressed symbols (index_count entries) or NULL */
+    unsigned char *expanded_data; /**< Storage for expanded symbols data */
 } MOBIHuffCdic;
 
 MOBI_RET mobi_decompress_lz77(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in);
+MOBI_RET mobi_compress_lz77(unsigned char *out, size_t *len_out, const unsigned char *in, const size_t len_in);
 MOBI_RET mobi_decompress_huffman(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, const MOBIHuffCdic *huffcdic);
+MOBI_RET mobi_expand_huffman_symbols(MOBIHuffCdic *huffcdic);
 
 #endif
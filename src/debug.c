@@ -10,6 +10,7 @@
  */
 
 #include <stdlib.h>
+#include <string.h>
 
 #include "debug.h"
 #include "index.h"
@@ -72,6 +73,93 @@ void *debug_calloc(const size_t num, const size_t size, const char *file, const
     return ptr;
 }
 
+/**
+ @brief Allocation counters, updated only if library is built with --enable-alloc-stats
+ */
+static MOBIAllocStats alloc_stats;
+
+#if defined(__GNUC__)
+# define stats_add(counter, value) __atomic_fetch_add(&(counter), (value), __ATOMIC_RELAXED)
+#else
+/* counters may be inexact if allocations run concurrently */
+# define stats_add(counter, value) ((counter) += (value))
+#endif
+
+/**
+ @brief Counting wrapper for free(void *ptr)
+ 
+ @param[in] ptr Pointer
+ */
+void stats_free(void *ptr) {
+    if (ptr) {
+        stats_add(alloc_stats.frees, 1);
+    }
+    (free)(ptr);
+}
+
+/**
+ @brief Counting wrapper for malloc(size_t size)
+ 
+ @param[in] size Size of memory
+ @return A pointer to the allocated memory block on success, NULL on failure
+ */
+void *stats_malloc(const size_t size) {
+    stats_add(alloc_stats.allocs, 1);
+    stats_add(alloc_stats.bytes, size);
+    return (malloc)(size);
+}
+
+/**
+ @brief Counting wrapper for realloc(void* ptr, size_t size)
+ 
+ @param[in] ptr Pointer
+ @param[in] size Size of memory
+ @return A pointer to the reallocated memory block on success, NULL on failure
+ */
+void *stats_realloc(void *ptr, const size_t size) {
+    stats_add(alloc_stats.reallocs, 1);
+    stats_add(alloc_stats.bytes, size);
+    return (realloc)(ptr, size);
+}
+
+/**
+ @brief Counting wrapper for calloc(size_t num, size_t size)
+ 
+ @param[in] num Number of elements to allocate
+ @param[in] size Size of each element
+ @return A pointer to the allocated memory block on success, NULL on failure
+ */
+void *stats_calloc(const size_t num, const size_t size) {
+    stats_add(alloc_stats.allocs, 1);
+    stats_add(alloc_stats.bytes, num * size);
+    return (calloc)(num, size);
+}
+
+/**
+ @brief Get memory allocation counters
+ 
+ Counters are cumulative for the whole process. Take a snapshot before and after
+ the measured operation and subtract.
+ 
+ @param[in,out] stats Structure to be filled with current counters
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_INIT_FAILED if library was built without --enable-alloc-stats
+ */
+MOBI_RET mobi_get_alloc_stats(MOBIAllocStats *stats) {
+    if (stats == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+#if MOBI_ALLOC_STATS && !MOBI_DEBUG_ALLOC
+    stats->allocs = stats_add(alloc_stats.allocs, 0);
+    stats->reallocs = stats_add(alloc_stats.reallocs, 0);
+    stats->frees = stats_add(alloc_stats.frees, 0);
+    stats->bytes = stats_add(alloc_stats.bytes, 0);
+    return MOBI_SUCCESS;
+#else
+    memset(stats, 0, sizeof(MOBIAllocStats));
+    return MOBI_INIT_FAILED;
+#endif
+}
+
 /**
  @brief Dump index values
  
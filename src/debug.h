@@ -30,8 +30,24 @@
 #define realloc(x, y) debug_realloc(x, y, __FILE__, __LINE__)
 #define calloc(x, y) debug_calloc(x, y, __FILE__, __LINE__)
 /** @} */
+#elif MOBI_ALLOC_STATS
+/**
+ @defgroup mobi_stats Counting wrappers for memory allocation functions
+ 
+ Set this on by running "configure --enable-alloc-stats"
+ @{
+ */
+#define free(x) stats_free(x)
+#define malloc(x) stats_malloc(x)
+#define realloc(x, y) stats_realloc(x, y)
+#define calloc(x, y) stats_calloc(x, y)
+/** @} */
 #endif
 
+void stats_free(void *ptr);
+void *stats_malloc(const size_t size);
+void *stats_realloc(void *ptr, const size_t size);
+void *stats_calloc(const size_t num, const size_t size);
 void debug_free(void *ptr, const char *file, const int line);
 void *debug_malloc(const size_t size, const char *file, const int line);
 void *debug_realloc(void *ptr, const size_t size, const char *file, const int line);
@@ -0,0 +1,685 @@
+/** @file diff.c
+ *  @brief Record level difference between two editions of document
+ *
+ * Records of both documents are divided into sections (header, text, index,
+ * resources, other) and hashed in parallel. Records with equal content are
+ * matched within their section, the rest are paired by position between
+ * matched ones. Changed text records are mapped to markup parts
+ * using location map of the second document.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "diff.h"
+#include "thread.h"
+#include "util.h"
+#include "debug.h"
+
+/**
+ @brief Record prepared for comparison
+ */
+typedef struct {
+    const MOBIPdbRecord *record; /**< PDB record */
+    size_t seqnumber; /**< Sequence number of record */
+    MOBISection section; /**< Section of record */
+    uint64_t hash; /**< Hash of record data */
+} MOBIDiffRecord;
+
+/**
+ @brief Hashing job, range of records
+ */
+typedef struct {
+    MOBIDiffRecord *records; /**< First record of range */
+    size_t count; /**< Number of records in range */
+} MOBIDiffJob;
+
+/**
+ @brief Initializer for MOBIDiff structure
+
+ It allocates memory for structure.
+ Memory should be freed with mobi_free_diff().
+
+ @return MOBIDiff on success, NULL otherwise
+ */
+MOBIDiff * mobi_init_diff(void) {
+    MOBIDiff *diff = calloc(1, sizeof(MOBIDiff));
+    if (diff == NULL) {
+        debug_print("%s", "Memory allocation for diff failed\n");
+        return NULL;
+    }
+    return diff;
+}
+
+/**
+ @brief Free results of MOBIDiff structure, leave it empty
+
+ @param[in,out] diff MOBIDiff structure
+ */
+static void mobi_diff_reset(MOBIDiff *diff) {
+    free(diff->records);
+    free(diff->parts);
+    diff->records = NULL;
+    diff->parts = NULL;
+    diff->records_count = 0;
+    diff->parts_count = 0;
+}
+
+/**
+ @brief Free MOBIDiff structure
+
+ @param[in] diff MOBIDiff structure
+ */
+void mobi_free_diff(MOBIDiff *diff) {
+    if (diff == NULL) {
+        return;
+    }
+    mobi_diff_reset(diff);
+    free(diff);
+}
+
+/**
+ @brief Get section of record
+
+ Only text records of parsed part of hybrid file are classified as text.
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] record PDB record
+ @param[in] seqnumber Sequence number of record
+ @param[in] first_resource Sequence number of the first resource record
+ @return Section of record
+ */
+static MOBISection mobi_diff_section(const MOBIData *m, const MOBIPdbRecord *record, const size_t seqnumber, const size_t first_resource) {
+    if (seqnumber == 0 || (m->kf8_boundary_offset != MOBI_NOTSET && seqnumber == m->kf8_boundary_offset + 1)) {
+        return MOBI_SECTION_HEADER;
+    }
+    const size_t first_text = 1 + mobi_get_kf8offset(m);
+    if (m->rh && seqnumber >= first_text && seqnumber < first_text + m->rh->text_record_count) {
+        return MOBI_SECTION_TEXT;
+    }
+    if (record->size >= 4 && memcmp(record->data, INDX_MAGIC, 4) == 0) {
+        return MOBI_SECTION_INDEX;
+    }
+    if (seqnumber >= first_resource) {
+        const MOBIFiletype type = mobi_determine_resource_type(record);
+        if (type != T_UNKNOWN && type != T_BREAK) {
+            return MOBI_SECTION_RESOURCE;
+        }
+    }
+    return MOBI_SECTION_OTHER;
+}
+
+/**
+ @brief Prepare array of records for comparison
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] records Array of records
+ @param[out] count Number of records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_records(const MOBIData *m, MOBIDiffRecord **records, size_t *count) {
+    size_t records_count = 0;
+    for (const MOBIPdbRecord *curr = m->rec; curr != NULL; curr = curr->next) {
+        records_count++;
+    }
+    *records = malloc((records_count + 1) * sizeof(MOBIDiffRecord));
+    if (*records == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t first_resource = mobi_get_first_resource_record(m);
+    if (first_resource == MOBI_NOTSET) {
+        first_resource = 0;
+    }
+    size_t i = 0;
+    for (const MOBIPdbRecord *curr = m->rec; curr != NULL; curr = curr->next, i++) {
+        (*records)[i].record = curr;
+        (*records)[i].seqnumber = i;
+        (*records)[i].section = mobi_diff_section(m, curr, i, first_resource);
+        (*records)[i].hash = 0;
+    }
+    *count = records_count;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Thread entry point of hashing job
+
+ @param[in,out] arg MOBIDiffJob structure
+ @return NULL
+ */
+static void * mobi_diff_hash_thread(void *arg) {
+    MOBIDiffJob *job = arg;
+    for (size_t i = 0; i < job->count; i++) {
+        const MOBIPdbRecord *record = job->records[i].record;
+        job->records[i].hash = mobi_hash64(record->data, record->size);
+    }
+    return NULL;
+}
+
+/**
+ @brief Hash records in worker threads
+
+ @param[in,out] records Array of records
+ @param[in] count Number of records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_hash(MOBIDiffRecord *records, const size_t count) {
+    const size_t jobs_count = mobi_jobs_count(count, MOBI_DIFF_JOB_MIN);
+    MOBIDiffJob *jobs = malloc(jobs_count * sizeof(MOBIDiffJob));
+    if (jobs == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t i = 0; i < jobs_count; i++) {
+        const size_t first = count * i / jobs_count;
+        jobs[i].records = records + first;
+        jobs[i].count = count * (i + 1) / jobs_count - first;
+    }
+    mobi_run_jobs(jobs, sizeof(MOBIDiffJob), jobs_count, mobi_diff_hash_thread);
+    free(jobs);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Add changed record to results
+
+ @param[in,out] diff MOBIDiff structure
+ @param[in,out] max_count Allocated number of results
+ @param[in] section Section of record
+ @param[in] status Kind of change
+ @param[in] seqnumber_a Sequence number in first document or MOBI_NOTSET
+ @param[in] seqnumber_b Sequence number in second document or MOBI_NOTSET
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_add(MOBIDiff *diff, size_t *max_count, const MOBISection section, const MOBIDiffStatus status, const size_t seqnumber_a, const size_t seqnumber_b) {
+    if (diff->records_count == *max_count) {
+        const size_t new_count = *max_count ? 2 * *max_count : 16;
+        MOBIRecordDiff *tmp = realloc(diff->records, new_count * sizeof(MOBIRecordDiff));
+        if (tmp == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        diff->records = tmp;
+        *max_count = new_count;
+    }
+    MOBIRecordDiff *change = &diff->records[diff->records_count++];
+    change->section = section;
+    change->status = status;
+    change->seqnumber_a = seqnumber_a;
+    change->seqnumber_b = seqnumber_b;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Record of one document in sorted array of records of both documents
+ */
+typedef struct {
+    uint64_t hash; /**< Hash of record data */
+    size_t size; /**< Size of record data */
+    size_t side; /**< 0 for first document, 1 for second */
+    size_t index; /**< Index of record in section */
+} MOBIDiffKey;
+
+/**
+ @brief State of section alignment
+ */
+typedef struct {
+    MOBIDiff *diff; /**< Results */
+    size_t max_count; /**< Allocated number of results */
+    bool *removed_before; /**< Flags indexed by sequence number of second document text record, text was removed before it */
+} MOBIDiffAlign;
+
+/**
+ @brief Compare keys by content, then by document and position, for qsort
+
+ @param[in] a First key
+ @param[in] b Second key
+ @return Comparison result as in qsort()
+ */
+static int mobi_diff_key_compare(const void *a, const void *b) {
+    const MOBIDiffKey *key_a = a;
+    const MOBIDiffKey *key_b = b;
+    if (key_a->hash != key_b->hash) {
+        return key_a->hash < key_b->hash ? -1 : 1;
+    }
+    if (key_a->size != key_b->size) {
+        return key_a->size < key_b->size ? -1 : 1;
+    }
+    if (key_a->side != key_b->side) {
+        return key_a->side < key_b->side ? -1 : 1;
+    }
+    return (key_a->index > key_b->index) - (key_a->index < key_b->index);
+}
+
+/**
+ @brief Match records of both documents with equal content, keeping their order
+
+ Records whose content is unique in both documents are matched first, as many of them
+ as keep their relative order (longest increasing subsequence). Between each two such anchors
+ remaining records with equal content are matched in order of their positions.
+
+ @param[out] match Index of matching record of second document for each record of first one, MOBI_NOTSET if none
+ @param[in] a Records of first document in section
+ @param[in] count_a Number of records of first document
+ @param[in] b Records of second document in section
+ @param[in] count_b Number of records of second document
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_match(size_t *match, const MOBIDiffRecord **a, const size_t count_a, const MOBIDiffRecord **b, const size_t count_b) {
+    const size_t count = count_a + count_b;
+    MOBIDiffKey *keys = malloc((count + 1) * sizeof(MOBIDiffKey));
+    /* range of keys of second document records with the same content, for each record of first one */
+    size_t *group_start = malloc((count_a + 1) * sizeof(size_t));
+    size_t *group_end = malloc((count_a + 1) * sizeof(size_t));
+    /* unique matches ordered by first document position, then their longest increasing subsequence */
+    size_t *unique = malloc((count_a + 1) * sizeof(size_t));
+    size_t *tails = malloc((count_a + 1) * sizeof(size_t));
+    size_t *previous = malloc((count_a + 1) * sizeof(size_t));
+    if (keys == NULL || group_start == NULL || group_end == NULL || unique == NULL || tails == NULL || previous == NULL) {
+        free(keys);
+        free(group_start);
+        free(group_end);
+        free(unique);
+        free(tails);
+        free(previous);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t i = 0; i < count_a; i++) {
+        keys[i] = (MOBIDiffKey) { a[i]->hash, a[i]->record->size, 0, i };
+        match[i] = MOBI_NOTSET;
+        unique[i] = MOBI_NOTSET;
+    }
+    for (size_t j = 0; j < count_b; j++) {
+        keys[count_a + j] = (MOBIDiffKey) { b[j]->hash, b[j]->record->size, 1, j };
+    }
+    qsort(keys, count, sizeof(MOBIDiffKey), mobi_diff_key_compare);
+    size_t k = 0;
+    while (k < count) {
+        size_t first_b = k;
+        while (first_b < count && keys[first_b].side == 0 && keys[first_b].hash == keys[k].hash && keys[first_b].size == keys[k].size) {
+            first_b++;
+        }
+        size_t last = first_b;
+        while (last < count && keys[last].hash == keys[k].hash && keys[last].size == keys[k].size) {
+            last++;
+        }
+        if (first_b - k == 1 && last - first_b == 1) {
+            unique[keys[k].index] = keys[first_b].index;
+        }
+        for (size_t i = k; i < first_b; i++) {
+            group_start[keys[i].index] = first_b;
+            group_end[keys[i].index] = last;
+        }
+        k = last;
+    }
+    /* longest increasing subsequence of unique matches, tails holds first document positions */
+    size_t length = 0;
+    for (size_t i = 0; i < count_a; i++) {
+        if (unique[i] == MOBI_NOTSET) {
+            continue;
+        }
+        size_t low = 0;
+        size_t high = length;
+        while (low < high) {
+            const size_t mid = low + (high - low) / 2;
+            if (unique[tails[mid]] < unique[i]) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        previous[i] = low ? tails[low - 1] : MOBI_NOTSET;
+        tails[low] = i;
+        if (low == length) {
+            length++;
+        }
+    }
+    for (size_t i = length ? tails[length - 1] : MOBI_NOTSET; i != MOBI_NOTSET; i = previous[i]) {
+        match[i] = unique[i];
+    }
+    /* second document position of next anchor, for each record of first one */
+    size_t *limits = previous;
+    size_t limit = count_b;
+    for (size_t i = count_a; i-- > 0;) {
+        if (match[i] != MOBI_NOTSET) {
+            limit = match[i];
+        }
+        limits[i] = limit;
+    }
+    /* records between anchors, matched to the first equal record after previous match */
+    size_t last_match = MOBI_NOTSET;
+    for (size_t i = 0; i < count_a; i++) {
+        if (match[i] != MOBI_NOTSET) {
+            last_match = match[i];
+            continue;
+        }
+        const size_t min_index = last_match == MOBI_NOTSET ? 0 : last_match + 1;
+        /* keys in group are sorted by position */
+        size_t low = group_start[i];
+        size_t high = group_end[i];
+        while (low < high) {
+            const size_t mid = low + (high - low) / 2;
+            if (keys[mid].index < min_index) {
+                low = mid + 1;
+            } else {
+                high = mid;
+            }
+        }
+        if (low < group_end[i] && keys[low].index < limits[i]) {
+            match[i] = keys[low].index;
+            last_match = match[i];
+        }
+    }
+    free(keys);
+    free(group_start);
+    free(group_end);
+    free(unique);
+    free(tails);
+    free(previous);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Report unmatched records between two matched ones, pairing them by position
+
+ @param[in,out] align Alignment state
+ @param[in] section Section of records
+ @param[in] a Unmatched records of first document
+ @param[in] count_a Number of unmatched records of first document
+ @param[in] b Unmatched records of second document
+ @param[in] count_b Number of unmatched records of second document
+ @param[in] next_b Sequence number of second document record following unmatched ones, MOBI_NOTSET if none
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_unmatched(MOBIDiffAlign *align, const MOBISection section, const MOBIDiffRecord **a, const size_t count_a, const MOBIDiffRecord **b, const size_t count_b, const size_t next_b) {
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t k = 0; ret == MOBI_SUCCESS && k < count_a && k < count_b; k++) {
+        ret = mobi_diff_add(align->diff, &align->max_count, section, MOBI_DIFF_CHANGED, a[k]->seqnumber, b[k]->seqnumber);
+    }
+    for (size_t k = count_b; ret == MOBI_SUCCESS && k < count_a; k++) {
+        ret = mobi_diff_add(align->diff, &align->max_count, section, MOBI_DIFF_REMOVED, a[k]->seqnumber, MOBI_NOTSET);
+        if (section == MOBI_SECTION_TEXT && next_b != MOBI_NOTSET) {
+            align->removed_before[next_b] = true;
+        }
+    }
+    for (size_t k = count_a; ret == MOBI_SUCCESS && k < count_b; k++) {
+        ret = mobi_diff_add(align->diff, &align->max_count, section, MOBI_DIFF_ADDED, MOBI_NOTSET, b[k]->seqnumber);
+    }
+    return ret;
+}
+
+/**
+ @brief Align records of section in both documents and compare them
+
+ Records are matched by content first, so that inserted or removed records
+ don't shift the remaining ones. Records without match are paired by position
+ between matched ones and reported as changed, the rest as removed or added.
+
+ @param[in,out] align Alignment state
+ @param[in] section Section of records
+ @param[in] a Records of first document in section
+ @param[in] count_a Number of records of first document
+ @param[in] b Records of second document in section
+ @param[in] count_b Number of records of second document
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_align_section(MOBIDiffAlign *align, const MOBISection section, const MOBIDiffRecord **a, const size_t count_a, const MOBIDiffRecord **b, const size_t count_b) {
+    size_t *match = malloc((count_a + 1) * sizeof(size_t));
+    if (match == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = mobi_diff_match(match, a, count_a, b, count_b);
+    /* position following text of second document, text removed at the end is marked there */
+    const size_t end_b = count_b ? b[count_b - 1]->seqnumber + 1 : MOBI_NOTSET;
+    size_t i = 0;
+    size_t j = 0;
+    while (ret == MOBI_SUCCESS && (i < count_a || j < count_b)) {
+        size_t next_i = i;
+        while (next_i < count_a && match[next_i] == MOBI_NOTSET) {
+            next_i++;
+        }
+        const size_t next_j = next_i < count_a ? match[next_i] : count_b;
+        ret = mobi_diff_unmatched(align, section, a + i, next_i - i, b + j, next_j - j, next_j < count_b ? b[next_j]->seqnumber : end_b);
+        /* matched records are equal */
+        i = next_i + 1;
+        j = next_j + 1;
+        if (next_i == count_a) {
+            break;
+        }
+    }
+    free(match);
+    return ret;
+}
+
+/**
+ @brief Align records of both documents within each section and compare them
+
+ @param[in,out] diff MOBIDiff structure
+ @param[in] records_a Records of first document
+ @param[in] count_a Number of records of first document
+ @param[in] records_b Records of second document
+ @param[in] count_b Number of records of second document
+ @param[out] removed_before Flags indexed by sequence number of second document text record, count_b + 1 entries, set if text was removed before it
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_align(MOBIDiff *diff, const MOBIDiffRecord *records_a, const size_t count_a, const MOBIDiffRecord *records_b, const size_t count_b, bool *removed_before) {
+    const MOBIDiffRecord **a = malloc((count_a + 1) * sizeof(*a));
+    const MOBIDiffRecord **b = malloc((count_b + 1) * sizeof(*b));
+    if (a == NULL || b == NULL) {
+        free(a);
+        free(b);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBIDiffAlign align = { diff, 0, removed_before };
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (int s = 0; ret == MOBI_SUCCESS && s < MOBI_SECTION_COUNT; s++) {
+        const MOBISection section = (MOBISection) s;
+        size_t section_a = 0;
+        size_t section_b = 0;
+        for (size_t i = 0; i < count_a; i++) {
+            if (records_a[i].section == section) {
+                a[section_a++] = &records_a[i];
+            }
+        }
+        for (size_t j = 0; j < count_b; j++) {
+            if (records_b[j].section == section) {
+                b[section_b++] = &records_b[j];
+            }
+        }
+        ret = mobi_diff_align_section(&align, section, a, section_a, b, section_b);
+    }
+    free(a);
+    free(b);
+    return ret;
+}
+
+/**
+ @brief Mark parts containing text in range
+
+ @param[in] map Location map
+ @param[in] start Start of range
+ @param[in] end End of range
+ @param[in,out] affected Flags of affected parts, indexed by part uid
+ */
+static void mobi_diff_mark(const MOBILocationMap *map, const size_t start, const size_t end, bool *affected) {
+    if (map->segments_count == 0) {
+        return;
+    }
+    /* last segment starting at or before range start */
+    size_t low = 0;
+    size_t high = map->segments_count;
+    while (high - low > 1) {
+        const size_t mid = low + (high - low) / 2;
+        if (map->segments[mid].start <= start) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    for (size_t k = low; k < map->segments_count && map->segments[k].start < end; k++) {
+        const size_t segment_end = (k + 1 < map->segments_count) ? map->segments[k + 1].start : map->markup_length;
+        if (segment_end > start) {
+            affected[map->segments[k].part_uid] = true;
+        }
+    }
+}
+
+/**
+ @brief Find markup parts of second document affected by changed text records
+
+ @param[in,out] diff MOBIDiff structure with compared records
+ @param[in] m Second document
+ @param[in] removed_before Flags indexed by sequence number of text record, set if text was removed before it
+ @param[in] removed_count Number of flags
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_diff_parts(MOBIDiff *diff, const MOBIData *m, const bool *removed_before, const size_t removed_count) {
+    MOBILocationMap *map = mobi_init_locationmap();
+    if (map == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = mobi_build_locationmap(map, m);
+    if (ret != MOBI_SUCCESS) {
+        mobi_free_locationmap(map);
+        return ret;
+    }
+    size_t parts_max = 0;
+    for (size_t k = 0; k < map->segments_count; k++) {
+        if (map->segments[k].part_uid >= parts_max) {
+            parts_max = map->segments[k].part_uid + 1;
+        }
+    }
+    bool *affected = calloc(parts_max + 1, sizeof(bool));
+    if (affected == NULL) {
+        mobi_free_locationmap(map);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t i = 0; i < diff->records_count; i++) {
+        const MOBIRecordDiff *change = &diff->records[i];
+        if (change->section != MOBI_SECTION_TEXT || change->seqnumber_b == MOBI_NOTSET) {
+            continue;
+        }
+        const size_t index = change->seqnumber_b - map->first_record;
+        if (index < map->records_count) {
+            mobi_diff_mark(map, map->record_starts[index], map->record_starts[index + 1], affected);
+        }
+    }
+    for (size_t seqnumber = map->first_record; seqnumber < removed_count && map->markup_length > 0; seqnumber++) {
+        const size_t index = seqnumber - map->first_record;
+        if (!removed_before[seqnumber] || index > map->records_count) {
+            continue;
+        }
+        /* text was cut out, mark text on both sides of the cut */
+        size_t position = index < map->records_count ? map->record_starts[index] : map->markup_length;
+        if (position > map->markup_length) {
+            position = map->markup_length;
+        }
+        mobi_diff_mark(map, position ? position - 1 : 0, position + 1, affected);
+    }
+    size_t count = 0;
+    for (size_t uid = 0; uid < parts_max; uid++) {
+        count += affected[uid];
+    }
+    if (count > 0) {
+        diff->parts = malloc(count * sizeof(*diff->parts));
+        if (diff->parts == NULL) {
+            free(affected);
+            mobi_free_locationmap(map);
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        for (size_t uid = 0; uid < parts_max; uid++) {
+            if (affected[uid]) {
+                diff->parts[diff->parts_count++] = uid;
+            }
+        }
+    }
+    free(affected);
+    mobi_free_locationmap(map);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compare two editions of document record by record
+
+ Records are hashed in worker threads and aligned within their section, by content first
+ and by position between records with equal content. Inserting or removing record
+ does not affect the following ones. Changed, added and removed records are reported, together with markup parts
+ of the second document which contain changed text. Parts are found using
+ skeleton and fragment indices, without reconstructing markup,
+ so text records of second document must be readable.
+
+ @param[in,out] diff MOBIDiff structure initialized with mobi_init_diff()
+ @param[in] a First document
+ @param[in] b Second document
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_FILE_ENCRYPTED if second document is encrypted and its key is not set
+ */
+MOBI_RET mobi_diff(MOBIDiff *diff, const MOBIData *a, const MOBIData *b) {
+    if (diff == NULL || a == NULL || b == NULL) {
+        debug_print("%s", "Structures not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    mobi_diff_reset(diff);
+    if (mobi_is_encrypted(b) && b->drm_key == NULL) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    MOBIDiffRecord *records_a = NULL;
+    MOBIDiffRecord *records_b = NULL;
+    size_t count_a = 0;
+    size_t count_b = 0;
+    MOBI_RET ret = mobi_diff_records(a, &records_a, &count_a);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_diff_records(b, &records_b, &count_b);
+    }
+    if (ret == MOBI_SUCCESS) {
+        /* hash both documents in one batch */
+        MOBIDiffRecord *records = realloc(records_a, (count_a + count_b + 1) * sizeof(MOBIDiffRecord));
+        if (records == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            ret = MOBI_MALLOC_FAILED;
+        } else {
+            records_a = records;
+            memcpy(records_a + count_a, records_b, count_b * sizeof(MOBIDiffRecord));
+            ret = mobi_diff_hash(records_a, count_a + count_b);
+        }
+    }
+    bool *removed_before = NULL;
+    if (ret == MOBI_SUCCESS) {
+        removed_before = calloc(count_b + 1, sizeof(bool));
+        if (removed_before == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            ret = MOBI_MALLOC_FAILED;
+        }
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_diff_align(diff, records_a, count_a, records_a + count_a, count_b, removed_before);
+    }
+    free(records_a);
+    free(records_b);
+    if (ret == MOBI_SUCCESS) {
+        bool text_changed = false;
+        for (size_t i = 0; i < diff->records_count && !text_changed; i++) {
+            text_changed = diff->records[i].section == MOBI_SECTION_TEXT;
+        }
+        if (text_changed) {
+            ret = mobi_diff_parts(diff, b, removed_before, count_b + 1);
+        }
+    }
+    free(removed_before);
+    if (ret != MOBI_SUCCESS) {
+        mobi_diff_reset(diff);
+    }
+    return ret;
+}
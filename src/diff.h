@@ -0,0 +1,25 @@
+/** @file diff.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_diff_h
+#define libmobi_diff_h
+
+#include "config.h"
+#include "mobi.h"
+
+/**
+ @defgroup mobi_diff Params of document diff
+ @{
+ */
+#define MOBI_DIFF_JOB_MIN 64 /**< Minimal number of records worth a separate hashing thread */
+#define MOBI_SECTION_COUNT (MOBI_SECTION_OTHER + 1) /**< Number of record sections */
+/** @} */
+
+#endif
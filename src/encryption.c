@@ -37,6 +37,33 @@
 #define COOKIESIZE 32
 #define pk1_swap(a, b) { uint16_t tmp = a; a = b; b = tmp; }
 
+/* PK1 state is 16-bit, so records may be decrypted in parallel in SIMD lanes */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define PK1_LANES 8
+typedef __m128i pk1_vec;
+# define pk1_vec_set(x) _mm_set1_epi16((short) (x))
+# define pk1_vec_load(p) _mm_loadu_si128((const __m128i *) (p))
+# define pk1_vec_store(p, v) _mm_storeu_si128((__m128i *) (p), (v))
+# define pk1_vec_add(a, b) _mm_add_epi16((a), (b))
+# define pk1_vec_mul(a, b) _mm_mullo_epi16((a), (b))
+# define pk1_vec_xor(a, b) _mm_xor_si128((a), (b))
+# define pk1_vec_and(a, b) _mm_and_si128((a), (b))
+# define pk1_vec_shr8(a) _mm_srli_epi16((a), 8)
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+# include <arm_neon.h>
+# define PK1_LANES 8
+typedef uint16x8_t pk1_vec;
+# define pk1_vec_set(x) vdupq_n_u16((uint16_t) (x))
+# define pk1_vec_load(p) vld1q_u16(p)
+# define pk1_vec_store(p, v) vst1q_u16((p), (v))
+# define pk1_vec_add(a, b) vaddq_u16((a), (b))
+# define pk1_vec_mul(a, b) vmulq_u16((a), (b))
+# define pk1_vec_xor(a, b) veorq_u16((a), (b))
+# define pk1_vec_and(a, b) vandq_u16((a), (b))
+# define pk1_vec_shr8(a) vshrq_n_u16((a), 8)
+#endif
+
 /**
  @brief Structure for PK1 routines
  */
@@ -121,6 +148,153 @@ static MOBI_RET mobi_pk1_decrypt(unsigned char *out, const unsigned char *in, si
     return MOBI_SUCCESS;
 }
 
+#ifdef PK1_LANES
+/**
+ @brief PK1 states of records decrypted in parallel, one record per lane
+ */
+typedef struct {
+    uint16_t si[PK1_LANES]; /**< PK1 si of each lane */
+    uint16_t x1a2[PK1_LANES]; /**< PK1 x1a2 of each lane */
+    uint16_t key[KEYSIZE / 2][PK1_LANES]; /**< Current key of each lane, as 16-bit big endian words */
+} PK1Lanes;
+
+/**
+ @brief Start decryption of new record in given lane
+ 
+ @param[in,out] lanes PK1Lanes structure
+ @param[in] lane Lane number
+ @param[in] key Key
+ */
+static void pk1_lane_init(PK1Lanes *lanes, const size_t lane, const unsigned char key[KEYSIZE]) {
+    lanes->si[lane] = 0;
+    lanes->x1a2[lane] = 0;
+    for (size_t i = 0; i < KEYSIZE / 2; i++) {
+        lanes->key[i][lane] = (uint16_t) ((key[i * 2] << 8) | key[i * 2 + 1]);
+    }
+}
+
+/**
+ @brief Decrypt PK1_LANES buffers at once
+ 
+ Runs pk1_assemble() for all lanes in SIMD registers.
+ Conditional multiplications of pk1_code() are unconditional here,
+ as they only skip multiplying zero.
+ Buffers may overlap with output, each byte is read before it is written.
+ 
+ @param[in,out] lanes PK1Lanes structure
+ @param[in,out] out Decrypted buffers, NULL for idle lanes
+ @param[in] in Encrypted buffers, NULL for idle lanes
+ @param[in] length Number of bytes to decrypt in each lane
+ */
+static void pk1_decrypt_lanes(PK1Lanes *lanes, unsigned char *out[PK1_LANES], const unsigned char *in[PK1_LANES], const size_t length) {
+    const pk1_vec bx = pk1_vec_set(0x4e35);
+    const pk1_vec cx = pk1_vec_set(0x015a);
+    const pk1_vec one = pk1_vec_set(1);
+    const pk1_vec low = pk1_vec_set(0xff);
+    const pk1_vec twice = pk1_vec_set(0x0101);
+    pk1_vec si = pk1_vec_load(lanes->si);
+    pk1_vec x1a2 = pk1_vec_load(lanes->x1a2);
+    pk1_vec key[KEYSIZE / 2];
+    for (size_t i = 0; i < KEYSIZE / 2; i++) {
+        key[i] = pk1_vec_load(lanes->key[i]);
+    }
+    uint16_t bytes[PK1_LANES];
+    for (size_t j = 0; j < length; j++) {
+        for (size_t l = 0; l < PK1_LANES; l++) {
+            bytes[l] = in[l] ? in[l][j] : 0;
+        }
+        pk1_vec inter = pk1_vec_set(0);
+        pk1_vec x1a0 = key[0];
+        for (size_t i = 0; i < KEYSIZE / 2; i++) {
+            if (i) {
+                x1a0 = pk1_vec_xor(x1a0, key[i]);
+            }
+            const pk1_vec dx = pk1_vec_add(si, pk1_vec_mul(pk1_vec_add(x1a2, pk1_vec_set(i)), bx));
+            si = pk1_vec_mul(x1a0, cx);
+            x1a2 = pk1_vec_add(dx, si);
+            x1a0 = pk1_vec_add(pk1_vec_mul(x1a0, bx), one);
+            inter = pk1_vec_xor(inter, pk1_vec_xor(x1a0, x1a2));
+        }
+        inter = pk1_vec_xor(inter, pk1_vec_shr8(inter));
+        const pk1_vec c = pk1_vec_and(pk1_vec_xor(pk1_vec_load(bytes), inter), low);
+        const pk1_vec c2 = pk1_vec_mul(c, twice);
+        for (size_t i = 0; i < KEYSIZE / 2; i++) {
+            key[i] = pk1_vec_xor(key[i], c2);
+        }
+        pk1_vec_store(bytes, c);
+        for (size_t l = 0; l < PK1_LANES; l++) {
+            if (out[l]) {
+                out[l][j] = (unsigned char) bytes[l];
+            }
+        }
+    }
+    pk1_vec_store(lanes->si, si);
+    pk1_vec_store(lanes->x1a2, x1a2);
+    for (size_t i = 0; i < KEYSIZE / 2; i++) {
+        pk1_vec_store(lanes->key[i], key[i]);
+    }
+}
+
+/**
+ @brief Decrypt multiple buffers with PK1 algorithm in SIMD lanes
+ 
+ Each buffer is decrypted independently with the same key.
+ Lane which finishes its buffer takes the next one.
+ 
+ @param[in,out] out Decrypted buffers
+ @param[in] in Encrypted buffers
+ @param[in] length Buffers lengths
+ @param[in] count Number of buffers
+ @param[in] key Key
+ */
+static void mobi_pk1_decrypt_lanes(unsigned char **out, const unsigned char **in, const size_t *length, const size_t count, const unsigned char key[KEYSIZE]) {
+    PK1Lanes lanes;
+    unsigned char *lane_out[PK1_LANES];
+    const unsigned char *lane_in[PK1_LANES];
+    size_t lane_left[PK1_LANES];
+    for (size_t l = 0; l < PK1_LANES; l++) {
+        pk1_lane_init(&lanes, l, key);
+        lane_out[l] = NULL;
+        lane_in[l] = NULL;
+        lane_left[l] = 0;
+    }
+    size_t next = 0;
+    while (true) {
+        size_t step = SIZE_MAX;
+        for (size_t l = 0; l < PK1_LANES; l++) {
+            if (lane_left[l] == 0) {
+                lane_out[l] = NULL;
+                lane_in[l] = NULL;
+                while (next < count && length[next] == 0) {
+                    next++;
+                }
+                if (next < count) {
+                    pk1_lane_init(&lanes, l, key);
+                    lane_out[l] = out[next];
+                    lane_in[l] = in[next];
+                    lane_left[l] = length[next];
+                    next++;
+                }
+            }
+            if (lane_left[l] && lane_left[l] < step) {
+                step = lane_left[l];
+            }
+        }
+        if (step == SIZE_MAX) {
+            break;
+        }
+        pk1_decrypt_lanes(&lanes, lane_out, lane_in, step);
+        for (size_t l = 0; l < PK1_LANES; l++) {
+            if (lane_left[l]) {
+                lane_out[l] += step;
+                lane_in[l] += step;
+                lane_left[l] -= step;
+            }
+        }
+    }
+}
+#endif
+
 /**
  @brief Encrypt buffer with PK1 algorithm
  
@@ -388,6 +562,43 @@ MOBI_RET mobi_decrypt(unsigned char *out, const unsigned char *in, const size_t
     return ret;
 }
 
+/**
+ @brief Decrypt multiple buffers with PK1 algorithm
+ 
+ Buffers are decrypted independently, with the same key,
+ as text records are. Where SIMD is available several buffers
+ are decrypted at once, otherwise one by one.
+ Output buffer may be the same as input buffer.
+ 
+ @param[in,out] out Decrypted buffers
+ @param[in] in Encrypted buffers
+ @param[in] length Buffers lengths
+ @param[in] count Number of buffers
+ @param[in] m MOBIData structure with loaded key
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_decrypt_multi(unsigned char **out, const unsigned char **in, const size_t *length, const size_t count, const MOBIData *m) {
+    if (m == NULL || m->drm_key == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (!out[i] || !in[i]) {
+            return MOBI_INIT_FAILED;
+        }
+    }
+#ifdef PK1_LANES
+    mobi_pk1_decrypt_lanes(out, in, length, count, m->drm_key);
+#else
+    for (size_t i = 0; i < count; i++) {
+        MOBI_RET ret = mobi_pk1_decrypt(out[i], in[i], length[i], m->drm_key);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+#endif
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Verify PID
  
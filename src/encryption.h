@@ -16,6 +16,7 @@
 #include "mobi.h"
 
 MOBI_RET mobi_decrypt(unsigned char *out, const unsigned char *in, const size_t length, const MOBIData *m);
+MOBI_RET mobi_decrypt_multi(unsigned char **out, const unsigned char **in, const size_t *length, const size_t count, const MOBIData *m);
 MOBI_RET mobi_drm_setkey_internal(MOBIData *m, const char *pid);
 MOBI_RET mobi_drm_delkey_internal(MOBIData *m);
 
@@ -0,0 +1,578 @@
+/** @file fingerprint.c
+ *  @brief Content fingerprint of document text for near-duplicate detection
+ *
+ * Decompressed text records are hashed one by one and passed through a scanner
+ * that skips tags and splits remaining text into words. Shingles, runs of
+ * consecutive words, feed a MinHash signature and a SimHash, without building
+ * MOBIRawml. Text records are split into ranges processed in parallel, as in
+ * statistics pass. A range starts in unknown state, so its scanner waits for the
+ * first tag delimiter. Bytes before it, as well as shingles crossing range
+ * boundaries, are added when ranges are joined, so results don't depend
+ * on the number of threads.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "fingerprint.h"
+#include "thread.h"
+#include "util.h"
+#include "read.h"
+#include "debug.h"
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL /**< FNV-1a 64-bit offset basis */
+#define FNV_PRIME 0x100000001b3ULL /**< FNV-1a 64-bit prime */
+
+/**
+ @brief Fingerprint scanner
+ */
+typedef struct {
+    bool in_tag; /**< Inside tag */
+    bool in_word; /**< Inside word */
+    uint64_t word_hash; /**< Hash of current word read so far */
+    uint64_t head[MOBI_FINGERPRINT_SHINGLE_MAX]; /**< First words, up to shingle size - 1 */
+    uint64_t window[MOBI_FINGERPRINT_SHINGLE_MAX]; /**< Last words, ring buffer of shingle size */
+    size_t pushed; /**< Number of words pushed to window */
+    size_t words; /**< Number of words */
+    size_t shingles; /**< Number of shingles */
+    size_t ones[64]; /**< Number of shingles hashes with each bit set, see mobi_fingerprint_flush() */
+    uint64_t ones_packed[8]; /**< Byte counters of bits not yet added to ones, bits j, j + 8, ..., j + 56 in element j */
+    size_t packed_count; /**< Number of shingles in byte counters */
+    uint64_t minhash[MOBI_FINGERPRINT_MINHASH_MAX]; /**< Minimal shingle hash in each bin, UINT64_MAX if empty */
+} MOBIFingerprintScanner;
+
+/**
+ @brief Data shared by fingerprint jobs
+ */
+typedef struct {
+    const MOBIData *m; /**< MOBIData structure */
+    const MOBIHuffCdic *huffcdic; /**< Parsed huff/cdic tables or NULL */
+    uint16_t extra_flags; /**< Flags of trailing entries of text records */
+    size_t first_record; /**< Sequence number of the first text record */
+    size_t max_record_size; /**< Maximal size of decompressed text record */
+    bool direct; /**< Text records are neither compressed nor encrypted, scan them in place */
+    size_t shingle_size; /**< Number of words in shingle */
+    size_t minhash_count; /**< Number of MinHash bins */
+    uint64_t *record_hashes; /**< Hashes of text records, filled by jobs */
+} MOBIFingerprintContext;
+
+/**
+ @brief Fingerprint job, range of text records
+ */
+typedef struct {
+    const MOBIFingerprintContext *ctx; /**< Shared data */
+    size_t first; /**< Index of the first text record in range */
+    size_t count; /**< Number of text records in range */
+    bool synced; /**< Scanner state is known */
+    unsigned char *prefix; /**< Text preceding the point where state became known */
+    size_t prefix_length; /**< Length of prefix */
+    MOBIFingerprintScanner scanner; /**< Scanner state at the end of range */
+    MOBI_RET ret; /**< Job status */
+} MOBIFingerprintJob;
+
+/**
+ @brief Initialize scanner
+
+ @param[out] scanner Scanner
+ */
+static void mobi_fingerprint_scanner_init(MOBIFingerprintScanner *scanner) {
+    memset(scanner, 0, sizeof(MOBIFingerprintScanner));
+    for (size_t i = 0; i < MOBI_FINGERPRINT_MINHASH_MAX; i++) {
+        scanner->minhash[i] = UINT64_MAX;
+    }
+}
+
+/**
+ @brief Add byte counters of set bits to ones
+
+ @param[in,out] scanner Scanner
+ */
+static void mobi_fingerprint_flush(MOBIFingerprintScanner *scanner) {
+    for (size_t j = 0; j < 8; j++) {
+        for (size_t byte = 0; byte < 8; byte++) {
+            scanner->ones[8 * byte + j] += (size_t) ((scanner->ones_packed[j] >> (8 * byte)) & 0xff);
+        }
+        scanner->ones_packed[j] = 0;
+    }
+    scanner->packed_count = 0;
+}
+
+/**
+ @brief Add shingle to MinHash and SimHash
+
+ MinHash uses one hash function, which selects a bin and is minimized
+ within it (one permutation hashing), so cost doesn't grow with signature size.
+
+ @param[in,out] scanner Scanner
+ @param[in] ctx Shared data
+ @param[in] hash Shingle hash
+ */
+static void mobi_fingerprint_add(MOBIFingerprintScanner *scanner, const MOBIFingerprintContext *ctx, const uint64_t hash) {
+    scanner->shingles++;
+    const size_t bin = (size_t) (((hash >> 32) * ctx->minhash_count) >> 32);
+    if (hash < scanner->minhash[bin]) {
+        scanner->minhash[bin] = hash;
+    }
+    /* eight bits counted at once, in byte counters flushed before they overflow */
+    for (size_t j = 0; j < 8; j++) {
+        scanner->ones_packed[j] += (hash >> j) & 0x0101010101010101ULL;
+    }
+    if (++scanner->packed_count == 255) {
+        mobi_fingerprint_flush(scanner);
+    }
+}
+
+/**
+ @brief Push word to the window, optionally adding shingle ending with it
+
+ @param[in,out] scanner Scanner
+ @param[in] ctx Shared data
+ @param[in] word Word hash
+ @param[in] add Add shingle ending with this word
+ */
+static void mobi_fingerprint_push(MOBIFingerprintScanner *scanner, const MOBIFingerprintContext *ctx, const uint64_t word, const bool add) {
+    const size_t k = ctx->shingle_size;
+    scanner->window[scanner->pushed % k] = word;
+    scanner->pushed++;
+    if (add && scanner->pushed >= k) {
+        uint64_t shingle = FNV_OFFSET;
+        for (size_t i = scanner->pushed - k; i < scanner->pushed; i++) {
+            shingle = (shingle ^ scanner->window[i % k]) * FNV_PRIME;
+        }
+        mobi_fingerprint_add(scanner, ctx, mobi_mix64(shingle));
+    }
+}
+
+/**
+ @brief End current word, if any
+
+ @param[in,out] scanner Scanner
+ @param[in] ctx Shared data
+ */
+static void mobi_fingerprint_word_end(MOBIFingerprintScanner *scanner, const MOBIFingerprintContext *ctx) {
+    if (!scanner->in_word) {
+        return;
+    }
+    scanner->in_word = false;
+    if (scanner->words < ctx->shingle_size - 1) {
+        scanner->head[scanner->words] = scanner->word_hash;
+    }
+    scanner->words++;
+    mobi_fingerprint_push(scanner, ctx, scanner->word_hash, true);
+}
+
+/**
+ @brief Scan text
+
+ Tags are skipped and split words. Words are runs of ASCII letters and digits
+ and non-ASCII bytes, ASCII letters are compared case insensitive.
+
+ @param[in,out] scanner Scanner
+ @param[in] ctx Shared data
+ @param[in] data Text
+ @param[in] length Length of text
+ */
+static void mobi_fingerprint_scan(MOBIFingerprintScanner *scanner, const MOBIFingerprintContext *ctx, const unsigned char *data, const size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = data[i];
+        if (scanner->in_tag) {
+            if (c == '>') {
+                scanner->in_tag = false;
+            }
+            continue;
+        }
+        if (c == '<') {
+            mobi_fingerprint_word_end(scanner, ctx);
+            scanner->in_tag = true;
+            continue;
+        }
+        if (c >= 'A' && c <= 'Z') {
+            c += 'a' - 'A';
+        }
+        if (c >= 0x80 || (c >= 'a' && c <= 'z') || (c >= '0' && c <= '9')) {
+            if (!scanner->in_word) {
+                scanner->in_word = true;
+                scanner->word_hash = FNV_OFFSET;
+            }
+            scanner->word_hash = (scanner->word_hash ^ c) * FNV_PRIME;
+        } else {
+            mobi_fingerprint_word_end(scanner, ctx);
+        }
+    }
+}
+
+/**
+ @brief Get text of a record
+
+ @param[in] ctx Shared data
+ @param[in] record Text record
+ @param[in,out] buffer Memory area of max_record_size for decompressed text
+ @param[in,out] decrypted Memory area for decrypted record, reallocated if needed
+ @param[in,out] decrypted_size Size of decrypted memory area
+ @param[out] data Text of the record, points to buffer or record data
+ @param[out] size Length of text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_fingerprint_record(const MOBIFingerprintContext *ctx, const MOBIPdbRecord *record, unsigned char *buffer, unsigned char **decrypted, size_t *decrypted_size, const unsigned char **data, size_t *size) {
+    if (ctx->direct) {
+        size_t extra_size = 0;
+        if (ctx->extra_flags) {
+            extra_size = mobi_get_record_extrasize(record, ctx->extra_flags);
+            if (extra_size == MOBI_NOTSET || extra_size >= record->size) {
+                return MOBI_DATA_CORRUPT;
+            }
+        }
+        *data = record->data;
+        *size = record->size - extra_size;
+        return MOBI_SUCCESS;
+    }
+    if (mobi_is_encrypted(ctx->m) && *decrypted_size < record->size) {
+        unsigned char *tmp = realloc(*decrypted, record->size);
+        if (tmp == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        *decrypted = tmp;
+        *decrypted_size = record->size;
+    }
+    *size = ctx->max_record_size;
+    *data = buffer;
+    return mobi_decompress_record(buffer, size, ctx->m, record, ctx->extra_flags, ctx->huffcdic, *decrypted);
+}
+
+/**
+ @brief Hash and scan range of text records
+
+ @param[in,out] job Fingerprint job
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_fingerprint_job_run(MOBIFingerprintJob *job) {
+    const MOBIFingerprintContext *ctx = job->ctx;
+    unsigned char *buffer = ctx->direct ? NULL : malloc(ctx->max_record_size);
+    if (!ctx->direct && buffer == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    unsigned char *decrypted = NULL;
+    size_t decrypted_size = 0;
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(ctx->m, ctx->first_record + job->first);
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t i = 0; i < job->count; i++) {
+        if (curr == NULL) {
+            debug_print("Text record %zu not found\n", job->first + i);
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        const unsigned char *data;
+        size_t size;
+        ret = mobi_fingerprint_record(ctx, curr, buffer, &decrypted, &decrypted_size, &data, &size);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        ctx->record_hashes[job->first + i] = mobi_hash64(data, size);
+        size_t offset = 0;
+        if (!job->synced) {
+            while (offset < size && data[offset] != '<' && data[offset] != '>') {
+                offset++;
+            }
+            if (offset < size) {
+                /* tag end belongs to prefix, tag start does not */
+                if (data[offset] == '>') {
+                    offset++;
+                }
+                job->synced = true;
+            }
+            if (offset > 0) {
+                unsigned char *tmp = realloc(job->prefix, job->prefix_length + offset);
+                if (tmp == NULL) {
+                    debug_print("%s\n", "Memory allocation failed");
+                    ret = MOBI_MALLOC_FAILED;
+                    break;
+                }
+                job->prefix = tmp;
+                memcpy(job->prefix + job->prefix_length, data, offset);
+                job->prefix_length += offset;
+            }
+        }
+        mobi_fingerprint_scan(&job->scanner, ctx, data + offset, size - offset);
+        curr = curr->next;
+    }
+    mobi_fingerprint_flush(&job->scanner);
+    free(buffer);
+    free(decrypted);
+    return ret;
+}
+
+/**
+ @brief Thread entry point of fingerprint job
+
+ @param[in,out] arg MOBIFingerprintJob structure
+ @return NULL
+ */
+static void * mobi_fingerprint_thread(void *arg) {
+    MOBIFingerprintJob *job = arg;
+    job->ret = mobi_fingerprint_job_run(job);
+    return NULL;
+}
+
+/**
+ @brief Join results of ranges
+
+ Prefix of each range is scanned with the state where previous range ended.
+ Then shingles ending with first words of the range are added, as the range
+ itself only counts shingles which start within it.
+
+ @param[in] jobs Finished fingerprint jobs
+ @param[in] jobs_count Number of jobs
+ @param[out] carry Scanner state at the end of text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_fingerprint_merge(const MOBIFingerprintJob *jobs, const size_t jobs_count, MOBIFingerprintScanner *carry) {
+    const MOBIFingerprintContext *ctx = jobs[0].ctx;
+    const size_t k = ctx->shingle_size;
+    mobi_fingerprint_scanner_init(carry);
+    for (size_t j = 0; j < jobs_count; j++) {
+        const MOBIFingerprintJob *job = &jobs[j];
+        if (job->ret != MOBI_SUCCESS) {
+            return job->ret;
+        }
+        mobi_fingerprint_scan(carry, ctx, job->prefix, job->prefix_length);
+        if (!job->synced) {
+            continue;
+        }
+        /* sync point is a tag delimiter, which ends word */
+        mobi_fingerprint_word_end(carry, ctx);
+        const MOBIFingerprintScanner *scanner = &job->scanner;
+        const size_t head_count = scanner->words < k - 1 ? scanner->words : k - 1;
+        for (size_t i = 0; i < head_count; i++) {
+            mobi_fingerprint_push(carry, ctx, scanner->head[i], true);
+        }
+        if (scanner->words > head_count) {
+            /* window continues with last words of range */
+            for (size_t i = scanner->pushed - (k - 1); i < scanner->pushed; i++) {
+                mobi_fingerprint_push(carry, ctx, scanner->window[i % k], false);
+            }
+        }
+        carry->words += scanner->words;
+        carry->shingles += scanner->shingles;
+        for (size_t bit = 0; bit < 64; bit++) {
+            carry->ones[bit] += scanner->ones[bit];
+        }
+        for (size_t i = 0; i < ctx->minhash_count; i++) {
+            if (scanner->minhash[i] < carry->minhash[i]) {
+                carry->minhash[i] = scanner->minhash[i];
+            }
+        }
+        carry->in_tag = scanner->in_tag;
+        carry->in_word = scanner->in_word;
+        carry->word_hash = scanner->word_hash;
+    }
+    mobi_fingerprint_word_end(carry, ctx);
+    mobi_fingerprint_flush(carry);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Copy results of scanner into fingerprint
+
+ Empty MinHash bins borrow value from the next non-empty bin, mixed with the distance,
+ so that signatures of short texts may still be compared bin by bin.
+
+ @param[out] fingerprint Fingerprint
+ @param[in] scanner Scanner state at the end of text
+ @param[in] ctx Shared data
+ */
+static void mobi_fingerprint_finish(MOBIFingerprint *fingerprint, const MOBIFingerprintScanner *scanner, const MOBIFingerprintContext *ctx) {
+    fingerprint->words = scanner->words;
+    fingerprint->shingles = scanner->shingles;
+    fingerprint->simhash = 0;
+    for (size_t bit = 0; bit < 64; bit++) {
+        if (2 * scanner->ones[bit] > scanner->shingles) {
+            fingerprint->simhash |= 1ULL << bit;
+        }
+    }
+    const size_t count = ctx->minhash_count;
+    for (size_t i = 0; i < count; i++) {
+        fingerprint->minhash[i] = scanner->minhash[i];
+        if (scanner->minhash[i] == UINT64_MAX && scanner->shingles) {
+            size_t distance = 1;
+            while (scanner->minhash[(i + distance) % count] == UINT64_MAX) {
+                distance++;
+            }
+            fingerprint->minhash[i] = mobi_mix64(scanner->minhash[(i + distance) % count] + distance * 0x9e3779b97f4a7c15ULL);
+        }
+    }
+}
+
+/**
+ @brief Initializer for MOBIFingerprint structure
+
+ It allocates memory for structure.
+ Memory should be freed with mobi_free_fingerprint().
+
+ @return MOBIFingerprint on success, NULL otherwise
+ */
+MOBIFingerprint * mobi_init_fingerprint(void) {
+    MOBIFingerprint *fingerprint = calloc(1, sizeof(MOBIFingerprint));
+    if (fingerprint == NULL) {
+        debug_print("%s", "Memory allocation for fingerprint failed\n");
+        return NULL;
+    }
+    return fingerprint;
+}
+
+/**
+ @brief Free results of MOBIFingerprint structure, leave it empty
+
+ @param[in,out] fingerprint MOBIFingerprint structure
+ */
+static void mobi_fingerprint_reset(MOBIFingerprint *fingerprint) {
+    free(fingerprint->record_hashes);
+    free(fingerprint->minhash);
+    memset(fingerprint, 0, sizeof(MOBIFingerprint));
+}
+
+/**
+ @brief Free MOBIFingerprint structure
+
+ @param[in] fingerprint MOBIFingerprint structure
+ */
+void mobi_free_fingerprint(MOBIFingerprint *fingerprint) {
+    if (fingerprint == NULL) {
+        return;
+    }
+    mobi_fingerprint_reset(fingerprint);
+    free(fingerprint);
+}
+
+/**
+ @brief Compute content fingerprint of document
+
+ Text records are decompressed one at a time in worker threads. Hash of each
+ decompressed record is stored, and text outside of tags is split into words.
+ Shingles of consecutive words feed MinHash signature and SimHash,
+ see mobi_fingerprint_similarity() and mobi_fingerprint_distance().
+ Fingerprints are comparable if they were computed with the same options.
+
+ @param[in,out] fingerprint MOBIFingerprint structure, previous results are freed
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] options Options, NULL for defaults (4 words in shingle, 128 MinHash values)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_fingerprint(MOBIFingerprint *fingerprint, const MOBIData *m, const MOBIFingerprintOptions *options) {
+    if (fingerprint == NULL || m == NULL) {
+        debug_print("%s", "Structures not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    mobi_fingerprint_reset(fingerprint);
+    MOBIFingerprintContext ctx;
+    ctx.shingle_size = (options && options->shingle_size) ? options->shingle_size : MOBI_FINGERPRINT_SHINGLE;
+    ctx.minhash_count = (options && options->minhash_count) ? options->minhash_count : MOBI_FINGERPRINT_MINHASH;
+    if (ctx.shingle_size > MOBI_FINGERPRINT_SHINGLE_MAX || ctx.minhash_count > MOBI_FINGERPRINT_MINHASH_MAX) {
+        debug_print("%s", "Fingerprint options out of range\n");
+        return MOBI_PARAM_ERR;
+    }
+    if (mobi_is_encrypted(m) && m->drm_key == NULL) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    ctx.m = m;
+    ctx.huffcdic = NULL;
+    ctx.extra_flags = (m->mh && m->mh->extra_flags) ? *m->mh->extra_flags : 0;
+    ctx.first_record = 1 + mobi_get_kf8offset(m);
+    ctx.max_record_size = mobi_get_textrecord_maxsize(m);
+    ctx.direct = m->rh->compression_type == RECORD0_NO_COMPRESSION && !mobi_is_encrypted(m);
+    if (m->rh->compression_type == RECORD0_HUFF_COMPRESSION) {
+        MOBI_RET ret = mobi_get_huffcdic(m, &ctx.huffcdic);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    const size_t records_count = m->rh->text_record_count;
+    fingerprint->record_hashes = malloc(records_count * sizeof(*fingerprint->record_hashes));
+    fingerprint->minhash = malloc(ctx.minhash_count * sizeof(*fingerprint->minhash));
+    const size_t jobs_count = mobi_jobs_count(records_count, MOBI_FINGERPRINT_JOB_MIN);
+    MOBIFingerprintJob *jobs = calloc(jobs_count, sizeof(MOBIFingerprintJob));
+    MOBIFingerprintScanner *carry = malloc(sizeof(MOBIFingerprintScanner));
+    if (fingerprint->record_hashes == NULL || fingerprint->minhash == NULL || jobs == NULL || carry == NULL) {
+        free(jobs);
+        free(carry);
+        mobi_fingerprint_reset(fingerprint);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    ctx.record_hashes = fingerprint->record_hashes;
+    for (size_t i = 0; i < jobs_count; i++) {
+        jobs[i].ctx = &ctx;
+        jobs[i].first = records_count * i / jobs_count;
+        jobs[i].count = records_count * (i + 1) / jobs_count - jobs[i].first;
+        mobi_fingerprint_scanner_init(&jobs[i].scanner);
+    }
+    /* state at text start is known */
+    jobs[0].synced = true;
+    mobi_run_jobs(jobs, sizeof(MOBIFingerprintJob), jobs_count, mobi_fingerprint_thread);
+    MOBI_RET ret = mobi_fingerprint_merge(jobs, jobs_count, carry);
+    for (size_t i = 0; i < jobs_count; i++) {
+        free(jobs[i].prefix);
+    }
+    free(jobs);
+    if (ret == MOBI_SUCCESS) {
+        fingerprint->records_count = records_count;
+        fingerprint->shingle_size = ctx.shingle_size;
+        fingerprint->minhash_count = ctx.minhash_count;
+        mobi_fingerprint_finish(fingerprint, carry, &ctx);
+    } else {
+        mobi_fingerprint_reset(fingerprint);
+    }
+    free(carry);
+    return ret;
+}
+
+/**
+ @brief Estimate similarity of texts of two documents
+
+ Fraction of equal MinHash values, which estimates Jaccard similarity
+ of sets of shingles.
+
+ @param[in] a Fingerprint of first document
+ @param[in] b Fingerprint of second document
+ @return Similarity from 0 to 1, 0 if fingerprints were computed with different options
+ */
+double mobi_fingerprint_similarity(const MOBIFingerprint *a, const MOBIFingerprint *b) {
+    if (a == NULL || b == NULL || a->minhash_count == 0 || a->minhash_count != b->minhash_count || a->shingle_size != b->shingle_size) {
+        return 0.0;
+    }
+    size_t equal = 0;
+    for (size_t i = 0; i < a->minhash_count; i++) {
+        if (a->minhash[i] == b->minhash[i]) {
+            equal++;
+        }
+    }
+    return (double) equal / (double) a->minhash_count;
+}
+
+/**
+ @brief Count bits differing between SimHash values of two documents
+
+ @param[in] a Fingerprint of first document
+ @param[in] b Fingerprint of second document
+ @return Hamming distance from 0 to 64
+ */
+size_t mobi_fingerprint_distance(const MOBIFingerprint *a, const MOBIFingerprint *b) {
+    uint64_t diff = a->simhash ^ b->simhash;
+    size_t distance = 0;
+    for (size_t i = 0; i < 8; i++) {
+        distance += (size_t) mobi_bitcount((uint8_t) (diff >> (8 * i)));
+    }
+    return distance;
+}
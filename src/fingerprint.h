@@ -0,0 +1,28 @@
+/** @file fingerprint.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_fingerprint_h
+#define libmobi_fingerprint_h
+
+#include "config.h"
+#include "mobi.h"
+
+/**
+ @defgroup mobi_fingerprint Params of document fingerprint
+ @{
+ */
+#define MOBI_FINGERPRINT_SHINGLE 4 /**< Default number of words in shingle */
+#define MOBI_FINGERPRINT_SHINGLE_MAX 16 /**< Maximal number of words in shingle */
+#define MOBI_FINGERPRINT_MINHASH 128 /**< Default number of MinHash values */
+#define MOBI_FINGERPRINT_MINHASH_MAX 1024 /**< Maximal number of MinHash values */
+#define MOBI_FINGERPRINT_JOB_MIN 16 /**< Minimal number of text records worth a separate thread */
+/** @} */
+
+#endif
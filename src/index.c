@@ -787,16 +787,20 @@ bool mobi_indx_has_tag(const MOBIIndx *indx, const size_t tagid) {
  @brief Get compiled index entry string
 
  Allocates memory for the string. Must be freed by caller.
+ Upper 16 bits of the offset select the cncx record, if index has more than one.
  
- @param[in] cncx_record MOBIPdbRecord structure with cncx record
+ @param[in] cncx_record MOBIPdbRecord structure with first cncx record
  @param[in] cncx_offset Offset of string entry from the beginning of the record
  @return Entry string or null if malloc failed
  */
 char * mobi_get_cncx_string(const MOBIPdbRecord *cncx_record, const uint32_t cncx_offset) {
-    /* TODO: handle multiple cncx records */
+    size_t record_number = cncx_offset >> 16;
+    while (record_number-- && cncx_record->next) {
+        cncx_record = cncx_record->next;
+    }
     MOBIBuffer *buf = buffer_init_null(cncx_record->size);
     buf->data = cncx_record->data;
-    buffer_setpos(buf, cncx_offset);
+    buffer_setpos(buf, cncx_offset & 0xffff);
     size_t len = 0;
     const uint32_t string_length = buffer_get_varlen(buf, &len);
     char *string = malloc(string_length + 1);
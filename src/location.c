@@ -0,0 +1,645 @@
+/** @file location.c
+ *  @brief Kindle locations and map of raw text positions to markup parts
+ *
+ * Raw text positions are byte offsets in the concatenation of decompressed text records,
+ * they are used by Kindle readers for locations and by kindle:pos links.
+ * Map is built in one pass over text records and skeleton and fragment indices,
+ * without reconstructing the markup.
+ * Text is not converted to utf-8, so part offsets of cp1252 documents are raw byte offsets.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "location.h"
+#include "index.h"
+#include "memory.h"
+#include "util.h"
+#include "read.h"
+#include "debug.h"
+
+/**
+ @brief Segment of raw text used while building map
+ */
+typedef struct {
+    uint32_t start; /**< Raw text position */
+    uint32_t length; /**< Segment length */
+    uint32_t part_uid; /**< Markup part uid */
+    uint32_t part_offset; /**< Offset in markup part */
+} MOBILocationSpan;
+
+/**
+ @brief Initializer for MOBILocationMap structure
+
+ It allocates memory for structure.
+ Memory should be freed with mobi_free_locationmap().
+
+ @return MOBILocationMap on success, NULL otherwise
+ */
+MOBILocationMap * mobi_init_locationmap(void) {
+    MOBILocationMap *map = calloc(1, sizeof(MOBILocationMap));
+    if (map == NULL) {
+        debug_print("%s", "Memory allocation for location map failed\n");
+        return NULL;
+    }
+    map->location_size = MOBI_LOCATION_SIZE;
+    return map;
+}
+
+/**
+ @brief Free tables of MOBILocationMap structure, leave it empty
+
+ @param[in,out] map MOBILocationMap structure
+ */
+static void mobi_locationmap_reset(MOBILocationMap *map) {
+    free(map->record_starts);
+    free(map->segments);
+    map->record_starts = NULL;
+    map->segments = NULL;
+    map->records_count = 0;
+    map->segments_count = 0;
+    map->text_length = 0;
+    map->markup_length = 0;
+}
+
+/**
+ @brief Free MOBILocationMap structure
+
+ @param[in] map MOBILocationMap structure
+ */
+void mobi_free_locationmap(MOBILocationMap *map) {
+    if (map == NULL) {
+        return;
+    }
+    mobi_locationmap_reset(map);
+    free(map);
+}
+
+/**
+ @brief Fill table of raw text positions of text records
+
+ Sizes of uncompressed records are known without reading their data,
+ otherwise records are decompressed one at a time. Records are left unmodified.
+
+ @param[in,out] map MOBILocationMap structure
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_locationmap_records(MOBILocationMap *map, const MOBIData *m) {
+    const size_t records_count = m->rh->text_record_count;
+    const uint16_t compression_type = m->rh->compression_type;
+    const bool is_encrypted = mobi_is_encrypted(m);
+    uint16_t extra_flags = 0;
+    if (m->mh && m->mh->extra_flags) {
+        extra_flags = *m->mh->extra_flags;
+    }
+    map->first_record = (uint32_t) (1 + mobi_get_kf8offset(m));
+    map->record_starts = malloc((records_count + 1) * sizeof(*map->record_starts));
+    if (map->record_starts == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    const MOBIHuffCdic *huffcdic = NULL;
+    if (compression_type == RECORD0_HUFF_COMPRESSION) {
+        MOBI_RET ret = mobi_get_huffcdic(m, &huffcdic);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    const bool decompress = (compression_type != RECORD0_NO_COMPRESSION || is_encrypted);
+    const size_t max_record_size = mobi_get_textrecord_maxsize(m);
+    unsigned char *decompressed = NULL;
+    if (decompress) {
+        decompressed = malloc(max_record_size);
+        if (decompressed == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+    }
+    unsigned char *decrypted = NULL;
+    size_t decrypted_size = 0;
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, map->first_record);
+    size_t text_length = 0;
+    size_t i = 0;
+    MOBI_RET ret = MOBI_SUCCESS;
+    while (i < records_count) {
+        if (curr == NULL) {
+            debug_print("Text record %zu not found\n", i);
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        size_t size = max_record_size;
+        if (decompress) {
+            if (is_encrypted && decrypted_size < curr->size) {
+                unsigned char *tmp = realloc(decrypted, curr->size);
+                if (tmp == NULL) {
+                    debug_print("%s\n", "Memory allocation failed");
+                    ret = MOBI_MALLOC_FAILED;
+                    break;
+                }
+                decrypted = tmp;
+                decrypted_size = curr->size;
+            }
+            ret = mobi_decompress_record(decompressed, &size, m, curr, extra_flags, huffcdic, decrypted);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+        } else {
+            size_t extra_size = 0;
+            if (extra_flags) {
+                extra_size = mobi_get_record_extrasize(curr, extra_flags);
+                if (extra_size == MOBI_NOTSET || extra_size >= curr->size) {
+                    ret = MOBI_DATA_CORRUPT;
+                    break;
+                }
+            }
+            size = curr->size - extra_size;
+        }
+        map->record_starts[i++] = (uint32_t) text_length;
+        text_length += size;
+        if (text_length > RAWTEXT_SIZEMAX) {
+            debug_print("Text too long: %zu\n", text_length);
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        curr = curr->next;
+    }
+    free(decompressed);
+    free(decrypted);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    map->record_starts[records_count] = (uint32_t) text_length;
+    map->records_count = records_count;
+    map->text_length = (uint32_t) text_length;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Insert fragment span into spans of markup part, which are kept in reading order
+
+ Fragment is inserted before text found at given position, same way as in mobi_reconstruct_parts().
+ Span containing position is split, there must be room for two more spans.
+
+ @param[in,out] spans Spans of markup part
+ @param[in,out] count Number of spans
+ @param[in] start Raw text position of fragment
+ @param[in] length Length of fragment
+ @param[in] position Insert position in markup part
+ */
+static void mobi_locationmap_insert(MOBILocationSpan *spans, size_t *count, const uint32_t start, const uint32_t length, const size_t position) {
+    size_t k = 0;
+    size_t offset = 0;
+    while (k < *count && offset + spans[k].length <= position) {
+        offset += spans[k].length;
+        k++;
+    }
+    if (k < *count && offset < position) {
+        /* split span */
+        const uint32_t head = (uint32_t) (position - offset);
+        memmove(spans + k + 2, spans + k + 1, (*count - k - 1) * sizeof(*spans));
+        spans[k + 1].start = spans[k].start + head;
+        spans[k + 1].length = spans[k].length - head;
+        spans[k].length = head;
+        (*count)++;
+        k++;
+    }
+    memmove(spans + k + 1, spans + k, (*count - k) * sizeof(*spans));
+    spans[k].start = start;
+    spans[k].length = length;
+    (*count)++;
+}
+
+/**
+ @brief Compare spans by raw text position, for qsort
+
+ @param[in] a First span
+ @param[in] b Second span
+ @return -1, 0 or 1
+ */
+static int mobi_locationspan_compare(const void *a, const void *b) {
+    const MOBILocationSpan *span_a = a;
+    const MOBILocationSpan *span_b = b;
+    return (span_a->start > span_b->start) - (span_a->start < span_b->start);
+}
+
+/**
+ @brief Build spans of markup parts from skeleton and fragment indices
+
+ Each skeleton is followed in raw text by its fragments, which are inserted into skeleton
+ at positions given by fragment labels. Resulting parts are described by spans
+ of raw text in reading order, spans are then sorted by raw text position.
+
+ @param[out] spans Array for spans, skel->entries_count + 2 * frag->entries_count entries
+ @param[out] spans_count Number of spans
+ @param[in] text_length Length of raw text
+ @param[in] skel Parsed skeleton index
+ @param[in] frag Parsed fragment index
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_locationmap_spans(MOBILocationSpan *spans, size_t *spans_count, const size_t text_length, const MOBIIndx *skel, const MOBIIndx *frag) {
+    size_t count = 0;
+    size_t j = 0;
+    size_t curr_position = 0;
+    for (size_t i = 0; i < skel->entries_count; i++) {
+        const MOBIIndexEntry *entry = &skel->entries[i];
+        uint32_t fragments_count;
+        uint32_t skel_position;
+        uint32_t skel_length;
+        if (mobi_get_indxentry_tagvalue(&fragments_count, entry, INDX_TAG_SKEL_COUNT) != MOBI_SUCCESS
+            || mobi_get_indxentry_tagvalue(&skel_position, entry, INDX_TAG_SKEL_POSITION) != MOBI_SUCCESS
+            || mobi_get_indxentry_tagvalue(&skel_length, entry, INDX_TAG_SKEL_LENGTH) != MOBI_SUCCESS) {
+            return MOBI_DATA_CORRUPT;
+        }
+        if (fragments_count > frag->entries_count - j || (size_t) skel_position + skel_length > text_length) {
+            debug_print("Wrong skeleton entry: %zu\n", i);
+            return MOBI_DATA_CORRUPT;
+        }
+        MOBILocationSpan *part = spans + count;
+        size_t part_count = 0;
+        if (skel_length) {
+            part[0].start = skel_position;
+            part[0].length = skel_length;
+            part_count = 1;
+        }
+        size_t part_length = skel_length;
+        size_t frag_position = (size_t) skel_position + skel_length;
+        while (fragments_count--) {
+            entry = &frag->entries[j++];
+            const size_t insert_position = strtoul(entry->label, NULL, 10);
+            uint32_t frag_length;
+            if (mobi_get_indxentry_tagvalue(&frag_length, entry, INDX_TAG_FRAG_LENGTH) != MOBI_SUCCESS
+                || insert_position < curr_position || frag_position + frag_length > text_length) {
+                debug_print("Wrong fragment entry: %zu\n", j - 1);
+                return MOBI_DATA_CORRUPT;
+            }
+            size_t position = insert_position - curr_position;
+            if (position > part_length) {
+                /* inserted at the end, as in mobi_reconstruct_parts() */
+                position = part_length;
+            }
+            if (frag_length) {
+                mobi_locationmap_insert(part, &part_count, (uint32_t) frag_position, frag_length, position);
+            }
+            part_length += frag_length;
+            frag_position += frag_length;
+        }
+        size_t part_offset = 0;
+        for (size_t k = 0; k < part_count; k++) {
+            part[k].part_uid = (uint32_t) i;
+            part[k].part_offset = (uint32_t) part_offset;
+            part_offset += part[k].length;
+        }
+        count += part_count;
+        curr_position += part_length;
+    }
+    qsort(spans, count, sizeof(*spans), mobi_locationspan_compare);
+    *spans_count = count;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Fill map of raw text positions to markup parts
+
+ Without skeleton index whole text is mapped to single part.
+
+ @param[in,out] map MOBILocationMap structure with filled text length
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_locationmap_segments(MOBILocationMap *map, const MOBIData *m) {
+    if (!mobi_exists_skel_indx(m) || !mobi_exists_frag_indx(m)) {
+        map->segments = calloc(1, sizeof(*map->segments));
+        if (map->segments == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        map->segments_count = (map->text_length > 0);
+        map->markup_length = map->text_length;
+        return MOBI_SUCCESS;
+    }
+    const size_t offset = mobi_get_kf8offset(m);
+    MOBIIndx *skel = mobi_init_indx();
+    MOBIIndx *frag = mobi_init_indx();
+    if (skel == NULL || frag == NULL) {
+        mobi_free_indx(skel);
+        mobi_free_indx(frag);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = mobi_parse_index(m, skel, *m->mh->skeleton_index + offset);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_parse_index(m, frag, *m->mh->fragment_index + offset);
+    }
+    MOBILocationSpan *spans = NULL;
+    size_t spans_count = 0;
+    if (ret == MOBI_SUCCESS) {
+        spans = malloc((skel->entries_count + 2 * frag->entries_count + 1) * sizeof(*spans));
+        if (spans == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            ret = MOBI_MALLOC_FAILED;
+        }
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_locationmap_spans(spans, &spans_count, map->text_length, skel, frag);
+    }
+    mobi_free_indx(skel);
+    mobi_free_indx(frag);
+    if (ret != MOBI_SUCCESS) {
+        free(spans);
+        return ret;
+    }
+    /* spans must cover markup without gaps or overlaps, merge the ones continuing each other */
+    size_t count = 0;
+    for (size_t k = 0; k < spans_count; k++) {
+        if (count > 0) {
+            MOBILocationSpan *last = &spans[count - 1];
+            if (last->start + last->length != spans[k].start) {
+                debug_print("Skeleton and fragments don't cover raw text at %u\n", last->start + last->length);
+                free(spans);
+                return MOBI_DATA_CORRUPT;
+            }
+            if (last->part_uid == spans[k].part_uid && last->part_offset + last->length == spans[k].part_offset) {
+                last->length += spans[k].length;
+                continue;
+            }
+        }
+        spans[count++] = spans[k];
+    }
+    map->segments = malloc((count + 1) * sizeof(*map->segments));
+    if (map->segments == NULL) {
+        free(spans);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t k = 0; k < count; k++) {
+        map->segments[k].start = spans[k].start;
+        map->segments[k].part_uid = spans[k].part_uid;
+        map->segments[k].part_offset = spans[k].part_offset;
+    }
+    map->segments_count = count;
+    map->markup_length = count ? spans[count - 1].start + spans[count - 1].length : 0;
+    free(spans);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build Kindle locations and position map of document text
+
+ Text records are processed one at a time, so memory usage does not depend on the text size.
+ For KF8 documents positions are mapped to markup parts using skeleton and fragment indices.
+ Map may be cached with mobi_save_locationmap().
+
+ @param[in,out] map MOBILocationMap structure initialized with mobi_init_locationmap()
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_build_locationmap(MOBILocationMap *map, const MOBIData *m) {
+    if (map == NULL || m == NULL) {
+        debug_print("%s", "Structures not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (mobi_is_encrypted(m) && m->drm_key == NULL) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    mobi_locationmap_reset(map);
+    MOBI_RET ret = mobi_locationmap_records(map, m);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_locationmap_segments(map, m);
+    }
+    if (ret != MOBI_SUCCESS) {
+        mobi_locationmap_reset(map);
+    }
+    return ret;
+}
+
+/**
+ @brief Get Kindle location of raw text position
+
+ @param[in] map MOBILocationMap structure
+ @param[in] position Raw text position
+ @return Location number, starting with 1
+ */
+size_t mobi_locationmap_location(const MOBILocationMap *map, const size_t position) {
+    return position / map->location_size + 1;
+}
+
+/**
+ @brief Get raw text position where Kindle location starts
+
+ @param[in] map MOBILocationMap structure
+ @param[in] location Location number, starting with 1
+ @return Raw text position
+ */
+size_t mobi_locationmap_location_position(const MOBILocationMap *map, const size_t location) {
+    if (location == 0) {
+        return 0;
+    }
+    return (location - 1) * map->location_size;
+}
+
+/**
+ @brief Get markup part and offset in that part of raw text position
+
+ @param[in] map MOBILocationMap structure
+ @param[in] position Raw text position
+ @param[out] part_uid Uid of markup part
+ @param[out] part_offset Offset in markup part, for cp1252 documents byte offset in part before its conversion to utf-8
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_PARAM_ERR if position is not in markup
+ */
+MOBI_RET mobi_locationmap_position(const MOBILocationMap *map, const size_t position, size_t *part_uid, size_t *part_offset) {
+    if (map->segments_count == 0 || position < map->segments[0].start || position >= map->markup_length) {
+        debug_print("Position outside of markup: %zu\n", position);
+        return MOBI_PARAM_ERR;
+    }
+    size_t low = 0;
+    size_t high = map->segments_count;
+    while (high - low > 1) {
+        const size_t mid = low + (high - low) / 2;
+        if (map->segments[mid].start <= position) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    *part_uid = map->segments[low].part_uid;
+    *part_offset = map->segments[low].part_offset + (position - map->segments[low].start);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get text record containing raw text position and offset in decompressed record
+
+ @param[in] map MOBILocationMap structure
+ @param[in] position Raw text position
+ @param[out] seqnumber Sequence number of text record
+ @param[out] record_offset Offset in decompressed record
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_PARAM_ERR if position is beyond text end
+ */
+MOBI_RET mobi_locationmap_record(const MOBILocationMap *map, const size_t position, size_t *seqnumber, size_t *record_offset) {
+    if (map->records_count == 0 || position >= map->text_length) {
+        debug_print("Position beyond text end: %zu\n", position);
+        return MOBI_PARAM_ERR;
+    }
+    size_t low = 0;
+    size_t high = map->records_count;
+    while (high - low > 1) {
+        const size_t mid = low + (high - low) / 2;
+        if (map->record_starts[mid] <= position) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    *seqnumber = map->first_record + low;
+    *record_offset = position - map->record_starts[low];
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Serialize location map
+
+ All values are stored as big-endian 32-bit integers following the header.
+
+ @param[in] map MOBILocationMap structure
+ @param[out] data Output buffer, if NULL only required size is returned
+ @param[in,out] size Size of output buffer, on return size of serialized map
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_save_locationmap(const MOBILocationMap *map, unsigned char *data, size_t *size) {
+    if (map == NULL || size == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    const size_t records_size = (map->records_count + 1) * 4;
+    const size_t segments_size = map->segments_count * 3 * 4;
+    const size_t total_size = LOCATIONMAP_HEADER_LEN + records_size + segments_size;
+    if (data == NULL) {
+        *size = total_size;
+        return MOBI_SUCCESS;
+    }
+    if (*size < total_size || map->record_starts == NULL) {
+        debug_print("Buffer too small for location map: %zu\n", *size);
+        return MOBI_PARAM_ERR;
+    }
+    MOBIBuffer *buf = buffer_init_null(total_size);
+    if (buf == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    buf->data = data;
+    buffer_addstring(buf, LOCATIONMAP_MAGIC);
+    buffer_add32(buf, LOCATIONMAP_VERSION);
+    buffer_add32(buf, map->text_length);
+    buffer_add32(buf, map->markup_length);
+    buffer_add32(buf, map->location_size);
+    buffer_add32(buf, map->first_record);
+    buffer_add32(buf, (uint32_t) map->records_count);
+    buffer_add32(buf, (uint32_t) map->segments_count);
+    for (size_t i = 0; i <= map->records_count; i++) {
+        buffer_add32(buf, map->record_starts[i]);
+    }
+    for (size_t i = 0; i < map->segments_count; i++) {
+        buffer_add32(buf, map->segments[i].start);
+        buffer_add32(buf, map->segments[i].part_uid);
+        buffer_add32(buf, map->segments[i].part_offset);
+    }
+    MOBI_RET ret = buf->error;
+    buffer_free_null(buf);
+    *size = total_size;
+    return ret;
+}
+
+/**
+ @brief Load location map serialized with mobi_save_locationmap()
+
+ Previous contents of the map are released, on failure map is left empty.
+
+ @param[in,out] map MOBILocationMap structure initialized with mobi_init_locationmap()
+ @param[in] data Serialized map
+ @param[in] size Size of serialized map
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_load_locationmap(MOBILocationMap *map, const unsigned char *data, const size_t size) {
+    if (map == NULL || data == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    mobi_locationmap_reset(map);
+    MOBIBuffer *buf = buffer_init_null(size);
+    if (buf == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    /* buffer is only read */
+    buf->data = (unsigned char *) data;
+    if (size < LOCATIONMAP_HEADER_LEN || !buffer_match_magic(buf, LOCATIONMAP_MAGIC)) {
+        buffer_free_null(buf);
+        debug_print("%s", "Not a location map\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    buffer_setpos(buf, 4);
+    const uint32_t version = buffer_get32(buf);
+    if (version != LOCATIONMAP_VERSION) {
+        buffer_free_null(buf);
+        debug_print("Unsupported location map version: %u\n", version);
+        return MOBI_DATA_CORRUPT;
+    }
+    map->text_length = buffer_get32(buf);
+    map->markup_length = buffer_get32(buf);
+    map->location_size = buffer_get32(buf);
+    map->first_record = buffer_get32(buf);
+    const size_t records_count = buffer_get32(buf);
+    const size_t segments_count = buffer_get32(buf);
+    if (map->location_size == 0 || map->markup_length > map->text_length
+        || records_count + 1 > (size - LOCATIONMAP_HEADER_LEN) / 4
+        || segments_count > (size - LOCATIONMAP_HEADER_LEN - (records_count + 1) * 4) / 12) {
+        buffer_free_null(buf);
+        mobi_locationmap_reset(map);
+        debug_print("%s", "Corrupt location map\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    map->record_starts = malloc((records_count + 1) * sizeof(*map->record_starts));
+    map->segments = malloc((segments_count + 1) * sizeof(*map->segments));
+    if (map->record_starts == NULL || map->segments == NULL) {
+        buffer_free_null(buf);
+        mobi_locationmap_reset(map);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    /* tables must be ordered for lookups */
+    bool ordered = true;
+    for (size_t i = 0; i <= records_count; i++) {
+        map->record_starts[i] = buffer_get32(buf);
+        if (i > 0 && map->record_starts[i] < map->record_starts[i - 1]) {
+            ordered = false;
+        }
+    }
+    for (size_t i = 0; i < segments_count; i++) {
+        map->segments[i].start = buffer_get32(buf);
+        map->segments[i].part_uid = buffer_get32(buf);
+        map->segments[i].part_offset = buffer_get32(buf);
+        if (i > 0 && map->segments[i].start <= map->segments[i - 1].start) {
+            ordered = false;
+        }
+    }
+    map->records_count = records_count;
+    map->segments_count = segments_count;
+    if (buf->error != MOBI_SUCCESS || !ordered || map->record_starts[records_count] != map->text_length) {
+        buffer_free_null(buf);
+        mobi_locationmap_reset(map);
+        debug_print("%s", "Corrupt location map\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    buffer_free_null(buf);
+    return MOBI_SUCCESS;
+}
@@ -0,0 +1,27 @@
+/** @file location.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_location_h
+#define libmobi_location_h
+
+#include "config.h"
+#include "mobi.h"
+
+/**
+ @defgroup mobi_location Params of location map
+ @{
+ */
+#define MOBI_LOCATION_SIZE 150 /**< Number of raw text positions in one Kindle location */
+#define LOCATIONMAP_MAGIC "LMAP" /**< Magic of serialized location map */
+#define LOCATIONMAP_VERSION 1 /**< Version of serialized location map */
+#define LOCATIONMAP_HEADER_LEN 32 /**< Length of serialized location map header, including magic */
+/** @} */
+
+#endif
@@ -35,79 +35,20 @@ MOBIData * mobi_init(void) {
     m->eh = NULL;
     m->rec = NULL;
     m->next = NULL;
+    m->spare_rec = NULL;
+    m->records_immutable = false;
+    m->repair_utf8 = false;
+    m->huffcdic = NULL;
     return m;
 }
 
 /**
- @brief Free MOBIMobiHeader structure
+ @brief Free MOBIMobiHeader structure allocated by mobi_parse_mobiheader()
  
  @param[in] mh MOBIMobiHeader structure
  */
 void mobi_free_mh(MOBIMobiHeader *mh) {
-    if (mh == NULL) {
-        return;
-    }
-    free(mh->header_length);
-    free(mh->mobi_type);
-    free(mh->text_encoding);
-    free(mh->uid);
-    free(mh->version);
-    free(mh->orth_index);
-    free(mh->infl_index);
-    free(mh->names_index);
-    free(mh->keys_index);
-    free(mh->extra0_index);
-    free(mh->extra1_index);
-    free(mh->extra2_index);
-    free(mh->extra3_index);
-    free(mh->extra4_index);
-    free(mh->extra5_index);
-    free(mh->non_text_index);
-    free(mh->full_name_offset);
-    free(mh->full_name_length);
-    free(mh->locale);
-    free(mh->dict_input_lang);
-    free(mh->dict_output_lang);
-    free(mh->min_version);
-    free(mh->image_index);
-    free(mh->huff_rec_index);
-    free(mh->huff_rec_count);
-    free(mh->datp_rec_index);
-    free(mh->datp_rec_count);
-    free(mh->exth_flags);
-    free(mh->unknown6);
-    free(mh->drm_offset);
-    free(mh->drm_count);
-    free(mh->drm_size);
-    free(mh->drm_flags);
-    free(mh->fdst_index);
-    free(mh->first_text_index);
-    free(mh->last_text_index);
-    free(mh->fdst_section_count);
-    //free(mh->unknown9);
-    free(mh->fcis_index);
-    free(mh->fcis_count);
-    free(mh->flis_index);
-    free(mh->flis_count);
-    free(mh->unknown10);
-    free(mh->unknown11);
-    free(mh->srcs_index);
-    free(mh->srcs_count);
-    free(mh->unknown12);
-    free(mh->unknown13);
-    free(mh->extra_flags);
-    free(mh->ncx_index);
-    free(mh->fragment_index);
-    free(mh->skeleton_index);
-    free(mh->unknown14);
-    free(mh->unknown15);
-    free(mh->datp_index);
-    free(mh->guide_index);
-    free(mh->unknown16);
-    free(mh->unknown17);
-    free(mh->unknown18);
-    free(mh->unknown19);
-    free(mh->unknown20);
+    /* header fields are stored in the same allocation */
     free(mh);
     mh = NULL;
 }
@@ -120,53 +61,57 @@ void mobi_free_mh(MOBIMobiHeader *mh) {
  @param[in,out] m MOBIData structure
  */
 void mobi_free_rec(MOBIData *m) {
+    mobi_free_records(m->rec);
+    m->rec = NULL;
+}
+
+/**
+ @brief Free list of MOBIPdbRecord structures and their data
+ 
+ @param[in] records First record of the list
+ */
+void mobi_free_records(MOBIPdbRecord *records) {
     MOBIPdbRecord *curr, *tmp;
-    curr = m->rec;
+    curr = records;
     while (curr != NULL) {
         tmp = curr;
         curr = curr->next;
         free(tmp->data);
         free(tmp);
-        tmp = NULL;
     }
-    m->rec = NULL;
 }
 
 /**
  @brief Free all MOBIExthHeader structures and its respective data attached to MOBIData structure
  
- Each MOBIExthHeader structure holds metadata and data for each EXTH record
+ Each MOBIExthHeader structure holds metadata and data for each EXTH record,
+ all of them are allocated in one block by mobi_parse_extheader()
  
  @param[in,out] m MOBIData structure
  */
 void mobi_free_eh(MOBIData *m) {
-    MOBIExthHeader *curr, *tmp;
-    curr = m->eh;
-    while (curr != NULL) {
-        tmp = curr;
-        curr = curr->next;
-        free(tmp->data);
-        free(tmp);
-        tmp = NULL;
-    }
+    /* list nodes and records data are stored in the same allocation */
+    free(m->eh);
     m->eh = NULL;
 }
 
 /**
- @brief Free MOBIData structure and all its children
+ @brief Free document contents of MOBIData structure, except records
  
- @param[in] m MOBIData structure
+ @param[in,out] m MOBIData structure
  */
-void mobi_free(MOBIData *m) {
-    if (m == NULL) {
-        return;
-    }
+static void mobi_free_contents(MOBIData *m) {
+    mobi_free_huffcdic(m->huffcdic);
+    m->huffcdic = NULL;
     mobi_free_mh(m->mh);
+    m->mh = NULL;
     mobi_free_eh(m);
-    mobi_free_rec(m);
     free(m->ph);
+    m->ph = NULL;
     free(m->rh);
+    m->rh = NULL;
     if (m->next) {
+        mobi_free_huffcdic(m->next->huffcdic);
         mobi_free_mh(m->next->mh);
         mobi_free_eh(m->next);
         free(m->next->rh);
@@ -175,11 +120,55 @@ void mobi_free(MOBIData *m) {
     }
     if (m->drm_key) {
         free(m->drm_key);
+        m->drm_key = NULL;
+    }
+}
+
+/**
+ @brief Free MOBIData structure and all its children
+ 
+ @param[in] m MOBIData structure
+ */
+void mobi_free(MOBIData *m) {
+    if (m == NULL) {
+        return;
     }
+    mobi_free_contents(m);
+    mobi_free_rec(m);
+    mobi_free_records(m->spare_rec);
     free(m);
     m = NULL;
 }
 
+/**
+ @brief Release loaded document, so that MOBIData structure may be reused for loading next file
+ 
+ Headers, EXTH records and decryption key are freed.
+ Records with their data buffers are kept on spare list and reused by next mobi_load_file() call,
+ which saves allocations when many files are processed in a loop.
+ Setting of KF8 part selection is preserved.
+ Spare records are freed with mobi_free().
+ 
+ @param[in,out] m MOBIData structure
+ */
+void mobi_reset(MOBIData *m) {
+    if (m == NULL) {
+        return;
+    }
+    mobi_free_contents(m);
+    /* move records to spare list, record size is kept as capacity of its data buffer */
+    if (m->rec) {
+        MOBIPdbRecord *last = m->rec;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = m->spare_rec;
+        m->spare_rec = m->rec;
+        m->rec = NULL;
+    }
+    m->kf8_boundary_offset = MOBI_NOTSET;
+}
+
 /**
  @brief Initialize and return MOBIHuffCdic structure.
  
@@ -210,10 +199,33 @@ void mobi_free_huffcdic(MOBIHuffCdic *huffcdic) {
     }
     free(huffcdic->symbol_offsets);
     free(huffcdic->symbols);
+    free(huffcdic->symbols_size);
+    free(huffcdic->expanded);
+    free(huffcdic->expanded_data);
     free(huffcdic);
     huffcdic = NULL;
 }
 
+/**
+ @brief Set MOBIRawml members to initial values
+ 
+ @param[in,out] rawml MOBIRawml structure
+ @param[in] m Initialized MOBIData structure
+ */
+static void mobi_rawml_clear(MOBIRawml *rawml, const MOBIData *m) {
+    rawml->version = mobi_get_fileversion(m);
+    rawml->fdst = NULL;
+    rawml->skel = NULL;
+    rawml->frag = NULL;
+    rawml->guide = NULL;
+    rawml->ncx = NULL;
+    rawml->orth = NULL;
+    rawml->infl = NULL;
+    rawml->flow = NULL;
+    rawml->markup = NULL;
+    rawml->resources = NULL;
+}
+
 /**
  @brief Initialize and return MOBIRawml structure.
  
@@ -230,17 +242,7 @@ MOBIRawml * mobi_init_rawml(const MOBIData *m) {
         debug_print("%s", "Memory allocation failed for rawml structure\n");
         return NULL;
     }
-    rawml->version = mobi_get_fileversion(m);
-    rawml->fdst = NULL;
-    rawml->skel = NULL;
-    rawml->frag = NULL;
-    rawml->guide = NULL;
-    rawml->ncx = NULL;
-    rawml->orth = NULL;
-    rawml->infl = NULL;
-    rawml->flow = NULL;
-    rawml->markup = NULL;
-    rawml->resources = NULL;
+    mobi_rawml_clear(rawml, m);
     return rawml;
 }
 
@@ -368,6 +370,8 @@ void mobi_free_part(MOBIPart *part, int free_data) {
         tmp = curr;
         curr = curr->next;
         if (free_data) { free(tmp->data); }
+        /* compressed blocks are always owned by part */
+        free(tmp->blocks);
         free(tmp);
         tmp = NULL;
     }
@@ -395,7 +399,7 @@ void mobi_free_opf_data(MOBIPart *part) {
  */
 void mobi_free_font_data(MOBIPart *part) {
     while (part != NULL) {
-        if (part->type == T_OTF || part->type == T_TTF) {
+        if (part->type == T_OTF || part->type == T_TTF || part->type == T_FONT) {
             free(part->data);
         }
         part = part->next;
@@ -403,17 +407,14 @@ void mobi_free_font_data(MOBIPart *part) {
 }
 
 /**
- @brief Free MOBIRawml structure allocated by mobi_init_rawml()
+ @brief Free children of MOBIRawml structure
  
  Pointer to data may point to memory area also used by record->data.
  So we need a flag to leave the memory allocated, while freeing MOBIPart structure
  
  @param[in] rawml MOBIRawml structure
  */
-void mobi_free_rawml(MOBIRawml *rawml) {
-    if (rawml == NULL) {
-        return;
-    }
+static void mobi_free_rawml_contents(MOBIRawml *rawml) {
     mobi_free_fdst(rawml->fdst);
     mobi_free_indx(rawml->skel);
     mobi_free_indx(rawml->frag);
@@ -429,8 +430,39 @@ void mobi_free_rawml(MOBIRawml *rawml) {
     /* and free decoded fonts data */
     mobi_free_font_data(rawml->resources);
     mobi_free_part(rawml->resources, false);
+}
+
+/**
+ @brief Free MOBIRawml structure allocated by mobi_init_rawml()
+ 
+ @param[in] rawml MOBIRawml structure
+ */
+void mobi_free_rawml(MOBIRawml *rawml) {
+    if (rawml == NULL) {
+        return;
+    }
+    mobi_free_rawml_contents(rawml);
     free(rawml);
     rawml = NULL;
 }
 
+/**
+ @brief Release parsed document, so that MOBIRawml structure may be reused for parsing next file
+ 
+ Parsed contents are freed and structure is initialized for the document loaded in MOBIData structure,
+ as if it was returned by mobi_init_rawml().
+ Rawml must be reset before mobi_reset() is called on MOBIData structure it was parsed from,
+ as resource parts point to records data.
+ 
+ @param[in,out] rawml MOBIRawml structure
+ @param[in] m Initialized MOBIData structure
+ */
+void mobi_rawml_reset(MOBIRawml *rawml, const MOBIData *m) {
+    if (rawml == NULL) {
+        return;
+    }
+    mobi_free_rawml_contents(rawml);
+    mobi_rawml_clear(rawml, m);
+}
+
 
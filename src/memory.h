@@ -29,6 +29,7 @@ MOBIIndx * mobi_init_indx(void);
 void mobi_free_indx(MOBIIndx *indx);
 void mobi_free_tagx(MOBITagx *tagx);
 void mobi_free_ordt(MOBIOrdt *ordt);
+void mobi_free_fdst(MOBIFdst *fdst);
 void mobi_free_index_entries(MOBIIndx *indx);
 
 #endif
@@ -183,7 +183,7 @@ extern "C"
         T_MPG, /**< mp3 */
         T_PDF, /**< pdf */
         /* generic types */
-        T_FONT, /**< encoded font */
+        T_FONT, /**< encoded font, or decoded font of unrecognized format */
         T_AUDIO, /**< audio resource */
         T_VIDEO, /**< video resource */
         T_BREAK /**< end of file */
@@ -378,6 +378,10 @@ extern "C"
         MOBIExthHeader *eh; /**< Linked list of EXTH records or NULL if not loaded */
         MOBIPdbRecord *rec; /**< Linked list of palmdoc database records or NULL if not loaded */
         struct MOBIData *next; /**< Pointer to the other part of hybrid file or NULL if not a hybrid file */
+        MOBIPdbRecord *spare_rec; /**< Linked list of records released by mobi_reset(), reused by next load, or NULL */
+        struct MOBIHuffCdic *huffcdic; /**< Huffman decompression tables parsed on first use and cached, or NULL */
+        bool records_immutable; /**< Flag: if set, records are not modified after loading and EXTH data points into record 0 instead of being copied (default: false) */
+        bool repair_utf8; /**< Flag: if set, invalid sequences in markup of utf-8 documents are replaced with U+FFFD while parsing (default: false) */
     } MOBIData;
     
     /** @} */ // end of raw_structs group
@@ -434,17 +438,25 @@ extern "C"
         char *orth_index_name; /**< Orth index name */
     } MOBIIndx;
     
+    /**
+     @brief Opaque structure holding part data compressed in blocks
+     */
+    typedef struct MOBIPartBlocks MOBIPartBlocks;
+
     /**
      @brief Reconstructed source file.
      
      All file parts are organized in a linked list.
+     Field blocks was appended to the structure together with mobi_compress_rawml(),
+     which changed its size (ABI), so applications built against older headers must be rebuilt.
      */
     typedef struct MOBIPart {
         size_t uid; /**< Unique id */
         MOBIFiletype type; /**< File type */
         size_t size; /**< File size */
-        unsigned char *data; /**< File data */
+        unsigned char *data; /**< File data, NULL if data is compressed */
         struct MOBIPart *next; /**< Pointer to next part or NULL */
+        MOBIPartBlocks *blocks; /**< Compressed data, see mobi_compress_rawml(), NULL if data is not compressed */
     } MOBIPart;
     
     /**
@@ -464,30 +476,248 @@ extern "C"
         MOBIPart *resources; /**< Linked list of reconstructed resources files or NULL if not present */
     } MOBIRawml;
 
+    /**
+     @brief Callbacks receiving data streamed by the library
+     */
+    typedef struct {
+        MOBI_RET (*write)(void *context, const unsigned char *data, const size_t size); /**< Called with consecutive chunks of data */
+        MOBI_RET (*write_offset)(void *context, const size_t offset, const size_t size); /**< Optional, called instead of write with offset of data in the source file, if it is stored there unmodified */
+        void *context; /**< User data passed to callbacks */
+    } MOBISink;
+
+    /**
+     @brief Table of contents entry of document written with mobi_write_kf8()
+     */
+    typedef struct {
+        const char *label; /**< Entry text */
+        const char *target; /**< Link target, "part00000.html" or "part00000.html#id" */
+        size_t level; /**< Nesting level, 0 for top level entries */
+    } MOBITocEntry;
+
+    /**
+     @brief Guide reference of document written with mobi_write_kf8()
+     */
+    typedef struct {
+        const char *type; /**< Reference type, eg. "toc" or "text" */
+        const char *title; /**< Reference title */
+        const char *target; /**< Link target, "part00000.html" */
+    } MOBIGuideEntry;
+
+    /**
+     @brief Source of document written with mobi_write_kf8()
+     
+     Parts reference each other the same way as parts reconstructed by mobi_parse_rawml():
+     "part00000.html#id", "flow00001.css" and "resource00000.jpg".
+     */
+    typedef struct {
+        const MOBIPart *markup; /**< Linked list of xhtml files, file number is the position on the list */
+        const MOBIPart *flow; /**< Linked list of css and svg files, flow number is the position on the list plus one, or NULL */
+        const MOBIPart *resources; /**< Linked list of images, fonts and media, resource number is part uid, or NULL */
+        const char *title; /**< Document title */
+        const char *author; /**< Document author or NULL */
+        const char *language; /**< Document language, eg. "en-us", or NULL */
+        const MOBITocEntry *toc; /**< Table of contents entries in document order or NULL */
+        size_t toc_count; /**< Number of table of contents entries */
+        const MOBIGuideEntry *guide; /**< Guide references or NULL */
+        size_t guide_count; /**< Number of guide references */
+    } MOBIKf8Book;
+
+    /**
+     @brief Memory allocation counters, see mobi_get_alloc_stats()
+     */
+    typedef struct {
+        size_t allocs; /**< Number of malloc and calloc calls */
+        size_t reallocs; /**< Number of realloc calls */
+        size_t frees; /**< Number of free calls with non-NULL pointer */
+        size_t bytes; /**< Total number of bytes requested */
+    } MOBIAllocStats;
+
+    /**
+     @brief Segment of raw text mapped to markup part, see MOBILocationMap
+     */
+    typedef struct {
+        uint32_t start; /**< Raw text position of segment start */
+        uint32_t part_uid; /**< Uid of markup part containing segment */
+        uint32_t part_offset; /**< Offset of segment start in markup part, in raw text bytes before conversion to utf-8 */
+    } MOBILocationSegment;
+
+    /**
+     @brief Kindle locations and position map of raw text, see mobi_build_locationmap()
+     
+     Positions are byte offsets in raw text, which is concatenation of decompressed text records.
+     Markup part offsets refer to parts as reassembled from skeleton and fragments,
+     before links are reconstructed.
+     Offsets are not converted to utf-8: for cp1252 encoded documents they are byte offsets
+     in raw cp1252 text, not in markup parts returned by mobi_parse_rawml().
+     */
+    typedef struct {
+        uint32_t text_length; /**< Length of raw text */
+        uint32_t markup_length; /**< Length of raw text mapped to markup parts, following flows are not mapped */
+        uint32_t location_size; /**< Number of positions in one Kindle location */
+        uint32_t first_record; /**< Sequence number of the first text record */
+        size_t records_count; /**< Number of text records */
+        uint32_t *record_starts; /**< Raw text position of each text record start, records_count + 1 entries, last one equals text_length */
+        size_t segments_count; /**< Number of segments */
+        MOBILocationSegment *segments; /**< Segments sorted by start position, each one ends where next one starts, last one ends at markup_length */
+    } MOBILocationMap;
+
+    /**
+     @brief Statistics of document, see mobi_compute_stats()
+     */
+    typedef struct {
+        size_t text_length; /**< Length of markup text in bytes, following css and svg flows excluded */
+        size_t characters; /**< Number of characters outside of tags, white space excluded */
+        size_t words; /**< Number of words, separated by white space and non-inline tags */
+        size_t image_references; /**< Number of img and svg image tags */
+        size_t resources; /**< Number of resource records */
+        size_t images; /**< Number of image resources */
+        size_t fonts; /**< Number of font resources */
+        size_t audio; /**< Number of audio resources */
+        size_t video; /**< Number of video resources */
+        size_t reading_time; /**< Estimated reading time in minutes, at 250 words per minute */
+    } MOBIStats;
+
+    /**
+     @brief Resource record properties, see mobi_probe_resources()
+     */
+    typedef struct {
+        size_t uid; /**< Resource uid, same as uid of resource part reconstructed by mobi_parse_rawml() */
+        MOBIFiletype type; /**< Resource type, fonts and media are not decoded */
+        uint32_t width; /**< Image width, 0 if not an image or unknown */
+        uint32_t height; /**< Image height, 0 if not an image or unknown */
+        size_t size; /**< Size of resource record */
+    } MOBIResourceInfo;
+
+    /**
+     @brief Section of document records, see mobi_diff()
+     */
+    typedef enum {
+        MOBI_SECTION_HEADER, /**< Record 0 with MOBI and EXTH headers */
+        MOBI_SECTION_TEXT, /**< Text records */
+        MOBI_SECTION_INDEX, /**< Index records */
+        MOBI_SECTION_RESOURCE, /**< Images, fonts and media */
+        MOBI_SECTION_OTHER /**< Remaining records (FDST, FLIS, HUFF/CDIC etc) */
+    } MOBISection;
+
+    /**
+     @brief Kind of record change, see mobi_diff()
+     */
+    typedef enum {
+        MOBI_DIFF_CHANGED, /**< Record content differs */
+        MOBI_DIFF_ADDED, /**< Record present only in second document */
+        MOBI_DIFF_REMOVED /**< Record present only in first document */
+    } MOBIDiffStatus;
+
+    /**
+     @brief Changed record, see mobi_diff()
+     */
+    typedef struct {
+        MOBISection section; /**< Section of record */
+        MOBIDiffStatus status; /**< Kind of change */
+        size_t seqnumber_a; /**< Sequence number of record in first document, MOBI_NOTSET if added */
+        size_t seqnumber_b; /**< Sequence number of record in second document, MOBI_NOTSET if removed */
+    } MOBIRecordDiff;
+
+    /**
+     @brief Record level difference between two editions of document, see mobi_diff()
+     */
+    typedef struct {
+        size_t records_count; /**< Number of changed records */
+        MOBIRecordDiff *records; /**< Changed records ordered by section and position in section */
+        size_t parts_count; /**< Number of affected markup parts */
+        size_t *parts; /**< Sorted uids of markup parts of second document containing changed text */
+    } MOBIDiff;
+
+    /**
+     @brief Options of document fingerprint, see mobi_fingerprint()
+     */
+    typedef struct {
+        size_t shingle_size; /**< Number of consecutive words in shingle, at most 16, 0 for default of 4 */
+        size_t minhash_count; /**< Number of MinHash values, at most 1024, 0 for default of 128 */
+    } MOBIFingerprintOptions;
+
+    /**
+     @brief Content fingerprint of document text, see mobi_fingerprint()
+     */
+    typedef struct {
+        size_t records_count; /**< Number of text records */
+        uint64_t *record_hashes; /**< Hash of decompressed text of each text record */
+        size_t words; /**< Number of words outside of tags */
+        size_t shingles; /**< Number of shingles */
+        size_t shingle_size; /**< Number of words in shingle */
+        size_t minhash_count; /**< Number of MinHash values */
+        uint64_t *minhash; /**< MinHash signature of shingles */
+        uint64_t simhash; /**< SimHash of shingles */
+    } MOBIFingerprint;
+
     /** @} */ // end of parsed_structs group
     
     /** 
      @defgroup mobi_export Functions exported by the library
+     
+     Most settings are kept in MOBIData structure and apply to that document only.
+     Settings of mobi_set_scratch_threshold(), mobi_set_scratch_pool() and mobi_set_threads_count()
+     are process-wide instead: they are plain variables read by every thread using the library,
+     so they must be set before other threads start calling the library,
+     and must not be changed while any document is processed.
      @{
      */
     MOBI_EXPORT const char * mobi_version(void);
+    MOBI_EXPORT MOBI_RET mobi_get_alloc_stats(MOBIAllocStats *stats);
+    MOBI_EXPORT MOBI_RET mobi_set_scratch_threshold(const size_t threshold);
+    MOBI_EXPORT MOBI_RET mobi_set_scratch_pool(const size_t max_size);
+    MOBI_EXPORT void mobi_release_scratch_pool(void);
+    MOBI_EXPORT MOBI_RET mobi_set_threads_count(const size_t count);
     MOBI_EXPORT MOBI_RET mobi_load_file(MOBIData *m, FILE *file);
     MOBI_EXPORT MOBI_RET mobi_load_filename(MOBIData *m, const char *path);
     
     MOBI_EXPORT MOBIData * mobi_init(void);
     MOBI_EXPORT void mobi_free(MOBIData *m);
+    MOBI_EXPORT void mobi_reset(MOBIData *m);
     
     MOBI_EXPORT MOBI_RET mobi_parse_kf7(MOBIData *m);
     MOBI_EXPORT MOBI_RET mobi_parse_kf8(MOBIData *m);
+    MOBI_EXPORT MOBI_RET mobi_set_records_immutable(MOBIData *m, const bool immutable);
+    MOBI_EXPORT MOBI_RET mobi_set_utf8_repair(MOBIData *m, const bool repair);
     
     MOBI_EXPORT MOBI_RET mobi_parse_rawml(MOBIRawml *rawml, const MOBIData *m);
     MOBI_EXPORT MOBI_RET mobi_parse_rawml_opt(MOBIRawml *rawml, const MOBIData *m, bool parse_toc, bool parse_dict, bool reconstruct);
 
     MOBI_EXPORT MOBI_RET mobi_get_rawml(const MOBIData *m, char *text, size_t *len);
     MOBI_EXPORT MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_extract_replica_pdf(const MOBIData *m, const MOBISink *sink);
     MOBI_EXPORT MOBI_RET mobi_decode_font_resource(unsigned char **decoded_font, size_t *decoded_size, MOBIPart *part);
     MOBI_EXPORT MOBI_RET mobi_decode_audio_resource(unsigned char **decoded_resource, size_t *decoded_size, MOBIPart *part);
     MOBI_EXPORT MOBI_RET mobi_decode_video_resource(unsigned char **decoded_resource, size_t *decoded_size, MOBIPart *part);
+    MOBI_EXPORT MOBI_RET mobi_write_kf8(const MOBIKf8Book *book, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_rebuild_kf8(const MOBIData *m, FILE *file);
+    MOBI_EXPORT MOBI_RET mobi_build_index(MOBIPdbRecord **records, const MOBIIndexEntry *entries, const size_t entries_count, const uint32_t type);
+    MOBI_EXPORT void mobi_free_records(MOBIPdbRecord *records);
+    MOBI_EXPORT MOBI_RET mobi_fix_xhtml(unsigned char **fixed, size_t *fixed_size, const MOBIPart *part);
+    MOBI_EXPORT MOBI_RET mobi_compress_rawml(MOBIRawml *rawml, const size_t block_size);
+    MOBI_EXPORT MOBI_RET mobi_decompress_rawml(MOBIRawml *rawml);
+    MOBI_EXPORT MOBI_RET mobi_part_read(const MOBIPart *part, unsigned char *out, const size_t offset, size_t *size);
+    MOBI_EXPORT MOBILocationMap * mobi_init_locationmap(void);
+    MOBI_EXPORT MOBI_RET mobi_build_locationmap(MOBILocationMap *map, const MOBIData *m);
+    MOBI_EXPORT void mobi_free_locationmap(MOBILocationMap *map);
+    MOBI_EXPORT size_t mobi_locationmap_location(const MOBILocationMap *map, const size_t position);
+    MOBI_EXPORT size_t mobi_locationmap_location_position(const MOBILocationMap *map, const size_t location);
+    MOBI_EXPORT MOBI_RET mobi_locationmap_position(const MOBILocationMap *map, const size_t position, size_t *part_uid, size_t *part_offset);
+    MOBI_EXPORT MOBI_RET mobi_locationmap_record(const MOBILocationMap *map, const size_t position, size_t *seqnumber, size_t *record_offset);
+    MOBI_EXPORT MOBI_RET mobi_save_locationmap(const MOBILocationMap *map, unsigned char *data, size_t *size);
+    MOBI_EXPORT MOBI_RET mobi_load_locationmap(MOBILocationMap *map, const unsigned char *data, const size_t size);
+    MOBI_EXPORT MOBI_RET mobi_compute_stats(const MOBIData *m, MOBIStats *stats);
+    MOBI_EXPORT MOBI_RET mobi_get_image_size(const MOBIPart *part, size_t *width, size_t *height);
+    MOBI_EXPORT MOBI_RET mobi_probe_resources(const MOBIData *m, MOBIResourceInfo **info, size_t *count);
+    MOBI_EXPORT void mobi_free_resources_info(MOBIResourceInfo *info);
+    MOBI_EXPORT MOBIDiff * mobi_init_diff(void);
+    MOBI_EXPORT MOBI_RET mobi_diff(MOBIDiff *diff, const MOBIData *a, const MOBIData *b);
+    MOBI_EXPORT void mobi_free_diff(MOBIDiff *diff);
+    MOBI_EXPORT MOBIFingerprint * mobi_init_fingerprint(void);
+    MOBI_EXPORT MOBI_RET mobi_fingerprint(MOBIFingerprint *fingerprint, const MOBIData *m, const MOBIFingerprintOptions *options);
+    MOBI_EXPORT void mobi_free_fingerprint(MOBIFingerprint *fingerprint);
+    MOBI_EXPORT double mobi_fingerprint_similarity(const MOBIFingerprint *a, const MOBIFingerprint *b);
+    MOBI_EXPORT size_t mobi_fingerprint_distance(const MOBIFingerprint *a, const MOBIFingerprint *b);
     
     MOBI_EXPORT MOBIPdbRecord * mobi_get_record_by_uid(const MOBIData *m, const size_t uid);
     MOBI_EXPORT MOBIPdbRecord * mobi_get_record_by_seqnumber(const MOBIData *m, const size_t uid);
@@ -527,10 +757,12 @@ extern "C"
     MOBI_EXPORT bool mobi_is_encrypted(const MOBIData *m);
     MOBI_EXPORT bool mobi_is_mobipocket(const MOBIData *m);
     MOBI_EXPORT bool mobi_is_dictionary(const MOBIData *m);
+    MOBI_EXPORT bool mobi_is_replica(const MOBIData *m);
     MOBI_EXPORT bool mobi_is_kf8(const MOBIData *m);
     MOBI_EXPORT bool mobi_is_rawml_kf8(const MOBIRawml *rawml);
     MOBI_EXPORT MOBIRawml * mobi_init_rawml(const MOBIData *m);
     MOBI_EXPORT void mobi_free_rawml(MOBIRawml *rawml);
+    MOBI_EXPORT void mobi_rawml_reset(MOBIRawml *rawml, const MOBIData *m);
     
     MOBI_EXPORT MOBI_RET mobi_drm_setkey(MOBIData *m, const char *pid);
     MOBI_EXPORT MOBI_RET mobi_drm_delkey(MOBIData *m);
@@ -0,0 +1,409 @@
+/** @file mobi.hpp
+ *  @brief Header-only C++ interface to libmobi
+ *
+ * This file is installed with the library.
+ * Include it in your project with "#include <mobi.hpp>", requires C++17.
+ *
+ * Thin wrappers over C API: Document and Rawml own MOBIData and MOBIRawml
+ * structures, parts are exposed as views into MOBIPart data, no data is copied.
+ * Views stay valid as long as Rawml object they come from. Resource views may
+ * also point into records data, so Rawml must not outlive Document it was parsed from.
+ *
+ * Functions come in two flavours: throwing mobi::Error, or reporting
+ * failure through std::error_code argument.
+ * See example of usage in mobibench.cpp.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_mobi_hpp
+#define libmobi_mobi_hpp
+
+#include <cstddef>
+#include <iterator>
+#include <new>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include "mobi.h"
+
+namespace mobi {
+
+    /**
+     @brief Error codes, same values as MOBI_RET
+     */
+    enum class Errc {
+        success = MOBI_SUCCESS,
+        error = MOBI_ERROR,
+        param_err = MOBI_PARAM_ERR,
+        data_corrupt = MOBI_DATA_CORRUPT,
+        file_not_found = MOBI_FILE_NOT_FOUND,
+        file_encrypted = MOBI_FILE_ENCRYPTED,
+        file_unsupported = MOBI_FILE_UNSUPPORTED,
+        malloc_failed = MOBI_MALLOC_FAILED,
+        init_failed = MOBI_INIT_FAILED,
+        buffer_end = MOBI_BUFFER_END,
+        xml_err = MOBI_XML_ERR,
+        drm_pidinv = MOBI_DRM_PIDINV,
+        drm_keynotfound = MOBI_DRM_KEYNOTFOUND,
+        drm_unsupported = MOBI_DRM_UNSUPPORTED,
+    };
+
+    /**
+     @brief Error category of libmobi error codes
+     */
+    class ErrorCategory : public std::error_category {
+    public:
+        const char *name() const noexcept override {
+            return "mobi";
+        }
+
+        std::string message(int code) const override {
+            switch (static_cast<MOBI_RET>(code)) {
+                case MOBI_SUCCESS: return "Success";
+                case MOBI_ERROR: return "Generic error";
+                case MOBI_PARAM_ERR: return "Wrong function parameter";
+                case MOBI_DATA_CORRUPT: return "Corrupted data";
+                case MOBI_FILE_NOT_FOUND: return "File not found";
+                case MOBI_FILE_ENCRYPTED: return "Unsupported encrypted data";
+                case MOBI_FILE_UNSUPPORTED: return "Unsupported document type";
+                case MOBI_MALLOC_FAILED: return "Memory allocation error";
+                case MOBI_INIT_FAILED: return "Initialization error";
+                case MOBI_BUFFER_END: return "Out of buffer error";
+                case MOBI_XML_ERR: return "XMLwriter error";
+                case MOBI_DRM_PIDINV: return "Invalid DRM PID";
+                case MOBI_DRM_KEYNOTFOUND: return "Key not found";
+                case MOBI_DRM_UNSUPPORTED: return "DRM support not included";
+            }
+            return "Unknown error";
+        }
+
+        std::error_condition default_error_condition(int code) const noexcept override {
+            switch (static_cast<MOBI_RET>(code)) {
+                case MOBI_PARAM_ERR: return std::errc::invalid_argument;
+                case MOBI_FILE_NOT_FOUND: return std::errc::no_such_file_or_directory;
+                case MOBI_MALLOC_FAILED: return std::errc::not_enough_memory;
+                case MOBI_FILE_UNSUPPORTED:
+                case MOBI_DRM_UNSUPPORTED: return std::errc::not_supported;
+                default: return std::error_condition(code, *this);
+            }
+        }
+    };
+
+    /**
+     @brief Get libmobi error category
+     */
+    inline const std::error_category &error_category() noexcept {
+        static const ErrorCategory category;
+        return category;
+    }
+
+    /**
+     @brief Make std::error_code from Errc
+     */
+    inline std::error_code make_error_code(Errc code) noexcept {
+        return std::error_code(static_cast<int>(code), error_category());
+    }
+
+    /**
+     @brief Make std::error_code from MOBI_RET status code
+     */
+    inline std::error_code make_error_code(MOBI_RET ret) noexcept {
+        return make_error_code(static_cast<Errc>(ret));
+    }
+
+    /**
+     @brief Exception thrown by throwing overloads
+     */
+    class Error : public std::system_error {
+    public:
+        Error(std::error_code code, const char *what) : std::system_error(code, what) {}
+    };
+
+    namespace detail {
+        /**
+         @brief Store status code in ec, return true on success
+         */
+        inline bool check(MOBI_RET ret, std::error_code &ec) noexcept {
+            if (ret == MOBI_SUCCESS) {
+                ec.clear();
+                return true;
+            }
+            ec = make_error_code(ret);
+            return false;
+        }
+
+        /**
+         @brief Throw Error if ec holds failure
+         */
+        inline void throw_if(const std::error_code &ec, const char *what) {
+            if (ec) {
+                throw Error(ec, what);
+            }
+        }
+    }
+
+    /**
+     @brief View of single reconstructed part, does not own data
+     */
+    class Part {
+    public:
+        explicit Part(const MOBIPart *part) noexcept : part_(part) {}
+
+        size_t uid() const noexcept { return part_->uid; }
+        MOBIFiletype type() const noexcept { return part_->type; }
+        size_t size() const noexcept { return part_->size; }
+        /** @brief True if part data is compressed, see Rawml::compress() */
+        bool compressed() const noexcept { return part_->blocks != nullptr; }
+        /** @brief Raw part data, empty view if part is compressed */
+        std::string_view data() const noexcept {
+            if (part_->data == nullptr) {
+                return std::string_view();
+            }
+            return std::string_view(reinterpret_cast<const char *>(part_->data), part_->size);
+        }
+        const unsigned char *bytes() const noexcept { return part_->data; }
+        /** @brief File extension for part type */
+        const char *extension() const noexcept { return mobi_get_filemeta_by_type(part_->type).extension; }
+        /**
+         @brief Copy range of part data, works for compressed parts
+         @return Number of bytes copied
+         */
+        size_t read(size_t offset, unsigned char *out, size_t size, std::error_code &ec) const noexcept {
+            detail::check(mobi_part_read(part_, out, offset, &size), ec);
+            return ec ? 0 : size;
+        }
+        size_t read(size_t offset, unsigned char *out, size_t size) const {
+            std::error_code ec;
+            size = read(offset, out, size, ec);
+            detail::throw_if(ec, "mobi_part_read");
+            return size;
+        }
+        const MOBIPart *get() const noexcept { return part_; }
+
+    private:
+        const MOBIPart *part_;
+    };
+
+    /**
+     @brief Forward iterator over linked list of parts
+     */
+    class PartIterator {
+    public:
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = Part;
+        using difference_type = std::ptrdiff_t;
+        using pointer = void;
+        using reference = Part;
+
+        PartIterator() noexcept : part_(nullptr) {}
+        explicit PartIterator(const MOBIPart *part) noexcept : part_(part) {}
+
+        Part operator*() const noexcept { return Part(part_); }
+        PartIterator &operator++() noexcept {
+            part_ = part_->next;
+            return *this;
+        }
+        PartIterator operator++(int) noexcept {
+            PartIterator tmp = *this;
+            part_ = part_->next;
+            return tmp;
+        }
+        bool operator==(const PartIterator &other) const noexcept { return part_ == other.part_; }
+        bool operator!=(const PartIterator &other) const noexcept { return part_ != other.part_; }
+
+    private:
+        const MOBIPart *part_;
+    };
+
+    /**
+     @brief Range of parts, usable in range-based for loop
+     */
+    class PartRange {
+    public:
+        explicit PartRange(const MOBIPart *first) noexcept : first_(first) {}
+        PartIterator begin() const noexcept { return PartIterator(first_); }
+        PartIterator end() const noexcept { return PartIterator(); }
+        bool empty() const noexcept { return first_ == nullptr; }
+
+    private:
+        const MOBIPart *first_;
+    };
+
+    /**
+     @brief Move-only owner of MOBIData structure
+     */
+    class Document {
+    public:
+        /** @brief Create empty document, throws std::bad_alloc */
+        Document() : m_(mobi_init()) {
+            if (m_ == nullptr) {
+                throw std::bad_alloc();
+            }
+        }
+        /** @brief Take ownership of MOBIData structure */
+        explicit Document(MOBIData *m) noexcept : m_(m) {}
+        Document(Document &&other) noexcept : m_(std::exchange(other.m_, nullptr)) {}
+        Document &operator=(Document &&other) noexcept {
+            if (this != &other) {
+                mobi_free(m_);
+                m_ = std::exchange(other.m_, nullptr);
+            }
+            return *this;
+        }
+        Document(const Document &) = delete;
+        Document &operator=(const Document &) = delete;
+        ~Document() { mobi_free(m_); }
+
+        /** @brief Load document from file, ec is set on failure */
+        static Document load(const std::string &path, std::error_code &ec, bool kf7 = false) {
+            Document doc(mobi_init());
+            if (doc.m_ == nullptr) {
+                ec = make_error_code(Errc::malloc_failed);
+                return doc;
+            }
+            if (kf7) {
+                mobi_parse_kf7(doc.m_);
+            }
+            detail::check(mobi_load_filename(doc.m_, path.c_str()), ec);
+            return doc;
+        }
+        /** @brief Load document from file, throws Error on failure */
+        static Document load(const std::string &path, bool kf7 = false) {
+            std::error_code ec;
+            Document doc = load(path, ec, kf7);
+            detail::throw_if(ec, "mobi_load_filename");
+            return doc;
+        }
+
+        /** @brief Set PID for decryption */
+        void set_drm_key(const std::string &pid, std::error_code &ec) noexcept {
+            detail::check(mobi_drm_setkey(m_, pid.c_str()), ec);
+        }
+        void set_drm_key(const std::string &pid) {
+            std::error_code ec;
+            set_drm_key(pid, ec);
+            detail::throw_if(ec, "mobi_drm_setkey");
+        }
+
+        bool is_encrypted() const noexcept { return mobi_is_encrypted(m_); }
+        bool is_kf8() const noexcept { return mobi_is_kf8(m_); }
+        bool is_dictionary() const noexcept { return mobi_is_dictionary(m_); }
+        bool is_replica() const noexcept { return mobi_is_replica(m_); }
+        /** @brief Full name stored in record 0, empty if not available */
+        std::string fullname() const {
+            /* extra byte for terminator, written past the name of maximal length */
+            std::string name(RECORD0_FULLNAME_MAX + 1, '\0');
+            if (mobi_get_fullname(m_, &name[0], RECORD0_FULLNAME_MAX) != MOBI_SUCCESS) {
+                return std::string();
+            }
+            const size_t length = name.find('\0');
+            if (length != std::string::npos) {
+                name.resize(length);
+            }
+            return name;
+        }
+
+        MOBIData *get() const noexcept { return m_; }
+        explicit operator bool() const noexcept { return m_ != nullptr; }
+        /** @brief Give up ownership of MOBIData structure */
+        MOBIData *release() noexcept { return std::exchange(m_, nullptr); }
+
+    private:
+        /** Same as RECORD0_FULLNAME_SIZE_MAX in library */
+        static constexpr size_t RECORD0_FULLNAME_MAX = 1024;
+        MOBIData *m_;
+    };
+
+    /**
+     @brief Move-only owner of MOBIRawml structure
+     */
+    class Rawml {
+    public:
+        /** @brief Take ownership of MOBIRawml structure */
+        explicit Rawml(MOBIRawml *rawml) noexcept : rawml_(rawml) {}
+        Rawml(Rawml &&other) noexcept : rawml_(std::exchange(other.rawml_, nullptr)) {}
+        Rawml &operator=(Rawml &&other) noexcept {
+            if (this != &other) {
+                mobi_free_rawml(rawml_);
+                rawml_ = std::exchange(other.rawml_, nullptr);
+            }
+            return *this;
+        }
+        Rawml(const Rawml &) = delete;
+        Rawml &operator=(const Rawml &) = delete;
+        ~Rawml() { mobi_free_rawml(rawml_); }
+
+        /**
+         @brief Parse document, ec is set on failure
+         @param[in] doc Loaded document, must outlive returned object
+         @param[in,out] ec Error code
+         @param[in] parse_toc Parse content indices
+         @param[in] parse_dict Parse dictionary indices
+         @param[in] reconstruct Reconstruct links, build opf and ncx
+         */
+        static Rawml parse(const Document &doc, std::error_code &ec, bool parse_toc = true, bool parse_dict = true, bool reconstruct = true) {
+            Rawml rawml(mobi_init_rawml(doc.get()));
+            if (rawml.rawml_ == nullptr) {
+                ec = make_error_code(Errc::malloc_failed);
+                return rawml;
+            }
+            detail::check(mobi_parse_rawml_opt(rawml.rawml_, doc.get(), parse_toc, parse_dict, reconstruct), ec);
+            return rawml;
+        }
+        /** @brief Parse document, throws Error on failure */
+        static Rawml parse(const Document &doc, bool parse_toc = true, bool parse_dict = true, bool reconstruct = true) {
+            std::error_code ec;
+            Rawml rawml = parse(doc, ec, parse_toc, parse_dict, reconstruct);
+            detail::throw_if(ec, "mobi_parse_rawml");
+            return rawml;
+        }
+
+        /** @brief Markup (html) parts */
+        PartRange markup() const noexcept { return PartRange(rawml_->markup); }
+        /** @brief Flow parts, first one is raw unparsed text */
+        PartRange flow() const noexcept { return PartRange(rawml_->flow); }
+        /** @brief Resource parts */
+        PartRange resources() const noexcept { return PartRange(rawml_->resources); }
+
+        /** @brief Compress markup and flow parts, see mobi_compress_rawml() */
+        void compress(std::error_code &ec, size_t block_size = 0) noexcept {
+            detail::check(mobi_compress_rawml(rawml_, block_size), ec);
+        }
+        void compress(size_t block_size = 0) {
+            std::error_code ec;
+            compress(ec, block_size);
+            detail::throw_if(ec, "mobi_compress_rawml");
+        }
+        /** @brief Restore compressed parts, see mobi_decompress_rawml() */
+        void decompress(std::error_code &ec) noexcept {
+            detail::check(mobi_decompress_rawml(rawml_), ec);
+        }
+        void decompress() {
+            std::error_code ec;
+            decompress(ec);
+            detail::throw_if(ec, "mobi_decompress_rawml");
+        }
+
+        bool is_kf8() const noexcept { return mobi_is_rawml_kf8(rawml_); }
+        MOBIRawml *get() const noexcept { return rawml_; }
+        explicit operator bool() const noexcept { return rawml_ != nullptr; }
+        /** @brief Give up ownership of MOBIRawml structure */
+        MOBIRawml *release() noexcept { return std::exchange(rawml_, nullptr); }
+
+    private:
+        MOBIRawml *rawml_;
+    };
+}
+
+namespace std {
+    template <> struct is_error_code_enum<mobi::Errc> : true_type {};
+}
+
+#endif
@@ -23,6 +23,8 @@
 #include "opf.h"
 #include "structure.h"
 #include "index.h"
+#include "buffer.h"
+#include "scratch.h"
 #include "debug.h"
 
 
@@ -731,22 +733,20 @@ MOBI_RET mobi_reconstruct_flow(MOBIRawml *rawml, const char *text, const size_t
         if (memcmp(text, REPLICA_MAGIC, 4) == 0) {
             debug_print("%s", "Print Replica book\n");
             /* print replica */
-            unsigned char *pdf = malloc(length);
+            /* extract pdf directly into section data, no intermediate copy */
+            /* use mobi_extract_replica_pdf() to stream it without decompressing whole text */
+            section_data = malloc(length);
+            if (section_data == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
             section_length = length;
             section_type = T_PDF;
-            const MOBI_RET ret = mobi_process_replica(pdf, text, &section_length);
+            const MOBI_RET ret = mobi_process_replica(section_data, text, &section_length);
             if (ret != MOBI_SUCCESS) {
-                free(pdf);
+                free(section_data);
                 return ret;
             }
-            section_data = malloc(section_length);
-            if (section_data == NULL) {
-                debug_print("%s", "Memory allocation failed\n");
-                free(pdf);
-                return MOBI_MALLOC_FAILED;
-            }
-            memcpy(section_data, pdf, section_length);
-            free(pdf);
         } else {
             /* text data */
             section_length = length;
@@ -1021,135 +1021,390 @@ MOBI_RET mobi_get_ncx_filepos_array(MOBIArray *links, const MOBIPart *part) {
 }
 
 /**
- @brief Replace kindle:pos link with html href
+ @brief Build table of parts indexed by uid
+ 
+ First part with given uid wins, same as in linked list search.
+ Parts with uid not lower than parts count are not indexed.
+ 
+ @param[in,out] count Will be set to the size of the table
+ @param[in] list Linked list of parts
+ @return Table of pointers to parts, NULL if list is empty or on allocation failure
+ */
+static MOBIPart ** mobi_linkresolver_table(size_t *count, MOBIPart *list) {
+    size_t parts_count = 0;
+    MOBIPart *curr = list;
+    while (curr) {
+        parts_count++;
+        curr = curr->next;
+    }
+    *count = 0;
+    if (parts_count == 0) {
+        return NULL;
+    }
+    MOBIPart **table = calloc(parts_count, sizeof(*table));
+    if (table == NULL) {
+        return NULL;
+    }
+    curr = list;
+    while (curr) {
+        if (curr->uid < parts_count && table[curr->uid] == NULL) {
+            table[curr->uid] = curr;
+        }
+        curr = curr->next;
+    }
+    *count = parts_count;
+    return table;
+}
+
+/**
+ @brief Get part with given uid from table, fall back to list search for uids not indexed
+ 
+ @param[in] table Table of parts indexed by uid
+ @param[in] count Size of the table
+ @param[in] list Linked list of parts
+ @param[in] uid Unique id
+ @return Pointer to MOBIPart structure, NULL if not found
+ */
+static MOBIPart * mobi_linkresolver_part(MOBIPart * const *table, const size_t count, MOBIPart *list, const size_t uid) {
+    if (uid < count) {
+        return table[uid];
+    }
+    while (list) {
+        if (list->uid == uid) {
+            return list;
+        }
+        list = list->next;
+    }
+    return NULL;
+}
+
+/**
+ @brief Initialize lookup tables for resolving kindle: links
+ 
+ Parts are indexed by uid and fragment entries are converted to skeleton file numbers
+ and offsets, so that links may be resolved without list walks and tag lookups.
+ 
+ @param[in,out] resolver MOBILinkResolver structure to be initialized
+ @param[in] rawml MOBIRawml parsed records structure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_linkresolver_init(MOBILinkResolver *resolver, const MOBIRawml *rawml) {
+    if (resolver == NULL || rawml == NULL) {
+        debug_print("%s", "Initialization failed\n");
+        return MOBI_INIT_FAILED;
+    }
+    memset(resolver, 0, sizeof(MOBILinkResolver));
+    resolver->rawml = rawml;
+    resolver->markup = mobi_linkresolver_table(&resolver->markup_count, rawml->markup);
+    resolver->flow = mobi_linkresolver_table(&resolver->flow_count, rawml->flow);
+    resolver->resources = mobi_linkresolver_table(&resolver->resources_count, rawml->resources);
+    if ((rawml->markup && resolver->markup == NULL) ||
+        (rawml->flow && resolver->flow == NULL) ||
+        (rawml->resources && resolver->resources == NULL)) {
+        debug_print("%s", "Memory allocation failed\n");
+        mobi_linkresolver_free(resolver);
+        return MOBI_MALLOC_FAILED;
+    }
+    if (rawml->frag && rawml->frag->entries && rawml->frag->entries_count &&
+        rawml->skel && rawml->skel->entries) {
+        const size_t count = rawml->frag->entries_count;
+        resolver->frag_file = malloc(count * sizeof(*resolver->frag_file));
+        resolver->frag_offset = malloc(count * sizeof(*resolver->frag_offset));
+        if (resolver->frag_file == NULL || resolver->frag_offset == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            mobi_linkresolver_free(resolver);
+            return MOBI_MALLOC_FAILED;
+        }
+        for (size_t i = 0; i < count; i++) {
+            const MOBIIndexEntry *entry = &rawml->frag->entries[i];
+            resolver->frag_file[i] = MOBI_NOTSET;
+            uint32_t file_nr;
+            MOBI_RET ret = mobi_get_indxentry_tagvalue(&file_nr, entry, INDX_TAG_FRAG_FILE_NR);
+            if (ret != MOBI_SUCCESS || file_nr >= rawml->skel->entries_count) {
+                continue;
+            }
+            uint32_t skel_position;
+            ret = mobi_get_indxentry_tagvalue(&skel_position, &rawml->skel->entries[file_nr], INDX_TAG_SKEL_POSITION);
+            if (ret != MOBI_SUCCESS) {
+                continue;
+            }
+            size_t offset = strtoul(entry->label, NULL, 10);
+            resolver->frag_offset[i] = offset - skel_position;
+            resolver->frag_file[i] = file_nr;
+        }
+        resolver->frag_count = count;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free lookup tables allocated by mobi_linkresolver_init()
+ 
+ @param[in,out] resolver MOBILinkResolver structure
+ */
+void mobi_linkresolver_free(MOBILinkResolver *resolver) {
+    if (resolver == NULL) {
+        return;
+    }
+    free(resolver->markup);
+    free(resolver->flow);
+    free(resolver->resources);
+    free(resolver->frag_file);
+    free(resolver->frag_offset);
+    if (resolver->cache) {
+        for (size_t i = 0; i < resolver->cache_size; i++) {
+            free(resolver->cache[i].link);
+        }
+        free(resolver->cache);
+    }
+    memset(resolver, 0, sizeof(MOBILinkResolver));
+}
+
+/**
+ @brief Get hash table slot for given pos:fid link
+ 
+ @param[in] cache Hash table
+ @param[in] cache_size Capacity of the hash table, power of two
+ @param[in] pos_fid Decoded fid value
+ @param[in] pos_off Decoded off value
+ @return Pointer to matching or empty slot
+ */
+static MOBILinkTarget * mobi_linkresolver_slot(MOBILinkTarget *cache, const size_t cache_size, const uint32_t pos_fid, const uint32_t pos_off) {
+    size_t i = ((pos_fid * 0x9e3779b1U) ^ (pos_off * 0x85ebca77U)) & (cache_size - 1);
+    while (cache[i].link && (cache[i].pos_fid != pos_fid || cache[i].pos_off != pos_off)) {
+        i = (i + 1) & (cache_size - 1);
+    }
+    return &cache[i];
+}
+
+/**
+ @brief Store resolved pos:fid link in the cache
  
- @param[in,out] link Memory area which will be filled with "part00000.html#customid", including quotation marks
- @param[in] rawml Structure rawml
+ @param[in,out] resolver MOBILinkResolver structure
+ @param[in] pos_fid Decoded fid value
+ @param[in] pos_off Decoded off value
+ @param[in] link Replacement link
+ @return Cached link copy, NULL on allocation failure
+ */
+static const char * mobi_linkresolver_cache_add(MOBILinkResolver *resolver, const uint32_t pos_fid, const uint32_t pos_off, const char *link) {
+    if (2 * (resolver->cache_count + 1) > resolver->cache_size) {
+        const size_t new_size = resolver->cache_size ? 2 * resolver->cache_size : 256;
+        MOBILinkTarget *new_cache = calloc(new_size, sizeof(MOBILinkTarget));
+        if (new_cache == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < resolver->cache_size; i++) {
+            if (resolver->cache[i].link) {
+                MOBILinkTarget *slot = mobi_linkresolver_slot(new_cache, new_size, resolver->cache[i].pos_fid, resolver->cache[i].pos_off);
+                *slot = resolver->cache[i];
+            }
+        }
+        free(resolver->cache);
+        resolver->cache = new_cache;
+        resolver->cache_size = new_size;
+    }
+    MOBILinkTarget *slot = mobi_linkresolver_slot(resolver->cache, resolver->cache_size, pos_fid, pos_off);
+    slot->link = strdup(link);
+    if (slot->link == NULL) {
+        return NULL;
+    }
+    slot->pos_fid = pos_fid;
+    slot->pos_off = pos_off;
+    resolver->cache_count++;
+    return slot->link;
+}
+
+/**
+ @brief Resolve kindle:pos:fid link using lookup tables
+ 
+ Link points to the part containing target position and to the id of element at that position.
+ Resolved links are cached by (fid, off) pair.
+ 
+ @param[in,out] link Will be set to the replacement link, including quotation marks, empty string if link is skipped
+ @param[in,out] resolver MOBILinkResolver structure
  @param[in] value String kindle:pos:fid:0000:off:0000000000, without quotation marks
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_posfid_to_link(char *link, const MOBIRawml *rawml, const char *value) {
+static MOBI_RET mobi_linkresolver_posfid(const char **link, MOBILinkResolver *resolver, const char *value) {
     /* "kindle:pos:fid:0000:off:0000000000" */
-    /* extract fid and off */
     if (strlen(value) < (sizeof("kindle:pos:fid:0000:off:0000000000") - 1)) {
         debug_print("Skipping too short link: %s\n", value);
-        *link = '\0';
+        *link = "";
         return MOBI_SUCCESS;
     }
     value += (sizeof("kindle:pos:fid:") - 1);
     if (value[4] != ':') {
         debug_print("Skipping malformed link: kindle:pos:fid:%s\n", value);
-        *link = '\0';
+        *link = "";
         return MOBI_SUCCESS;
     }
-    char str_fid[4 + 1];
-    strncpy(str_fid, value, 4);
-    str_fid[4] = '\0';
-    char str_off[10 + 1];
-    value += (sizeof("0001:off:") - 1);
-    strncpy(str_off, value, 10);
-    str_off[10] = '\0';
-    
-    /* get file number and id value */
     uint32_t pos_off, pos_fid;
-    MOBI_RET ret = mobi_base32_decode(&pos_off, str_off);
+    MOBI_RET ret = mobi_base32_decode_n(&pos_off, value + sizeof("0001:off:") - 1, 10);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    ret = mobi_base32_decode(&pos_fid, str_fid);
+    ret = mobi_base32_decode_n(&pos_fid, value, 4);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
-    uint32_t part_id;
+    if (resolver->cache) {
+        const MOBILinkTarget *target = mobi_linkresolver_slot(resolver->cache, resolver->cache_size, pos_fid, pos_off);
+        if (target->link) {
+            *link = target->link;
+            return MOBI_SUCCESS;
+        }
+    }
+    if (pos_fid >= resolver->frag_count || resolver->frag_file[pos_fid] == MOBI_NOTSET) {
+        debug_print("Entry for pos:fid:%u doesn't exist\n", pos_fid);
+        return MOBI_DATA_CORRUPT;
+    }
+    const uint32_t part_id = resolver->frag_file[pos_fid];
+    const size_t offset = resolver->frag_offset[pos_fid] + pos_off;
+    const MOBIPart *html = mobi_linkresolver_part(resolver->markup, resolver->markup_count, resolver->rawml->markup, part_id);
+    if (html == NULL || offset > html->size) {
+        return MOBI_DATA_CORRUPT;
+    }
     char id[MOBI_ATTRVALUE_MAXSIZE + 1];
-    ret = mobi_get_id_by_posoff(&part_id, id, rawml, pos_fid, pos_off);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
+    if (mobi_get_attribute_value(id, html->data + offset, html->size - offset, "id", true) == SIZE_MAX) {
+        id[0] = '\0';
     }
+    char new_link[MOBI_ATTRVALUE_MAXSIZE + 1];
     /* FIXME: pos_off == 0 means top of file? */
     if (pos_off) {
-        snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"part%05u.html#%s\"", part_id, id);
+        snprintf(new_link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"part%05u.html#%s\"", part_id, id);
     } else {
-        snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"part%05u.html\"", part_id);
+        snprintf(new_link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"part%05u.html\"", part_id);
+    }
+    *link = mobi_linkresolver_cache_add(resolver, pos_fid, pos_off, new_link);
+    if (*link == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
     }
     return MOBI_SUCCESS;
 }
 
 /**
- @brief Replace kindle:flow link with html href
+ @brief Write link to part file name, like "resource00000.ext", into buffer
  
- @param[in,out] link Memory area which will be filled with "part00000.ext", including quotation marks
- @param[in] rawml Structure rawml
- @param[in] value String kindle:flow:0000?mime=type, without quotation marks
- @return MOBI_RET status code (on success MOBI_SUCCESS)
+ @param[in,out] out Output buffer
+ @param[in] prefix File name prefix
+ @param[in] uid Part uid, zero padded to five digits
+ @param[in] extension File extension
+ @param[in] quoted Enclose link in quotation marks if true
  */
-MOBI_RET mobi_flow_to_link(char *link, const MOBIRawml *rawml, const char *value) {
-    /* "kindle:flow:0000?mime=" */
-    if (strlen(value) < (sizeof("kindle:flow:0000?mime=") - 1)) {
-        debug_print("Skipping too short link: %s\n", value);
-        *link = '\0';
-        return MOBI_SUCCESS;
-    }
-    value += (sizeof("kindle:flow:") - 1);
-    if (value[4] != '?') {
-        debug_print("Skipping malformed link: kindle:flow:%s\n", value);
-        *link = '\0';
-        return MOBI_SUCCESS;
-    }
-    char str_fid[4 + 1];
-    strncpy(str_fid, value, 4);
-    str_fid[4] = '\0';
-    
-    MOBIPart *flow = mobi_get_flow_by_fid(rawml, str_fid);
-    if (flow == NULL) {
-        debug_print("Link corrupt: kindle:flow:%s\n", value);
-        return MOBI_DATA_CORRUPT;
-    }
-    MOBIFileMeta meta = mobi_get_filemeta_by_type(flow->type);
-    char *extension = meta.extension;
-    snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"flow%05zu.%s\"", flow->uid, extension);
-    return MOBI_SUCCESS;
+static void mobi_linkresolver_add_filename(MOBIBuffer *out, const char *prefix, size_t uid, const char *extension, const bool quoted) {
+    char digits[24];
+    size_t count = 0;
+    do {
+        digits[count++] = (char) ('0' + uid % 10);
+        uid /= 10;
+    } while (uid);
+    while (count < 5) {
+        digits[count++] = '0';
+    }
+    const size_t prefix_length = strlen(prefix);
+    const size_t extension_length = strlen(extension);
+    buffer_reserve(out, prefix_length + count + extension_length + 3);
+    if (out->error != MOBI_SUCCESS) {
+        return;
+    }
+    unsigned char *data = out->data + out->offset;
+    if (quoted) { *data++ = '"'; }
+    memcpy(data, prefix, prefix_length);
+    data += prefix_length;
+    while (count) {
+        *data++ = (unsigned char) digits[--count];
+    }
+    *data++ = '.';
+    memcpy(data, extension, extension_length);
+    data += extension_length;
+    if (quoted) { *data++ = '"'; }
+    out->offset = (size_t) (data - out->data);
 }
 
 /**
- @brief Replace kindle:embed link with html href
+ @brief Resolve kindle: link and write replacement href into buffer
+ 
+ Links are replaced with "part00000.html#id", "flow00000.ext" or "resource00000.ext".
  
- @param[in,out] link Memory area which will be filled with "resource00000.ext", including quotation marks
- @param[in] rawml Structure rawml
- @param[in] value String kindle:embed:0000?mime=type, with optional quotation marks
+ @param[in,out] out Output buffer
+ @param[in,out] resolver MOBILinkResolver structure
+ @param[in] value Attribute value containing kindle: link
+ @param[in] is_url True if value is part of css url attribute, link is written without quotation marks
+ @param[in,out] replaced Will be set to true if link was written, false if it was skipped
  @return MOBI_RET status code (on success MOBI_SUCCESS)
  */
-MOBI_RET mobi_embed_to_link(char *link, const MOBIRawml *rawml, const char *value) {
-    /* "kindle:embed:0000[?mime=]" */
-    /* skip quotation marks or spaces */
-    while (*value == '"' || *value == '\'' || isspace(*value)) {
-        value++;
-    }
-    if (strlen(value) < (sizeof("kindle:embed:0000") - 1)) {
-        debug_print("Skipping too short link: %s\n", value);
-        *link = '\0';
+MOBI_RET mobi_linkresolver_add_link(MOBIBuffer *out, MOBILinkResolver *resolver, const char *value, const bool is_url, bool *replaced) {
+    *replaced = false;
+    const char *target;
+    if ((target = strstr(value, "kindle:pos:fid:")) != NULL) {
+        /* "kindle:pos:fid:0001:off:0000000000" */
+        /* replace link with href="part00000.html#00" */
+        const char *link;
+        MOBI_RET ret = mobi_linkresolver_posfid(&link, resolver, target);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        if (*link == '\0') {
+            return MOBI_SUCCESS;
+        }
+        /* strip quotes if is_url */
+        const size_t link_length = strlen(link) - 2 * is_url;
+        buffer_reserve(out, link_length);
+        buffer_addraw(out, (const unsigned char *) link + is_url, link_length);
+    } else if ((target = strstr(value, "kindle:flow:")) != NULL) {
+        /* kindle:flow:0000?mime=text/css */
+        /* replace link with href="flow00000.ext" */
+        if (strlen(target) < (sizeof("kindle:flow:0000?mime=") - 1)) {
+            debug_print("Skipping too short link: %s\n", target);
+            return MOBI_SUCCESS;
+        }
+        target += (sizeof("kindle:flow:") - 1);
+        if (target[4] != '?') {
+            debug_print("Skipping malformed link: kindle:flow:%s\n", target);
+            return MOBI_SUCCESS;
+        }
+        uint32_t part_id;
+        const MOBIPart *flow = NULL;
+        if (mobi_base32_decode_n(&part_id, target, 4) == MOBI_SUCCESS) {
+            flow = mobi_linkresolver_part(resolver->flow, resolver->flow_count, resolver->rawml->flow, part_id);
+        }
+        if (flow == NULL) {
+            debug_print("Link corrupt: kindle:flow:%s\n", target);
+            return MOBI_DATA_CORRUPT;
+        }
+        MOBIFileMeta meta = mobi_get_filemeta_by_type(flow->type);
+        mobi_linkresolver_add_filename(out, "flow", flow->uid, meta.extension, !is_url);
+    } else if ((target = strstr(value, "kindle:embed:")) != NULL) {
+        /* kindle:embed:0000?mime=image/jpg */
+        /* kindle:embed:0000 (font resources) */
+        /* replace link with href="resource00000.ext" */
+        if (strlen(target) < (sizeof("kindle:embed:0000") - 1)) {
+            debug_print("Skipping too short link: %s\n", target);
+            return MOBI_SUCCESS;
+        }
+        target += (sizeof("kindle:embed:") - 1);
+        uint32_t part_id;
+        MOBI_RET ret = mobi_base32_decode_n(&part_id, target, 4);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        part_id--;
+        const MOBIPart *resource = mobi_linkresolver_part(resolver->resources, resolver->resources_count, resolver->rawml->resources, part_id);
+        if (resource == NULL) {
+            debug_print("Link corrupt: kindle:embed:%s\n", target);
+            return MOBI_DATA_CORRUPT;
+        }
+        MOBIFileMeta meta = mobi_get_filemeta_by_type(resource->type);
+        mobi_linkresolver_add_filename(out, "resource", part_id, meta.extension, !is_url);
+    } else {
         return MOBI_SUCCESS;
     }
-    value += (sizeof("kindle:embed:") - 1);
-    char str_fid[4 + 1];
-    strncpy(str_fid, value, 4);
-    str_fid[4] = '\0';
-    
-    /* get file number */
-    uint32_t part_id;
-    MOBI_RET ret = mobi_base32_decode(&part_id, str_fid);
-    if (ret != MOBI_SUCCESS) {
-        return ret;
-    }
-    part_id--;
-    MOBIPart *resource = mobi_get_resource_by_uid(rawml, part_id);
-    if (resource == NULL) {
-        debug_print("Link corrupt: kindle:embed:%s\n", value);
-        return MOBI_DATA_CORRUPT;
+    if (out->error != MOBI_SUCCESS) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
     }
-    MOBIFileMeta meta = mobi_get_filemeta_by_type(resource->type);
-    char *extension = meta.extension;
-    snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"resource%05u.%s\"", part_id, extension);
+    *replaced = true;
     return MOBI_SUCCESS;
 }
 
@@ -1165,17 +1420,22 @@ MOBI_RET mobi_reconstruct_links_kf8(const MOBIRawml *rawml) {
     typedef struct NEWData {
         size_t part_group;
         size_t part_uid;
-        MOBIFragment *list;
-        size_t size;
+        MOBIBuffer *buf;
         struct NEWData *next;
     } NEWData;
     
     NEWData *partdata = NULL;
     NEWData *curdata = NULL;
+    MOBIBuffer *buf = NULL;
     MOBIPart *parts[] = {
         rawml->markup, /* html files */
         rawml->flow->next /* css, skip first unparsed html part */
     };
+    MOBILinkResolver resolver;
+    MOBI_RET ret = mobi_linkresolver_init(&resolver, rawml);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
     size_t i;
     for (i = 0; i < 2; i++) {
         MOBIPart *part = parts[i];
@@ -1183,100 +1443,80 @@ MOBI_RET mobi_reconstruct_links_kf8(const MOBIRawml *rawml) {
             unsigned char *data_in = part->data;
             result.start = part->data;
             const unsigned char *data_end = part->data + part->size - 1;
-            MOBIFragment *first = NULL;
-            MOBIFragment *curr = NULL;
-            size_t part_size = 0;
+            size_t links_count = 0;
             while (true) {
                 mobi_search_links_kf8(&result, result.start, data_end, part->type);
                 if (result.start == NULL) {
                     break;
                 }
-                char *value = (char *) result.value;
                 unsigned char *data_cur = result.start;
-                char *target = NULL;
                 if (data_cur < data_in) {
-                    mobi_list_del_all(first);
-                    return MOBI_DATA_CORRUPT;
+                    ret = MOBI_DATA_CORRUPT;
+                    goto cleanup;
                 }
-                size_t size = (size_t) (data_cur - data_in);
-                char link[MOBI_ATTRVALUE_MAXSIZE + 1];
-                if ((target = strstr(value, "kindle:pos:fid:")) != NULL) {
-                    /* "kindle:pos:fid:0001:off:0000000000" */
-                    /* replace link with href="part00000.html#00" */
-                    /* FIXME: this requires present target id tag */
-                    MOBI_RET ret = mobi_posfid_to_link(link, rawml, target);
-                    if (ret != MOBI_SUCCESS) {
-                        mobi_list_del_all(first);
-                        return ret;
-                    }
-                } else if ((target = strstr(value, "kindle:flow:")) != NULL) {
-                    /* kindle:flow:0000?mime=text/css */
-                    /* replace link with href="flow00000.ext" */
-                    MOBI_RET ret = mobi_flow_to_link(link, rawml, target);
-                    if (ret != MOBI_SUCCESS) {
-                        mobi_list_del_all(first);
-                        return ret;
-                    }
-                } else if ((target = strstr(value, "kindle:embed:")) != NULL) {
-                    /* kindle:embed:0000?mime=image/jpg */
-                    /* kindle:embed:0000 (font resources) */
-                    /* replace link with href="resource00000.ext" */
-                    MOBI_RET ret = mobi_embed_to_link(link, rawml, target);
-                    if (ret != MOBI_SUCCESS) {
-                        mobi_list_del_all(first);
-                        return ret;
+                if (buf == NULL) {
+                    buf = buffer_init(part->size + MOBI_ATTRVALUE_MAXSIZE);
+                    if (buf == NULL) {
+                        ret = MOBI_MALLOC_FAILED;
+                        goto cleanup;
                     }
                 }
-                if (target && *link != '\0') {
-                    /* first chunk */
-                    curr = mobi_list_add(curr, (size_t) (data_in - part->data), data_in, size, false);
-                    if (curr == NULL) {
-                        mobi_list_del_all(first);
-                        debug_print("%s\n", "Memory allocation failed");
-                        return MOBI_MALLOC_FAILED;
-                    }
-                    if (!first) { first = curr; }
-                    part_size += curr->size;
-                    /* second chunk */
-                    /* strip quotes if is_url */
-                    curr = mobi_list_add(curr, SIZE_MAX,
-                                         (unsigned char *) strdup(link + result.is_url),
-                                         strlen(link) - 2 * result.is_url, true);
-                    if (curr == NULL) {
-                        mobi_list_del_all(first);
-                        debug_print("%s\n", "Memory allocation failed");
-                        return MOBI_MALLOC_FAILED;
-                    }
-                    part_size += curr->size;
+                /* chunk preceding the link, dropped if link is skipped */
+                const size_t chunk_offset = buf->offset;
+                const size_t size = (size_t) (data_cur - data_in);
+                buffer_reserve(buf, size);
+                buffer_addraw(buf, data_in, size);
+                if (buf->error != MOBI_SUCCESS) {
+                    debug_print("%s", "Memory allocation failed\n");
+                    ret = MOBI_MALLOC_FAILED;
+                    goto cleanup;
+                }
+                /* link written directly after the chunk */
+                bool replaced;
+                ret = mobi_linkresolver_add_link(buf, &resolver, result.value, result.is_url, &replaced);
+                if (ret != MOBI_SUCCESS) {
+                    goto cleanup;
+                }
+                if (replaced) {
                     data_in = result.end;
+                    links_count++;
+                } else {
+                    buf->offset = chunk_offset;
                 }
             }
-            if (first && first->fragment) {
+            if (links_count) {
                 /* last chunk */
                 if (part->data + part->size < data_in) {
-                    mobi_list_del_all(first);
-                    return MOBI_DATA_CORRUPT;
+                    ret = MOBI_DATA_CORRUPT;
+                    goto cleanup;
                 }
                 size_t size = (size_t) (part->data + part->size - data_in);
-                curr = mobi_list_add(curr, (size_t) (data_in - part->data), data_in, size, false);
-                if (curr == NULL) {
-                    mobi_list_del_all(first);
-                    debug_print("%s\n", "Memory allocation failed");
-                    return MOBI_MALLOC_FAILED;
+                buffer_reserve(buf, size);
+                buffer_addraw(buf, data_in, size);
+                if (buf->error != MOBI_SUCCESS) {
+                    debug_print("%s", "Memory allocation failed\n");
+                    ret = MOBI_MALLOC_FAILED;
+                    goto cleanup;
                 }
-                part_size += curr->size;
                 /* save */
+                NEWData *newdata = calloc(1, sizeof(NEWData));
+                if (newdata == NULL) {
+                    debug_print("%s", "Memory allocation failed\n");
+                    ret = MOBI_MALLOC_FAILED;
+                    goto cleanup;
+                }
                 if (!curdata) {
-                    curdata = calloc(1, sizeof(NEWData));
-                    partdata = curdata;
+                    partdata = newdata;
                 } else {
-                    curdata->next = calloc(1, sizeof(NEWData));
-                    curdata = curdata->next;
+                    curdata->next = newdata;
                 }
+                curdata = newdata;
                 curdata->part_group = i;
                 curdata->part_uid = part->uid;
-                curdata->list = first;
-                curdata->size = part_size;
+                curdata->buf = buf;
+                buf = NULL;
+            } else if (buf) {
+                buf->offset = 0;
             }
             part = part->next;
         }
@@ -1287,17 +1527,10 @@ MOBI_RET mobi_reconstruct_links_kf8(const MOBIRawml *rawml) {
         MOBIPart *part = parts[i];
         while (part) {
             if (partdata && part->uid == partdata->part_uid && i == partdata->part_group) {
-                unsigned char *new_data = malloc(partdata->size);
-                unsigned char *data_out = new_data;
-                MOBIFragment *fragdata = partdata->list;
-                while (fragdata) {
-                    memcpy(data_out, fragdata->fragment, fragdata->size);
-                    data_out += fragdata->size;
-                    fragdata = mobi_list_del(fragdata);
-                }
                 free(part->data);
-                part->data = new_data;
-                part->size = partdata->size;
+                part->data = partdata->buf->data;
+                part->size = partdata->buf->offset;
+                buffer_free_null(partdata->buf);
                 NEWData *partused = partdata;
                 partdata = partdata->next;
                 free(partused);
@@ -1305,7 +1538,16 @@ MOBI_RET mobi_reconstruct_links_kf8(const MOBIRawml *rawml) {
             part = part->next;
         }
     }
-    return MOBI_SUCCESS;
+cleanup:
+    while (partdata) {
+        NEWData *partused = partdata;
+        partdata = partdata->next;
+        buffer_free(partused->buf);
+        free(partused);
+    }
+    buffer_free(buf);
+    mobi_linkresolver_free(&resolver);
+    return ret;
 }
 
 /**
@@ -1448,9 +1690,37 @@ MOBI_RET mobi_reconstruct_infl_v1(char *outstring, MOBITrie * const infl_tree, c
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Orth entry start position, used to order insertions
+ */
+typedef struct {
+    uint32_t startpos; /**< Entry start position in text */
+    size_t index; /**< Entry index */
+} MOBIOrthPosition;
+
+/**
+ @brief Compare orth positions by start position, then by entry index
+ 
+ @param[in] a First MOBIOrthPosition
+ @param[in] b Second MOBIOrthPosition
+ @return Comparison result as in qsort()
+ */
+static int mobi_orth_position_compare(const void *a, const void *b) {
+    const MOBIOrthPosition *pos1 = a;
+    const MOBIOrthPosition *pos2 = b;
+    if (pos1->startpos != pos2->startpos) {
+        return pos1->startpos < pos2->startpos ? -1 : 1;
+    }
+    return (pos1->index > pos2->index) - (pos1->index < pos2->index);
+}
+
 /**
  @brief Insert orth index markup to linked list of fragments
  
+ Entries are inserted in order of their start positions, so that search
+ for insert position always continues from previous insertion,
+ instead of restarting from the first fragment for unordered entries.
+ 
  @param[in] rawml Structure rawml contains orth index data
  @param[in,out] first First element of the linked list
  @param[in,out] new_size Counter to be updated with inserted fragments size
@@ -1478,24 +1748,35 @@ MOBI_RET mobi_reconstruct_orth(const MOBIRawml *rawml, MOBIFragment *first, size
     }
     
     MOBIFragment *curr = first;
+    const size_t entries_count = rawml->orth->entries_count;
+    MOBIOrthPosition *positions = malloc(entries_count * sizeof(MOBIOrthPosition) + 1);
+    if (positions == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        mobi_trie_free(infl_trie);
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t count = 0;
+    for (size_t j = 0; j < entries_count; j++) {
+        uint32_t entry_startpos;
+        if (mobi_get_indxentry_tagvalue(&entry_startpos, &rawml->orth->entries[j], INDX_TAG_ORTH_STARTPOS) == MOBI_SUCCESS) {
+            positions[count].startpos = entry_startpos;
+            positions[count].index = j;
+            count++;
+        }
+    }
+    qsort(positions, count, sizeof(MOBIOrthPosition), mobi_orth_position_compare);
     size_t i = 0;
-    const size_t count = rawml->orth->entries_count;
     const char *start_tag1 = "<idx:entry><idx:orth value=\"%s\">%s</idx:orth></idx:entry>";
     const char *start_tag2 = "<idx:entry scriptable=\"yes\"><idx:orth value=\"%s\">%s</idx:orth>";
     const char *end_tag = "</idx:entry>";
     const size_t start_tag1_len = strlen(start_tag1) - 4;
     const size_t start_tag2_len = strlen(start_tag2) - 4;
     const size_t end_tag_len = strlen(end_tag);
-    uint32_t prev_startpos = 0;
     while (i < count) {
-        const MOBIIndexEntry *orth_entry = &rawml->orth->entries[i];
+        const MOBIIndexEntry *orth_entry = &rawml->orth->entries[positions[i].index];
         const char *label = orth_entry->label;
-        uint32_t entry_startpos;
-        MOBI_RET ret = mobi_get_indxentry_tagvalue(&entry_startpos, orth_entry, INDX_TAG_ORTH_STARTPOS);
-        if (ret != MOBI_SUCCESS) {
-            i++;
-            continue;
-        }
+        const uint32_t entry_startpos = positions[i].startpos;
+        MOBI_RET ret = MOBI_SUCCESS;
         size_t entry_length = 0;
         uint32_t entry_textlen = 0;
         mobi_get_indxentry_tagvalue(&entry_textlen, orth_entry, INDX_TAG_ORTH_ENDPOS);
@@ -1514,6 +1795,7 @@ MOBI_RET mobi_reconstruct_orth(const MOBIRawml *rawml, MOBIFragment *first, size
             if (infl_tag == NULL) {
                 debug_print("%s\n", "Memory allocation failed");
                 mobi_trie_free(infl_trie);
+                free(positions);
                 return MOBI_MALLOC_FAILED;
             }
             infl_tag[0] = '\0';
@@ -1526,6 +1808,8 @@ MOBI_RET mobi_reconstruct_orth(const MOBIRawml *rawml, MOBIFragment *first, size
             }
             if (ret != MOBI_SUCCESS) {
                 free(infl_tag);
+                mobi_trie_free(infl_trie);
+                free(positions);
                 return ret;
             }
             entry_length += strlen(infl_tag);
@@ -1538,16 +1822,13 @@ MOBI_RET mobi_reconstruct_orth(const MOBIRawml *rawml, MOBIFragment *first, size
             sprintf(entry_text, start_tag, label, "");
         }
         
-        if (entry_startpos < prev_startpos) {
-            curr = first;
-        }
         curr = mobi_list_insert(curr, SIZE_MAX,
                                 (unsigned char *) entry_text,
                                 entry_length, true, entry_startpos);
-        prev_startpos = entry_startpos;
         if (curr == NULL) {
             debug_print("%s\n", "Memory allocation failed");
             mobi_trie_free(infl_trie);
+            free(positions);
             return MOBI_MALLOC_FAILED;
         }
         *new_size += curr->size;
@@ -1559,6 +1840,7 @@ MOBI_RET mobi_reconstruct_orth(const MOBIRawml *rawml, MOBIFragment *first, size
             if (curr == NULL) {
                 debug_print("%s\n", "Memory allocation failed");
                 mobi_trie_free(infl_trie);
+                free(positions);
                 return MOBI_MALLOC_FAILED;
             }
             *new_size += curr->size;
@@ -1566,6 +1848,7 @@ MOBI_RET mobi_reconstruct_orth(const MOBIRawml *rawml, MOBIFragment *first, size
         i++;
     }
     mobi_trie_free(infl_trie);
+    free(positions);
     return MOBI_SUCCESS;
 }
 
@@ -1817,33 +2100,47 @@ MOBI_RET mobi_markup_to_utf8(MOBIPart *part) {
     /* extreme case in which each input character is converted
      to 3-byte utf-8 sequence */
     size_t out_length = 3 * length + 1;
-    char *out_text = malloc(out_length);
-    if (out_text == NULL) {
-        debug_print("%s", "Memory allocation failed\n");
-        return MOBI_MALLOC_FAILED;
+    MOBIScratch scratch;
+    MOBI_RET ret = mobi_scratch_alloc(&scratch, out_length);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
     }
-    MOBI_RET ret = mobi_cp1252_to_utf8(out_text, (const char *) text, &out_length, length);
+    char *out_text = (char *) scratch.data;
+    ret = mobi_cp1252_to_utf8(out_text, (const char *) text, &out_length, length);
     free(text);
     if (ret != MOBI_SUCCESS || out_length == 0) {
         debug_print("%s", "conversion from cp1252 to utf8 failed\n");
-        free(out_text);
+        mobi_scratch_free(&scratch);
         part->data = NULL;
         return MOBI_DATA_CORRUPT;
     }
     text = malloc(out_length);
     if (text == NULL) {
         debug_print("%s", "Memory allocation failed\n");
-        free(out_text);
+        mobi_scratch_free(&scratch);
         part->data = NULL;
         return MOBI_MALLOC_FAILED;
     }
     memcpy(text, out_text, out_length);
-    free(out_text);
+    mobi_scratch_free(&scratch);
     part->data = text;
     part->size = out_length;
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Replace invalid utf-8 sequences in MOBIPart part data with U+FFFD
+ 
+ @param[in,out] part MOBIPart part
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_markup_repair_utf8(MOBIPart *part) {
+    if (part == NULL || part->data == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    return mobi_utf8_repair(&part->data, &part->size);
+}
+
 /**
  @brief Strip unneeded tags from html. Currently only <aid\>
  
@@ -1921,6 +2218,820 @@ MOBI_RET mobi_strip_mobitags(MOBIPart *part) {
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Namespace uri of Kindle specific prefixes, as in Kindle Publishing Guidelines
+ */
+#define MOBI_XHTML_KINDLE_NS "https://kindlegen.s3.amazonaws.com/AmazonKindlePublishingGuidelines.pdf"
+
+/**
+ @brief Namespace prefixes declared by mobi_fix_xhtml() when they are used but not declared in markup
+ */
+static const struct {
+    const char *prefix; /**< Namespace prefix */
+    const char *uri; /**< Namespace uri */
+} mobi_xhtml_namespaces[] = {
+    { "epub", "http://www.idpf.org/2007/ops" },
+    { "svg", "http://www.w3.org/2000/svg" },
+    { "xlink", "http://www.w3.org/1999/xlink" },
+    { "math", "http://www.w3.org/1998/Math/MathML" },
+    { "idx", MOBI_XHTML_KINDLE_NS },
+    { "mbp", MOBI_XHTML_KINDLE_NS },
+    { "mmc", MOBI_XHTML_KINDLE_NS },
+    { "cx", MOBI_XHTML_KINDLE_NS }
+};
+
+/**
+ @brief Element name or namespace prefix, points to source markup
+ */
+typedef struct {
+    const char *name; /**< Name, not null terminated */
+    size_t length; /**< Name length */
+} MOBIXhtmlName;
+
+/**
+ @brief Open element on mobi_fix_xhtml() tag stack
+ */
+typedef struct {
+    MOBIXhtmlName name; /**< Element name in source markup, end tags are matched against it */
+    MOBIXhtmlName output; /**< Element name written to output, without undeclared prefix */
+    size_t prefixes; /**< Number of namespace prefixes declared by the element */
+} MOBIXhtmlTag;
+
+/**
+ @brief Attribute of start tag
+ */
+typedef struct {
+    MOBIXhtmlName name; /**< Attribute name */
+    const char *value; /**< Attribute value without quotes, NULL if attribute is minimized */
+    size_t value_length; /**< Attribute value length */
+} MOBIXhtmlAttr;
+
+/**
+ @brief State of mobi_fix_xhtml()
+ */
+typedef struct {
+    MOBIBuffer *buf; /**< Output buffer */
+    MOBIXhtmlTag *tags; /**< Stack of open elements */
+    size_t tags_count; /**< Number of open elements */
+    size_t tags_capacity; /**< Capacity of tags stack */
+    MOBIXhtmlName *prefixes; /**< Stack of namespace prefixes declared in scope */
+    size_t prefixes_count; /**< Number of declared prefixes */
+    size_t prefixes_capacity; /**< Capacity of prefixes stack */
+} MOBIXhtmlFixer;
+
+/**
+ @brief Check if character may be a part of html element or attribute name
+
+ @param[in] c Character
+ @return True if character is a name character
+ */
+static bool mobi_xhtml_is_namechar(const char c) {
+    return isalnum((unsigned char) c) || c == ':' || c == '-' || c == '_' || c == '.';
+}
+
+/**
+ @brief Case insensitive comparison of name with lowercase string
+
+ @param[in] name Name, not null terminated
+ @param[in] length Name length
+ @param[in] lower Null terminated lowercase string
+ @return True if names are equal
+ */
+static bool mobi_xhtml_name_is(const char *name, const size_t length, const char *lower) {
+    size_t i;
+    for (i = 0; i < length; i++) {
+        if (lower[i] == '\0' || tolower((unsigned char) name[i]) != lower[i]) {
+            return false;
+        }
+    }
+    return lower[i] == '\0';
+}
+
+/**
+ @brief Case insensitive comparison of two names
+
+ @param[in] name1 First name
+ @param[in] name2 Second name, not null terminated
+ @param[in] length Second name length
+ @return True if names are equal
+ */
+static bool mobi_xhtml_names_equal(const MOBIXhtmlName *name1, const char *name2, const size_t length) {
+    if (name1->length != length) {
+        return false;
+    }
+    for (size_t i = 0; i < length; i++) {
+        if (tolower((unsigned char) name1->name[i]) != tolower((unsigned char) name2[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ @brief Check if html element is void, so it can not have end tag
+
+ @param[in] name Element name, not null terminated
+ @param[in] length Element name length
+ @return True if element is void
+ */
+static bool mobi_xhtml_is_void(const char *name, const size_t length) {
+    static const char *void_tags[] = {
+        "area", "base", "basefont", "br", "col", "embed", "frame", "hr", "img",
+        "input", "isindex", "link", "meta", "param", "source", "track", "wbr"
+    };
+    const size_t count = sizeof(void_tags) / sizeof(void_tags[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (mobi_xhtml_name_is(name, length, void_tags[i])) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ @brief Get namespace prefix of qualified name
+
+ @param[out] prefix Will be set to the prefix, zero length if name has no prefix
+ @param[in] name Qualified name, not null terminated
+ @param[in] length Name length
+ */
+static void mobi_xhtml_get_prefix(MOBIXhtmlName *prefix, const char *name, const size_t length) {
+    const char *colon = memchr(name, ':', length);
+    prefix->name = name;
+    prefix->length = colon ? (size_t) (colon - name) : 0;
+}
+
+/**
+ @brief Get next attribute of start tag
+
+ @param[out] attr Will be filled with attribute data
+ @param[in,out] pos Current position in attributes, will be moved past the attribute
+ @param[in] end End of attributes
+ @return True if attribute was found, false at the end of attributes
+ */
+static bool mobi_xhtml_next_attribute(MOBIXhtmlAttr *attr, const char **pos, const char *end) {
+    const char *c = *pos;
+    /* whitespace or garbage between attributes, names must start with letter or underscore */
+    while (c < end && !(isalpha((unsigned char) *c) || *c == '_')) {
+        c++;
+    }
+    if (c == end) {
+        *pos = end;
+        return false;
+    }
+    attr->name.name = c;
+    while (c < end && mobi_xhtml_is_namechar(*c)) {
+        c++;
+    }
+    attr->name.length = (size_t) (c - attr->name.name);
+    const char *value = c;
+    while (value < end && isspace((unsigned char) *value)) {
+        value++;
+    }
+    if (value == end || *value != '=') {
+        /* minimized attribute, eg. <hr noshade> */
+        attr->value = NULL;
+        attr->value_length = 0;
+        *pos = c;
+        return true;
+    }
+    value++;
+    while (value < end && isspace((unsigned char) *value)) {
+        value++;
+    }
+    if (value < end && (*value == '"' || *value == '\'')) {
+        const char *quote_end = memchr(value + 1, *value, (size_t) (end - value - 1));
+        attr->value = value + 1;
+        if (quote_end == NULL) {
+            /* unterminated quote, value ends with the tag */
+            attr->value_length = (size_t) (end - value - 1);
+            *pos = end;
+        } else {
+            attr->value_length = (size_t) (quote_end - value - 1);
+            *pos = quote_end + 1;
+        }
+        return true;
+    }
+    /* unquoted value, eg. filepos=0000123 */
+    c = value;
+    while (c < end && !isspace((unsigned char) *c)) {
+        c++;
+    }
+    attr->value = value;
+    attr->value_length = (size_t) (c - value);
+    *pos = c;
+    return true;
+}
+
+/**
+ @brief Check if name is a valid qualified name: optional prefix and local part
+        separated by a colon, both starting with a letter or underscore
+
+ @param[in] name Name, not null terminated
+ @param[in] length Name length
+ @return True if name is valid
+ */
+static bool mobi_xhtml_is_qname(const char *name, const size_t length) {
+    const char *colon = memchr(name, ':', length);
+    const char *local = colon ? colon + 1 : name;
+    const size_t local_length = length - (size_t) (local - name);
+    return length > 0 && (isalpha((unsigned char) name[0]) || name[0] == '_')
+        && local_length > 0 && (isalpha((unsigned char) local[0]) || local[0] == '_')
+        && memchr(local, ':', local_length) == NULL;
+}
+
+/**
+ @brief Get local part of name, following the last colon
+
+ @param[in] name Name, not null terminated
+ @param[in] length Name length
+ @return Offset of local part in name
+ */
+static size_t mobi_xhtml_local_offset(const char *name, const size_t length) {
+    size_t offset = length;
+    while (offset > 0 && name[offset - 1] != ':') {
+        offset--;
+    }
+    return offset;
+}
+
+/**
+ @brief Check if namespace prefix is declared in scope
+
+ @param[in] fixer MOBIXhtmlFixer structure
+ @param[in] prefix Namespace prefix
+ @return True if prefix is declared
+ */
+static bool mobi_xhtml_is_declared(const MOBIXhtmlFixer *fixer, const MOBIXhtmlName *prefix) {
+    for (size_t i = fixer->prefixes_count; i > 0; i--) {
+        const MOBIXhtmlName *declared = &fixer->prefixes[i - 1];
+        if (declared->length == prefix->length && memcmp(declared->name, prefix->name, prefix->length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ @brief Check if attribute with the same name precedes given attribute in start tag
+
+ @param[in] attr Attribute
+ @param[in] attributes Start of attributes
+ @param[in] end End of attributes
+ @return True if attribute is a duplicate
+ */
+static bool mobi_xhtml_is_duplicate(const MOBIXhtmlAttr *attr, const char *attributes, const char *end) {
+    MOBIXhtmlAttr previous;
+    const char *pos = attributes;
+    while (mobi_xhtml_next_attribute(&previous, &pos, end) && previous.name.name < attr->name.name) {
+        if (previous.name.length == attr->name.length && memcmp(previous.name.name, attr->name.name, attr->name.length) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ @brief Check if attribute declares namespace prefix, declarations of reserved prefixes and empty ones are not allowed
+
+ @param[out] prefix Will be set to declared prefix
+ @param[in] attr Attribute
+ @return True if attribute is a valid prefix declaration
+ */
+static bool mobi_xhtml_declares_prefix(MOBIXhtmlName *prefix, const MOBIXhtmlAttr *attr) {
+    if (attr->name.length <= 6 || memcmp(attr->name.name, "xmlns:", 6) != 0) {
+        return false;
+    }
+    prefix->name = attr->name.name + 6;
+    prefix->length = attr->name.length - 6;
+    return attr->value_length > 0
+        && !mobi_xhtml_name_is(prefix->name, prefix->length, "xml")
+        && !mobi_xhtml_name_is(prefix->name, prefix->length, "xmlns");
+}
+
+/**
+ @brief Get uri of namespace prefix that may be declared by the fixer
+
+ @param[in] prefix Namespace prefix
+ @return Namespace uri, NULL if prefix is unknown
+ */
+static const char * mobi_xhtml_namespace_uri(const MOBIXhtmlName *prefix) {
+    const size_t count = sizeof(mobi_xhtml_namespaces) / sizeof(mobi_xhtml_namespaces[0]);
+    for (size_t i = 0; i < count; i++) {
+        if (mobi_xhtml_name_is(prefix->name, prefix->length, mobi_xhtml_namespaces[i].prefix)) {
+            return mobi_xhtml_namespaces[i].uri;
+        }
+    }
+    return NULL;
+}
+
+/**
+ @brief Push namespace prefix declared in scope of current element
+
+ @param[in,out] fixer MOBIXhtmlFixer structure
+ @param[in] prefix Namespace prefix
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_xhtml_push_prefix(MOBIXhtmlFixer *fixer, const MOBIXhtmlName *prefix) {
+    if (fixer->prefixes_count == fixer->prefixes_capacity) {
+        const size_t capacity = fixer->prefixes_capacity ? 2 * fixer->prefixes_capacity : 8;
+        MOBIXhtmlName *tmp = realloc(fixer->prefixes, capacity * sizeof(MOBIXhtmlName));
+        if (tmp == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        fixer->prefixes = tmp;
+        fixer->prefixes_capacity = capacity;
+    }
+    fixer->prefixes[fixer->prefixes_count++] = *prefix;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Append raw data to growable buffer
+
+ @param[in,out] buf MOBIBuffer structure
+ @param[in] data Data
+ @param[in] length Data length
+ */
+static void mobi_xhtml_add(MOBIBuffer *buf, const char *data, const size_t length) {
+    buffer_reserve(buf, length);
+    buffer_addraw(buf, (const unsigned char *) data, length);
+}
+
+/**
+ @brief Check if code point may appear in xml document
+
+ @param[in] codepoint Unicode code point
+ @return True if character is allowed
+ */
+static bool mobi_xhtml_is_xmlchar(const uint32_t codepoint) {
+    return codepoint == 0x9 || codepoint == 0xa || codepoint == 0xd
+        || (codepoint >= 0x20 && codepoint <= 0xd7ff)
+        || (codepoint >= 0xe000 && codepoint <= 0xfffd)
+        || (codepoint >= 0x10000 && codepoint <= 0x10ffff);
+}
+
+/**
+ @brief Check character or entity reference starting with '&'
+
+ Numeric references to allowed characters and predefined xml entities are kept,
+ known html entities are replaced with utf-8 characters.
+
+ @param[out] replacement Will be set to the replacement of html entity, NULL if reference is kept
+ @param[in] ref Start of reference ('&' character)
+ @param[in] end End of data
+ @return Length of reference, zero if it is not a valid reference
+ */
+static size_t mobi_xhtml_reference(const char **replacement, const char *ref, const char *end) {
+    /* longest reference kept: "&#x10ffff;", longest known entity name is shorter */
+    const size_t max_length = 12;
+    *replacement = NULL;
+    const char *c = ref + 1;
+    if (c < end && *c == '#') {
+        c++;
+        const bool hex = c < end && (*c == 'x' || *c == 'X');
+        c += hex;
+        const char *digits = c;
+        uint32_t codepoint = 0;
+        while (c < end && (size_t) (c - ref) < max_length && (hex ? isxdigit((unsigned char) *c) : isdigit((unsigned char) *c))) {
+            const uint32_t digit = (uint32_t) (isdigit((unsigned char) *c) ? *c - '0' : tolower((unsigned char) *c) - 'a' + 10);
+            codepoint = codepoint * (hex ? 16 : 10) + digit;
+            c++;
+        }
+        if (c == digits || c == end || *c != ';' || !mobi_xhtml_is_xmlchar(codepoint)) {
+            return 0;
+        }
+        return (size_t) (c - ref + 1);
+    }
+    const char *name = c;
+    while (c < end && (size_t) (c - ref) < max_length && isalnum((unsigned char) *c)) {
+        c++;
+    }
+    const size_t length = (size_t) (c - name);
+    if (length == 0 || c == end || *c != ';') {
+        return 0;
+    }
+    if (mobi_xhtml_name_is(name, length, "amp") || mobi_xhtml_name_is(name, length, "lt") ||
+        mobi_xhtml_name_is(name, length, "gt") || mobi_xhtml_name_is(name, length, "quot") ||
+        mobi_xhtml_name_is(name, length, "apos")) {
+        /* xml entities are case sensitive */
+        if (islower((unsigned char) name[0])) {
+            return length + 2;
+        }
+    }
+    *replacement = mobi_get_htmlentity(name, length);
+    return *replacement ? length + 2 : 0;
+}
+
+/**
+ @brief Append text or attribute value, escaping characters not allowed in xml
+
+ Ampersands not starting valid reference are escaped, known html entities are decoded.
+ In attribute values quotation marks and '<' are escaped.
+
+ @param[in,out] buf MOBIBuffer structure
+ @param[in] text Text
+ @param[in] length Text length
+ @param[in] is_attribute True if text is attribute value
+ */
+static void mobi_xhtml_add_text(MOBIBuffer *buf, const char *text, const size_t length, const bool is_attribute) {
+    const char *end = text + length;
+    const char *chunk = text;
+    const char *c = text;
+    while (c < end) {
+        if (!is_attribute) {
+            c = memchr(c, '&', (size_t) (end - c));
+            if (c == NULL) {
+                break;
+            }
+        } else if (*c != '&' && *c != '"' && *c != '<') {
+            c++;
+            continue;
+        }
+        mobi_xhtml_add(buf, chunk, (size_t) (c - chunk));
+        if (*c == '"') {
+            mobi_xhtml_add(buf, "&quot;", 6);
+            chunk = ++c;
+            continue;
+        }
+        if (*c == '<') {
+            mobi_xhtml_add(buf, "&lt;", 4);
+            chunk = ++c;
+            continue;
+        }
+        const char *replacement;
+        const size_t ref_length = mobi_xhtml_reference(&replacement, c, end);
+        if (ref_length == 0) {
+            /* bare ampersand */
+            mobi_xhtml_add(buf, "&amp;", 5);
+            chunk = ++c;
+        } else if (replacement) {
+            mobi_xhtml_add(buf, replacement, strlen(replacement));
+            c += ref_length;
+            chunk = c;
+        } else {
+            chunk = c;
+            c += ref_length;
+        }
+    }
+    mobi_xhtml_add(buf, chunk, (size_t) (end - chunk));
+}
+
+/**
+ @brief Close element from the top of the stack, write its end tag and drop its namespace declarations
+
+ @param[in,out] fixer MOBIXhtmlFixer structure
+ */
+static void mobi_xhtml_close(MOBIXhtmlFixer *fixer) {
+    const MOBIXhtmlTag *tag = &fixer->tags[--fixer->tags_count];
+    mobi_xhtml_add(fixer->buf, "</", 2);
+    mobi_xhtml_add(fixer->buf, tag->output.name, tag->output.length);
+    mobi_xhtml_add(fixer->buf, ">", 1);
+    fixer->prefixes_count -= tag->prefixes;
+}
+
+/**
+ @brief Write namespace declaration
+
+ @param[in,out] buf MOBIBuffer structure
+ @param[in] prefix Namespace prefix
+ @param[in] uri Namespace uri
+ */
+static void mobi_xhtml_add_namespace(MOBIBuffer *buf, const MOBIXhtmlName *prefix, const char *uri) {
+    mobi_xhtml_add(buf, " xmlns:", 7);
+    mobi_xhtml_add(buf, prefix->name, prefix->length);
+    mobi_xhtml_add(buf, "=\"", 2);
+    mobi_xhtml_add(buf, uri, strlen(uri));
+    mobi_xhtml_add(buf, "\"", 1);
+}
+
+/**
+ @brief Write start tag with its attributes
+
+ Attribute values are quoted, minimized attributes get their name as value,
+ repeated and malformed attributes are dropped.
+ Namespace prefixes used but not declared are declared if they are known,
+ otherwise they are stripped from element name and attributes using them are dropped.
+ Root html element gets xhtml namespace if it has none.
+
+ @param[in,out] fixer MOBIXhtmlFixer structure
+ @param[out] tag Will be filled with element data
+ @param[in] name Element name, its local part must be a valid name
+ @param[in] name_length Element name length
+ @param[in] attributes Start of attributes
+ @param[in] end End of attributes
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_xhtml_add_starttag(MOBIXhtmlFixer *fixer, MOBIXhtmlTag *tag, const char *name, const size_t name_length,
+                                        const char *attributes, const char *end) {
+    MOBIBuffer *buf = fixer->buf;
+    tag->name.name = name;
+    tag->name.length = name_length;
+    tag->output = tag->name;
+    tag->prefixes = 0;
+    /* declarations of the element are in scope of its name and attributes */
+    bool has_xmlns = false;
+    MOBIXhtmlAttr attr;
+    MOBIXhtmlName prefix;
+    const char *pos = attributes;
+    while (mobi_xhtml_next_attribute(&attr, &pos, end)) {
+        if (mobi_xhtml_name_is(attr.name.name, attr.name.length, "xmlns")) {
+            has_xmlns = true;
+        } else if (mobi_xhtml_declares_prefix(&prefix, &attr) && mobi_xhtml_is_qname(attr.name.name, attr.name.length)) {
+            MOBI_RET ret = mobi_xhtml_push_prefix(fixer, &prefix);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+            tag->prefixes++;
+        }
+    }
+    const char *name_uri = NULL;
+    mobi_xhtml_get_prefix(&prefix, name, name_length);
+    if (prefix.length && mobi_xhtml_is_qname(name, name_length) && !mobi_xhtml_is_declared(fixer, &prefix)) {
+        name_uri = mobi_xhtml_namespace_uri(&prefix);
+        if (name_uri) {
+            MOBI_RET ret = mobi_xhtml_push_prefix(fixer, &prefix);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+            tag->prefixes++;
+        }
+    }
+    if (prefix.length && (!mobi_xhtml_is_qname(name, name_length) || !mobi_xhtml_is_declared(fixer, &prefix))) {
+        /* unknown or malformed prefix */
+        const size_t offset = mobi_xhtml_local_offset(name, name_length);
+        tag->output.name += offset;
+        tag->output.length -= offset;
+    }
+    mobi_xhtml_add(buf, "<", 1);
+    mobi_xhtml_add(buf, tag->output.name, tag->output.length);
+    if (!has_xmlns && fixer->tags_count == 0 && mobi_xhtml_name_is(name, name_length, "html")) {
+        static const char xhtml_ns[] = " xmlns=\"http://www.w3.org/1999/xhtml\"";
+        mobi_xhtml_add(buf, xhtml_ns, sizeof(xhtml_ns) - 1);
+    }
+    if (name_uri) {
+        mobi_xhtml_add_namespace(buf, &prefix, name_uri);
+    }
+    pos = attributes;
+    while (mobi_xhtml_next_attribute(&attr, &pos, end)) {
+        if (!mobi_xhtml_is_qname(attr.name.name, attr.name.length) || mobi_xhtml_is_duplicate(&attr, attributes, end)) {
+            continue;
+        }
+        mobi_xhtml_get_prefix(&prefix, attr.name.name, attr.name.length);
+        if (mobi_xhtml_name_is(prefix.name, prefix.length, "xmlns")) {
+            MOBIXhtmlName declared;
+            if (!mobi_xhtml_declares_prefix(&declared, &attr)) {
+                continue;
+            }
+        } else if (prefix.length && !mobi_xhtml_name_is(prefix.name, prefix.length, "xml")
+                   && !mobi_xhtml_is_declared(fixer, &prefix)) {
+            const char *uri = mobi_xhtml_namespace_uri(&prefix);
+            if (uri == NULL) {
+                continue;
+            }
+            MOBI_RET ret = mobi_xhtml_push_prefix(fixer, &prefix);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+            tag->prefixes++;
+            mobi_xhtml_add_namespace(buf, &prefix, uri);
+        }
+        mobi_xhtml_add(buf, " ", 1);
+        mobi_xhtml_add(buf, attr.name.name, attr.name.length);
+        mobi_xhtml_add(buf, "=\"", 2);
+        if (attr.value) {
+            mobi_xhtml_add_text(buf, attr.value, attr.value_length, true);
+        } else {
+            mobi_xhtml_add(buf, attr.name.name, attr.name.length);
+        }
+        mobi_xhtml_add(buf, "\"", 1);
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Find end of construct starting with "<!" or "<?" or end of tag
+
+ Quoted attribute values may contain '>' character, they are skipped when searching for tag end.
+
+ @param[in] tag Start of tag ('<' character)
+ @param[in] end End of data
+ @return Pointer to '>' character or NULL if tag is not terminated
+ */
+static const char * mobi_xhtml_tag_end(const char *tag, const char *end) {
+    if (end - tag >= 4 && memcmp(tag, "<!--", 4) == 0) {
+        const char *close = tag + 4;
+        while ((close = memchr(close, '-', (size_t) (end - close))) != NULL) {
+            if (end - close >= 3 && close[1] == '-' && close[2] == '>') {
+                return close + 2;
+            }
+            close++;
+        }
+        return NULL;
+    }
+    if (end - tag >= 9 && memcmp(tag, "<![CDATA[", 9) == 0) {
+        const char *close = tag + 9;
+        while ((close = memchr(close, ']', (size_t) (end - close))) != NULL) {
+            if (end - close >= 3 && close[1] == ']' && close[2] == '>') {
+                return close + 2;
+            }
+            close++;
+        }
+        return NULL;
+    }
+    const char *c = tag + 1;
+    while (c < end && *c != '>') {
+        if (*c == '"' || *c == '\'') {
+            const char *quote_end = memchr(c + 1, *c, (size_t) (end - c - 1));
+            if (quote_end == NULL) {
+                return NULL;
+            }
+            c = quote_end;
+        }
+        c++;
+    }
+    return c < end ? c : NULL;
+}
+
+/**
+ @brief Repair markup part so that it is well-formed xhtml
+
+ Single pass over data, which fixes problems found in reconstructed mobipocket markup:
+ adds missing xml declaration, replaces doctype with html5 one, closes void elements,
+ quotes unquoted and minimized attribute values, removes <mbp:*> tags,
+ drops stray end tags and closes elements left open, using a stack of open tags.
+ Namespace prefixes used but not declared are declared if known (eg. "idx:", "epub:"),
+ otherwise they are stripped. In text and attribute values bare ampersands are escaped
+ and html named entities are replaced with utf-8 characters.
+ This is not a general html cleaner, markup is not validated against any schema.
+
+ @param[in,out] fixed Pointer to memory to write to. Will be allocated. Must be freed by caller
+ @param[in,out] fixed_size Fixed data size
+ @param[in] part MOBIPart structure containing html markup
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_fix_xhtml(unsigned char **fixed, size_t *fixed_size, const MOBIPart *part) {
+    if (fixed == NULL || fixed_size == NULL || part == NULL || (part->data == NULL && part->size > 0)) {
+        return MOBI_PARAM_ERR;
+    }
+    const char *data = (const char *) part->data;
+    const char *end = data + part->size;
+    MOBIBuffer *buf = buffer_init(part->size + part->size / 16 + 64);
+    if (buf == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBIXhtmlFixer fixer = { .buf = buf };
+    bool has_root = false;
+    bool has_doctype = false;
+    MOBI_RET ret = MOBI_SUCCESS;
+    const char *p = data;
+    static const char bom[] = "\xef\xbb\xbf";
+    if (end - p >= 3 && memcmp(p, bom, 3) == 0) {
+        mobi_xhtml_add(buf, p, 3);
+        p += 3;
+    }
+    /* xml declaration must be the very first thing in document */
+    while (p < end && isspace((unsigned char) *p)) {
+        p++;
+    }
+    if (!(end - p >= 5 && memcmp(p, "<?xml", 5) == 0)) {
+        static const char declaration[] = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n";
+        mobi_xhtml_add(buf, declaration, sizeof(declaration) - 1);
+    }
+    while (p < end && buf->error == MOBI_SUCCESS) {
+        const char *tag = memchr(p, '<', (size_t) (end - p));
+        /* document may have no content after root element was closed */
+        const bool is_epilog = has_root && fixer.tags_count == 0;
+        if (tag == NULL) {
+            if (!is_epilog) {
+                mobi_xhtml_add_text(buf, p, (size_t) (end - p), false);
+            }
+            break;
+        }
+        if (!is_epilog) {
+            mobi_xhtml_add_text(buf, p, (size_t) (tag - p), false);
+        }
+        p = tag;
+        const char *tag_end = mobi_xhtml_tag_end(tag, end);
+        if (tag_end == NULL) {
+            /* unterminated tag, treat as text */
+            if (!is_epilog) {
+                mobi_xhtml_add(buf, "&lt;", 4);
+            }
+            p++;
+            continue;
+        }
+        if (tag + 1 < end && (tag[1] == '!' || tag[1] == '?')) {
+            p = tag_end + 1;
+            if (tag_end - tag >= 9 && mobi_xhtml_name_is(tag + 2, 7, "doctype")) {
+                /* legacy doctypes often lack system literal required by xml, use html5 one */
+                if (!has_doctype && !has_root) {
+                    static const char doctype[] = "<!DOCTYPE html>";
+                    mobi_xhtml_add(buf, doctype, sizeof(doctype) - 1);
+                    has_doctype = true;
+                }
+                continue;
+            }
+            /* comment, cdata or processing instruction */
+            mobi_xhtml_add(buf, tag, (size_t) (tag_end - tag + 1));
+            continue;
+        }
+        const bool is_endtag = tag[1] == '/';
+        const char *name = tag + 1 + is_endtag;
+        const char *name_end = name;
+        while (name_end < tag_end && mobi_xhtml_is_namechar(*name_end)) {
+            name_end++;
+        }
+        const size_t name_length = (size_t) (name_end - name);
+        const size_t local_offset = mobi_xhtml_local_offset(name, name_length);
+        if (name_length == 0 || !isalpha((unsigned char) *name)
+            || local_offset == name_length || !mobi_xhtml_is_qname(name + local_offset, name_length - local_offset)) {
+            /* not a tag, eg. "a < b" */
+            if (!is_epilog) {
+                mobi_xhtml_add(buf, "&lt;", 4);
+            }
+            p++;
+            continue;
+        }
+        p = tag_end + 1;
+        if (name_length > 4 && tolower((unsigned char) name[0]) == 'm'
+            && tolower((unsigned char) name[1]) == 'b'
+            && tolower((unsigned char) name[2]) == 'p' && name[3] == ':') {
+            /* mobipocket specific tags, eg. <mbp:pagebreak/> */
+            continue;
+        }
+        const bool is_void = mobi_xhtml_is_void(name, name_length);
+        if (is_endtag) {
+            if (is_void) {
+                /* void elements are already closed */
+                continue;
+            }
+            size_t i = fixer.tags_count;
+            while (i > 0 && !mobi_xhtml_names_equal(&fixer.tags[i - 1].name, name, name_length)) {
+                i--;
+            }
+            if (i == 0) {
+                /* stray end tag */
+                continue;
+            }
+            /* close elements left open inside this one */
+            while (fixer.tags_count >= i) {
+                mobi_xhtml_close(&fixer);
+            }
+            continue;
+        }
+        if (is_epilog) {
+            continue;
+        }
+        has_root = true;
+        const bool is_empty = tag_end > name_end && tag_end[-1] == '/';
+        MOBIXhtmlTag current;
+        ret = mobi_xhtml_add_starttag(&fixer, &current, name, name_length, name_end, is_empty ? tag_end - 1 : tag_end);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        if (is_void || is_empty) {
+            mobi_xhtml_add(buf, "/>", 2);
+            fixer.prefixes_count -= current.prefixes;
+            continue;
+        }
+        mobi_xhtml_add(buf, ">", 1);
+        if (fixer.tags_count == fixer.tags_capacity) {
+            const size_t capacity = fixer.tags_capacity ? 2 * fixer.tags_capacity : 32;
+            MOBIXhtmlTag *tmp = realloc(fixer.tags, capacity * sizeof(MOBIXhtmlTag));
+            if (tmp == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                ret = MOBI_MALLOC_FAILED;
+                break;
+            }
+            fixer.tags = tmp;
+            fixer.tags_capacity = capacity;
+        }
+        fixer.tags[fixer.tags_count++] = current;
+    }
+    /* close elements left open */
+    while (ret == MOBI_SUCCESS && fixer.tags_count > 0) {
+        mobi_xhtml_close(&fixer);
+    }
+    free(fixer.tags);
+    free(fixer.prefixes);
+    if (ret == MOBI_SUCCESS && buf->error != MOBI_SUCCESS) {
+        debug_print("%s", "Memory allocation failed\n");
+        ret = MOBI_MALLOC_FAILED;
+    }
+    if (ret != MOBI_SUCCESS) {
+        buffer_free(buf);
+        return ret;
+    }
+    *fixed_size = buf->offset;
+    *fixed = buf->data;
+    /* buffer data is now owned by caller */
+    buffer_free_null(buf);
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Parse raw records into html flow parts, markup parts, resources and indices
  
@@ -1935,6 +3046,7 @@ MOBI_RET mobi_parse_rawml(MOBIRawml *rawml, const MOBIData *m) {
 /**
  @brief Parse raw records into html flow parts, markup parts, resources and indices.
         Individual stages of the parsing may be turned on/off.
+        Invalid utf-8 sequences are repaired if enabled with mobi_set_utf8_repair().
  
  @param[in,out] rawml Structure rawml will be filled with reconstructed parts and resources
  @param[in] m MOBIData structure
@@ -1960,17 +3072,19 @@ MOBI_RET mobi_parse_rawml_opt(MOBIRawml *rawml, const MOBIData *m, bool parse_to
         debug_print("%s", "Insane text lenght\n");
         return MOBI_DATA_CORRUPT;
     }
-    char *text = malloc(maxlen + 1);
-    if (text == NULL) {
-        debug_print("%s", "Memory allocation failed\n");
-        return MOBI_MALLOC_FAILED;
+    /* text is only needed until it is split into flow parts */
+    MOBIScratch scratch;
+    ret = mobi_scratch_alloc(&scratch, maxlen + 1);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
     }
+    char *text = (char *) scratch.data;
     /* Extract text records, unpack, merge and copy it to text string */
     size_t length = maxlen;
     ret = mobi_get_rawml(m, text, &length);
     if (ret != MOBI_SUCCESS) {
         debug_print("%s", "Error parsing text\n");
-        free(text);
+        mobi_scratch_free(&scratch);
         return ret;
     }
     
@@ -1979,13 +3093,13 @@ MOBI_RET mobi_parse_rawml_opt(MOBIRawml *rawml, const MOBIData *m, bool parse_to
         if (m->mh->fdst_section_count && *m->mh->fdst_section_count > 1) {
             ret = mobi_parse_fdst(m, rawml);
             if (ret != MOBI_SUCCESS) {
-                free(text);
+                mobi_scratch_free(&scratch);
                 return ret;
             }
         }
     }
     ret = mobi_reconstruct_flow(rawml, text, length);
-    free(text);
+    mobi_scratch_free(&scratch);
     if (ret != MOBI_SUCCESS) {
         return ret;
     }
@@ -2092,6 +3206,19 @@ MOBI_RET mobi_parse_rawml_opt(MOBIRawml *rawml, const MOBIData *m, bool parse_to
         if (ret != MOBI_SUCCESS) {
             return ret;
         }
+    } else if (m->repair_utf8) {
+        debug_print("Repairing invalid utf8 sequences%s", "\n");
+        ret = mobi_iterate_txtparts(rawml, mobi_markup_repair_utf8);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        /* first flow part holds unparsed html, it is returned to caller too */
+        if (rawml->flow && rawml->flow->data) {
+            ret = mobi_markup_repair_utf8(rawml->flow);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+        }
     }
     return MOBI_SUCCESS;
 }
@@ -15,6 +15,7 @@
 
 #include "config.h"
 #include "mobi.h"
+#include "buffer.h"
 
 #define MOBI_ATTRNAME_MAXSIZE 100 /**< Maximum length of tag attribute name, like "href" */
 #define MOBI_ATTRVALUE_MAXSIZE 512 /**< Maximum length of tag attribute value */
@@ -29,7 +30,48 @@ typedef struct {
     bool is_url; /**< True if value is part of css url attribute */
 } MOBIResult;
 
+/**
+ @brief Cached href for resolved kindle:pos:fid:x:off:y link
+ */
+typedef struct {
+    uint32_t pos_fid; /**< Decoded fid value */
+    uint32_t pos_off; /**< Decoded off value */
+    char *link; /**< Replacement link, including quotation marks, NULL if slot is empty */
+} MOBILinkTarget;
+
+/**
+ @brief Lookup tables for resolving kindle: links in KF8 markup
+ 
+ Tables are built once per document by mobi_linkresolver_init()
+ and freed with mobi_linkresolver_free().
+ */
+typedef struct {
+    const MOBIRawml *rawml; /**< Parsed rawml structure */
+    MOBIPart **markup; /**< Markup parts indexed by uid */
+    size_t markup_count; /**< Size of markup table */
+    MOBIPart **flow; /**< Flow parts indexed by uid */
+    size_t flow_count; /**< Size of flow table */
+    MOBIPart **resources; /**< Resources indexed by uid */
+    size_t resources_count; /**< Size of resources table */
+    uint32_t *frag_file; /**< Skeleton file number for each fragment entry, MOBI_NOTSET if invalid */
+    size_t *frag_offset; /**< Fragment insert position relative to its skeleton part */
+    size_t frag_count; /**< Number of fragment entries */
+    MOBILinkTarget *cache; /**< Hash table of resolved pos:fid links */
+    size_t cache_size; /**< Capacity of the hash table, power of two */
+    size_t cache_count; /**< Number of cached links */
+} MOBILinkResolver;
+
 MOBI_RET mobi_get_id_by_posoff(uint32_t *file_number, char *id, const MOBIRawml *rawml, const size_t pos_fid, const size_t pos_off);
+MOBI_RET mobi_search_links_kf8(MOBIResult *result, const unsigned char *data_start, const unsigned char *data_end, const MOBIFiletype type);
 MOBI_RET mobi_find_attrvalue(MOBIResult *result, const unsigned char *data_start, const unsigned char *data_end, const MOBIFiletype type, const char *needle);
+MOBI_RET mobi_linkresolver_init(MOBILinkResolver *resolver, const MOBIRawml *rawml);
+void mobi_linkresolver_free(MOBILinkResolver *resolver);
+MOBI_RET mobi_linkresolver_add_link(MOBIBuffer *out, MOBILinkResolver *resolver, const char *value, const bool is_url, bool *replaced);
+MOBI_RET mobi_reconstruct_parts(MOBIRawml *rawml);
+MOBI_RET mobi_reconstruct_links(const MOBIRawml *rawml);
+MOBI_RET mobi_iterate_txtparts(MOBIRawml *rawml, MOBI_RET (*cb) (MOBIPart *));
+MOBI_RET mobi_markup_to_utf8(MOBIPart *part);
+MOBI_RET mobi_markup_repair_utf8(MOBIPart *part);
+MOBI_RET mobi_strip_mobitags(MOBIPart *part);
 
 #endif
@@ -17,6 +17,22 @@
 #include "util.h"
 #include "index.h"
 #include "debug.h"
+#include "thread.h"
+
+/**
+ @brief MOBI header with storage for all its fields in one allocation
+ 
+ Field pointers of the header point into storage of the same block,
+ so the whole structure is freed with single free() call.
+ */
+typedef struct {
+    MOBIMobiHeader header; /**< Header, must be first member */
+    MOBIEncoding text_encoding; /**< Storage for text encoding */
+    uint32_t values32[MOBI_HEADER_FIELDS32]; /**< Storage for 32-bit fields */
+    uint16_t values16[MOBI_HEADER_FIELDS16]; /**< Storage for 16-bit fields */
+    size_t count32; /**< Number of used 32-bit fields */
+    size_t count16; /**< Number of used 16-bit fields */
+} MOBIMobiHeaderBlock;
 
 /**
  @brief Read palm database header from file into MOBIData structure (MOBIPdbHeader)
@@ -68,6 +84,31 @@ MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file) {
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Get empty MOBIPdbRecord structure, taken from spare list if available
+ 
+ Spare record released by mobi_reset() keeps its data buffer,
+ its size is set to buffer capacity, record offset is not set yet.
+ 
+ @param[in,out] m MOBIData structure
+ @return MOBIPdbRecord on success, NULL otherwise
+ */
+static MOBIPdbRecord * mobi_reuse_record(MOBIData *m) {
+    MOBIPdbRecord *rec = m->spare_rec;
+    if (rec == NULL) {
+        return calloc(1, sizeof(MOBIPdbRecord));
+    }
+    m->spare_rec = rec->next;
+    rec->offset = 0;
+    rec->attributes = 0;
+    rec->uid = 0;
+    rec->next = NULL;
+    if (rec->data == NULL) {
+        rec->size = 0;
+    }
+    return rec;
+}
+
 /**
  @brief Read list of database records from file into MOBIData structure (MOBIPdbRecord)
  
@@ -84,39 +125,40 @@ MOBI_RET mobi_load_reclist(MOBIData *m, FILE *file) {
         debug_print("%s", "File not ready\n");
         return MOBI_FILE_NOT_FOUND;
     }
-    m->rec = calloc(1, sizeof(MOBIPdbRecord));
+    m->rec = mobi_reuse_record(m);
     if (m->rec == NULL) {
         debug_print("%s", "Memory allocation for pdb record failed\n");
         return MOBI_MALLOC_FAILED;
     }
     MOBIPdbRecord *curr = m->rec;
+    unsigned char info[PALMDB_RECORD_INFO_SIZE];
+    MOBIBuffer buf;
+    buf.data = info;
+    buf.maxlen = sizeof(info);
     for (int i = 0; i < m->ph->rec_count; i++) {
-        MOBIBuffer *buf = buffer_init(PALMDB_RECORD_INFO_SIZE);
-        if (buf == NULL) {
-            debug_print("%s\n", "Memory allocation failed");
-            return MOBI_MALLOC_FAILED;
-        }
-        const size_t len = fread(buf->data, 1, PALMDB_RECORD_INFO_SIZE, file);
+        const size_t len = fread(info, 1, PALMDB_RECORD_INFO_SIZE, file);
         if (len != PALMDB_RECORD_INFO_SIZE) {
-            buffer_free(buf);
+            /* reused records hold data of previous document */
+            mobi_free_rec(m);
             return MOBI_DATA_CORRUPT;
         }
+        buf.offset = 0;
+        buf.error = MOBI_SUCCESS;
         if (i > 0) {
-            curr->next = calloc(1, sizeof(MOBIPdbRecord));
+            curr->next = mobi_reuse_record(m);
             if (curr->next == NULL) {
                 debug_print("%s", "Memory allocation for pdb record failed\n");
-                buffer_free(buf);
+                mobi_free_rec(m);
                 return MOBI_MALLOC_FAILED;
             }
             curr = curr->next;
         }
-        curr->offset = buffer_get32(buf);
-        curr->attributes = buffer_get8(buf);
-        const uint8_t h = buffer_get8(buf);
-        const uint16_t l = buffer_get16(buf);
+        curr->offset = buffer_get32(&buf);
+        curr->attributes = buffer_get8(&buf);
+        const uint8_t h = buffer_get8(&buf);
+        const uint16_t l = buffer_get16(&buf);
         curr->uid =  (uint32_t) h << 16 | l;
         curr->next = NULL;
-        buffer_free(buf);
     }
     return MOBI_SUCCESS;
 }
@@ -134,24 +176,41 @@ MOBI_RET mobi_load_rec(MOBIData *m, FILE *file) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
+    fseek(file, 0, SEEK_END);
+    const long file_size = ftell(file);
+    if (file_size < 0) {
+        debug_print("%s", "Unable to get file size\n");
+        return MOBI_DATA_CORRUPT;
+    }
     MOBIPdbRecord *curr = m->rec;
     while (curr != NULL) {
         MOBIPdbRecord *next;
         size_t size;
         if (curr->next != NULL) {
             next = curr->next;
+            /* don't allocate huge buffers for corrupt offsets, reading them would fail anyway */
+            if (next->offset < curr->offset || next->offset > (size_t) file_size) {
+                debug_print("Wrong record offset: %zu\n", (size_t) next->offset);
+                mobi_free_rec(m);
+                return MOBI_DATA_CORRUPT;
+            }
             size = next->offset - curr->offset;
         } else {
-            fseek(file, 0, SEEK_END);
-            long diff = ftell(file) - curr->offset;
+            long diff = file_size - (long) curr->offset;
             if (diff <= 0) {
                 debug_print("Wrong record size: %li\n", diff);
+                mobi_free_rec(m);
                 return MOBI_DATA_CORRUPT;
             }
             size = (size_t) diff;
             next = NULL;
         }
 
+        /* reused record keeps its data buffer if it is large enough */
+        if (curr->data && curr->size < size) {
+            free(curr->data);
+            curr->data = NULL;
+        }
         curr->size = size;
         ret = mobi_load_recdata(curr, file);
         if (ret  != MOBI_SUCCESS) {
@@ -167,6 +226,9 @@ MOBI_RET mobi_load_rec(MOBIData *m, FILE *file) {
 /**
  @brief Read record data from file into MOBIPdbRecord structure
  
+ Data buffer is allocated, unless record already holds buffer of at least record size.
+ On failure data buffer is freed and record size is set to zero.
+ 
  @param[in,out] rec MOBIPdbRecord structure to be filled with read data
  @param[in] file Filedescriptor to read from
  @return MOBI_RET status code (on success MOBI_SUCCESS)
@@ -175,16 +237,25 @@ MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, FILE *file) {
     const int ret = fseek(file, rec->offset, SEEK_SET);
     if (ret != 0) {
         debug_print("Record %i not found\n", rec->uid);
+        free(rec->data);
+        rec->data = NULL;
+        rec->size = 0;
         return MOBI_DATA_CORRUPT;
     }
-    rec->data = malloc(rec->size);
     if (rec->data == NULL) {
-        debug_print("%s", "Memory allocation for pdb record data failed\n");
-        return MOBI_MALLOC_FAILED;
+        rec->data = malloc(rec->size);
+        if (rec->data == NULL) {
+            debug_print("%s", "Memory allocation for pdb record data failed\n");
+            rec->size = 0;
+            return MOBI_MALLOC_FAILED;
+        }
     }
     const size_t len = fread(rec->data, 1, rec->size, file);
     if (len < rec->size) {
         debug_print("Truncated data in record %i\n", rec->uid);
+        free(rec->data);
+        rec->data = NULL;
+        rec->size = 0;
         return MOBI_DATA_CORRUPT;
     }
     return MOBI_SUCCESS;
@@ -193,6 +264,11 @@ MOBI_RET mobi_load_recdata(MOBIPdbRecord *rec, FILE *file) {
 /**
  @brief Parse EXTH header from Record 0 into MOBIData structure (MOBIExthHeader)
  
+ All list nodes are allocated in one block, which is freed with mobi_free_eh().
+ Records data is copied into the same block, unless records are immutable
+ (see mobi_set_records_immutable()), then it points into record 0.
+ Records with empty data are skipped, except the last one.
+ 
  @param[in,out] m MOBIData structure to be filled with parsed data
  @param[in] buf MOBIBuffer buffer to read from
  @return MOBI_RET status code (on success MOBI_SUCCESS)
@@ -214,50 +290,114 @@ MOBI_RET mobi_parse_extheader(MOBIData *m, MOBIBuffer *buf) {
     }
     const size_t saved_maxlen = buf->maxlen;
     buf->maxlen = exth_length + buf->offset - 12;
-    m->eh = calloc(1, sizeof(MOBIExthHeader));
+    /* first pass: validate records and count nodes and data size */
+    const size_t start = buf->offset;
+    size_t nodes_count = 0;
+    size_t data_size = 0;
+    bool last_empty = false;
+    for (size_t i = 0; i < rec_count; i++) {
+        const uint32_t tag = buffer_get32(buf);
+        /* tag is only reported in debug builds */
+        (void) tag;
+        /* data size = record size minus 8 bytes for uid and size */
+        const uint32_t size = buffer_get32(buf) - 8;
+        if (size == 0) {
+            debug_print("Skip record %i, data too short\n", tag);
+            last_empty = true;
+            continue;
+        }
+        if (buf->offset + size > buf->maxlen) {
+            debug_print("Record %i too long\n", tag);
+            buf->maxlen = saved_maxlen;
+            return MOBI_DATA_CORRUPT;
+        }
+        buffer_seek(buf, size);
+        nodes_count++;
+        data_size += size;
+        last_empty = false;
+    }
+    if (last_empty) {
+        nodes_count++;
+    }
+    if (m->records_immutable) {
+        data_size = 0;
+    }
+    m->eh = calloc(1, nodes_count * sizeof(MOBIExthHeader) + data_size);
     if (m->eh == NULL) {
         debug_print("%s", "Memory allocation for EXTH header failed\n");
+        buf->maxlen = saved_maxlen;
         return MOBI_MALLOC_FAILED;
     }
+    /* second pass: fill nodes */
+    unsigned char *data = (unsigned char *) (m->eh + nodes_count);
+    buffer_setpos(buf, start);
     MOBIExthHeader *curr = m->eh;
     for (size_t i = 0; i < rec_count; i++) {
         if (curr->data) {
-            curr->next = calloc(1, sizeof(MOBIExthHeader));
-            if (curr->next == NULL) {
-                debug_print("%s", "Memory allocation for EXTH header failed\n");
-                mobi_free_eh(m);
-                return MOBI_MALLOC_FAILED;
-            }
+            curr->next = curr + 1;
             curr = curr->next;
         }
         curr->tag = buffer_get32(buf);
-        /* data size = record size minus 8 bytes for uid and size */
         curr->size = buffer_get32(buf) - 8;
         if (curr->size == 0) {
-            debug_print("Skip record %i, data too short\n", curr->tag);
             continue;
         }
-        if (buf->offset + curr->size > buf->maxlen) {
-            debug_print("Record %i too long\n", curr->tag);
-            mobi_free_eh(m);
-            return MOBI_DATA_CORRUPT;
-        }
-        curr->data = malloc(curr->size);
-        if (curr->data == NULL) {
-            debug_print("Memory allocation for EXTH record %i failed\n", curr->tag);
-            mobi_free_eh(m);
-            return MOBI_MALLOC_FAILED;
+        if (m->records_immutable) {
+            curr->data = buf->data + buf->offset;
+            buffer_seek(buf, curr->size);
+        } else {
+            curr->data = data;
+            buffer_getraw(curr->data, buf, curr->size);
+            data += curr->size;
         }
-        buffer_getraw(curr->data, buf, curr->size);
-        curr->next = NULL;
-    }    
+    }
     buf->maxlen = saved_maxlen;
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Read 32-bit value from MOBIBuffer into MOBI header storage
+ 
+ Works like buffer_dup32(), but value is stored in the header block.
+ If the data is not accessible pointer is set to NULL.
+ 
+ @param[in,out] block MOBIMobiHeaderBlock structure
+ @param[out] val Pointer to value
+ @param[in] buf MOBIBuffer structure containing data
+ */
+static void mobi_header_dup32(MOBIMobiHeaderBlock *block, uint32_t **val, MOBIBuffer *buf) {
+    *val = NULL;
+    if (buf->offset + 4 > buf->maxlen || block->count32 == MOBI_HEADER_FIELDS32) {
+        return;
+    }
+    *val = &block->values32[block->count32++];
+    **val = buffer_get32(buf);
+}
+
+/**
+ @brief Read 16-bit value from MOBIBuffer into MOBI header storage
+ 
+ Works like buffer_dup16(), but value is stored in the header block.
+ If the data is not accessible pointer is set to NULL.
+ 
+ @param[in,out] block MOBIMobiHeaderBlock structure
+ @param[out] val Pointer to value
+ @param[in] buf MOBIBuffer structure containing data
+ */
+static void mobi_header_dup16(MOBIMobiHeaderBlock *block, uint16_t **val, MOBIBuffer *buf) {
+    *val = NULL;
+    if (buf->offset + 2 > buf->maxlen || block->count16 == MOBI_HEADER_FIELDS16) {
+        return;
+    }
+    *val = &block->values16[block->count16++];
+    **val = buffer_get16(buf);
+}
+
 /**
  @brief Parse MOBI header from Record 0 into MOBIData structure (MOBIMobiHeader)
  
+ Header and its fields are allocated in one block, which is freed with mobi_free_mh().
+ 
  @param[in,out] m MOBIData structure to be filled with parsed data
  @param[in] buf MOBIBuffer buffer to read from
  @return MOBI_RET status code (on success MOBI_SUCCESS)
@@ -268,13 +408,14 @@ MOBI_RET mobi_parse_mobiheader(MOBIData *m, MOBIBuffer *buf) {
         debug_print("%s", "Mobi structure not initialized\n");
         return MOBI_INIT_FAILED;
     }
-    m->mh = calloc(1, sizeof(MOBIMobiHeader));
-    if (m->mh == NULL) {
+    MOBIMobiHeaderBlock *block = calloc(1, sizeof(MOBIMobiHeaderBlock));
+    if (block == NULL) {
         debug_print("%s", "Memory allocation for MOBI header failed\n");
         return MOBI_MALLOC_FAILED;
     }
+    m->mh = &block->header;
     buffer_getstring(m->mh->mobi_magic, buf, 4);
-    buffer_dup32(&m->mh->header_length, buf);
+    mobi_header_dup32(block, &m->mh->header_length, buf);
     if (strcmp(m->mh->mobi_magic, MOBI_MAGIC) != 0 || m->mh->header_length == NULL) {
         debug_print("%s", "MOBI header not found\n");
         mobi_free_mh(m->mh);
@@ -284,98 +425,90 @@ MOBI_RET mobi_parse_mobiheader(MOBIData *m, MOBIBuffer *buf) {
     const size_t saved_maxlen = buf->maxlen;
     /* read only declared MOBI header length (curr offset minus 8 already read bytes) */
     buf->maxlen = *m->mh->header_length + buf->offset - 8;
-    buffer_dup32(&m->mh->mobi_type, buf);
+    mobi_header_dup32(block, &m->mh->mobi_type, buf);
     uint32_t encoding = buffer_get32(buf);
     if (encoding == 1252) {
-        m->mh->text_encoding = malloc(sizeof(MOBIEncoding));
-        if (m->mh->text_encoding == NULL) {
-            debug_print("%s", "Memory allocation for MOBI header failed\n");
-            return MOBI_MALLOC_FAILED;
-        }
+        m->mh->text_encoding = &block->text_encoding;
         *m->mh->text_encoding = MOBI_CP1252;
     }
     else if (encoding == 65001) {
-        m->mh->text_encoding = malloc(sizeof(MOBIEncoding));
-        if (m->mh->text_encoding == NULL) {
-            debug_print("%s", "Memory allocation for MOBI header failed\n");
-            return MOBI_MALLOC_FAILED;
-        }
+        m->mh->text_encoding = &block->text_encoding;
         *m->mh->text_encoding = MOBI_UTF8;
     } else {
         debug_print("Unknown encoding in mobi header: %i\n", encoding);
     }
-    buffer_dup32(&m->mh->uid, buf);
-    buffer_dup32(&m->mh->version, buf);
+    mobi_header_dup32(block, &m->mh->uid, buf);
+    mobi_header_dup32(block, &m->mh->version, buf);
     if (m->mh->version && *m->mh->version == 8) {
         isKF8 = 1;
     }
-    buffer_dup32(&m->mh->orth_index, buf);
-    buffer_dup32(&m->mh->infl_index, buf);
-    buffer_dup32(&m->mh->names_index, buf);
-    buffer_dup32(&m->mh->keys_index, buf);
-    buffer_dup32(&m->mh->extra0_index, buf);
-    buffer_dup32(&m->mh->extra1_index, buf);
-    buffer_dup32(&m->mh->extra2_index, buf);
-    buffer_dup32(&m->mh->extra3_index, buf);
-    buffer_dup32(&m->mh->extra4_index, buf);
-    buffer_dup32(&m->mh->extra5_index, buf);
-    buffer_dup32(&m->mh->non_text_index, buf);
-    buffer_dup32(&m->mh->full_name_offset, buf);
-    buffer_dup32(&m->mh->full_name_length, buf);
-    buffer_dup32(&m->mh->locale, buf);
-    buffer_dup32(&m->mh->dict_input_lang, buf);
-    buffer_dup32(&m->mh->dict_output_lang, buf);
-    buffer_dup32(&m->mh->min_version, buf);
-    buffer_dup32(&m->mh->image_index, buf);
-    buffer_dup32(&m->mh->huff_rec_index, buf);
-    buffer_dup32(&m->mh->huff_rec_count, buf);
-    buffer_dup32(&m->mh->datp_rec_index, buf);
-    buffer_dup32(&m->mh->datp_rec_count, buf);
-    buffer_dup32(&m->mh->exth_flags, buf);
+    mobi_header_dup32(block, &m->mh->orth_index, buf);
+    mobi_header_dup32(block, &m->mh->infl_index, buf);
+    mobi_header_dup32(block, &m->mh->names_index, buf);
+    mobi_header_dup32(block, &m->mh->keys_index, buf);
+    mobi_header_dup32(block, &m->mh->extra0_index, buf);
+    mobi_header_dup32(block, &m->mh->extra1_index, buf);
+    mobi_header_dup32(block, &m->mh->extra2_index, buf);
+    mobi_header_dup32(block, &m->mh->extra3_index, buf);
+    mobi_header_dup32(block, &m->mh->extra4_index, buf);
+    mobi_header_dup32(block, &m->mh->extra5_index, buf);
+    mobi_header_dup32(block, &m->mh->non_text_index, buf);
+    mobi_header_dup32(block, &m->mh->full_name_offset, buf);
+    mobi_header_dup32(block, &m->mh->full_name_length, buf);
+    mobi_header_dup32(block, &m->mh->locale, buf);
+    mobi_header_dup32(block, &m->mh->dict_input_lang, buf);
+    mobi_header_dup32(block, &m->mh->dict_output_lang, buf);
+    mobi_header_dup32(block, &m->mh->min_version, buf);
+    mobi_header_dup32(block, &m->mh->image_index, buf);
+    mobi_header_dup32(block, &m->mh->huff_rec_index, buf);
+    mobi_header_dup32(block, &m->mh->huff_rec_count, buf);
+    mobi_header_dup32(block, &m->mh->datp_rec_index, buf);
+    mobi_header_dup32(block, &m->mh->datp_rec_count, buf);
+    mobi_header_dup32(block, &m->mh->exth_flags, buf);
     buffer_seek(buf, 32); /* 32 unknown bytes */
-    buffer_dup32(&m->mh->unknown6, buf);
-    buffer_dup32(&m->mh->drm_offset, buf);
-    buffer_dup32(&m->mh->drm_count, buf);
-    buffer_dup32(&m->mh->drm_size, buf);
-    buffer_dup32(&m->mh->drm_flags, buf);
+    mobi_header_dup32(block, &m->mh->unknown6, buf);
+    mobi_header_dup32(block, &m->mh->drm_offset, buf);
+    mobi_header_dup32(block, &m->mh->drm_count, buf);
+    mobi_header_dup32(block, &m->mh->drm_size, buf);
+    mobi_header_dup32(block, &m->mh->drm_flags, buf);
     buffer_seek(buf, 8); /* 8 unknown bytes */
     if (isKF8) {
-        buffer_dup32(&m->mh->fdst_index, buf);
+        mobi_header_dup32(block, &m->mh->fdst_index, buf);
     } else {
-        buffer_dup16(&m->mh->first_text_index, buf);
-        buffer_dup16(&m->mh->last_text_index, buf);
-    }
-    buffer_dup32(&m->mh->fdst_section_count, buf);
-    buffer_dup32(&m->mh->fcis_index, buf);
-    buffer_dup32(&m->mh->fcis_count, buf);
-    buffer_dup32(&m->mh->flis_index, buf);
-    buffer_dup32(&m->mh->flis_count, buf);
-    buffer_dup32(&m->mh->unknown10, buf);
-    buffer_dup32(&m->mh->unknown11, buf);
-    buffer_dup32(&m->mh->srcs_index, buf);
-    buffer_dup32(&m->mh->srcs_count, buf);
-    buffer_dup32(&m->mh->unknown12, buf);
-    buffer_dup32(&m->mh->unknown13, buf);
+        mobi_header_dup16(block, &m->mh->first_text_index, buf);
+        mobi_header_dup16(block, &m->mh->last_text_index, buf);
+    }
+    mobi_header_dup32(block, &m->mh->fdst_section_count, buf);
+    mobi_header_dup32(block, &m->mh->fcis_index, buf);
+    mobi_header_dup32(block, &m->mh->fcis_count, buf);
+    mobi_header_dup32(block, &m->mh->flis_index, buf);
+    mobi_header_dup32(block, &m->mh->flis_count, buf);
+    mobi_header_dup32(block, &m->mh->unknown10, buf);
+    mobi_header_dup32(block, &m->mh->unknown11, buf);
+    mobi_header_dup32(block, &m->mh->srcs_index, buf);
+    mobi_header_dup32(block, &m->mh->srcs_count, buf);
+    mobi_header_dup32(block, &m->mh->unknown12, buf);
+    mobi_header_dup32(block, &m->mh->unknown13, buf);
     buffer_seek(buf, 2); /* 2 byte fill */
-    buffer_dup16(&m->mh->extra_flags, buf);
-    buffer_dup32(&m->mh->ncx_index, buf);
+    mobi_header_dup16(block, &m->mh->extra_flags, buf);
+    mobi_header_dup32(block, &m->mh->ncx_index, buf);
     if (isKF8) {
-        buffer_dup32(&m->mh->fragment_index, buf);
-        buffer_dup32(&m->mh->skeleton_index, buf);
+        mobi_header_dup32(block, &m->mh->fragment_index, buf);
+        mobi_header_dup32(block, &m->mh->skeleton_index, buf);
     } else {
-        buffer_dup32(&m->mh->unknown14, buf);
-        buffer_dup32(&m->mh->unknown15, buf);
+        mobi_header_dup32(block, &m->mh->unknown14, buf);
+        mobi_header_dup32(block, &m->mh->unknown15, buf);
     }
-    buffer_dup32(&m->mh->datp_index, buf);
+    mobi_header_dup32(block, &m->mh->datp_index, buf);
     if (isKF8) {
-        buffer_dup32(&m->mh->guide_index, buf);
+        mobi_header_dup32(block, &m->mh->guide_index, buf);
     } else {
-        buffer_dup32(&m->mh->unknown16, buf);
+        mobi_header_dup32(block, &m->mh->unknown16, buf);
     }
-    buffer_dup32(&m->mh->unknown17, buf);
-    buffer_dup32(&m->mh->unknown18, buf);
-    buffer_dup32(&m->mh->unknown19, buf);
-    buffer_dup32(&m->mh->unknown20, buf);
+    mobi_header_dup32(block, &m->mh->unknown17, buf);
+    mobi_header_dup32(block, &m->mh->unknown18, buf);
+    mobi_header_dup32(block, &m->mh->unknown19, buf);
+    mobi_header_dup32(block, &m->mh->unknown20, buf);
     if (buf->maxlen > buf->offset) {
         debug_print("Skipping %zu unknown bytes in MOBI header\n", (buf->maxlen - buf->offset));
         buffer_setpos(buf, buf->maxlen);
@@ -408,16 +541,15 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
         debug_print("%s", "Record 0 too short\n");
         return MOBI_DATA_CORRUPT;
     }
-    MOBIBuffer *buf = buffer_init_null(record0->size);
-    if (buf == NULL) {
-        debug_print("%s\n", "Memory allocation failed");
-        return MOBI_MALLOC_FAILED;
-    }
-    buf->data = record0->data;
+    MOBIBuffer record0_buf;
+    record0_buf.data = record0->data;
+    record0_buf.offset = 0;
+    record0_buf.maxlen = record0->size;
+    record0_buf.error = MOBI_SUCCESS;
+    MOBIBuffer *buf = &record0_buf;
     m->rh = calloc(1, sizeof(MOBIRecord0Header));
     if (m->rh == NULL) {
         debug_print("%s", "Memory allocation for record 0 header failed\n");
-        buffer_free_null(buf);
         return MOBI_MALLOC_FAILED;
     }
     /* parse palmdoc header */
@@ -427,7 +559,6 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
          compression != RECORD0_PALMDOC_COMPRESSION &&
          compression != RECORD0_HUFF_COMPRESSION)) {
         debug_print("Wrong record0 header: %c%c%c%c\n", record0->data[0], record0->data[1], record0->data[2], record0->data[3]);
-        buffer_free_null(buf);
         free(m->rh);
         m->rh = NULL;
         return MOBI_DATA_CORRUPT;
@@ -446,7 +577,6 @@ MOBI_RET mobi_parse_record0(MOBIData *m, const size_t seqnumber) {
             mobi_parse_extheader(m, buf);
         }
     } 
-    buffer_free_null(buf);
     return MOBI_SUCCESS;
 }
 
@@ -665,6 +795,7 @@ MOBI_RET mobi_parse_cdic(MOBIHuffCdic *huffcdic, const MOBIPdbRecord *record, co
     }
     /* copy pointer to data */
     huffcdic->symbols[num] = record->data + CDIC_HEADER_LEN;
+    huffcdic->symbols_size[num] = record->size - CDIC_HEADER_LEN;
     /* free buffer */
     buffer_free_null(buf);
     return MOBI_SUCCESS;
@@ -707,6 +838,11 @@ MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *huffcdic) {
     curr = curr->next;
     /* allocate memory for symbols data in each CDIC record */
     huffcdic->symbols = malloc((huff_rec_count - 1) * sizeof(*huffcdic->symbols));
+    huffcdic->symbols_size = malloc((huff_rec_count - 1) * sizeof(*huffcdic->symbols_size));
+    if (huffcdic->symbols == NULL || huffcdic->symbols_size == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
     /* get following CDIC records */
     size_t i = 0;
     while (i < huff_rec_count - 1) {
@@ -724,6 +860,45 @@ MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *huffcdic) {
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Get huff/cdic tables of the document, parsed on first use and cached in MOBIData structure
+ 
+ Compressed symbols are expanded when tables are cached.
+ Cached tables are shared by all threads decompressing the document,
+ they are freed by mobi_reset() or mobi_free().
+ 
+ @param[in] m MOBIData structure with loaded MOBI document
+ @param[out] huffcdic Set to cached MOBIHuffCdic structure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_get_huffcdic(const MOBIData *m, const MOBIHuffCdic **huffcdic) {
+    /* cache does not change document, so it may be filled through const structure */
+    void **cache = (void **) &((MOBIData *) m)->huffcdic;
+    MOBIHuffCdic *cached = mobi_atomic_load_ptr(cache);
+    if (cached == NULL) {
+        cached = mobi_init_huffcdic();
+        if (cached == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        const MOBI_RET ret = mobi_parse_huffdic(m, cached);
+        if (ret != MOBI_SUCCESS) {
+            mobi_free_huffcdic(cached);
+            return ret;
+        }
+        if (mobi_expand_huffman_symbols(cached) != MOBI_SUCCESS) {
+            debug_print("%s", "Huffman symbols will be decompressed on each use\n");
+        }
+        if (!mobi_atomic_init_ptr(cache, cached)) {
+            /* other thread was first */
+            mobi_free_huffcdic(cached);
+            cached = mobi_atomic_load_ptr(cache);
+        }
+    }
+    *huffcdic = cached;
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Parse FDST record into MOBIRawml structure (MOBIFdst member)
  
@@ -851,6 +1026,8 @@ MOBI_RET mobi_load_file(MOBIData *m, FILE *file) {
             /* it is a hybrid KF7/KF8 file */
             m->kf8_boundary_offset = (uint32_t) boundary_rec_number;
             m->next = mobi_init();
+            m->next->records_immutable = m->records_immutable;
+            m->next->repair_utf8 = m->repair_utf8;
             /* link pdb header and records data to KF8data structure */
             m->next->ph = m->ph;
             m->next->rec = m->rec;
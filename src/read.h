@@ -17,9 +17,12 @@
 #include "compression.h"
 
 #define MOBI_EXTH_MAXCNT 1024
+#define MOBI_HEADER_FIELDS32 53 /**< Maximal number of 32-bit fields parsed from MOBI header */
+#define MOBI_HEADER_FIELDS16 3 /**< Maximal number of 16-bit fields parsed from MOBI header */
 
 MOBI_RET mobi_parse_fdst(const MOBIData *m, MOBIRawml *rawml);
 MOBI_RET mobi_parse_huffdic(const MOBIData *m, MOBIHuffCdic *cdic);
+MOBI_RET mobi_get_huffcdic(const MOBIData *m, const MOBIHuffCdic **huffcdic);
 MOBI_RET mobi_load_pdbheader(MOBIData *m, FILE *file);
 MOBI_RET mobi_load_reclist(MOBIData *m, FILE *file);
 MOBI_RET mobi_load_rec(MOBIData *m, FILE *file);
@@ -11,6 +11,8 @@
 #include <errno.h>
 /* include libmobi header */
 #include "save_epub.h"
+#include "thread.h"
+#include "util.h"
 // unzip101e headers
 #include <zip.h>
 
@@ -58,205 +60,807 @@ static bool startFileInZip(zipFile zf, const char *name, bool compress)
 	return true;
 }
 
+/* Maximum size of data waiting in the EPUB writer queue */
+#define EPUB_QUEUE_MAX (16 * 1024 * 1024)
+
 /**
-@brief Dump parsed markup files and resources into created folder
-@param[in] rawml MOBIRawml structure holding parsed records
-@param[in] epub_fn File to the epub file to be created.
-E
-xample structure:
---ZIP Container--
-mimetype
-META-INF/
-  container.xml
-OEBPS/
-  content.opf
-  chapter1.xhtml
-  ch1-pic.png
-  css/
-    style.css
-    myfont.otf
-  toc.ncx
+@brief Function releasing data of written entry
 */
-int epub_rawml_parts(const MOBIRawml *rawml, const char *epub_fn) {
-	if (rawml == NULL) {
-		printf("Rawml structure not initialized\n");
-		return ERROR;
+typedef void (*EpubReleaseFunc)(void *owner);
+
+/**
+@brief Single file waiting to be stored in EPUB container
+*/
+typedef struct EpubEntry {
+	char name[FILENAME_MAX]; /**< Path inside container */
+	const unsigned char *data; /**< File data */
+	size_t size; /**< File size */
+	bool compress; /**< Deflate or store */
+	EpubReleaseFunc release; /**< Called after entry is written, may be NULL */
+	void *owner; /**< Argument passed to release function */
+	struct EpubEntry *next; /**< Next queued entry */
+} EpubEntry;
+
+/**
+@brief EPUB container writer
+
+Entries are compressed and written in a separate thread, in the order they were added,
+so that the caller may prepare next parts in the meantime.
+Without threads support entries are written immediately.
+*/
+typedef struct {
+	zipFile zf; /**< Container handle */
+	bool threaded; /**< True if writer thread is running */
+	bool closing; /**< No more entries will be added */
+	bool failed; /**< Writing some entry failed */
+	size_t pending; /**< Size of queued data */
+	EpubEntry *first; /**< Queue head, entry being written */
+	EpubEntry *last; /**< Queue tail */
+	MOBIThread thread; /**< Writer thread */
+	MOBIMutex mutex; /**< Guards queue and flags */
+	MOBICond cond; /**< Signals queue changes */
+} EpubWriter;
+
+static bool writeEntryToZip(zipFile zf, const EpubEntry *entry)
+{
+	bool noError = startFileInZip(zf, entry->name, entry->compress);
+	noError &= zipWriteInFileInZip(zf, entry->data, entry->size) == ZIP_OK;
+	noError &= zipCloseFileInZip(zf) == ZIP_OK;
+	if (!noError)
+	{
+		printf("Could not open file inside EPUB for writing: %s\n", entry->name);
 	}
-	printf("Saving EPUB %s\n", epub_fn);
+	return noError;
+}
+
+static void releaseEntry(EpubEntry *entry)
+{
+	if (entry->release) {
+		entry->release(entry->owner);
+	}
+	free(entry);
+}
 
-	zipFile zf = zipOpen(epub_fn, APPEND_STATUS_CREATE);
+static void *epubWriterRun(void *arg)
+{
+	EpubWriter *writer = (EpubWriter *) arg;
+	mobi_mutex_lock(&writer->mutex);
+	while (true) {
+		while (writer->first == NULL && !writer->closing) {
+			mobi_cond_wait(&writer->cond, &writer->mutex);
+		}
+		EpubEntry *entry = writer->first;
+		if (entry == NULL) {
+			break;
+		}
+		const bool skip = writer->failed;
+		mobi_mutex_unlock(&writer->mutex);
+		/* after first failure remaining entries are only released */
+		const bool noError = skip || writeEntryToZip(writer->zf, entry);
+		mobi_mutex_lock(&writer->mutex);
+		writer->first = entry->next;
+		if (writer->first == NULL) {
+			writer->last = NULL;
+		}
+		writer->pending -= entry->size;
+		if (!noError) {
+			writer->failed = true;
+		}
+		mobi_cond_broadcast(&writer->cond);
+		mobi_mutex_unlock(&writer->mutex);
+		releaseEntry(entry);
+		mobi_mutex_lock(&writer->mutex);
+	}
+	mobi_mutex_unlock(&writer->mutex);
+	return NULL;
+}
 
-	if (zf == NULL) {
+static bool epubWriterOpen(EpubWriter *writer, const char *epub_fn)
+{
+	memset(writer, 0, sizeof(EpubWriter));
+	writer->zf = zipOpen(epub_fn, APPEND_STATUS_CREATE);
+	if (writer->zf == NULL) {
 		printf("Creating EPUB/zip file failed, file name: %s\n", epub_fn);
-		return ERROR;
+		return false;
 	}
-	// Create regular EPUB structure in zf here...
-	bool noError;
+	if (mobi_mutex_init(&writer->mutex) == MOBI_SUCCESS) {
+		if (mobi_cond_init(&writer->cond) == MOBI_SUCCESS) {
+			if (mobi_thread_create(&writer->thread, epubWriterRun, writer) == MOBI_SUCCESS) {
+				writer->threaded = true;
+				return true;
+			}
+			mobi_cond_destroy(&writer->cond);
+		}
+		mobi_mutex_destroy(&writer->mutex);
+	}
+	/* no writer thread, entries will be written synchronously */
+	return true;
+}
+
+/**
+@brief Add file to EPUB container
 
+Data must stay valid until release function is called.
+Release function is called also if adding fails.
+*/
+static bool epubWriterAdd(EpubWriter *writer, const char *name, const unsigned char *data, size_t size, bool compress, EpubReleaseFunc release, void *owner)
+{
+	EpubEntry *entry = (EpubEntry *) malloc(sizeof(EpubEntry));
+	if (entry == NULL) {
+		printf("Memory allocation failed\n");
+		if (release) {
+			release(owner);
+		}
+		return false;
+	}
+	strncpy(entry->name, name, FILENAME_MAX - 1);
+	entry->name[FILENAME_MAX - 1] = '\0';
+	entry->data = data;
+	entry->size = size;
+	entry->compress = compress;
+	entry->release = release;
+	entry->owner = owner;
+	entry->next = NULL;
+	if (!writer->threaded) {
+		const bool noError = !writer->failed && writeEntryToZip(writer->zf, entry);
+		if (!noError) {
+			writer->failed = true;
+		}
+		releaseEntry(entry);
+		return noError;
+	}
+	mobi_mutex_lock(&writer->mutex);
+	/* bound memory held by queued parts */
+	while (writer->pending > EPUB_QUEUE_MAX && !writer->failed) {
+		mobi_cond_wait(&writer->cond, &writer->mutex);
+	}
+	if (writer->failed) {
+		mobi_mutex_unlock(&writer->mutex);
+		releaseEntry(entry);
+		return false;
+	}
+	if (writer->last) {
+		writer->last->next = entry;
+	} else {
+		writer->first = entry;
+	}
+	writer->last = entry;
+	writer->pending += size;
+	mobi_cond_broadcast(&writer->cond);
+	mobi_mutex_unlock(&writer->mutex);
+	return true;
+}
+
+/**
+@brief Flush queued entries and close EPUB container
+@return True if all entries were written
+*/
+static bool epubWriterClose(EpubWriter *writer)
+{
+	if (writer->threaded) {
+		mobi_mutex_lock(&writer->mutex);
+		writer->closing = true;
+		mobi_cond_broadcast(&writer->cond);
+		mobi_mutex_unlock(&writer->mutex);
+		mobi_thread_join(&writer->thread);
+		mobi_cond_destroy(&writer->cond);
+		mobi_mutex_destroy(&writer->mutex);
+		writer->threaded = false;
+	}
+	zipClose(writer->zf, NULL);
+	return !writer->failed;
+}
+
+/* Free part data as soon as it is written */
+static void releasePart(void *owner)
+{
+	MOBIPart *part = (MOBIPart *) owner;
+	free(part->data);
+	part->data = NULL;
+	part->size = 0;
+}
+
+static bool addContainerFiles(EpubWriter *writer)
+{
 	// mimetype :
-	static const char contents[] = "application/epub+zip";
-	noError = startFileInZip(zf, "mimetype", false);
-	noError &= zipWriteInFileInZip(zf, contents, sizeof(contents)-1) == ZIP_OK; // Must strip ending 0 byte, hence -1
-	noError &= zipCloseFileInZip(zf) == ZIP_OK;
-	if (!noError)
-	{
-		printf("Could not open file inside EPUB for writing: mimetype\n");
-		zipClose(zf, NULL);
-		return ERROR;
+	static const char contents[] = "application/epub+zip";
+	// Must strip ending 0 byte, hence -1
+	if (!epubWriterAdd(writer, "mimetype", (const unsigned char *) contents, sizeof(contents)-1, false, NULL, NULL)) {
+		return false;
 	}
-
-	// META-INF/container.xml :
+
+	// META-INF/container.xml :
 	static const char cont_xml[] =
-		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
-		"<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n"
-		"  <rootfiles>\n"
-		"    <rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/>\n"
-		"  </rootfiles>\n"
+		"<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n"
+		"<container version=\"1.0\" xmlns=\"urn:oasis:names:tc:opendocument:xmlns:container\">\n"
+		"  <rootfiles>\n"
+		"    <rootfile full-path=\"OEBPS/content.opf\" media-type=\"application/oebps-package+xml\"/>\n"
+		"  </rootfiles>\n"
 		"</container>";
-	noError = startFileInZip(zf, "META-INF/container.xml", true);
-	noError &= zipWriteInFileInZip(zf, cont_xml, sizeof(cont_xml)-1) == ZIP_OK; // again -1 to strip ending 0
-	noError &= zipCloseFileInZip(zf) == ZIP_OK;
-	if (!noError)
-	{
-		printf("Could not open file inside EPUB for writing: META-INF/container.xml\n");
-		zipClose(zf, NULL);
-		return ERROR;
+	// again -1 to strip ending 0
+	return epubWriterAdd(writer, "META-INF/container.xml", (const unsigned char *) cont_xml, sizeof(cont_xml)-1, true, NULL, NULL);
+}
+
+/**
+@brief Markup part after cleanup stage
+*/
+typedef struct {
+	unsigned char *data; /**< Cleaned data, may point to part data if unchanged */
+	size_t size; /**< Cleaned data size */
+	EpubReleaseFunc release; /**< Frees cleaned data, may be NULL */
+	void *owner; /**< Argument passed to release function */
+} EpubCleaned;
+
+/**
+@brief Pluggable markup cleanup stage
+
+State is created once per worker thread and reused for all parts processed by that thread.
+clean() must not modify the source part.
+*/
+typedef struct {
+	bool (*init)(void **state); /**< Create per-thread state */
+	bool (*clean)(void *state, const MOBIPart *part, EpubCleaned *out); /**< Clean single part */
+	void (*free)(void *state); /**< Release per-thread state */
+} EpubCleanupStage;
+
+#ifdef WANT_TIDY_CLEANUP
+/**
+@brief Per-thread tidy document, configured once
+*/
+typedef struct {
+	TidyDoc tdoc;
+	TidyOutputSink errSink;
+} TidyState;
+
+static void releaseTidyBuffer(void *owner)
+{
+	TidyBuffer *tdBuf = (TidyBuffer *) owner;
+	tidyBufFree(tdBuf);
+	free(tdBuf);
+}
+
+static bool tidyStageInit(void **state)
+{
+	TidyState *tidy = (TidyState *) malloc(sizeof(TidyState));
+	if (tidy == NULL) {
+		return false;
 	}
+	tidy->tdoc = tidyCreate();
+	// What about input encoding? Do we get utf8 from mobi?
+	tidySetOutCharEncoding(tidy->tdoc, "utf8");
+	tidyOptSetBool(tidy->tdoc, TidyQuiet, yes);
+	tidyOptSetBool(tidy->tdoc, TidyMark, no);
+	tidyOptSetInt(tidy->tdoc, TidyWrapLen, 0);
+	tidyOptSetBool(tidy->tdoc, TidyForceOutput, true);
+	// Shut up the errors and warnings output
+	tidyInitSink(&tidy->errSink, (void*)1, emptyPutByteFunc); // (void*)1 because does not initialize for NULL.
+	tidySetErrorSink(tidy->tdoc, &tidy->errSink);
+	*state = tidy;
+	return true;
+}
 
+static bool tidyStageClean(void *state, const MOBIPart *part, EpubCleaned *out)
+{
+	TidyState *tidy = (TidyState *) state;
+	TidyBuffer *tdOut = (TidyBuffer *) malloc(sizeof(TidyBuffer));
+	if (tdOut == NULL) {
+		return false;
+	}
+	TidyBuffer tdBuf;
+	tidyBufInit(&tdBuf);
+	tidyBufAttach(&tdBuf, part->data, part->size);
+	tidyParseBuffer(tidy->tdoc, &tdBuf); // 2: errors, 1: warnings, 0: OK, see tidyDocStatus()
+	tidyBufDetach(&tdBuf);
 
-	// Now save all the ebook parts to zf...
-	char partname[FILENAME_MAX];
-	if (rawml->markup != NULL) {
-		/* Linked list of MOBIPart structures in rawml->markup holds main text files */
-		MOBIPart *curr = rawml->markup;
-		while (curr != NULL) {
-			MOBIFileMeta file_meta = mobi_get_filemeta_by_type(curr->type);
-			sprintf(partname, "OEBPS/part%05zu.%s", curr->uid, file_meta.extension);
-			noError = startFileInZip(zf, partname, true);
+	tidyCleanAndRepair(tidy->tdoc); // return same as above
+	tidyBufInit(tdOut);
+	tidySaveBuffer(tidy->tdoc, tdOut);
+	out->data = tdOut->bp;
+	out->size = tdOut->size;
+	out->release = releaseTidyBuffer;
+	out->owner = tdOut;
+	return true;
+}
+
+static void tidyStageFree(void *state)
+{
+	TidyState *tidy = (TidyState *) state;
+	tidyRelease(tidy->tdoc);
+	free(tidy);
+}
+
+static const EpubCleanupStage tidyStage = { tidyStageInit, tidyStageClean, tidyStageFree };
+#endif
+
+static bool nativeStageInit(void **state)
+{
+	*state = NULL;
+	return true;
+}
+
+static bool nativeStageClean(void *state, const MOBIPart *part, EpubCleaned *out)
+{
+	(void) state;
+	unsigned char *fixed = NULL;
+	size_t fixed_size = 0;
+	if (mobi_fix_xhtml(&fixed, &fixed_size, part) != MOBI_SUCCESS) {
+		printf("Fixing markup failed\n");
+		return false;
+	}
+	out->data = fixed;
+	out->size = fixed_size;
+	out->release = free;
+	out->owner = fixed;
+	return true;
+}
+
+static void nativeStageFree(void *state)
+{
+	(void) state;
+}
+
+static const EpubCleanupStage nativeStage = { nativeStageInit, nativeStageClean, nativeStageFree };
+
+#ifdef WANT_TIDY_CLEANUP
+static EpubCleanup epubCleanup = EPUB_CLEANUP_TIDY;
+#else
+static EpubCleanup epubCleanup = EPUB_CLEANUP_NONE;
+#endif
+
+/**
+@brief Select cleanup applied to markup parts by EPUB export
+@param[in] cleanup EPUB_CLEANUP_NONE, EPUB_CLEANUP_TIDY or EPUB_CLEANUP_NATIVE
+*/
+void setEpubCleanup(EpubCleanup cleanup)
+{
+	epubCleanup = cleanup;
+}
+
+/**
+@brief Cleanup stage applied to markup parts, NULL if parts are stored as they are
+*/
+static const EpubCleanupStage *markupCleanupStage(void)
+{
+	switch (epubCleanup) {
+	case EPUB_CLEANUP_TIDY:
 #ifdef WANT_TIDY_CLEANUP
-			TidyBuffer tdBuf;
-			tidyBufInit(&tdBuf);
-			tidyBufAttach(&tdBuf, curr->data, curr->size);
-
-			TidyDoc tdoc = tidyCreate();
-			// What about input encoding? Do we get utf8 from mobi?
-			tidySetOutCharEncoding(tdoc, "utf8");
-			tidyOptSetBool(tdoc, TidyQuiet, yes);
-			tidyOptSetBool(tdoc, TidyMark, no);
-			tidyOptSetInt(tdoc, TidyWrapLen, 0);
-			tidyOptSetBool(tdoc, TidyForceOutput, true);
-			// Shut up the errors and warnings output
-			TidyOutputSink errSink;
-			tidyInitSink(&errSink, (void*)1, emptyPutByteFunc); // (void*)1 because does not initialize for NULL.
-			tidySetErrorSink(tdoc, &errSink);
-			tidyParseBuffer(tdoc, &tdBuf); // 2: errors, 1: warnings, 0: OK, see tidyDocStatus()
-			tidyBufDetach(&tdBuf);
-
-			tidyCleanAndRepair(tdoc); // return same as above
-			tidySaveBuffer(tdoc, &tdBuf);
-			tidyRelease(tdoc);
-			noError &= zipWriteInFileInZip(zf, tdBuf.bp, tdBuf.size) == ZIP_OK;
-			tidyBufFree(&tdBuf);
+		return &tidyStage;
 #else
-			noError &= zipWriteInFileInZip(zf, curr->data, curr->size) == ZIP_OK;
+		/* built without tidy, nearest substitute */
+		return &nativeStage;
 #endif
-			noError &= zipCloseFileInZip(zf) == ZIP_OK;
-			if (!noError)
-			{
-				printf("Could not open file inside EPUB for writing: %s\n", partname);
-				zipClose(zf, NULL);
-				return ERROR;
+	case EPUB_CLEANUP_NATIVE:
+		return &nativeStage;
+	default:
+		return NULL;
+	}
+}
+
+/**
+@brief Queue markup part, optionally releasing its data once it is no longer needed
+@param[in] writer EPUB writer
+@param[in] part Markup part
+@param[in] cleaned Cleaned part data or NULL to store part data as it is
+@param[in] release Free part data
+*/
+static bool addMarkupPart(EpubWriter *writer, MOBIPart *part, const EpubCleaned *cleaned, bool release)
+{
+	char partname[FILENAME_MAX];
+	MOBIFileMeta file_meta = mobi_get_filemeta_by_type(part->type);
+	sprintf(partname, "OEBPS/part%05zu.%s", part->uid, file_meta.extension);
+	if (cleaned == NULL || cleaned->data == part->data) {
+		return epubWriterAdd(writer, partname, part->data, cleaned ? cleaned->size : part->size, true, release ? releasePart : NULL, part);
+	}
+	if (release) {
+		/* source is not needed any more, cleaned data is queued instead */
+		releasePart(part);
+	}
+	return epubWriterAdd(writer, partname, cleaned->data, cleaned->size, true, cleaned->release, cleaned->owner);
+}
+
+/**
+@brief Worker pool running cleanup stage on markup parts
+
+Parts are taken in order by workers and handed back to the writer in the same order.
+Workers may run at most window parts ahead of the writer, which bounds memory used by cleaned parts.
+*/
+typedef struct {
+	const EpubCleanupStage *stage; /**< Cleanup stage */
+	MOBIPart **parts; /**< Markup parts in output order */
+	EpubCleaned *results; /**< Cleaned parts */
+	int *status; /**< 0: pending, 1: cleaned, -1: failed */
+	size_t count; /**< Number of parts */
+	size_t next; /**< Next part to be taken by a worker */
+	size_t emitted; /**< Number of parts handed to writer */
+	size_t window; /**< Maximum number of parts cleaned ahead of writer */
+	bool abort; /**< Stop workers */
+	MOBIMutex mutex; /**< Guards pool state */
+	MOBICond cond; /**< Signals pool state changes */
+} EpubCleanupPool;
+
+static void *cleanupWorkerRun(void *arg)
+{
+	EpubCleanupPool *pool = (EpubCleanupPool *) arg;
+	void *state = NULL;
+	const bool ready = pool->stage->init(&state);
+	mobi_mutex_lock(&pool->mutex);
+	if (!ready) {
+		printf("Markup cleanup initialization failed\n");
+		pool->abort = true;
+		mobi_cond_broadcast(&pool->cond);
+	}
+	while (!pool->abort) {
+		while (!pool->abort && pool->next < pool->count && pool->next >= pool->emitted + pool->window) {
+			mobi_cond_wait(&pool->cond, &pool->mutex);
+		}
+		if (pool->abort || pool->next >= pool->count) {
+			break;
+		}
+		const size_t i = pool->next++;
+		mobi_mutex_unlock(&pool->mutex);
+		const bool noError = pool->stage->clean(state, pool->parts[i], &pool->results[i]);
+		mobi_mutex_lock(&pool->mutex);
+		pool->status[i] = noError ? 1 : -1;
+		if (!noError) {
+			pool->abort = true;
+		}
+		mobi_cond_broadcast(&pool->cond);
+	}
+	mobi_mutex_unlock(&pool->mutex);
+	if (ready) {
+		pool->stage->free(state);
+	}
+	return NULL;
+}
+
+/**
+@brief Clean markup parts on a worker pool and queue them in order
+@return True on success, false on failure; started is set to false if no worker could be started
+*/
+static bool addMarkupPartsParallel(EpubWriter *writer, EpubCleanupPool *pool, size_t threads_count, bool release, bool *started)
+{
+	*started = false;
+	MOBIThread *threads = (MOBIThread *) malloc(threads_count * sizeof(MOBIThread));
+	if (threads == NULL) {
+		return false;
+	}
+	if (mobi_mutex_init(&pool->mutex) != MOBI_SUCCESS) {
+		free(threads);
+		return false;
+	}
+	if (mobi_cond_init(&pool->cond) != MOBI_SUCCESS) {
+		mobi_mutex_destroy(&pool->mutex);
+		free(threads);
+		return false;
+	}
+	size_t running = 0;
+	while (running < threads_count && mobi_thread_create(&threads[running], cleanupWorkerRun, pool) == MOBI_SUCCESS) {
+		running++;
+	}
+	bool noError = running > 0;
+	*started = noError;
+	for (size_t i = 0; noError && i < pool->count; i++) {
+		mobi_mutex_lock(&pool->mutex);
+		while (pool->status[i] == 0 && !pool->abort) {
+			mobi_cond_wait(&pool->cond, &pool->mutex);
+		}
+		const bool cleaned = pool->status[i] == 1;
+		mobi_mutex_unlock(&pool->mutex);
+		noError = cleaned && addMarkupPart(writer, pool->parts[i], &pool->results[i], release);
+		mobi_mutex_lock(&pool->mutex);
+		if (cleaned) {
+			/* cleaned part is now owned by writer */
+			pool->emitted = i + 1;
+		}
+		if (!noError) {
+			pool->abort = true;
+		}
+		mobi_cond_broadcast(&pool->cond);
+		mobi_mutex_unlock(&pool->mutex);
+	}
+	for (size_t i = 0; i < running; i++) {
+		mobi_thread_join(&threads[i]);
+	}
+	/* release parts cleaned ahead of a failure */
+	for (size_t i = pool->emitted; i < pool->count; i++) {
+		if (pool->status[i] == 1 && pool->results[i].release) {
+			pool->results[i].release(pool->results[i].owner);
+		}
+	}
+	mobi_cond_destroy(&pool->cond);
+	mobi_mutex_destroy(&pool->mutex);
+	free(threads);
+	return noError;
+}
+
+/**
+@brief Clean markup parts in calling thread and queue them
+*/
+static bool addMarkupPartsSerial(EpubWriter *writer, const EpubCleanupStage *stage, MOBIPart *markup, bool release)
+{
+	void *state = NULL;
+	if (!stage->init(&state)) {
+		printf("Markup cleanup initialization failed\n");
+		return false;
+	}
+	bool noError = true;
+	MOBIPart *curr = markup;
+	while (noError && curr != NULL) {
+		EpubCleaned cleaned;
+		noError = stage->clean(state, curr, &cleaned) && addMarkupPart(writer, curr, &cleaned, release);
+		curr = curr->next;
+	}
+	stage->free(state);
+	return noError;
+}
+
+/**
+@brief Run cleanup stage on markup parts and queue them in original order
+@param[in] writer EPUB writer
+@param[in] markup Linked list of markup parts
+@param[in] release Free part data once it is no longer needed
+*/
+static bool addMarkupParts(EpubWriter *writer, MOBIPart *markup, bool release)
+{
+	const EpubCleanupStage *stage = markupCleanupStage();
+	MOBIPart *curr = markup;
+	if (stage == NULL) {
+		while (curr != NULL) {
+			if (!addMarkupPart(writer, curr, NULL, release)) {
+				return false;
 			}
 			curr = curr->next;
 		}
+		return true;
+	}
+	size_t count = 0;
+	while (curr != NULL) {
+		count++;
+		curr = curr->next;
+	}
+	size_t threads_count = mobi_threads_count();
+	if (threads_count > count) {
+		threads_count = count;
+	}
+	if (threads_count > 1) {
+		EpubCleanupPool pool;
+		memset(&pool, 0, sizeof(EpubCleanupPool));
+		pool.stage = stage;
+		pool.count = count;
+		pool.window = 2 * threads_count;
+		pool.parts = (MOBIPart **) malloc(count * sizeof(MOBIPart *));
+		pool.results = (EpubCleaned *) malloc(count * sizeof(EpubCleaned));
+		pool.status = (int *) calloc(count, sizeof(int));
+		bool started = false;
+		bool noError = false;
+		if (pool.parts && pool.results && pool.status) {
+			size_t i = 0;
+			for (curr = markup; curr != NULL; curr = curr->next) {
+				pool.parts[i++] = curr;
+			}
+			noError = addMarkupPartsParallel(writer, &pool, threads_count, release, &started);
+		}
+		free(pool.parts);
+		free(pool.results);
+		free(pool.status);
+		if (started) {
+			return noError;
+		}
+		/* no worker could be started, fall back to serial cleanup */
+	}
+	return addMarkupPartsSerial(writer, stage, markup, release);
+}
+
+/**
+@brief Queue flow part (css, svg), optionally releasing its data after it is written
+*/
+static bool addFlowPart(EpubWriter *writer, MOBIPart *part, bool release)
+{
+	char partname[FILENAME_MAX];
+	MOBIFileMeta file_meta = mobi_get_filemeta_by_type(part->type);
+	sprintf(partname, "OEBPS/flow%05zu.%s", part->uid, file_meta.extension);
+	// optional, get rid of negative text-indent
+	if (file_meta.type == T_CSS) {
+		// part data is not null terminated, so search within its size
+		static const char indent[] = "text-indent:";
+		const size_t indent_len = sizeof(indent) - 1;
+		char *pc = (char *) part->data;
+		char *end = pc + part->size;
+		while ((size_t) (end - pc) >= indent_len) {
+			if (memcmp(pc, indent, indent_len) != 0) {
+				pc++;
+				continue;
+			}
+			pc += indent_len;
+			while (pc < end && isspace((unsigned char) *pc))
+				pc++;
+			if (pc < end && *pc == '-') {
+				*pc++ = ' ';
+				while (pc < end && isdigit((unsigned char) *pc)) {
+					*pc++ = ' ';
+				}
+				// now *pc is maybe %, p for px etc.
+				*(--pc) = '0';
+			}
+		}
+	}
+	return epubWriterAdd(writer, partname, part->data, part->size, true, release ? releasePart : NULL, part);
+}
+
+/**
+@brief Queue resource part, its data must stay valid until writer is closed
+*/
+static bool addResourcePart(EpubWriter *writer, const MOBIPart *part)
+{
+	if (part->size == 0) {
+		return true;
+	}
+	char partname[FILENAME_MAX];
+	MOBIFileMeta file_meta = mobi_get_filemeta_by_type(part->type);
+	MOBIFiletype typ = file_meta.type;
+	if (typ == T_NCX)
+		sprintf(partname, "OEBPS/toc.%s", file_meta.extension);
+	else if (typ == T_OPF)
+		sprintf(partname, "OEBPS/content.%s", file_meta.extension);
+	else
+		sprintf(partname, "OEBPS/resource%05zu.%s", part->uid, file_meta.extension);
+	bool compress = !(typ==T_JPG || typ==T_GIF || typ==T_PNG || typ==T_MP3 || typ==T_MPG);
+	return epubWriterAdd(writer, partname, part->data, part->size, compress, NULL, NULL);
+}
+
+/**
+@brief Check whether resource of given record type is stored verbatim in its record
+
+Fonts, audio and video have to be decoded first.
+*/
+static bool isRecordResource(MOBIFiletype type)
+{
+	return !(type == T_UNKNOWN || type == T_BREAK || type == T_FONT || type == T_AUDIO || type == T_VIDEO);
+}
+
+static const MOBIPdbRecord *firstResourceRecord(const MOBIData *m)
+{
+	size_t first_res_seqnumber = mobi_get_first_resource_record(m);
+	if (first_res_seqnumber == MOBI_NOTSET) {
+		/* search all records */
+		first_res_seqnumber = 0;
+	}
+	return mobi_get_record_by_seqnumber(m, first_res_seqnumber);
+}
+
+/**
+@brief Queue resources stored verbatim in records, directly from MOBIData
+
+Numbering follows mobi_reconstruct_resources(), so names match those used in reconstructed links.
+May run concurrently with mobi_parse_rawml(), which only reads resource records.
+*/
+static bool addRecordResources(EpubWriter *writer, const MOBIData *m)
+{
+	const MOBIPdbRecord *curr_record = firstResourceRecord(m);
+	size_t uid = 0;
+	while (curr_record != NULL) {
+		const MOBIFiletype filetype = mobi_determine_resource_type(curr_record);
+		if (filetype == T_BREAK) {
+			break;
+		}
+		if (isRecordResource(filetype)) {
+			MOBIPart part;
+			part.uid = uid;
+			part.type = filetype;
+			part.size = curr_record->size;
+			part.data = curr_record->data;
+			part.next = NULL;
+			part.blocks = NULL;
+			if (!addResourcePart(writer, &part)) {
+				return false;
+			}
+		}
+		curr_record = curr_record->next;
+		uid++;
+	}
+	return true;
+}
+
+/**
+@brief Queue parsed markup, flow and resource parts
+@param[in] writer EPUB writer
+@param[in] rawml MOBIRawml structure holding parsed records
+@param[in] release Free markup and flow data once it is written
+@param[in] m If not NULL, skip resources already added from its records with addRecordResources()
+*/
+static bool addRawmlParts(EpubWriter *writer, const MOBIRawml *rawml, bool release, const MOBIData *m)
+{
+	if (rawml->markup != NULL) {
+		/* Linked list of MOBIPart structures in rawml->markup holds main text files */
+		if (!addMarkupParts(writer, rawml->markup, release)) {
+			return false;
+		}
 	}
 	if (rawml->flow != NULL) {
-		/* Linked list of MOBIPart structures in rawml->flow holds supplementary text files, 
+		/* Linked list of MOBIPart structures in rawml->flow holds supplementary text files,
 		   e.g. .css, .svg
 		*/
 		MOBIPart *curr = rawml->flow;
 		/* skip raw html file */
 		curr = curr->next;
 		while (curr != NULL) {
-			MOBIFileMeta file_meta = mobi_get_filemeta_by_type(curr->type);
-			sprintf(partname, "OEBPS/flow%05zu.%s", curr->uid, file_meta.extension);
-			// optional, get rid of negative text-indent
-			if (file_meta.type == T_CSS) {
-				char *pc = curr->data;
-				while (pc = strstr(pc, "text-indent:")) {
-					pc += 12; // strlen("text-indent:");
-					while (isspace(*pc) && (pc - (char*)curr->data) < curr->size)
-						pc++;
-					if (*pc == '-') {
-						*pc++ = ' ';
-						while (isdigit(*pc)) {
-							*pc++ = ' ';
-						}
-						// now *pc is maybe %, p for px etc.
-						*(--pc) = '0';
-					}
-				}
-			}
-			noError = startFileInZip(zf, partname, true);
-			noError &= zipWriteInFileInZip(zf, curr->data, curr->size) == ZIP_OK;
-			noError &= zipCloseFileInZip(zf) == ZIP_OK;
-			if (!noError)
-			{
-				printf("Could not open file inside EPUB for writing: %s\n", partname);
-				zipClose(zf, NULL);
-				return ERROR;
+			if (!addFlowPart(writer, curr, release)) {
+				return false;
 			}
 			curr = curr->next;
 		}
 	}
 	if (rawml->resources != NULL) {
 		/* Linked list of MOBIPart structures in rawml->resources holds binary files */
-		MOBIPart *curr = rawml->resources;
+		const MOBIPart *curr = rawml->resources;
+		/* resource parts and records are both ordered by uid */
+		const MOBIPdbRecord *curr_record = m ? firstResourceRecord(m) : NULL;
+		size_t record_uid = 0;
 		/* jpg, gif, png, bmp, font, audio, video */
 		while (curr != NULL) {
-			MOBIFileMeta file_meta = mobi_get_filemeta_by_type(curr->type);
-			if (curr->size > 0) {
-				MOBIFiletype typ = file_meta.type;
-				if (typ == T_NCX)
-					sprintf(partname, "OEBPS/toc.%s", file_meta.extension);
-				else if (typ == T_OPF)
-					sprintf(partname, "OEBPS/content.%s", file_meta.extension);
-				else
-					sprintf(partname, "OEBPS/resource%05zu.%s", curr->uid, file_meta.extension);
-				bool compress = !(typ==T_JPG || typ==T_GIF || typ==T_PNG || typ==T_MP3 || typ==T_MPG);
-				noError = startFileInZip(zf, partname, compress);
-				noError &= zipWriteInFileInZip(zf, curr->data, curr->size) == ZIP_OK;
-				noError &= zipCloseFileInZip(zf) == ZIP_OK;
-				if (!noError)
-				{
-					printf("Could not open file inside EPUB for writing: %s\n", partname);
-					zipClose(zf, NULL);
-					return ERROR;
+			bool streamed = false;
+			if (m && curr->type != T_NCX && curr->type != T_OPF) {
+				while (curr_record != NULL && record_uid < curr->uid) {
+					curr_record = curr_record->next;
+					record_uid++;
 				}
+				streamed = curr_record != NULL && isRecordResource(mobi_determine_resource_type(curr_record));
+			}
+			if (!streamed && !addResourcePart(writer, curr)) {
+				return false;
 			}
 			curr = curr->next;
 		}
 	}
-	zipClose(zf, NULL);
-	return SUCCESS;
+	return true;
 }
 
 /**
-@brief Loads Rawml data of Mobi
-@param[in] mobiFn Mobi file name
-@param[in] m MOBIData initialized with *m = mobi_init();
-MOBIData* m = mobi_init();
-if (m == NULL) {
-printf("Memory allocation failed\n");
-return NULL;
+@brief Dump parsed markup files and resources into created folder
+@param[in] rawml MOBIRawml structure holding parsed records
+@param[in] epub_fn File to the epub file to be created.
+E
+xample structure:
+--ZIP Container--
+mimetype
+META-INF/
+  container.xml
+OEBPS/
+  content.opf
+  chapter1.xhtml
+  ch1-pic.png
+  css/
+    style.css
+    myfont.otf
+  toc.ncx
+*/
+int epub_rawml_parts(const MOBIRawml *rawml, const char *epub_fn) {
+	if (rawml == NULL) {
+		printf("Rawml structure not initialized\n");
+		return ERROR;
+	}
+	printf("Saving EPUB %s\n", epub_fn);
+
+	EpubWriter writer;
+	if (!epubWriterOpen(&writer, epub_fn)) {
+		return ERROR;
+	}
+	// Create regular EPUB structure in zf here...
+	bool noError = addContainerFiles(&writer);
+	// Now save all the ebook parts to zf...
+	noError = noError && addRawmlParts(&writer, rawml, false, NULL);
+	noError &= epubWriterClose(&writer);
+	return noError ? SUCCESS : ERROR;
 }
-...
-mobi_free(m);
-mobi_free_rawml(rawml);
-@param[in] pid Device ID for decription, default NULL
-@param[in] parse_kf7_opt - true if KF7 part of hybrid KF7/KF8 file should be parsed, default false
+
+/**
+@brief Loads Mobi document into MOBIData and sets decryption key
+@param[in] m MOBIData initialized with *m = mobi_init();
+@param[in] mobiFn Mobi file name
+@param[in] pid Device ID for decription, may be NULL
+@param[in] parse_kf7_opt - true if KF7 part of hybrid KF7/KF8 file should be parsed
 */
-MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool parse_kf7_opt) {
+static bool loadMobiData(MOBIData *m, const char *mobiFn, const char* pid, bool parse_kf7_opt) {
 	MOBI_RET mobi_ret;
 	/* Initialize main MOBIData structure */
 
@@ -270,7 +874,7 @@ MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool
 	if (file == NULL) {
 		int errsv = errno;
 		printf("Error opening file: %s (%s)\n", mobiFn, strerror(errsv));
-		return NULL;
+		return false;
 	}
 	/* MOBIData structure will be filled with loaded document data and metadata */
 	mobi_ret = mobi_load_file(m, file);
@@ -280,7 +884,7 @@ MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool
 	// print_meta(m);
 	if (mobi_ret != MOBI_SUCCESS) {
 		printf("Error while loading document (%i)\n", mobi_ret);
-		return NULL;
+		return false;
 	}
 	/* Try to print EXTH metadata */
 	// print_exth(m);
@@ -298,12 +902,35 @@ MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool
 			mobi_ret = mobi_drm_setkey(m, pid);
 			if (mobi_ret != MOBI_SUCCESS) {
 				printf("failed (%i)\n", mobi_ret);
-				return NULL;
+				return false;
 			}
 			//printf("ok\n");
 		}
 	}
 #endif
+	return true;
+}
+
+/**
+@brief Loads Rawml data of Mobi
+@param[in] mobiFn Mobi file name
+@param[in] m MOBIData initialized with *m = mobi_init();
+MOBIData* m = mobi_init();
+if (m == NULL) {
+printf("Memory allocation failed\n");
+return NULL;
+}
+...
+mobi_free(m);
+mobi_free_rawml(rawml);
+@param[in] pid Device ID for decription, default NULL
+@param[in] parse_kf7_opt - true if KF7 part of hybrid KF7/KF8 file should be parsed, default false
+*/
+MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool parse_kf7_opt) {
+	MOBI_RET mobi_ret;
+	if (!loadMobiData(m, mobiFn, pid, parse_kf7_opt)) {
+		return NULL;
+	}
 
 	// printf("\nReconstructing source resources...\n");
 	/* Initialize MOBIRawml structure */
@@ -325,6 +952,35 @@ MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool
 	return rawml;
 }
 
+/**
+@brief Parser state passed to parsing thread
+*/
+typedef struct {
+	const MOBIData *m;
+	MOBIRawml *rawml;
+	MOBI_RET ret;
+} RawmlParser;
+
+static void *parseRawmlRun(void *arg)
+{
+	RawmlParser *parser = (RawmlParser *) arg;
+	parser->ret = mobi_parse_rawml(parser->rawml, parser->m);
+	return NULL;
+}
+
+/**
+@brief Converts Mobi file to EPUB
+
+Export is pipelined: text is parsed in a separate thread while resources
+are streamed from records to the writer thread. Parsed parts are then queued
+one by one, so preparing next part overlaps with compressing previous ones,
+and each part's data is freed as soon as it is written.
+@param[in] mobiFn Mobi file name
+@param[in] epubFn EPUB file to be created
+@param[in] pid Device ID for decription, default NULL
+@param[in] parse_kf7_opt - true if KF7 part of hybrid KF7/KF8 file should be parsed, default false
+@return True on success
+*/
 bool convertMobiToEpub(const char* mobiFn, const char* epubFn, const char* pid, bool parse_kf7_opt)
 {
 	MOBIData* m = mobi_init();
@@ -332,17 +988,45 @@ bool convertMobiToEpub(const char* mobiFn, const char* epubFn, const char* pid,
 		printf("Memory allocation failed\n");
 		return false;
 	}
-	MOBIRawml *rawml = loadMobiRawml(m, mobiFn, pid, parse_kf7_opt);
+	if (!loadMobiData(m, mobiFn, pid, parse_kf7_opt)) {
+		mobi_free(m);
+		return false;
+	}
+	MOBIRawml *rawml = mobi_init_rawml(m);
 	if (rawml == NULL) {
+		printf("Memory allocation failed\n");
 		mobi_free(m);
 		return false;
 	}
+	printf("Saving EPUB %s\n", epubFn);
+	EpubWriter writer;
+	if (!epubWriterOpen(&writer, epubFn)) {
+		mobi_free_rawml(rawml);
+		mobi_free(m);
+		return false;
+	}
+	/* Parse text, meanwhile queue resources stored verbatim in records */
+	RawmlParser parser = { m, rawml, MOBI_SUCCESS };
+	MOBIThread thread;
+	const bool parsing = mobi_thread_create(&thread, parseRawmlRun, &parser) == MOBI_SUCCESS;
+	bool noError = addContainerFiles(&writer) && addRecordResources(&writer, m);
+	if (parsing) {
+		mobi_thread_join(&thread);
+	} else {
+		parseRawmlRun(&parser);
+	}
+	if (parser.ret != MOBI_SUCCESS) {
+		printf("Parsing rawml failed (%i)\n", parser.ret);
+		noError = false;
+	}
 	/* Save parts to files */
-	int ret = epub_rawml_parts(rawml, epubFn);
-	if (ret != SUCCESS) {
+	noError = noError && addRawmlParts(&writer, rawml, true, m);
+	noError &= epubWriterClose(&writer);
+	if (!noError) {
 		printf("Dumping parts to EPUB failed\n");
+		remove(epubFn);
 	}
 	mobi_free(m);
 	mobi_free_rawml(rawml);
-	return ret == SUCCESS;
+	return noError;
 }
@@ -7,14 +7,23 @@
 
 #include "mobi.h"
 
+/* Cleanup applied to markup parts by EPUB export */
+typedef enum {
+	EPUB_CLEANUP_NONE = 0, /* store markup as reconstructed */
+	EPUB_CLEANUP_TIDY, /* HTML Tidy, default if built with WANT_TIDY_CLEANUP */
+	EPUB_CLEANUP_NATIVE /* built-in well-formedness fixer, mobi_fix_xhtml() */
+} EpubCleanup;
+
 #ifdef __cplusplus
 extern "C" {
+void setEpubCleanup(EpubCleanup cleanup);
 int epub_rawml_parts(const MOBIRawml *rawml, const char *epub_fn);
 MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid = NULL, bool parse_kf7_opt = false);
 bool convertMobiToEpub(const char* mobiFn, const char* epubFn, const char* pid = NULL, bool parse_kf7_opt = false); 
 }
 #else
 
+extern void setEpubCleanup(EpubCleanup cleanup);
 extern int epub_rawml_parts(const MOBIRawml *rawml, const char *epub_fn);
 extern MOBIRawml* loadMobiRawml(MOBIData *m, const char *mobiFn, const char* pid, bool parse_kf7_opt);
 extern bool convertMobiToEpub(const char* mobiFn, const char* epubFn, const char* pid, bool parse_kf7_opt);
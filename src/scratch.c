@@ -0,0 +1,324 @@
+/** @file scratch.c
+ *  @brief Large temporary buffers backed by temporary files
+ *
+ * Buffers above configured threshold are mapped from unlinked temporary
+ * file, so that kernel may write them out under memory pressure instead of
+ * using anonymous memory. Below threshold, or if mapping fails,
+ * buffers are allocated on heap. File backing is disabled by default.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+# define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include "scratch.h"
+#if defined(MOBI_SCRATCH_MMAP)
+# include <fcntl.h>
+# include <sys/mman.h>
+# include <unistd.h>
+#endif
+#include "debug.h"
+
+/**
+ @brief Minimal size of buffer mapped from temporary file, 0 if disabled
+ */
+static size_t scratch_threshold = 0;
+
+/**
+ @brief Set size above which large temporary buffers used while parsing are backed by temporary files
+ 
+ Affects buffer holding whole decompressed text and buffers used for conversion of cp1252 markup to utf-8.
+ Temporary files are created in directory set in TMPDIR (TEMP on Windows) environment variable
+ and are deleted immediately, so they never outlive the process.
+ Threshold is read whenever a buffer is allocated, it is process-wide setting (see @ref mobi_export).
+ 
+ @param[in] threshold Minimal size of file backed buffer in bytes, 0 (default) keeps all buffers on heap
+ @return MOBI_RET status code, MOBI_INIT_FAILED if temporary file backing is not supported on this platform
+ */
+MOBI_RET mobi_set_scratch_threshold(const size_t threshold) {
+#if defined(MOBI_SCRATCH_WIN32) || defined(MOBI_SCRATCH_MMAP)
+    scratch_threshold = threshold;
+    return MOBI_SUCCESS;
+#else
+    return threshold ? MOBI_INIT_FAILED : MOBI_SUCCESS;
+#endif
+}
+
+/**
+ @brief Maximal size of heap buffer kept in thread's pool for reuse, 0 if disabled
+ */
+static size_t scratch_pool_max = 0;
+
+#ifdef MOBI_THREAD_LOCAL
+/**
+ @brief Heap buffers released by calling thread, kept for reuse
+ */
+static MOBI_THREAD_LOCAL unsigned char *scratch_pool_data[MOBI_SCRATCH_POOL_SLOTS];
+/**
+ @brief Capacities of pooled buffers
+ */
+static MOBI_THREAD_LOCAL size_t scratch_pool_size[MOBI_SCRATCH_POOL_SLOTS];
+#endif
+
+/**
+ @brief Set maximal size of temporary heap buffers kept for reuse
+ 
+ Released buffers are kept in pool of calling thread, up to MOBI_SCRATCH_POOL_SLOTS largest ones,
+ and are reused by following allocations of the same thread.
+ This saves allocating and faulting in buffers for whole text and markup conversion
+ when many documents are parsed in a loop.
+ Threads started by the library release their pools on exit,
+ other threads should call mobi_release_scratch_pool() before they finish.
+ Setting 0 stops pooling, but frees only the pool of calling thread.
+ 
+ @param[in] max_size Maximal size of pooled buffer in bytes, 0 (default) disables pooling
+ @return MOBI_RET status code, MOBI_INIT_FAILED if thread local storage is not supported by compiler
+ */
+MOBI_RET mobi_set_scratch_pool(const size_t max_size) {
+#ifdef MOBI_THREAD_LOCAL
+    scratch_pool_max = max_size;
+    if (max_size == 0) {
+        mobi_release_scratch_pool();
+    }
+    return MOBI_SUCCESS;
+#else
+    return max_size ? MOBI_INIT_FAILED : MOBI_SUCCESS;
+#endif
+}
+
+/**
+ @brief Free temporary buffers pooled by calling thread
+ */
+void mobi_release_scratch_pool(void) {
+#ifdef MOBI_THREAD_LOCAL
+    for (size_t i = 0; i < MOBI_SCRATCH_POOL_SLOTS; i++) {
+        free(scratch_pool_data[i]);
+        scratch_pool_data[i] = NULL;
+        scratch_pool_size[i] = 0;
+    }
+#endif
+}
+
+#ifdef MOBI_THREAD_LOCAL
+/**
+ @brief Take smallest pooled buffer of at least given size
+ 
+ @param[in,out] scratch MOBIScratch structure to be initialized
+ @param[in] size Buffer size
+ @return True if buffer was found
+ */
+static bool mobi_scratch_pool_get(MOBIScratch *scratch, const size_t size) {
+    size_t found = MOBI_SCRATCH_POOL_SLOTS;
+    for (size_t i = 0; i < MOBI_SCRATCH_POOL_SLOTS; i++) {
+        if (scratch_pool_data[i] && scratch_pool_size[i] >= size
+            && (found == MOBI_SCRATCH_POOL_SLOTS || scratch_pool_size[i] < scratch_pool_size[found])) {
+            found = i;
+        }
+    }
+    if (found == MOBI_SCRATCH_POOL_SLOTS) {
+        return false;
+    }
+    scratch->data = scratch_pool_data[found];
+    scratch->size = scratch_pool_size[found];
+    scratch_pool_data[found] = NULL;
+    scratch_pool_size[found] = 0;
+    return true;
+}
+
+/**
+ @brief Put heap buffer into pool, replacing smallest pooled buffer if pool is full
+ 
+ @param[in] scratch MOBIScratch structure
+ @return True if buffer was pooled
+ */
+static bool mobi_scratch_pool_put(const MOBIScratch *scratch) {
+    if (scratch->size > scratch_pool_max) {
+        return false;
+    }
+    size_t slot = 0;
+    for (size_t i = 0; i < MOBI_SCRATCH_POOL_SLOTS; i++) {
+        if (scratch_pool_data[i] == NULL) {
+            slot = i;
+            break;
+        }
+        if (scratch_pool_size[i] < scratch_pool_size[slot]) {
+            slot = i;
+        }
+    }
+    if (scratch_pool_data[slot]) {
+        if (scratch_pool_size[slot] >= scratch->size) {
+            return false;
+        }
+        free(scratch_pool_data[slot]);
+    }
+    scratch_pool_data[slot] = scratch->data;
+    scratch_pool_size[slot] = scratch->size;
+    return true;
+}
+#endif
+
+#if defined(MOBI_SCRATCH_MMAP)
+/**
+ @brief Map buffer from unlinked temporary file
+ 
+ @param[in,out] scratch MOBIScratch structure with size set
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_scratch_map(MOBIScratch *scratch) {
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0') {
+        dir = "/tmp";
+    }
+    char path[FILENAME_MAX];
+    if (snprintf(path, sizeof(path), "%s/libmobi-XXXXXX", dir) >= (int) sizeof(path)) {
+        return MOBI_PARAM_ERR;
+    }
+    const int fd = mkstemp(path);
+    if (fd == -1) {
+        debug_print("Creating temporary file in %s failed\n", dir);
+        return MOBI_INIT_FAILED;
+    }
+    unlink(path);
+    /* reserve disk space, writing to mapped sparse file on full disk would raise SIGBUS */
+#ifdef HAVE_POSIX_FALLOCATE
+    const int error = posix_fallocate(fd, 0, (off_t) scratch->size);
+#else
+    const int error = ftruncate(fd, (off_t) scratch->size);
+#endif
+    if (error != 0) {
+        debug_print("Resizing temporary file to %zu failed\n", scratch->size);
+        close(fd);
+        return MOBI_INIT_FAILED;
+    }
+    void *data = mmap(NULL, scratch->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    /* mapping keeps file alive */
+    close(fd);
+    if (data == MAP_FAILED) {
+        debug_print("Mapping temporary file of size %zu failed\n", scratch->size);
+        return MOBI_INIT_FAILED;
+    }
+    scratch->data = data;
+    return MOBI_SUCCESS;
+}
+#elif defined(MOBI_SCRATCH_WIN32)
+/**
+ @brief Map buffer from temporary file deleted on close
+ 
+ @param[in,out] scratch MOBIScratch structure with size set
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_scratch_map(MOBIScratch *scratch) {
+    char dir[MAX_PATH + 1];
+    char path[MAX_PATH + 1];
+    const DWORD length = GetTempPathA(sizeof(dir), dir);
+    if (length == 0 || length > sizeof(dir) || GetTempFileNameA(dir, "mob", 0, path) == 0) {
+        debug_print("%s", "Creating temporary file name failed\n");
+        return MOBI_INIT_FAILED;
+    }
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, NULL, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        debug_print("Creating temporary file %s failed\n", path);
+        DeleteFileA(path);
+        return MOBI_INIT_FAILED;
+    }
+    const unsigned long long size = scratch->size;
+    HANDLE mapping = CreateFileMappingA(file, NULL, PAGE_READWRITE, (DWORD) (size >> 32), (DWORD) size, NULL);
+    /* mapping keeps file alive, it is deleted when mapping is closed */
+    CloseHandle(file);
+    if (mapping == NULL) {
+        debug_print("Mapping temporary file of size %zu failed\n", scratch->size);
+        return MOBI_INIT_FAILED;
+    }
+    void *data = MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, scratch->size);
+    if (data == NULL) {
+        debug_print("Mapping temporary file of size %zu failed\n", scratch->size);
+        CloseHandle(mapping);
+        return MOBI_INIT_FAILED;
+    }
+    scratch->mapping = mapping;
+    scratch->data = data;
+    return MOBI_SUCCESS;
+}
+#endif
+
+/**
+ @brief Allocate temporary buffer
+ 
+ Buffer is mapped from temporary file if its size reaches threshold
+ set with mobi_set_scratch_threshold(), otherwise, or if mapping fails, it is taken from
+ the pool of calling thread or allocated on heap.
+ Contents of new buffer are undefined, its size may be larger than requested.
+ 
+ @param[in,out] scratch MOBIScratch structure to be initialized
+ @param[in] size Buffer size
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_scratch_alloc(MOBIScratch *scratch, const size_t size) {
+    scratch->size = size;
+    scratch->mapped = false;
+#if defined(MOBI_SCRATCH_WIN32) || defined(MOBI_SCRATCH_MMAP)
+    if (scratch_threshold && size >= scratch_threshold) {
+        if (mobi_scratch_map(scratch) == MOBI_SUCCESS) {
+            scratch->mapped = true;
+            return MOBI_SUCCESS;
+        }
+        debug_print("%s", "Falling back to heap allocation\n");
+    }
+#endif
+#ifdef MOBI_THREAD_LOCAL
+    if (scratch_pool_max && mobi_scratch_pool_get(scratch, size)) {
+        return MOBI_SUCCESS;
+    }
+#endif
+    scratch->data = malloc(size);
+    if (scratch->data == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Release temporary buffer allocated with mobi_scratch_alloc()
+ 
+ Heap buffer is kept in the pool of calling thread if pooling is enabled with mobi_set_scratch_pool().
+ 
+ @param[in,out] scratch MOBIScratch structure
+ */
+void mobi_scratch_free(MOBIScratch *scratch) {
+    if (scratch->data == NULL) {
+        return;
+    }
+#if defined(MOBI_SCRATCH_MMAP)
+    if (scratch->mapped) {
+        munmap(scratch->data, scratch->size);
+        scratch->data = NULL;
+        return;
+    }
+#elif defined(MOBI_SCRATCH_WIN32)
+    if (scratch->mapped) {
+        UnmapViewOfFile(scratch->data);
+        CloseHandle(scratch->mapping);
+        scratch->data = NULL;
+        return;
+    }
+#endif
+#ifdef MOBI_THREAD_LOCAL
+    if (scratch_pool_max && mobi_scratch_pool_put(scratch)) {
+        scratch->data = NULL;
+        return;
+    }
+#endif
+    free(scratch->data);
+    scratch->data = NULL;
+}
@@ -0,0 +1,48 @@
+/** @file scratch.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_scratch_h
+#define libmobi_scratch_h
+
+#include "config.h"
+#include "mobi.h"
+
+#if defined(_WIN32)
+# define MOBI_SCRATCH_WIN32
+# include <windows.h>
+#elif defined(HAVE_SYS_MMAN_H) && defined(HAVE_MKSTEMP)
+# define MOBI_SCRATCH_MMAP
+#endif
+
+/* per-thread pool of heap buffers requires compiler support for thread local storage */
+#if defined(_MSC_VER)
+# define MOBI_THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+# define MOBI_THREAD_LOCAL __thread
+#endif
+
+#define MOBI_SCRATCH_POOL_SLOTS 4 /**< Maximal number of buffers kept in each thread's pool */
+
+/**
+ @brief Temporary buffer, either allocated on heap or mapped from unlinked temporary file
+ */
+typedef struct {
+    unsigned char *data; /**< Buffer data */
+    size_t size; /**< Buffer size */
+    bool mapped; /**< True if buffer is backed by temporary file */
+#if defined(MOBI_SCRATCH_WIN32)
+    HANDLE mapping; /**< File mapping handle */
+#endif
+} MOBIScratch;
+
+MOBI_RET mobi_scratch_alloc(MOBIScratch *scratch, const size_t size);
+void mobi_scratch_free(MOBIScratch *scratch);
+
+#endif
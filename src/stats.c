@@ -0,0 +1,582 @@
+/** @file stats.c
+ *  @brief Streaming statistics of document text and resources
+ *
+ * Decompressed text records are passed through a scanner that skips tags
+ * and counts characters, words and image references, without building MOBIRawml.
+ * Text records are split into ranges processed in parallel. A range starts
+ * in unknown state, so its scanner waits for the first tag delimiter. Bytes
+ * before it are kept and scanned later with the state where previous range ended.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "stats.h"
+#include "thread.h"
+#include "util.h"
+#include "read.h"
+#include "debug.h"
+
+/**
+ @brief State of statistics scanner
+ */
+typedef enum {
+    STATS_TEXT, /**< In text */
+    STATS_TAG, /**< Inside tag */
+    STATS_ENTITY /**< Inside character entity */
+} MOBIStatsState;
+
+/**
+ @brief Statistics scanner
+ */
+typedef struct {
+    MOBIStatsState state; /**< Current state */
+    bool utf8; /**< Text is UTF-8 encoded, cp1252 otherwise */
+    bool in_word; /**< Last character belongs to a word */
+    bool broken; /**< Word break was found since start of scanning */
+    bool leading_word; /**< Word was started before first word break */
+    bool tag_name_done; /**< Whole tag name was read */
+    size_t tag_length; /**< Length of tag name */
+    char tag[MOBI_STATS_TAGNAME_MAX + 1]; /**< Lowercase tag name */
+    size_t entity_length; /**< Length of current entity */
+    size_t characters; /**< Number of characters */
+    size_t words; /**< Number of words */
+    size_t images; /**< Number of image tags */
+} MOBIStatsScanner;
+
+/**
+ @brief Data shared by statistics jobs
+ */
+typedef struct {
+    const MOBIData *m; /**< MOBIData structure */
+    const MOBIHuffCdic *huffcdic; /**< Parsed huff/cdic tables or NULL */
+    uint16_t extra_flags; /**< Flags of trailing entries of text records */
+    size_t first_record; /**< Sequence number of the first text record */
+    size_t max_record_size; /**< Maximal size of decompressed text record */
+    bool direct; /**< Text records are neither compressed nor encrypted, scan them in place */
+    bool utf8; /**< Text is UTF-8 encoded */
+} MOBIStatsContext;
+
+/**
+ @brief Statistics job, range of text records
+ */
+typedef struct {
+    const MOBIStatsContext *ctx; /**< Shared data */
+    size_t first; /**< Index of the first text record in range */
+    size_t count; /**< Number of text records in range */
+    bool synced; /**< Scanner state is known */
+    unsigned char *prefix; /**< Text preceding the point where state became known */
+    size_t prefix_length; /**< Length of prefix */
+    size_t length; /**< Length of decompressed text of the range */
+    size_t *record_lengths; /**< Decompressed length of each record */
+    size_t *sync_offsets; /**< Offset in each record where scanning starts */
+    MOBIStatsScanner *snapshots; /**< Scanner state at sync offset of each record */
+    MOBIStatsScanner scanner; /**< Scanner state at the end of range */
+    MOBI_RET ret; /**< Job status */
+} MOBIStatsJob;
+
+/**
+ @brief Initialize scanner
+
+ @param[out] scanner Scanner
+ @param[in] utf8 Text is UTF-8 encoded
+ */
+static void mobi_stats_scanner_init(MOBIStatsScanner *scanner, const bool utf8) {
+    memset(scanner, 0, sizeof(MOBIStatsScanner));
+    scanner->state = STATS_TEXT;
+    scanner->utf8 = utf8;
+}
+
+/**
+ @brief Check whether tag is an inline tag, which does not split words
+
+ @param[in] name Lowercase tag name
+ @return True if inline
+ */
+static bool mobi_stats_inline_tag(const char *name) {
+    static const char *inline_tags[] = {
+        "a", "abbr", "b", "big", "cite", "code", "del", "dfn", "em", "font", "i", "ins", "kbd",
+        "mark", "q", "s", "samp", "small", "span", "strike", "strong", "sub", "sup", "tt", "u", "var"
+    };
+    for (size_t i = 0; i < sizeof(inline_tags) / sizeof(inline_tags[0]); i++) {
+        if (strcmp(name, inline_tags[i]) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ @brief Check whether character is a word separator
+
+ @param[in] c Character
+ @return True if white space
+ */
+static bool mobi_stats_space(const unsigned char c) {
+    return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\f' || c == '\v';
+}
+
+/**
+ @brief Scan character in text
+
+ @param[in,out] scanner Scanner
+ @param[in] c Character
+ */
+static void mobi_stats_text(MOBIStatsScanner *scanner, const unsigned char c) {
+    if (c == '<') {
+        scanner->state = STATS_TAG;
+        scanner->tag_length = 0;
+        scanner->tag_name_done = false;
+        return;
+    }
+    if (mobi_stats_space(c)) {
+        scanner->in_word = false;
+        scanner->broken = true;
+        return;
+    }
+    if (scanner->utf8 && (c & 0xc0) == 0x80) {
+        /* continuation byte */
+        return;
+    }
+    scanner->characters++;
+    if (c == '&') {
+        scanner->state = STATS_ENTITY;
+        scanner->entity_length = 0;
+    }
+    if (!scanner->in_word) {
+        scanner->in_word = true;
+        scanner->words++;
+        if (!scanner->broken) {
+            scanner->leading_word = true;
+        }
+    }
+}
+
+/**
+ @brief Scan character inside tag
+
+ @param[in,out] scanner Scanner
+ @param[in] c Character
+ */
+static void mobi_stats_tag(MOBIStatsScanner *scanner, const unsigned char c) {
+    if (c == '>') {
+        scanner->tag[scanner->tag_length] = '\0';
+        if (strcmp(scanner->tag, "img") == 0 || strcmp(scanner->tag, "image") == 0) {
+            scanner->images++;
+        }
+        if (!mobi_stats_inline_tag(scanner->tag)) {
+            scanner->in_word = false;
+            scanner->broken = true;
+        }
+        scanner->state = STATS_TEXT;
+        return;
+    }
+    if (scanner->tag_name_done) {
+        return;
+    }
+    if (c == '/' && scanner->tag_length == 0) {
+        /* closing tag */
+        return;
+    }
+    const bool name_char = (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') || c == ':';
+    if (name_char && scanner->tag_length < MOBI_STATS_TAGNAME_MAX) {
+        scanner->tag[scanner->tag_length++] = (char) (c | 0x20);
+    } else {
+        scanner->tag_name_done = true;
+    }
+}
+
+/**
+ @brief Scan text
+
+ @param[in,out] scanner Scanner
+ @param[in] data Text
+ @param[in] length Length of text
+ */
+static void mobi_stats_scan(MOBIStatsScanner *scanner, const unsigned char *data, const size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        const unsigned char c = data[i];
+        switch (scanner->state) {
+            case STATS_TAG:
+                mobi_stats_tag(scanner, c);
+                break;
+            case STATS_ENTITY:
+                if (c == ';') {
+                    scanner->state = STATS_TEXT;
+                } else if (c == '<' || c == '&' || mobi_stats_space(c) || ++scanner->entity_length > MOBI_STATS_ENTITY_MAX) {
+                    /* not an entity */
+                    scanner->state = STATS_TEXT;
+                    mobi_stats_text(scanner, c);
+                }
+                break;
+            default:
+                mobi_stats_text(scanner, c);
+                break;
+        }
+    }
+}
+
+/**
+ @brief Get text of a record
+
+ @param[in] ctx Shared data
+ @param[in] record Text record
+ @param[in,out] buffer Memory area of max_record_size for decompressed text
+ @param[in,out] decrypted Memory area for decrypted record, reallocated if needed
+ @param[in,out] decrypted_size Size of decrypted memory area
+ @param[out] data Text of the record, points to buffer or record data
+ @param[out] size Length of text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_stats_record(const MOBIStatsContext *ctx, const MOBIPdbRecord *record, unsigned char *buffer, unsigned char **decrypted, size_t *decrypted_size, const unsigned char **data, size_t *size) {
+    if (ctx->direct) {
+        size_t extra_size = 0;
+        if (ctx->extra_flags) {
+            extra_size = mobi_get_record_extrasize(record, ctx->extra_flags);
+            if (extra_size == MOBI_NOTSET || extra_size >= record->size) {
+                return MOBI_DATA_CORRUPT;
+            }
+        }
+        *data = record->data;
+        *size = record->size - extra_size;
+        return MOBI_SUCCESS;
+    }
+    if (mobi_is_encrypted(ctx->m) && *decrypted_size < record->size) {
+        unsigned char *tmp = realloc(*decrypted, record->size);
+        if (tmp == NULL) {
+            debug_print("%s\n", "Memory allocation failed");
+            return MOBI_MALLOC_FAILED;
+        }
+        *decrypted = tmp;
+        *decrypted_size = record->size;
+    }
+    *size = ctx->max_record_size;
+    *data = buffer;
+    return mobi_decompress_record(buffer, size, ctx->m, record, ctx->extra_flags, ctx->huffcdic, *decrypted);
+}
+
+/**
+ @brief Scan range of text records
+
+ @param[in,out] job Statistics job
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_stats_job_run(MOBIStatsJob *job) {
+    const MOBIStatsContext *ctx = job->ctx;
+    job->record_lengths = malloc(job->count * sizeof(*job->record_lengths));
+    job->sync_offsets = malloc(job->count * sizeof(*job->sync_offsets));
+    job->snapshots = malloc(job->count * sizeof(*job->snapshots));
+    unsigned char *buffer = ctx->direct ? NULL : malloc(ctx->max_record_size);
+    if (job->record_lengths == NULL || job->sync_offsets == NULL || job->snapshots == NULL || (!ctx->direct && buffer == NULL)) {
+        free(buffer);
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    unsigned char *decrypted = NULL;
+    size_t decrypted_size = 0;
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(ctx->m, ctx->first_record + job->first);
+    MOBI_RET ret = MOBI_SUCCESS;
+    for (size_t i = 0; i < job->count; i++) {
+        if (curr == NULL) {
+            debug_print("Text record %zu not found\n", job->first + i);
+            ret = MOBI_DATA_CORRUPT;
+            break;
+        }
+        const unsigned char *data;
+        size_t size;
+        ret = mobi_stats_record(ctx, curr, buffer, &decrypted, &decrypted_size, &data, &size);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        size_t offset = 0;
+        if (!job->synced) {
+            while (offset < size && data[offset] != '<' && data[offset] != '>') {
+                offset++;
+            }
+            if (offset < size) {
+                /* tag end belongs to prefix, tag start does not */
+                if (data[offset] == '>') {
+                    offset++;
+                }
+                job->synced = true;
+            }
+            if (offset > 0) {
+                unsigned char *tmp = realloc(job->prefix, job->prefix_length + offset);
+                if (tmp == NULL) {
+                    debug_print("%s\n", "Memory allocation failed");
+                    ret = MOBI_MALLOC_FAILED;
+                    break;
+                }
+                job->prefix = tmp;
+                memcpy(job->prefix + job->prefix_length, data, offset);
+                job->prefix_length += offset;
+            }
+        }
+        job->record_lengths[i] = size;
+        job->sync_offsets[i] = offset;
+        job->snapshots[i] = job->scanner;
+        mobi_stats_scan(&job->scanner, data + offset, size - offset);
+        job->length += size;
+        curr = curr->next;
+    }
+    free(buffer);
+    free(decrypted);
+    return ret;
+}
+
+/**
+ @brief Thread entry point of statistics job
+
+ @param[in,out] arg MOBIStatsJob structure
+ @return NULL
+ */
+static void * mobi_stats_thread(void *arg) {
+    MOBIStatsJob *job = arg;
+    job->ret = mobi_stats_job_run(job);
+    return NULL;
+}
+
+/**
+ @brief Rescan part of record in range ending inside this record
+
+ @param[in] job Statistics job
+ @param[in] index Index of record in range
+ @param[in] end Offset in record where text ends
+ @param[out] scanner Scanner state at the end of text
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_stats_partial(const MOBIStatsJob *job, const size_t index, const size_t end, MOBIStatsScanner *scanner) {
+    const MOBIStatsContext *ctx = job->ctx;
+    const MOBIPdbRecord *record = mobi_get_record_by_seqnumber(ctx->m, ctx->first_record + job->first + index);
+    if (record == NULL) {
+        return MOBI_DATA_CORRUPT;
+    }
+    unsigned char *buffer = ctx->direct ? NULL : malloc(ctx->max_record_size);
+    if (!ctx->direct && buffer == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    unsigned char *decrypted = NULL;
+    size_t decrypted_size = 0;
+    const unsigned char *data;
+    size_t size;
+    MOBI_RET ret = mobi_stats_record(ctx, record, buffer, &decrypted, &decrypted_size, &data, &size);
+    if (ret == MOBI_SUCCESS) {
+        *scanner = job->snapshots[index];
+        const size_t offset = job->sync_offsets[index];
+        if (end > offset && end <= size) {
+            mobi_stats_scan(scanner, data + offset, end - offset);
+        }
+    }
+    free(buffer);
+    free(decrypted);
+    return ret;
+}
+
+/**
+ @brief Join results of ranges, limited to given text length
+
+ @param[in] jobs Finished statistics jobs
+ @param[in] jobs_count Number of jobs
+ @param[in] limit Length of text to be counted
+ @param[in,out] stats Statistics
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_stats_merge(const MOBIStatsJob *jobs, const size_t jobs_count, const size_t limit, MOBIStats *stats) {
+    MOBIStatsScanner carry;
+    mobi_stats_scanner_init(&carry, jobs[0].ctx->utf8);
+    size_t position = 0;
+    for (size_t k = 0; k < jobs_count && position < limit; k++) {
+        const MOBIStatsJob *job = &jobs[k];
+        if (job->ret != MOBI_SUCCESS) {
+            return job->ret;
+        }
+        /* prefix is scanned with the state where previous range ended */
+        if (position + job->prefix_length >= limit) {
+            mobi_stats_scan(&carry, job->prefix, limit - position);
+            position = limit;
+            break;
+        }
+        mobi_stats_scan(&carry, job->prefix, job->prefix_length);
+        if (!job->synced) {
+            position += job->length;
+            continue;
+        }
+        MOBIStatsScanner partial;
+        const MOBIStatsScanner *scanner = &job->scanner;
+        if (position + job->length > limit) {
+            size_t index = 0;
+            size_t record_start = position;
+            while (record_start + job->record_lengths[index] <= limit) {
+                record_start += job->record_lengths[index++];
+            }
+            MOBI_RET ret = mobi_stats_partial(job, index, limit - record_start, &partial);
+            if (ret != MOBI_SUCCESS) {
+                return ret;
+            }
+            scanner = &partial;
+        }
+        /* word started at range sync point may continue word from previous range */
+        size_t words = carry.words + scanner->words;
+        if (carry.in_word && scanner->leading_word) {
+            words--;
+        }
+        const size_t characters = carry.characters + scanner->characters;
+        const size_t images = carry.images + scanner->images;
+        carry = *scanner;
+        carry.words = words;
+        carry.characters = characters;
+        carry.images = images;
+        position += job->length;
+    }
+    stats->text_length = position < limit ? position : limit;
+    stats->characters = carry.characters;
+    stats->words = carry.words;
+    stats->image_references = carry.images;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Count resources by type
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in,out] stats Statistics
+ */
+static void mobi_stats_resources(const MOBIData *m, MOBIStats *stats) {
+    size_t first_res_seqnumber = mobi_get_first_resource_record(m);
+    if (first_res_seqnumber == MOBI_NOTSET) {
+        /* search all records */
+        first_res_seqnumber = 0;
+    }
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, first_res_seqnumber);
+    while (curr != NULL) {
+        const MOBIFiletype filetype = mobi_determine_resource_type(curr);
+        if (filetype == T_BREAK) {
+            break;
+        }
+        curr = curr->next;
+        switch (filetype) {
+            case T_UNKNOWN:
+                continue;
+            case T_JPG:
+            case T_GIF:
+            case T_PNG:
+            case T_BMP:
+                stats->images++;
+                break;
+            case T_FONT:
+            case T_OTF:
+            case T_TTF:
+                stats->fonts++;
+                break;
+            case T_AUDIO:
+            case T_MP3:
+                stats->audio++;
+                break;
+            case T_VIDEO:
+            case T_MPG:
+                stats->video++;
+                break;
+            default:
+                break;
+        }
+        stats->resources++;
+    }
+}
+
+/**
+ @brief Get length of main markup flow
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return Length of first FDST section, SIZE_MAX if whole text is markup
+ */
+static size_t mobi_stats_text_limit(const MOBIData *m) {
+    if (!mobi_exists_fdst(m) || m->mh->fdst_section_count == NULL || *m->mh->fdst_section_count <= 1) {
+        return SIZE_MAX;
+    }
+    MOBIRawml rawml;
+    memset(&rawml, 0, sizeof(MOBIRawml));
+    if (mobi_parse_fdst(m, &rawml) != MOBI_SUCCESS) {
+        return SIZE_MAX;
+    }
+    const size_t limit = rawml.fdst->fdst_section_ends[0];
+    mobi_free_fdst(rawml.fdst);
+    return limit;
+}
+
+/**
+ @brief Compute statistics of document text and resources
+
+ Text records are decompressed one at a time in worker threads and scanned for
+ characters, words and image tags outside of markup. Flows following main
+ markup (css, svg) are not counted. Resource records are counted by type.
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] stats Statistics
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_compute_stats(const MOBIData *m, MOBIStats *stats) {
+    if (m == NULL || stats == NULL) {
+        debug_print("%s", "Structures not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (mobi_is_encrypted(m) && m->drm_key == NULL) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    memset(stats, 0, sizeof(MOBIStats));
+    mobi_stats_resources(m, stats);
+
+    MOBIStatsContext ctx;
+    ctx.m = m;
+    ctx.huffcdic = NULL;
+    ctx.extra_flags = (m->mh && m->mh->extra_flags) ? *m->mh->extra_flags : 0;
+    ctx.first_record = 1 + mobi_get_kf8offset(m);
+    ctx.max_record_size = mobi_get_textrecord_maxsize(m);
+    ctx.direct = m->rh->compression_type == RECORD0_NO_COMPRESSION && !mobi_is_encrypted(m);
+    ctx.utf8 = !mobi_is_cp1252(m);
+    if (m->rh->compression_type == RECORD0_HUFF_COMPRESSION) {
+        MOBI_RET ret = mobi_get_huffcdic(m, &ctx.huffcdic);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    const size_t records_count = m->rh->text_record_count;
+    const size_t jobs_count = mobi_jobs_count(records_count, MOBI_STATS_JOB_MIN);
+    MOBIStatsJob *jobs = calloc(jobs_count, sizeof(MOBIStatsJob));
+    if (jobs == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t i = 0; i < jobs_count; i++) {
+        jobs[i].ctx = &ctx;
+        jobs[i].first = records_count * i / jobs_count;
+        jobs[i].count = records_count * (i + 1) / jobs_count - jobs[i].first;
+        mobi_stats_scanner_init(&jobs[i].scanner, ctx.utf8);
+    }
+    /* state at text start is known */
+    jobs[0].synced = true;
+    mobi_run_jobs(jobs, sizeof(MOBIStatsJob), jobs_count, mobi_stats_thread);
+    MOBI_RET ret = mobi_stats_merge(jobs, jobs_count, mobi_stats_text_limit(m), stats);
+    for (size_t i = 0; i < jobs_count; i++) {
+        free(jobs[i].prefix);
+        free(jobs[i].record_lengths);
+        free(jobs[i].sync_offsets);
+        free(jobs[i].snapshots);
+    }
+    free(jobs);
+    if (ret == MOBI_SUCCESS) {
+        stats->reading_time = (stats->words + MOBI_STATS_WPM - 1) / MOBI_STATS_WPM;
+    }
+    return ret;
+}
@@ -0,0 +1,27 @@
+/** @file stats.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_stats_h
+#define libmobi_stats_h
+
+#include "config.h"
+#include "mobi.h"
+
+/**
+ @defgroup mobi_stats Params of statistics pass
+ @{
+ */
+#define MOBI_STATS_WPM 250 /**< Reading speed in words per minute used for reading time */
+#define MOBI_STATS_JOB_MIN 16 /**< Minimal number of text records worth a separate thread */
+#define MOBI_STATS_TAGNAME_MAX 8 /**< Maximal length of tag name recognized by statistics scanner */
+#define MOBI_STATS_ENTITY_MAX 10 /**< Maximal length of character entity */
+/** @} */
+
+#endif
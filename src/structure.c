@@ -485,7 +485,8 @@ MOBIFragment * mobi_list_insert(MOBIFragment *curr, size_t raw_offset, unsigned
             new->size = tmp.size;
             new->is_malloc = tmp.is_malloc;
             new->next = tmp.next;
-            return curr;
+            /* new chunk is now stored in curr, old one in new */
+            new = curr;
         }
     } else if (curr->raw_offset + curr->size == offset) {
         /* append chunk */
@@ -0,0 +1,405 @@
+/** @file thread.c
+ *  @brief Minimal portable threads layer
+ *
+ * Wraps Windows or Posix threads. If library is built without threads
+ * support, thread creation fails with MOBI_INIT_FAILED and callers are
+ * expected to run the work in the calling thread.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdlib.h>
+#include "thread.h"
+#if defined(MOBI_THREADS_WIN32)
+#include <process.h>
+#elif defined(MOBI_THREADS_POSIX)
+#include <unistd.h>
+#endif
+#include "debug.h"
+
+/**
+ @brief Check whether library was built with threads support
+
+ @return True if threads are supported
+ */
+bool mobi_threads_available(void) {
+#if defined(MOBI_THREADS_WIN32) || defined(MOBI_THREADS_POSIX)
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ @brief Number of threads set with mobi_set_threads_count(), 0 if not set
+ */
+static size_t threads_count = 0;
+
+/**
+ @brief Set number of threads used by routines that split work into parallel jobs
+
+ Results do not depend on the number of threads, it may be limited to save resources.
+ Count is read each time a routine splits its work, so it also applies to documents already loaded.
+
+ @param[in] count Number of threads, 0 (default) uses number of online processors
+ @return MOBI_RET status code, MOBI_INIT_FAILED if count is above 1 and threads are not supported
+ */
+MOBI_RET mobi_set_threads_count(const size_t count) {
+    if (count > 1 && !mobi_threads_available()) {
+        return MOBI_INIT_FAILED;
+    }
+    threads_count = count;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get number of threads to be used, set with mobi_set_threads_count() or number of online processors
+
+ @return Number of threads, 1 if unknown or threads are not supported
+ */
+size_t mobi_threads_count(void) {
+    if (threads_count) {
+        return threads_count;
+    }
+#if defined(MOBI_THREADS_WIN32)
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    if (info.dwNumberOfProcessors > 0) {
+        return (size_t) info.dwNumberOfProcessors;
+    }
+#elif defined(MOBI_THREADS_POSIX) && defined(_SC_NPROCESSORS_ONLN)
+    const long count = sysconf(_SC_NPROCESSORS_ONLN);
+    if (count > 0) {
+        return (size_t) count;
+    }
+#endif
+    return 1;
+}
+
+#if defined(MOBI_THREADS_WIN32)
+/**
+ @brief Windows thread entry point trampoline
+
+ Temporary buffers pooled by the thread are released on exit.
+
+ @param[in,out] arg MOBIThread structure
+ @return Zero
+ */
+static unsigned __stdcall mobi_thread_start(void *arg) {
+    MOBIThread *thread = arg;
+    thread->result = thread->func(thread->arg);
+    mobi_release_scratch_pool();
+    return 0;
+}
+#elif defined(MOBI_THREADS_POSIX)
+/**
+ @brief Posix thread entry point trampoline
+
+ Temporary buffers pooled by the thread are released on exit.
+
+ @param[in,out] arg MOBIThread structure
+ @return NULL
+ */
+static void * mobi_thread_start(void *arg) {
+    MOBIThread *thread = arg;
+    thread->result = thread->func(thread->arg);
+    mobi_release_scratch_pool();
+    return NULL;
+}
+#endif
+
+/**
+ @brief Start new thread
+
+ MOBIThread structure must stay valid until mobi_thread_join() returns.
+
+ @param[in,out] thread MOBIThread structure
+ @param[in] func Thread entry point
+ @param[in] arg Argument passed to entry point
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_thread_create(MOBIThread *thread, MOBIThreadFunc func, void *arg) {
+    if (thread == NULL || func == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    thread->func = func;
+    thread->arg = arg;
+    thread->result = NULL;
+#if defined(MOBI_THREADS_WIN32)
+    thread->handle = (HANDLE) _beginthreadex(NULL, 0, mobi_thread_start, thread, 0, NULL);
+    if (thread->handle == 0) {
+        debug_print("%s", "Thread creation failed\n");
+        return MOBI_INIT_FAILED;
+    }
+    return MOBI_SUCCESS;
+#elif defined(MOBI_THREADS_POSIX)
+    if (pthread_create(&thread->handle, NULL, mobi_thread_start, thread) != 0) {
+        debug_print("%s", "Thread creation failed\n");
+        return MOBI_INIT_FAILED;
+    }
+    return MOBI_SUCCESS;
+#else
+    return MOBI_INIT_FAILED;
+#endif
+}
+
+/**
+ @brief Wait for thread to finish
+
+ @param[in,out] thread MOBIThread structure started with mobi_thread_create()
+ @return Value returned by thread entry point
+ */
+void * mobi_thread_join(MOBIThread *thread) {
+#if defined(MOBI_THREADS_WIN32)
+    WaitForSingleObject(thread->handle, INFINITE);
+    CloseHandle(thread->handle);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_join(thread->handle, NULL);
+#endif
+    return thread->result;
+}
+
+/**
+ @brief Initialize mutex
+
+ @param[in,out] mutex MOBIMutex structure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_mutex_init(MOBIMutex *mutex) {
+#if defined(MOBI_THREADS_WIN32)
+    InitializeCriticalSection(&mutex->lock);
+#elif defined(MOBI_THREADS_POSIX)
+    if (pthread_mutex_init(&mutex->lock, NULL) != 0) {
+        debug_print("%s", "Mutex initialization failed\n");
+        return MOBI_INIT_FAILED;
+    }
+#endif
+    mutex->unused = 0;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Lock mutex
+
+ @param[in,out] mutex MOBIMutex structure
+ */
+void mobi_mutex_lock(MOBIMutex *mutex) {
+#if defined(MOBI_THREADS_WIN32)
+    EnterCriticalSection(&mutex->lock);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_mutex_lock(&mutex->lock);
+#else
+    (void) mutex;
+#endif
+}
+
+/**
+ @brief Unlock mutex
+
+ @param[in,out] mutex MOBIMutex structure
+ */
+void mobi_mutex_unlock(MOBIMutex *mutex) {
+#if defined(MOBI_THREADS_WIN32)
+    LeaveCriticalSection(&mutex->lock);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_mutex_unlock(&mutex->lock);
+#else
+    (void) mutex;
+#endif
+}
+
+/**
+ @brief Release mutex resources
+
+ @param[in,out] mutex MOBIMutex structure
+ */
+void mobi_mutex_destroy(MOBIMutex *mutex) {
+#if defined(MOBI_THREADS_WIN32)
+    DeleteCriticalSection(&mutex->lock);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_mutex_destroy(&mutex->lock);
+#else
+    (void) mutex;
+#endif
+}
+
+/**
+ @brief Initialize condition variable
+
+ @param[in,out] cond MOBICond structure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_cond_init(MOBICond *cond) {
+#if defined(MOBI_THREADS_WIN32)
+    InitializeConditionVariable(&cond->cond);
+#elif defined(MOBI_THREADS_POSIX)
+    if (pthread_cond_init(&cond->cond, NULL) != 0) {
+        debug_print("%s", "Condition variable initialization failed\n");
+        return MOBI_INIT_FAILED;
+    }
+#endif
+    cond->unused = 0;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Wait on condition variable
+
+ Mutex must be locked by calling thread.
+
+ @param[in,out] cond MOBICond structure
+ @param[in,out] mutex MOBIMutex structure
+ */
+void mobi_cond_wait(MOBICond *cond, MOBIMutex *mutex) {
+#if defined(MOBI_THREADS_WIN32)
+    SleepConditionVariableCS(&cond->cond, &mutex->lock, INFINITE);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_cond_wait(&cond->cond, &mutex->lock);
+#else
+    (void) cond;
+    (void) mutex;
+#endif
+}
+
+/**
+ @brief Wake one thread waiting on condition variable
+
+ @param[in,out] cond MOBICond structure
+ */
+void mobi_cond_signal(MOBICond *cond) {
+#if defined(MOBI_THREADS_WIN32)
+    WakeConditionVariable(&cond->cond);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_cond_signal(&cond->cond);
+#else
+    (void) cond;
+#endif
+}
+
+/**
+ @brief Wake all threads waiting on condition variable
+
+ @param[in,out] cond MOBICond structure
+ */
+void mobi_cond_broadcast(MOBICond *cond) {
+#if defined(MOBI_THREADS_WIN32)
+    WakeAllConditionVariable(&cond->cond);
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_cond_broadcast(&cond->cond);
+#else
+    (void) cond;
+#endif
+}
+
+/**
+ @brief Release condition variable resources
+
+ @param[in,out] cond MOBICond structure
+ */
+void mobi_cond_destroy(MOBICond *cond) {
+#if defined(MOBI_THREADS_WIN32)
+    (void) cond;
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_cond_destroy(&cond->cond);
+#else
+    (void) cond;
+#endif
+}
+
+/**
+ @brief Read pointer shared between threads
+
+ Pairs with mobi_atomic_init_ptr(), data published with it is visible to calling thread.
+ Without compiler support for atomics plain read is used.
+
+ @param[in] ptr Pointer to shared pointer
+ @return Value of shared pointer
+ */
+void * mobi_atomic_load_ptr(void **ptr) {
+#if defined(__GNUC__)
+    return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+#elif defined(MOBI_THREADS_WIN32)
+    return InterlockedCompareExchangePointer((PVOID volatile *) ptr, NULL, NULL);
+#else
+    return *ptr;
+#endif
+}
+
+/**
+ @brief Set pointer shared between threads, if it is not set yet
+
+ If other thread has already set the pointer, it is left unchanged
+ and the caller is expected to release its value.
+
+ @param[in,out] ptr Pointer to shared pointer
+ @param[in] value New value
+ @return True if pointer was set to value, false if it already held other value
+ */
+bool mobi_atomic_init_ptr(void **ptr, void *value) {
+#if defined(__GNUC__)
+    void *expected = NULL;
+    return __atomic_compare_exchange_n(ptr, &expected, value, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+#elif defined(MOBI_THREADS_WIN32)
+    return InterlockedCompareExchangePointer((PVOID volatile *) ptr, value, NULL) == NULL;
+#else
+    if (*ptr != NULL) {
+        return false;
+    }
+    *ptr = value;
+    return true;
+#endif
+}
+
+/**
+ @brief Number of parallel jobs for given amount of work
+
+ @param[in] items Number of work items
+ @param[in] min_items Minimal number of items worth a separate job
+ @return Number of jobs, at least one
+ */
+size_t mobi_jobs_count(const size_t items, const size_t min_items) {
+    size_t count = mobi_threads_count();
+    if (count > items / min_items) {
+        count = items / min_items;
+    }
+    return count ? count : 1;
+}
+
+/**
+ @brief Run jobs in worker threads
+
+ Every job but the first one gets its own thread. First job and jobs
+ whose thread can't be started are run in the calling thread.
+
+ @param[in,out] jobs Array of job structures
+ @param[in] job_size Size of job structure
+ @param[in] count Number of jobs
+ @param[in] func Thread entry point, called with pointer to job structure
+ */
+void mobi_run_jobs(void *jobs, const size_t job_size, const size_t count, MOBIThreadFunc func) {
+    unsigned char *job = jobs;
+    MOBIThread *threads = count > 1 ? calloc(count, sizeof(MOBIThread)) : NULL;
+    bool *started = count > 1 ? calloc(count, sizeof(bool)) : NULL;
+    if (threads && started) {
+        for (size_t i = 1; i < count; i++) {
+            started[i] = mobi_thread_create(&threads[i], func, job + i * job_size) == MOBI_SUCCESS;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        if (started == NULL || threads == NULL || !started[i]) {
+            func(job + i * job_size);
+        }
+    }
+    for (size_t i = 1; threads && started && i < count; i++) {
+        if (started[i]) {
+            mobi_thread_join(&threads[i]);
+        }
+    }
+    free(threads);
+    free(started);
+}
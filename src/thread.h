@@ -0,0 +1,86 @@
+/** @file thread.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#ifndef libmobi_thread_h
+#define libmobi_thread_h
+
+#include "config.h"
+#include "mobi.h"
+
+#if defined(_WIN32)
+# define MOBI_THREADS_WIN32
+# include <windows.h>
+#elif defined(USE_PTHREAD)
+# define MOBI_THREADS_POSIX
+# include <pthread.h>
+#endif
+
+/**
+ @brief Thread entry point
+ */
+typedef void * (*MOBIThreadFunc)(void *arg);
+
+/**
+ @brief Thread handle
+ */
+typedef struct {
+#if defined(MOBI_THREADS_WIN32)
+    HANDLE handle; /**< Windows thread handle */
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_t handle; /**< Posix thread handle */
+#endif
+    MOBIThreadFunc func; /**< Thread entry point */
+    void *arg; /**< Argument passed to entry point */
+    void *result; /**< Value returned by entry point */
+} MOBIThread;
+
+/**
+ @brief Mutex, no-op if library is built without threads support
+ */
+typedef struct {
+#if defined(MOBI_THREADS_WIN32)
+    CRITICAL_SECTION lock; /**< Windows critical section */
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_mutex_t lock; /**< Posix mutex */
+#endif
+    int unused; /**< Keeps structure non-empty */
+} MOBIMutex;
+
+/**
+ @brief Condition variable, no-op if library is built without threads support
+ */
+typedef struct {
+#if defined(MOBI_THREADS_WIN32)
+    CONDITION_VARIABLE cond; /**< Windows condition variable */
+#elif defined(MOBI_THREADS_POSIX)
+    pthread_cond_t cond; /**< Posix condition variable */
+#endif
+    int unused; /**< Keeps structure non-empty */
+} MOBICond;
+
+bool mobi_threads_available(void);
+size_t mobi_threads_count(void);
+MOBI_RET mobi_thread_create(MOBIThread *thread, MOBIThreadFunc func, void *arg);
+void * mobi_thread_join(MOBIThread *thread);
+MOBI_RET mobi_mutex_init(MOBIMutex *mutex);
+void mobi_mutex_lock(MOBIMutex *mutex);
+void mobi_mutex_unlock(MOBIMutex *mutex);
+void mobi_mutex_destroy(MOBIMutex *mutex);
+MOBI_RET mobi_cond_init(MOBICond *cond);
+void mobi_cond_wait(MOBICond *cond, MOBIMutex *mutex);
+void mobi_cond_signal(MOBICond *cond);
+void mobi_cond_broadcast(MOBICond *cond);
+void mobi_cond_destroy(MOBICond *cond);
+void * mobi_atomic_load_ptr(void **ptr);
+bool mobi_atomic_init_ptr(void **ptr, void *value);
+size_t mobi_jobs_count(const size_t items, const size_t min_items);
+void mobi_run_jobs(void *jobs, const size_t job_size, const size_t count, MOBIThreadFunc func);
+
+#endif
@@ -20,7 +20,9 @@
 #include "util.h"
 #include "parse_rawml.h"
 #include "index.h"
+#include "read.h"
 #include "debug.h"
+#include "scratch.h"
 
 #ifdef USE_ENCRYPTION
 #include "encryption.h"
@@ -30,6 +32,19 @@
 #include "opf.h"
 #endif
 
+/* ascii runs of utf-8 text are skipped in blocks of 32 bytes */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+# include <emmintrin.h>
+# define UTF8_BLOCK 32
+# define utf8_block_is_ascii(p) (_mm_movemask_epi8(_mm_or_si128(_mm_loadu_si128((const __m128i *) (p)), _mm_loadu_si128((const __m128i *) ((p) + 16)))) == 0)
+#elif defined(__aarch64__) && (defined(__ARM_NEON) || defined(__ARM_NEON__))
+# include <arm_neon.h>
+# define UTF8_BLOCK 32
+# define utf8_block_is_ascii(p) (vmaxvq_u8(vorrq_u8(vld1q_u8(p), vld1q_u8((p) + 16))) < 0x80)
+#endif
+/* shorter ascii runs between multibyte sequences are checked byte by byte */
+#define UTF8_ASCII_RUN 16
+
 /** @brief Lookup table for cp1252 to utf8 encoding conversion */
 static const unsigned char cp1252_to_utf8[32][3] = {
     {0xe2,0x82,0xac},
@@ -152,9 +167,10 @@ MOBI_RET mobi_cp1252_to_utf8(char *output, const char *input, size_t *outsize, c
             }
             if (i == 0) {
                 /* unmappable character in input */
-                /* substitute with utf-8 replacement character */
-                *out++ = 0xff;
-                *out++ = 0xfd;
+                /* substitute with utf-8 replacement character U+FFFD */
+                *out++ = 0xef;
+                *out++ = 0xbf;
+                *out++ = 0xbd;
                 debug_print("Invalid character found: %c\n", *in);
             }
             in++;
@@ -173,6 +189,171 @@ MOBI_RET mobi_cp1252_to_utf8(char *output, const char *input, size_t *outsize, c
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Get length of ascii run at the start of utf-8 data
+ 
+ @param[in] data Utf-8 data
+ @param[in] length Data length
+ @return Number of leading ascii bytes
+ */
+static size_t mobi_utf8_ascii_length(const unsigned char *data, const size_t length) {
+    size_t i = 0;
+#ifdef UTF8_BLOCK
+    while (i + UTF8_BLOCK <= length && utf8_block_is_ascii(data + i)) {
+        i += UTF8_BLOCK;
+    }
+#else
+    while (i + sizeof(uint64_t) <= length) {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(word));
+        if (word & 0x8080808080808080ULL) {
+            break;
+        }
+        i += sizeof(word);
+    }
+#endif
+    while (i < length && data[i] < 0x80) {
+        i++;
+    }
+    return i;
+}
+
+/**
+ @brief Check utf-8 sequence starting with non-ascii byte
+ 
+ Overlong forms, surrogates and code points above U+10FFFF are invalid.
+ 
+ @param[in] data Sequence data, first byte must be non-ascii
+ @param[in] length Length of available data
+ @param[out] invalid_length Set to length of maximal subpart of invalid sequence
+ @return Sequence length if valid, zero otherwise
+ */
+static size_t mobi_utf8_sequence(const unsigned char *data, const size_t length, size_t *invalid_length) {
+    const unsigned char c = data[0];
+    unsigned char lower = 0x80;
+    unsigned char upper = 0xbf;
+    size_t count;
+    if (c >= 0xc2 && c <= 0xdf) {
+        count = 2;
+    } else if (c >= 0xe0 && c <= 0xef) {
+        count = 3;
+        if (c == 0xe0) { lower = 0xa0; }
+        else if (c == 0xed) { upper = 0x9f; }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+        count = 4;
+        if (c == 0xf0) { lower = 0x90; }
+        else if (c == 0xf4) { upper = 0x8f; }
+    } else {
+        *invalid_length = 1;
+        return 0;
+    }
+    for (size_t i = 1; i < count; i++) {
+        if (i >= length || data[i] < lower || data[i] > upper) {
+            *invalid_length = i;
+            return 0;
+        }
+        lower = 0x80;
+        upper = 0xbf;
+    }
+    return count;
+}
+
+/**
+ @brief Find first invalid sequence in utf-8 data
+ 
+ @param[in] data Utf-8 data
+ @param[in] length Data length
+ @return Offset of first invalid sequence, length if data is valid
+ */
+size_t mobi_utf8_validate(const unsigned char *data, const size_t length) {
+    size_t i = 0;
+    size_t invalid_length;
+    while (i < length) {
+        i += mobi_utf8_ascii_length(data + i, length - i);
+        size_t ascii = 0;
+        while (i < length && ascii < UTF8_ASCII_RUN) {
+            if (data[i] < 0x80) {
+                ascii++;
+                i++;
+                continue;
+            }
+            ascii = 0;
+            const size_t count = mobi_utf8_sequence(data + i, length - i, &invalid_length);
+            if (count == 0) {
+                return i;
+            }
+            i += count;
+        }
+    }
+    return length;
+}
+
+/**
+ @brief Replace invalid sequences in utf-8 data with U+FFFD
+ 
+ Every maximal subpart of invalid sequence is replaced with single
+ replacement character, as recommended by Unicode standard.
+ Valid data is left untouched. Replacement is never shorter than
+ replaced subpart, so otherwise buffer is reallocated once to repaired size,
+ unchecked tail is moved to its end and repaired in place.
+ 
+ @param[in,out] data Pointer to allocated data, may be reallocated
+ @param[in,out] length Data length, will be set to repaired data length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_utf8_repair(unsigned char **data, size_t *length) {
+    if (data == NULL || *data == NULL || length == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    const size_t size = *length;
+    const size_t start = mobi_utf8_validate(*data, size);
+    if (start == size) {
+        return MOBI_SUCCESS;
+    }
+    size_t invalid_length;
+    size_t repaired_size = start;
+    size_t i = start;
+    while (i < size) {
+        const size_t valid = mobi_utf8_validate(*data + i, size - i);
+        i += valid;
+        repaired_size += valid;
+        if (i < size) {
+            mobi_utf8_sequence(*data + i, size - i, &invalid_length);
+            i += invalid_length;
+            repaired_size += 3;
+        }
+    }
+    debug_print("Repairing invalid utf-8 sequences, size %zu => %zu\n", size, repaired_size);
+    unsigned char *text = *data;
+    if (repaired_size > size) {
+        text = realloc(*data, repaired_size);
+        if (text == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        *data = text;
+    }
+    /* output never overtakes input, as replacement is not shorter than subpart */
+    size_t in = repaired_size - (size - start);
+    size_t out = start;
+    memmove(text + in, text + start, size - start);
+    while (in < repaired_size) {
+        const size_t valid = mobi_utf8_validate(text + in, repaired_size - in);
+        memmove(text + out, text + in, valid);
+        in += valid;
+        out += valid;
+        if (in < repaired_size) {
+            mobi_utf8_sequence(text + in, repaired_size - in, &invalid_length);
+            in += invalid_length;
+            text[out++] = 0xef;
+            text[out++] = 0xbf;
+            text[out++] = 0xbd;
+        }
+    }
+    *length = repaired_size;
+    return MOBI_SUCCESS;
+}
+
 /** @brief Decode ligature to cp1252
  
  Some latin ligatures are encoded in indices to facilitate search
@@ -1016,7 +1197,7 @@ const HTMLEntity entities[] = {
     { "&gt;", ">" },
     { "&apos;", "'" },
     { "&nbsp;", "\xc2\xa0" },
-    { "&copy;", "\xc2\a9" },
+    { "&copy;", "\xc2\xa9" },
     { "&reg;", "\xc2\xae" },
     { "&cent;", "\xc2\xa2" },
     { "&pound;", "\xc2\xa3" },
@@ -1044,6 +1225,23 @@ const HTMLEntity entities[] = {
     { "&trade;", "\xe2\x84\xa2" }
 };
 
+/**
+ @brief Get utf-8 sequence of named html entity
+ 
+ @param[in] name Entity name, without ampersand and semicolon, not null terminated
+ @param[in] length Entity name length
+ @return Null terminated utf-8 sequence, NULL if entity is not known
+ */
+const char * mobi_get_htmlentity(const char *name, const size_t length) {
+    for (size_t i = 0; i < (sizeof(entities)/sizeof(entities[0])); i++) {
+        const char *entity = entities[i].name + 1;
+        if (strncmp(entity, name, length) == 0 && entity[length] == ';') {
+            return entities[i].utf8_bytes;
+        }
+    }
+    return NULL;
+}
+
 /**
  @brief Convert html entities in string to utf-8 characters
  
@@ -1199,6 +1397,196 @@ int mobi_bitcount(const uint8_t byte) {
     return setbits[byte];
 }
 
+/**
+ @brief Finalize 64-bit hash, spreading all input bits over the result
+
+ @param[in] hash Hash
+ @return Mixed hash
+ */
+uint64_t mobi_mix64(uint64_t hash) {
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+/**
+ @brief Compute 64-bit hash of data
+
+ Non-cryptographic hash, data is read in 8-byte little-endian words,
+ so results don't depend on platform.
+
+ @param[in] data Data
+ @param[in] size Size of data
+ @return Hash value
+ */
+uint64_t mobi_hash64(const unsigned char *data, const size_t size) {
+    const uint64_t k1 = 0x87c37b91114253d5ULL;
+    const uint64_t k2 = 0x4cf5ad432745937fULL;
+    uint64_t hash = 0x9e3779b97f4a7c15ULL ^ (size * k1);
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        uint64_t word = 0;
+        for (size_t j = 0; j < 8; j++) {
+            word |= (uint64_t) data[i + j] << (8 * j);
+        }
+        word *= k1;
+        word = (word << 31) | (word >> 33);
+        hash ^= word * k2;
+        hash = ((hash << 27) | (hash >> 37)) * 5 + 0x52dce729;
+    }
+    uint64_t tail = 0;
+    for (size_t j = 0; i + j < size; j++) {
+        tail |= (uint64_t) data[i + j] << (8 * j);
+    }
+    hash ^= tail * k2;
+    return mobi_mix64(hash);
+}
+
+/**
+ @brief Get size of text record data without trailing entries (internal).
+ 
+ @param[in] record Text record
+ @param[in] extra_flags Flags of trailing entries at the end of text records
+ @return Size of data, MOBI_NOTSET if trailing entries are corrupt
+ */
+static size_t mobi_get_record_textsize(const MOBIPdbRecord *record, const uint16_t extra_flags) {
+    size_t extra_size = 0;
+    if (extra_flags) {
+        extra_size = mobi_get_record_extrasize(record, extra_flags);
+        if (extra_size == MOBI_NOTSET || extra_size >= record->size) {
+            return MOBI_NOTSET;
+        }
+    }
+    return record->size - extra_size;
+}
+
+#ifdef USE_ENCRYPTION
+/**
+ @brief Get size of encrypted part of text record (internal).
+ 
+ Must be called before record is decrypted.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] record Text record
+ @param[in] record_size Size of record data without trailing entries
+ @param[in] extra_flags Flags of trailing entries at the end of text records
+ @return Size of encrypted data
+ */
+static size_t mobi_get_record_decryptsize(const MOBIData *m, const MOBIPdbRecord *record, const size_t record_size, const uint16_t extra_flags) {
+    size_t decrypt_size = record_size;
+    if (m->rh->compression_type != RECORD0_HUFF_COMPRESSION) {
+        /* decrypt also multibyte extra data */
+        size_t mb_size = mobi_get_record_mb_extrasize(record, extra_flags);
+        decrypt_size += mb_size;
+    }
+    return decrypt_size;
+}
+
+/**
+ @brief Decrypt text records in place (internal).
+ 
+ Records are decrypted together, see mobi_decrypt_multi().
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] records Text records
+ @param[in] sizes Sizes of records data without trailing entries
+ @param[in] count Number of records, at most MOBI_DECRYPT_BATCH
+ @param[in] extra_flags Flags of trailing entries at the end of text records
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decrypt_records(const MOBIData *m, const MOBIPdbRecord **records, const size_t *sizes, const size_t count, const uint16_t extra_flags) {
+    unsigned char *data[MOBI_DECRYPT_BATCH];
+    size_t decrypt_sizes[MOBI_DECRYPT_BATCH];
+    for (size_t i = 0; i < count; i++) {
+        data[i] = records[i]->data;
+        decrypt_sizes[i] = mobi_get_record_decryptsize(m, records[i], sizes[i], extra_flags);
+    }
+    return mobi_decrypt_multi(data, (const unsigned char **) data, decrypt_sizes, count, m);
+}
+#endif
+
+/**
+ @brief Decompress text record data (internal).
+ 
+ @param[in,out] decompressed Memory area to be filled with decompressed output
+ @param[in,out] decompressed_size Size of the memory area, on return set to decompressed record length
+ @param[in] data Record data, decrypted
+ @param[in] record_size Size of record data without trailing entries
+ @param[in] compression_type Compression type from record 0 header
+ @param[in] huffcdic Parsed huff/cdic tables, NULL if text is not huffman compressed
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_decompress_record_data(unsigned char *decompressed, size_t *decompressed_size, const unsigned char *data, const size_t record_size, const uint16_t compression_type, const MOBIHuffCdic *huffcdic) {
+    MOBI_RET ret = MOBI_SUCCESS;
+    switch (compression_type) {
+        case RECORD0_NO_COMPRESSION:
+            /* no compression */
+            if (record_size > *decompressed_size) {
+                debug_print("Record too large: %zu\n", record_size);
+                return MOBI_DATA_CORRUPT;
+            }
+            memcpy(decompressed, data, record_size);
+            *decompressed_size = record_size;
+            break;
+        case RECORD0_PALMDOC_COMPRESSION:
+            /* palmdoc lz77 compression */
+            ret = mobi_decompress_lz77(decompressed, data, decompressed_size, record_size);
+            break;
+        case RECORD0_HUFF_COMPRESSION:
+            /* mobi huffman compression */
+            ret = mobi_decompress_huffman(decompressed, data, decompressed_size, record_size, huffcdic);
+            break;
+        default:
+            debug_print("%s", "Unknown compression type\n");
+            return MOBI_DATA_CORRUPT;
+    }
+    return ret;
+}
+
+/**
+ @brief Decompress single text record (internal).
+ 
+ @param[in,out] decompressed Memory area to be filled with decompressed output
+ @param[in,out] decompressed_size Size of the memory area, on return set to decompressed record length
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] record Text record
+ @param[in] extra_flags Flags of trailing entries at the end of text records
+ @param[in] huffcdic Parsed huff/cdic tables, NULL if text is not huffman compressed
+ @param[in,out] decrypted Memory area of at least record size for decrypted data, if NULL encrypted record will be decrypted in place
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_decompress_record(unsigned char *decompressed, size_t *decompressed_size, const MOBIData *m, const MOBIPdbRecord *record, const uint16_t extra_flags, const MOBIHuffCdic *huffcdic, unsigned char *decrypted) {
+    const size_t record_size = mobi_get_record_textsize(record, extra_flags);
+    if (record_size == MOBI_NOTSET) {
+        return MOBI_DATA_CORRUPT;
+    }
+    unsigned char *data = record->data;
+#ifdef USE_ENCRYPTION
+    if (mobi_is_encrypted(m) && m->drm_key) {
+        const size_t decrypt_size = mobi_get_record_decryptsize(m, record, record_size, extra_flags);
+        MOBI_RET ret;
+        if (decrypted) {
+            ret = mobi_decrypt(decrypted, record->data, decrypt_size, m);
+            data = decrypted;
+        } else {
+            ret = mobi_decrypt(decompressed, record->data, decrypt_size, m);
+            if (ret == MOBI_SUCCESS) {
+                memcpy(record->data, decompressed, decrypt_size);
+            }
+        }
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+#else
+    UNUSED(decrypted);
+#endif
+    return mobi_decompress_record_data(decompressed, decompressed_size, data, record_size, m->rh->compression_type, huffcdic);
+}
+
 /**
  @brief Decompress text record (internal).
  
@@ -1239,110 +1627,70 @@ static MOBI_RET mobi_decompress_content(const MOBIData *m, char *text, FILE *fil
     }
     /* get first text record */
     const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, text_rec_index);
-    MOBIHuffCdic *huffcdic = NULL;
+    const MOBIHuffCdic *huffcdic = NULL;
     if (compression_type == RECORD0_HUFF_COMPRESSION) {
-        /* load huff/cdic tables */
-        huffcdic = mobi_init_huffcdic();
-        if (huffcdic == NULL) {
-            debug_print("%s\n", "Memory allocation failed");
-            return MOBI_MALLOC_FAILED;
-        }
-        MOBI_RET ret = mobi_parse_huffdic(m, huffcdic);
+        /* get cached huff/cdic tables */
+        MOBI_RET ret = mobi_get_huffcdic(m, &huffcdic);
         if (ret != MOBI_SUCCESS) {
-            mobi_free_huffcdic(huffcdic);
             return ret;
         }
     }
+    const size_t max_record_size = mobi_get_textrecord_maxsize(m);
+    MOBIScratch scratch;
+    MOBI_RET ret = mobi_scratch_alloc(&scratch, max_record_size);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    unsigned char *decompressed = scratch.data;
     /* get following CDIC records */
     size_t text_length = 0;
-    while (text_rec_count-- && curr) {
-        size_t extra_size = 0;
-        if (extra_flags) {
-            extra_size = mobi_get_record_extrasize(curr, extra_flags);
-            if (extra_size == MOBI_NOTSET || extra_size >= curr->size) {
-                mobi_free_huffcdic(huffcdic);
+    while (text_rec_count && curr) {
+        /* records are taken in batches, so that encrypted ones may be decrypted together */
+        const MOBIPdbRecord *records[MOBI_DECRYPT_BATCH];
+        size_t sizes[MOBI_DECRYPT_BATCH];
+        size_t count = 0;
+        while (count < MOBI_DECRYPT_BATCH && text_rec_count && curr) {
+            sizes[count] = mobi_get_record_textsize(curr, extra_flags);
+            if (sizes[count] == MOBI_NOTSET) {
+                mobi_scratch_free(&scratch);
                 return MOBI_DATA_CORRUPT;
             }
+            records[count++] = curr;
+            curr = curr->next;
+            text_rec_count--;
         }
-        const size_t record_size = curr->size - extra_size;
-        size_t decompressed_size = mobi_get_textrecord_maxsize(m);
-        unsigned char *decompressed = malloc(decompressed_size);
-        if (decompressed == NULL) {
-            mobi_free_huffcdic(huffcdic);
-            debug_print("Memory allocation failed%s", "\n");
-            return MOBI_MALLOC_FAILED;
-        }
-        MOBI_RET ret = MOBI_SUCCESS;
 #ifdef USE_ENCRYPTION
-        if (mobi_is_encrypted(m) && m->drm_key) {
-            size_t decrypt_size = record_size;
-            if (compression_type != RECORD0_HUFF_COMPRESSION) {
-                /* decrypt also multibyte extra data */
-                size_t mb_size = mobi_get_record_mb_extrasize(curr, extra_flags);
-                decrypt_size += mb_size;
-            }
-            ret = mobi_decrypt(decompressed, curr->data, decrypt_size, m);
+        if (mobi_is_encrypted(m)) {
+            /* decrypted in place, as single records are */
+            ret = mobi_decrypt_records(m, records, sizes, count, extra_flags);
             if (ret != MOBI_SUCCESS) {
-                mobi_free_huffcdic(huffcdic);
-                free(decompressed);
+                mobi_scratch_free(&scratch);
                 return ret;
             }
-            memcpy(curr->data, decompressed, decrypt_size);
         }
 #endif
-        switch (compression_type) {
-            case RECORD0_NO_COMPRESSION:
-                /* no compression */
-                if (record_size > decompressed_size) {
-                    debug_print("Record too large: %zu\n", record_size);
-                    free(decompressed);
-                    return MOBI_DATA_CORRUPT;
-                }
-                memcpy(decompressed, curr->data, record_size);
-                decompressed_size = record_size;
-                break;
-            case RECORD0_PALMDOC_COMPRESSION:
-                /* palmdoc lz77 compression */
-                ret = mobi_decompress_lz77(decompressed, curr->data, &decompressed_size, record_size);
-                if (ret != MOBI_SUCCESS) {
-                    free(decompressed);
-                    return ret;
-                }
-                break;
-            case RECORD0_HUFF_COMPRESSION:
-                /* mobi huffman compression */
-                ret = mobi_decompress_huffman(decompressed, curr->data, &decompressed_size, record_size, huffcdic);
-                if (ret != MOBI_SUCCESS) {
-                    free(decompressed);
-                    mobi_free_huffcdic(huffcdic);
-                    return ret;
+        for (size_t i = 0; i < count; i++) {
+            size_t decompressed_size = max_record_size;
+            ret = mobi_decompress_record_data(decompressed, &decompressed_size, records[i]->data, sizes[i], compression_type, huffcdic);
+            if (ret != MOBI_SUCCESS) {
+                mobi_scratch_free(&scratch);
+                return ret;
+            }
+            if (dump) {
+                fwrite(decompressed, 1, decompressed_size, file);
+            } else {
+                if (text_length > *len) {
+                    debug_print("%s", "Text buffer too small\n");
+                    mobi_scratch_free(&scratch);
+                    return MOBI_PARAM_ERR;
                 }
-                break;
-            default:
-                debug_print("%s", "Unknown compression type\n");
-                mobi_free_huffcdic(huffcdic);
-                free(decompressed);
-                return MOBI_DATA_CORRUPT;
-        }
-        curr = curr->next;
-        if (dump) {
-            fwrite(decompressed, 1, decompressed_size, file);
-        } else {
-            if (text_length > *len) {
-                debug_print("%s", "Text buffer too small\n");
-                /* free huff/cdic tables */
-                mobi_free_huffcdic(huffcdic);
-                free(decompressed);
-                return MOBI_PARAM_ERR;
+                memcpy(text + text_length, decompressed, decompressed_size);
+                text_length += decompressed_size;
+                text[text_length] = '\0';
             }
-            memcpy(text + text_length, decompressed, decompressed_size);
-            text_length += decompressed_size;
-            text[text_length] = '\0';
         }
-        free(decompressed);
     }
-    /* free huff/cdic tables */
-    mobi_free_huffcdic(huffcdic);
+    mobi_scratch_free(&scratch);
     if (len) {
         *len = text_length;
     }
@@ -1384,6 +1732,215 @@ MOBI_RET mobi_dump_rawml(const MOBIData *m, FILE *file) {
     return mobi_decompress_content(m, NULL, file, NULL);
 }
 
+/**
+ @brief Check if document is Print Replica (azw4) book
+ 
+ Only first text record is decompressed.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @return true if raw text starts with Print Replica magic, false otherwise
+ */
+bool mobi_is_replica(const MOBIData *m) {
+    if (m == NULL || m->rh == NULL || m->rh->text_record_count == 0) {
+        return false;
+    }
+    if (mobi_is_encrypted(m) && m->drm_key == NULL) {
+        return false;
+    }
+    const MOBIPdbRecord *record = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    if (record == NULL) {
+        return false;
+    }
+    if (m->rh->compression_type == RECORD0_NO_COMPRESSION && !mobi_is_encrypted(m)) {
+        return (record->size >= 4 && memcmp(record->data, REPLICA_MAGIC, 4) == 0);
+    }
+    uint16_t extra_flags = 0;
+    if (m->mh && m->mh->extra_flags) {
+        extra_flags = *m->mh->extra_flags;
+    }
+    const MOBIHuffCdic *huffcdic = NULL;
+    if (m->rh->compression_type == RECORD0_HUFF_COMPRESSION && mobi_get_huffcdic(m, &huffcdic) != MOBI_SUCCESS) {
+        return false;
+    }
+    size_t decompressed_size = mobi_get_textrecord_maxsize(m);
+    unsigned char *decompressed = malloc(decompressed_size);
+    unsigned char *decrypted = NULL;
+    if (mobi_is_encrypted(m)) {
+        decrypted = malloc(record->size);
+    }
+    bool is_replica = false;
+    if (decompressed && (decrypted || !mobi_is_encrypted(m))) {
+        MOBI_RET ret = mobi_decompress_record(decompressed, &decompressed_size, m, record, extra_flags, huffcdic, decrypted);
+        if (ret == MOBI_SUCCESS && decompressed_size >= 4 && memcmp(decompressed, REPLICA_MAGIC, 4) == 0) {
+            is_replica = true;
+        }
+    }
+    free(decompressed);
+    free(decrypted);
+    return is_replica;
+}
+
+/**
+ @brief Stream pdf embedded in Print Replica (azw4) book to a sink.
+ 
+ Pdf byte range is read from the replica header in the first text record.
+ Text records are decompressed one at a time and only the pdf range is passed to the sink,
+ so memory usage does not depend on the book size. Records are left unmodified.
+ 
+ If text records are neither compressed nor encrypted and sink->write_offset is set,
+ it is called with offsets of the pdf data in the source file instead of sink->write,
+ so that the caller may copy the data directly (eg. with sendfile).
+ On failure sink may already have received part of the pdf.
+ 
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[in] sink MOBISink structure with callbacks receiving pdf data
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_extract_replica_pdf(const MOBIData *m, const MOBISink *sink) {
+    if (m == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (sink == NULL || sink->write == NULL) {
+        debug_print("%s", "Sink not initialized\n");
+        return MOBI_PARAM_ERR;
+    }
+    if (mobi_is_encrypted(m) && m->drm_key == NULL) {
+        debug_print("%s", "Document is encrypted\n");
+        return MOBI_FILE_ENCRYPTED;
+    }
+    if (m->rh == NULL || m->rh->text_record_count == 0) {
+        debug_print("%s", "Text records not found in MOBI header\n");
+        return MOBI_DATA_CORRUPT;
+    }
+    const uint16_t compression_type = m->rh->compression_type;
+    const bool is_encrypted = mobi_is_encrypted(m);
+    const bool zero_copy = (compression_type == RECORD0_NO_COMPRESSION && !is_encrypted && sink->write_offset);
+    uint16_t extra_flags = 0;
+    if (m->mh && m->mh->extra_flags) {
+        extra_flags = *m->mh->extra_flags;
+    }
+    const MOBIHuffCdic *huffcdic = NULL;
+    if (compression_type == RECORD0_HUFF_COMPRESSION) {
+        MOBI_RET ret = mobi_get_huffcdic(m, &huffcdic);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    const size_t max_record_size = mobi_get_textrecord_maxsize(m);
+    unsigned char *decompressed = malloc(max_record_size);
+    if (decompressed == NULL) {
+        debug_print("%s\n", "Memory allocation failed");
+        return MOBI_MALLOC_FAILED;
+    }
+    unsigned char *decrypted = NULL;
+    size_t decrypted_size = 0;
+    unsigned char header[REPLICA_HEADER_LEN];
+    size_t header_size = 0;
+    size_t pdf_start = 0;
+    size_t pdf_end = 0;
+    size_t text_pos = 0;
+    size_t text_rec_count = m->rh->text_record_count;
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    MOBI_RET ret = MOBI_SUCCESS;
+    while (text_rec_count-- && curr) {
+        const unsigned char *data;
+        size_t size = max_record_size;
+        if (zero_copy) {
+            size_t extra_size = 0;
+            if (extra_flags) {
+                extra_size = mobi_get_record_extrasize(curr, extra_flags);
+                if (extra_size == MOBI_NOTSET || extra_size >= curr->size) {
+                    ret = MOBI_DATA_CORRUPT;
+                    break;
+                }
+            }
+            size = curr->size - extra_size;
+            if (size > max_record_size) {
+                debug_print("Record too large: %zu\n", size);
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            data = curr->data;
+        } else {
+            if (is_encrypted && decrypted_size < curr->size) {
+                unsigned char *tmp = realloc(decrypted, curr->size);
+                if (tmp == NULL) {
+                    debug_print("%s\n", "Memory allocation failed");
+                    ret = MOBI_MALLOC_FAILED;
+                    break;
+                }
+                decrypted = tmp;
+                decrypted_size = curr->size;
+            }
+            ret = mobi_decompress_record(decompressed, &size, m, curr, extra_flags, huffcdic, decrypted);
+            if (ret != MOBI_SUCCESS) {
+                break;
+            }
+            data = decompressed;
+        }
+        if (header_size < REPLICA_HEADER_LEN) {
+            /* collect replica header, it may span records */
+            const size_t header_part = min(REPLICA_HEADER_LEN - header_size, size);
+            memcpy(header + header_size, data, header_part);
+            header_size += header_part;
+            if (header_size == REPLICA_HEADER_LEN) {
+                if (memcmp(header, REPLICA_MAGIC, 4) != 0) {
+                    debug_print("%s", "Not a Print Replica book\n");
+                    ret = MOBI_DATA_CORRUPT;
+                    break;
+                }
+                MOBIBuffer *buf = buffer_init_null(REPLICA_HEADER_LEN);
+                if (buf == NULL) {
+                    debug_print("%s\n", "Memory allocation failed");
+                    ret = MOBI_MALLOC_FAILED;
+                    break;
+                }
+                buf->data = header;
+                buffer_setpos(buf, 12);
+                pdf_start = buffer_get32(buf); /* offset 12 */
+                const size_t pdf_length = buffer_get32(buf); /* 16 */
+                buffer_free_null(buf);
+                pdf_end = pdf_start + pdf_length;
+                const size_t text_maxsize = mobi_get_text_maxsize(m);
+                if (text_maxsize == MOBI_NOTSET || pdf_end > text_maxsize) {
+                    debug_print("PDF size from replica header too large: %zu\n", pdf_length);
+                    ret = MOBI_DATA_CORRUPT;
+                    break;
+                }
+            }
+        }
+        if (header_size == REPLICA_HEADER_LEN) {
+            /* pass part of the record overlapping pdf range */
+            const size_t chunk_start = max(text_pos, pdf_start);
+            const size_t chunk_end = min(text_pos + size, pdf_end);
+            if (chunk_start < chunk_end) {
+                const size_t chunk_offset = chunk_start - text_pos;
+                if (zero_copy) {
+                    ret = sink->write_offset(sink->context, curr->offset + chunk_offset, chunk_end - chunk_start);
+                } else {
+                    ret = sink->write(sink->context, data + chunk_offset, chunk_end - chunk_start);
+                }
+                if (ret != MOBI_SUCCESS) {
+                    break;
+                }
+            }
+        }
+        text_pos += size;
+        if (header_size == REPLICA_HEADER_LEN && text_pos >= pdf_end) {
+            break;
+        }
+        curr = curr->next;
+    }
+    if (ret == MOBI_SUCCESS && (header_size < REPLICA_HEADER_LEN || text_pos < pdf_end)) {
+        debug_print("%s", "Text too short for pdf range from replica header\n");
+        ret = MOBI_DATA_CORRUPT;
+    }
+    free(decompressed);
+    free(decrypted);
+    return ret;
+}
+
 /**
  @brief Check if MOBI header is loaded / present in the loaded file
  
@@ -1692,6 +2249,235 @@ MOBI_RET mobi_decode_video_resource(unsigned char **decoded_resource, size_t *de
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Get array of compressed block offsets, stored right after MOBIPartBlocks header
+ 
+ @param[in] blocks MOBIPartBlocks structure
+ @return Array of count + 1 offsets into compressed data
+ */
+static size_t * mobi_blocks_offsets(const MOBIPartBlocks *blocks) {
+    return (size_t *) (blocks + 1);
+}
+
+/**
+ @brief Get compressed data, stored right after block offsets
+ 
+ @param[in] blocks MOBIPartBlocks structure
+ @return Compressed blocks
+ */
+static unsigned char * mobi_blocks_data(const MOBIPartBlocks *blocks) {
+    return (unsigned char *) (mobi_blocks_offsets(blocks) + blocks->count + 1);
+}
+
+/**
+ @brief Compress part data in fixed size blocks and release uncompressed data
+ 
+ Blocks which do not get smaller are stored uncompressed.
+ 
+ @param[in,out] part MOBIPart structure
+ @param[in] block_size Size of uncompressed block
+ @param[in,out] chunk Memory area of at least m_compressBound(block_size) bytes for compressed block
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_compress_part(MOBIPart *part, const size_t block_size, unsigned char *chunk) {
+    if (part->blocks || part->data == NULL || part->size == 0) {
+        return MOBI_SUCCESS;
+    }
+    const size_t count = (part->size + block_size - 1) / block_size;
+    const size_t header_size = sizeof(MOBIPartBlocks) + (count + 1) * sizeof(size_t);
+    /* compressed data never exceeds uncompressed size */
+    MOBIPartBlocks *blocks = malloc(header_size + part->size);
+    if (blocks == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    blocks->block_size = block_size;
+    blocks->count = count;
+    size_t *offsets = mobi_blocks_offsets(blocks);
+    unsigned char *data = mobi_blocks_data(blocks);
+    size_t offset = 0;
+    for (size_t i = 0; i < count; i++) {
+        const unsigned char *source = part->data + i * block_size;
+        const size_t source_size = (i + 1 < count) ? block_size : part->size - i * block_size;
+        unsigned long chunk_size = (unsigned long) m_compressBound((unsigned long) block_size);
+        offsets[i] = offset;
+        if (m_compress2(chunk, &chunk_size, source, (unsigned long) source_size, M_BEST_SPEED) == M_OK
+            && chunk_size < source_size) {
+            memcpy(data + offset, chunk, chunk_size);
+            offset += chunk_size;
+        } else {
+            memcpy(data + offset, source, source_size);
+            offset += source_size;
+        }
+    }
+    offsets[count] = offset;
+    MOBIPartBlocks *shrunk = realloc(blocks, header_size + offset);
+    if (shrunk) {
+        blocks = shrunk;
+    }
+    free(part->data);
+    part->data = NULL;
+    part->blocks = blocks;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compress text parts of MOBIRawml structure to reduce memory held by cached documents
+ 
+ Markup and flow parts are stored in independently compressed blocks
+ and their uncompressed data is released. Part data is then accessible
+ with mobi_part_read(), which decompresses only blocks covering requested range,
+ or it may be restored with mobi_decompress_rawml().
+ Resources are left untouched, they mostly point to records data and are already compressed.
+ 
+ Compressed parts have data set to NULL, size still holds uncompressed size.
+ 
+ @param[in,out] rawml MOBIRawml structure with parsed parts
+ @param[in] block_size Size of uncompressed block, 0 for default (64 KB)
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_compress_rawml(MOBIRawml *rawml, const size_t block_size) {
+    if (rawml == NULL) {
+        debug_print("%s", "Rawml structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    const size_t size = block_size ? block_size : MOBI_PART_BLOCK_SIZE;
+    if ((unsigned long) size != size) {
+        return MOBI_PARAM_ERR;
+    }
+    unsigned char *chunk = malloc(m_compressBound((unsigned long) size));
+    if (chunk == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    MOBIPart *lists[] = { rawml->markup, rawml->flow };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        MOBIPart *curr = lists[i];
+        while (ret == MOBI_SUCCESS && curr != NULL) {
+            ret = mobi_compress_part(curr, size, chunk);
+            curr = curr->next;
+        }
+    }
+    free(chunk);
+    return ret;
+}
+
+/**
+ @brief Read range of part data
+ 
+ Works for both compressed and uncompressed parts.
+ For compressed parts only blocks covering requested range are decompressed.
+ Function does not modify part, so it may be called concurrently on the same part.
+ 
+ @param[in] part MOBIPart structure
+ @param[in,out] out Memory area of at least size bytes to be filled with part data
+ @param[in] offset Offset in uncompressed part data
+ @param[in,out] size Requested length, on return set to number of bytes read, less if end of part was reached
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_part_read(const MOBIPart *part, unsigned char *out, const size_t offset, size_t *size) {
+    if (part == NULL || out == NULL || size == NULL || offset > part->size) {
+        return MOBI_PARAM_ERR;
+    }
+    size_t length = part->size - offset;
+    if (*size < length) {
+        length = *size;
+    }
+    *size = length;
+    const MOBIPartBlocks *blocks = part->blocks;
+    if (blocks == NULL) {
+        if (length && part->data == NULL) {
+            return MOBI_INIT_FAILED;
+        }
+        if (length) {
+            memcpy(out, part->data + offset, length);
+        }
+        return MOBI_SUCCESS;
+    }
+    const size_t *offsets = mobi_blocks_offsets(blocks);
+    const unsigned char *data = mobi_blocks_data(blocks);
+    unsigned char *block = NULL;
+    size_t i = offset / blocks->block_size;
+    size_t pos = offset;
+    MOBI_RET ret = MOBI_SUCCESS;
+    while (length) {
+        const size_t block_start = i * blocks->block_size;
+        const size_t block_end = (i + 1 < blocks->count) ? block_start + blocks->block_size : part->size;
+        const size_t block_length = block_end - block_start;
+        const size_t from = pos - block_start;
+        const size_t n = (block_end - pos < length) ? block_end - pos : length;
+        const unsigned char *source = data + offsets[i];
+        const size_t source_size = offsets[i + 1] - offsets[i];
+        if (source_size == block_length) {
+            /* stored uncompressed */
+            memcpy(out, source + from, n);
+        } else {
+            unsigned char *target = out;
+            if (n != block_length) {
+                if (block == NULL && (block = malloc(blocks->block_size)) == NULL) {
+                    ret = MOBI_MALLOC_FAILED;
+                    break;
+                }
+                target = block;
+            }
+            unsigned long target_size = (unsigned long) block_length;
+            if (m_uncompress(target, &target_size, source, (unsigned long) source_size) != M_OK
+                || target_size != block_length) {
+                debug_print("Decompression of part block %zu failed\n", i);
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            if (target != out) {
+                memcpy(out, target + from, n);
+            }
+        }
+        out += n;
+        pos += n;
+        length -= n;
+        i++;
+    }
+    free(block);
+    return ret;
+}
+
+/**
+ @brief Restore uncompressed data of parts compressed with mobi_compress_rawml()
+ 
+ @param[in,out] rawml MOBIRawml structure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_decompress_rawml(MOBIRawml *rawml) {
+    if (rawml == NULL) {
+        debug_print("%s", "Rawml structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    MOBIPart *lists[] = { rawml->markup, rawml->flow };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        MOBIPart *curr = lists[i];
+        while (curr != NULL) {
+            if (curr->blocks) {
+                unsigned char *data = malloc(curr->size);
+                if (data == NULL) {
+                    debug_print("%s", "Memory allocation failed\n");
+                    return MOBI_MALLOC_FAILED;
+                }
+                size_t size = curr->size;
+                MOBI_RET ret = mobi_part_read(curr, data, 0, &size);
+                if (ret != MOBI_SUCCESS) {
+                    free(data);
+                    return ret;
+                }
+                free(curr->blocks);
+                curr->blocks = NULL;
+                curr->data = data;
+            }
+            curr = curr->next;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Replace part data with decoded font data
  
@@ -1707,7 +2493,11 @@ MOBI_RET mobi_add_font_resource(MOBIPart *part) {
     }
     part->data = data;
     part->size = size;
-    part->type = mobi_determine_font_type(data);
+    part->type = size >= 4 ? mobi_determine_font_type(data) : T_UNKNOWN;
+    /* keep decoded data of unrecognized format marked as font, so that it is freed with other fonts */
+    if (part->type == T_UNKNOWN) {
+        part->type = T_FONT;
+    }
     return MOBI_SUCCESS;
 }
 
@@ -1819,31 +2609,261 @@ MOBIFiletype mobi_determine_resource_type(const MOBIPdbRecord *record) {
     const unsigned char video_magic[] = VIDE_MAGIC;
     const unsigned char boundary_magic[] = BOUNDARY_MAGIC;
     const unsigned char eof_magic[] = EOF_MAGIC;
-    if (memcmp(record->data, jpg_magic, 3) == 0) {
+    /* records may be shorter than compared magic */
+    const size_t size = record->data ? record->size : 0;
+    if (size >= 3 && memcmp(record->data, jpg_magic, 3) == 0) {
         return T_JPG;
-    } else if (memcmp(record->data, gif_magic, 4) == 0) {
+    } else if (size >= 4 && memcmp(record->data, gif_magic, 4) == 0) {
         return T_GIF;
-    } else if (memcmp(record->data, png_magic, 8) == 0) {
+    } else if (size >= 8 && memcmp(record->data, png_magic, 8) == 0) {
         return T_PNG;
-    } else if (memcmp(record->data, font_magic, 4) == 0) {
+    } else if (size >= 4 && memcmp(record->data, font_magic, 4) == 0) {
         return T_FONT;
-    } else if (memcmp(record->data, boundary_magic, 8) == 0) {
+    } else if (size >= 8 && memcmp(record->data, boundary_magic, 8) == 0) {
         return T_BREAK;
-    } else if (memcmp(record->data, eof_magic, 4) == 0) {
+    } else if (size >= 4 && memcmp(record->data, eof_magic, 4) == 0) {
         return T_BREAK;
-    } else if (memcmp(record->data, bmp_magic, 2) == 0) {
+    } else if (size >= 6 && memcmp(record->data, bmp_magic, 2) == 0) {
         const size_t bmp_size = (uint32_t) record->data[2] | (uint32_t) record->data[3] << 8 | (uint32_t) record->data[4] << 16 | (uint32_t) record->data[5] << 24;
-        if (record->size == bmp_size) {
+        if (size == bmp_size) {
             return T_BMP;
         }
-    } else if (memcmp(record->data, audio_magic, 4) == 0) {
+    } else if (size >= 4 && memcmp(record->data, audio_magic, 4) == 0) {
         return T_AUDIO;
-    } else if (memcmp(record->data, video_magic, 4) == 0) {
+    } else if (size >= 4 && memcmp(record->data, video_magic, 4) == 0) {
         return T_VIDEO;
     }
     return T_UNKNOWN;
 }
 
+/**
+ @brief Read little-endian 16-bit value
+
+ @param[in] data Data, at least 2 bytes
+ @return Value
+ */
+static uint32_t mobi_get_le16(const unsigned char *data) {
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8;
+}
+
+/**
+ @brief Read little-endian 32-bit value
+
+ @param[in] data Data, at least 4 bytes
+ @return Value
+ */
+static uint32_t mobi_get_le32(const unsigned char *data) {
+    return (uint32_t) data[0] | (uint32_t) data[1] << 8 | (uint32_t) data[2] << 16 | (uint32_t) data[3] << 24;
+}
+
+/**
+ @brief Read big-endian 32-bit value
+
+ @param[in] data Data, at least 4 bytes
+ @return Value
+ */
+static uint32_t mobi_get_be32(const unsigned char *data) {
+    return (uint32_t) data[0] << 24 | (uint32_t) data[1] << 16 | (uint32_t) data[2] << 8 | (uint32_t) data[3];
+}
+
+/**
+ @brief Get dimensions of JPEG image from its frame header
+
+ Segments are skipped using their lengths until start of frame marker is found.
+
+ @param[in] data Image data
+ @param[in] size Size of data
+ @param[out] width Image width
+ @param[out] height Image height
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_probe_jpeg(const unsigned char *data, const size_t size, uint32_t *width, uint32_t *height) {
+    MOBIBuffer buf;
+    buf.data = (unsigned char *) data;
+    buf.offset = 2;
+    buf.maxlen = size;
+    buf.error = MOBI_SUCCESS;
+    while (buf.error == MOBI_SUCCESS) {
+        if (buffer_get8(&buf) != 0xff) {
+            break;
+        }
+        uint8_t marker = buffer_get8(&buf);
+        /* skip fill bytes */
+        while (marker == 0xff && buf.error == MOBI_SUCCESS) {
+            marker = buffer_get8(&buf);
+        }
+        if (marker == 0x01 || (marker >= 0xd0 && marker <= 0xd8)) {
+            /* standalone markers */
+            continue;
+        }
+        if (marker == 0xd9 || marker == 0xda) {
+            /* end of image or start of scan before frame header */
+            break;
+        }
+        const uint16_t length = buffer_get16(&buf);
+        if (length < 2) {
+            break;
+        }
+        if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc) {
+            /* start of frame: precision, height, width */
+            buffer_seek(&buf, 1);
+            *height = buffer_get16(&buf);
+            *width = buffer_get16(&buf);
+            return buf.error;
+        }
+        buffer_seek(&buf, length - 2);
+    }
+    return MOBI_DATA_CORRUPT;
+}
+
+/**
+ @brief Get dimensions of image from its header, without decoding it
+
+ Only image header is read: JPEG segments up to frame header, PNG IHDR chunk,
+ GIF logical screen descriptor, BMP info header.
+
+ @param[in] data Image data
+ @param[in] size Size of data
+ @param[in] type Image type
+ @param[out] width Image width
+ @param[out] height Image height
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_PARAM_ERR if type is not supported image type
+ */
+MOBI_RET mobi_probe_image(const unsigned char *data, const size_t size, const MOBIFiletype type, uint32_t *width, uint32_t *height) {
+    *width = 0;
+    *height = 0;
+    if (data == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    switch (type) {
+        case T_JPG:
+            if (size < 4) {
+                return MOBI_DATA_CORRUPT;
+            }
+            return mobi_probe_jpeg(data, size, width, height);
+        case T_PNG:
+            /* signature, IHDR chunk length and type, width and height big-endian */
+            if (size < 24 || memcmp(data + 12, "IHDR", 4) != 0) {
+                return MOBI_DATA_CORRUPT;
+            }
+            *width = mobi_get_be32(data + 16);
+            *height = mobi_get_be32(data + 20);
+            return MOBI_SUCCESS;
+        case T_GIF:
+            /* logical screen width and height little-endian */
+            if (size < 10) {
+                return MOBI_DATA_CORRUPT;
+            }
+            *width = mobi_get_le16(data + 6);
+            *height = mobi_get_le16(data + 8);
+            return MOBI_SUCCESS;
+        case T_BMP:
+            if (size < 26) {
+                return MOBI_DATA_CORRUPT;
+            }
+            if (mobi_get_le32(data + 14) == 12) {
+                /* OS/2 core header, 16-bit dimensions */
+                *width = mobi_get_le16(data + 18);
+                *height = mobi_get_le16(data + 20);
+            } else {
+                /* negative height marks top-down bitmap */
+                const int32_t bmp_height = (int32_t) mobi_get_le32(data + 22);
+                *width = mobi_get_le32(data + 18);
+                *height = bmp_height < 0 ? (uint32_t) -(int64_t) bmp_height : (uint32_t) bmp_height;
+            }
+            return MOBI_SUCCESS;
+        default:
+            return MOBI_PARAM_ERR;
+    }
+}
+
+/**
+ @brief Get dimensions of image resource part, without decoding it
+
+ @param[in] part MOBIPart resource part
+ @param[out] width Image width
+ @param[out] height Image height
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_PARAM_ERR if part is not an image
+ */
+MOBI_RET mobi_get_image_size(const MOBIPart *part, size_t *width, size_t *height) {
+    if (part == NULL || width == NULL || height == NULL) {
+        return MOBI_PARAM_ERR;
+    }
+    uint32_t image_width;
+    uint32_t image_height;
+    const MOBI_RET ret = mobi_probe_image(part->data, part->size, part->type, &image_width, &image_height);
+    *width = image_width;
+    *height = image_height;
+    return ret;
+}
+
+/**
+ @brief Get type, size and dimensions of resources
+
+ Resource records are traversed once, images are probed by reading their headers only.
+ Text records are not touched.
+
+ @param[in] m MOBIData structure loaded with MOBI data
+ @param[out] info Newly allocated array of resources, to be freed with mobi_free_resources_info(), NULL if there are no resources
+ @param[out] count Number of resources
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_probe_resources(const MOBIData *m, MOBIResourceInfo **info, size_t *count) {
+    if (m == NULL || info == NULL || count == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    *info = NULL;
+    *count = 0;
+    size_t first_res_seqnumber = mobi_get_first_resource_record(m);
+    if (first_res_seqnumber == MOBI_NOTSET) {
+        /* search all records */
+        first_res_seqnumber = 0;
+    }
+    const MOBIPdbRecord *curr = mobi_get_record_by_seqnumber(m, first_res_seqnumber);
+    MOBIResourceInfo *resources = NULL;
+    size_t resources_count = 0;
+    size_t max_count = 0;
+    size_t uid = 0;
+    for (; curr != NULL; curr = curr->next, uid++) {
+        const MOBIFiletype type = mobi_determine_resource_type(curr);
+        if (type == T_BREAK) {
+            break;
+        }
+        if (type == T_UNKNOWN) {
+            continue;
+        }
+        if (resources_count == max_count) {
+            max_count = max_count ? 2 * max_count : 16;
+            MOBIResourceInfo *tmp = realloc(resources, max_count * sizeof(MOBIResourceInfo));
+            if (tmp == NULL) {
+                free(resources);
+                debug_print("%s\n", "Memory allocation failed");
+                return MOBI_MALLOC_FAILED;
+            }
+            resources = tmp;
+        }
+        MOBIResourceInfo *resource = &resources[resources_count++];
+        resource->uid = uid;
+        resource->type = type;
+        resource->size = curr->size;
+        /* corrupt image headers leave dimensions unknown */
+        mobi_probe_image(curr->data, curr->size, type, &resource->width, &resource->height);
+    }
+    *info = resources;
+    *count = resources_count;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free array of resources returned by mobi_probe_resources()
+
+ @param[in] info Array of resources
+ */
+void mobi_free_resources_info(MOBIResourceInfo *info) {
+    free(info);
+}
+
 /**
  @brief Check if loaded MOBI data is KF7/KF8 hybrid file
  
@@ -2089,6 +3109,71 @@ MOBI_RET mobi_base32_decode(uint32_t *decoded, const char *encoded) {
 }
 
 
+/**
+ @brief Values of base 32 digits used in kindle: links, -1 for illegal characters
+ */
+static const signed char mobi_base32_table[256] = {
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+     0,  1,  2,  3,  4,  5,  6,  7,  8,  9, -1, -1, -1, -1, -1, -1,
+    -1, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19, 20, 21, 22, 23, 24,
+    25, 26, 27, 28, 29, 30, 31, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1
+};
+
+/**
+ @brief Decode positive number from base 32 to base 10 using lookup table.
+ 
+ Faster variant of mobi_base32_decode() for strings that are not null terminated,
+ like fids embedded in kindle: links. Same rules apply:
+ base 32 characters must be upper case, maximal supported value is VVVVVV.
+ 
+ @param[in,out] decoded Base 10 output number
+ @param[in] encoded Base 32 input number
+ @param[in] length Number of characters to decode
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_base32_decode_n(uint32_t *decoded, const char *encoded, size_t length) {
+    if (!encoded || !decoded) {
+        debug_print("Error, null parameter (decoded: %p, encoded: %p)\n", (void *) decoded, (void *) encoded);
+        return MOBI_PARAM_ERR;
+    }
+    /* strip leading zeroes */
+    while (length && *encoded == '0') {
+        encoded++;
+        length--;
+    }
+    /* Let's limit input to 6 chars. VVVVVV(32) is 0x3FFFFFFF */
+    if (length > 6) {
+        debug_print("Base 32 number too big: %.*s\n", (int) length, encoded);
+        return MOBI_PARAM_ERR;
+    }
+    const unsigned char *c = (unsigned char *) encoded;
+    uint32_t value = 0;
+    while (length--) {
+        const signed char digit = mobi_base32_table[*c];
+        if (digit < 0) {
+            debug_print("Illegal character: \"%c\"\n", *c);
+            return MOBI_DATA_CORRUPT;
+        }
+        value = (value << 5) | (uint32_t) digit;
+        c++;
+    }
+    *decoded = value;
+    return MOBI_SUCCESS;
+}
+
+
 /**
  @brief Get offset of KF8 Boundary for KF7/KF8 hybrid file cached in MOBIData structure
  
@@ -2160,6 +3245,51 @@ MOBI_RET mobi_parse_kf8(MOBIData *m) {
     return MOBI_SUCCESS;
 }
 
+/**
+ @brief Declare that records will not be modified while document is loaded
+ 
+ Must be set before loading document. If set, loader does not copy EXTH records data,
+ but points to it in record 0, which saves allocations in metadata only processing.
+ Records, including record 0 data, must not be modified or freed then
+ until mobi_reset() or mobi_free() is called.
+ Setting is preserved by mobi_reset().
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] immutable True if records are immutable, false (default) otherwise
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_set_records_immutable(MOBIData *m, const bool immutable) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    m->records_immutable = immutable;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Enable repair of invalid utf-8 sequences in markup of utf-8 documents
+ 
+ If set, mobi_parse_rawml() validates html and css parts of utf-8 documents,
+ including unparsed html in the first flow part, and replaces invalid sequences
+ with U+FFFD, so that they do not break strict readers. Valid parts are not modified.
+ Setting is preserved by mobi_reset(). If set before loading, it is copied
+ to the other part of hybrid document.
+ 
+ @param[in,out] m MOBIData structure
+ @param[in] repair True if invalid sequences should be repaired, false (default) otherwise
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_set_utf8_repair(MOBIData *m, const bool repair) {
+    if (m == NULL) {
+        return MOBI_INIT_FAILED;
+    }
+    m->repair_utf8 = repair;
+    if (m->next) {
+        m->next->repair_utf8 = repair;
+    }
+    return MOBI_SUCCESS;
+}
+
 /**
  @brief Swap KF7 and KF8 MOBIData structures in a hybrid file
  
@@ -2179,12 +3309,15 @@ MOBI_RET mobi_swap_mobidata(MOBIData *m) {
     tmp->rh = m->rh;
     tmp->mh = m->mh;
     tmp->eh = m->eh;
+    tmp->huffcdic = m->huffcdic;
     m->rh = m->next->rh;
     m->mh = m->next->mh;
     m->eh = m->next->eh;
+    m->huffcdic = m->next->huffcdic;
     m->next->rh = tmp->rh;
     m->next->mh = tmp->mh;
     m->next->eh = tmp->eh;
+    m->next->huffcdic = tmp->huffcdic;
     free(tmp);
     tmp = NULL;
     return MOBI_SUCCESS;
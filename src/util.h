@@ -26,13 +26,19 @@
 #ifdef USE_MINIZ
 #include "miniz.h"
 #define m_uncompress mz_uncompress
+#define m_compress2 mz_compress2
+#define m_compressBound mz_compressBound
 #define m_crc32 mz_crc32
 #define M_OK MZ_OK
+#define M_BEST_SPEED MZ_BEST_SPEED
 #else
 #include <zlib.h>
 #define m_uncompress uncompress
+#define m_compress2 compress2
+#define m_compressBound compressBound
 #define m_crc32 crc32
 #define M_OK Z_OK
+#define M_BEST_SPEED Z_BEST_SPEED
 #endif
 
 #define UNUSED(x) (void)(x)
@@ -94,6 +100,7 @@
 #define RECORD0_NO_ENCRYPTION 0 /**< Text record encryption type: none */
 #define RECORD0_OLD_ENCRYPTION 1 /**< Text record encryption type: old mobipocket */
 #define RECORD0_MOBI_ENCRYPTION 2 /**< Text record encryption type: mobipocket */
+#define MOBI_DECRYPT_BATCH 16 /**< Number of encrypted text records decrypted together */
 /** @} */
 
 /** 
@@ -108,10 +115,23 @@
 #define HUFF_RECORD_MINSIZE 2584
 #define FONT_HEADER_LEN 24
 #define MEDIA_HEADER_LEN 12
+#define REPLICA_HEADER_LEN 20
 #define FONT_SIZEMAX (50 * 1024 * 1024)
 #define RAWTEXT_SIZEMAX 0xfffffff
+#define MOBI_PART_BLOCK_SIZE 65536 /**< Default size of uncompressed block of compressed part */
 /** @} */
 
+/**
+ @brief Part data compressed in independent blocks, see mobi_compress_rawml()
+ 
+ Header is followed in the same allocation by count + 1 offsets of blocks
+ and then by compressed blocks. Blocks which compressed size equals uncompressed size are stored as they are.
+ */
+struct MOBIPartBlocks {
+    size_t block_size; /**< Size of uncompressed block, last block may be shorter */
+    size_t count; /**< Number of blocks */
+};
+
 #ifndef max
 #define max(a, b) ((a) > (b) ? (a) : (b))
 #endif
@@ -125,11 +145,19 @@ MOBI_RET mobi_swap_mobidata(MOBIData *m);
 char * mobi_strdup(const char *s);
 bool mobi_is_cp1252(const MOBIData *m);
 MOBI_RET mobi_cp1252_to_utf8(char *output, const char *input, size_t *outsize, const size_t insize);
+const char * mobi_get_htmlentity(const char *name, const size_t length);
+size_t mobi_utf8_validate(const unsigned char *data, const size_t length);
+MOBI_RET mobi_utf8_repair(unsigned char **data, size_t *length);
 uint8_t mobi_ligature_to_cp1252(const uint8_t c1, const uint8_t c2);
 uint16_t mobi_ligature_to_utf16(const uint32_t control, const uint32_t c);
+uint64_t mobi_mix64(uint64_t hash);
+uint64_t mobi_hash64(const unsigned char *data, const size_t size);
+MOBI_RET mobi_decompress_record(unsigned char *decompressed, size_t *decompressed_size, const MOBIData *m, const MOBIPdbRecord *record, const uint16_t extra_flags, const MOBIHuffCdic *huffcdic, unsigned char *decrypted);
 MOBIFiletype mobi_determine_resource_type(const MOBIPdbRecord *record);
+MOBI_RET mobi_probe_image(const unsigned char *data, const size_t size, const MOBIFiletype type, uint32_t *width, uint32_t *height);
 MOBIFiletype mobi_determine_flowpart_type(const MOBIRawml *rawml, const size_t part_number);
 MOBI_RET mobi_base32_decode(uint32_t *decoded, const char *encoded);
+MOBI_RET mobi_base32_decode_n(uint32_t *decoded, const char *encoded, size_t length);
 MOBIFiletype mobi_get_resourcetype_by_uid(const MOBIRawml *rawml, const size_t uid);
 MOBI_RET mobi_add_audio_resource(MOBIPart *part);
 MOBI_RET mobi_add_video_resource(MOBIPart *part);
@@ -1,4 +1,6 @@
-/*
+/** @file write.c
+ *  @brief Functions for writing KF8 documents
+ *
  * Copyright (c) 2014 Bartek Fabiszewski
  * http://www.fabiszewski.net
  *
@@ -7,155 +9,3162 @@
  * See <http://www.gnu.org/licenses/>
  */
 
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <time.h>
 #include <string.h>
+#include <time.h>
 
 #include "write.h"
+#include "compression.h"
+#include "index.h"
+#include "parse_rawml.h"
+#include "thread.h"
 #include "util.h"
+#include "debug.h"
+
+/**
+ @brief Value of id attribute found in markup file
+ */
+typedef struct {
+    const unsigned char *value; /**< Attribute value, points to file data */
+    size_t length; /**< Value length */
+    size_t offset; /**< Offset of "id=" string in file data */
+} MOBIKf8Id;
 
+/**
+ @brief Markup file being written
 
-/* 
-   I focus my development on reading functions.
-   Below are just a bunch of a quick tests,
-   which will probably disappear or be thoroughly modified
-   when I get to coding true writing routines.
-*/
-
-/* FIXME test */
-/* buffer should be passed to this func */
-MOBIBuffer * serialize_palmdb_header(void) {
-    MOBIBuffer *buf;
-    const char title[PALMDB_NAME_SIZE_MAX] = "TITLE";
-    const size_t len = strlen(title);
-    
-    const uint32_t curtime = (uint32_t) time(NULL);
-    const uint32_t uid = 0xff;
-    const uint32_t rec_count = 1;
-    buf = buffer_init(PALMDB_HEADER_LEN);
+ Skeleton consists of data preceding body_start and data following body_end.
+ Data between them is split into fragments.
+ */
+typedef struct {
+    const unsigned char *source; /**< Source markup */
+    size_t source_size; /**< Source markup size */
+    unsigned char *source_copy; /**< Source markup decompressed by writer, NULL if part data is used */
+    MOBIBuffer *buf; /**< Markup with rewritten links */
+    size_t body_start; /**< Offset of first fragment */
+    size_t body_end; /**< Offset of skeleton data following last fragment */
+    size_t frag_first; /**< Index of first fragment */
+    size_t frag_count; /**< Number of fragments */
+    size_t position; /**< Offset of file in main flow */
+    MOBIKf8Id *ids; /**< Sorted values of id attributes, built on first lookup */
+    size_t ids_count; /**< Number of id attributes */
+    bool ids_ready; /**< True if ids array is built */
+} MOBIKf8File;
+
+/**
+ @brief Markup fragment
+ */
+typedef struct {
+    size_t file; /**< File number */
+    size_t start; /**< Offset of fragment in file */
+    size_t size; /**< Fragment size */
+} MOBIKf8Fragment;
+
+/**
+ @brief Link to position in markup, written as placeholder and resolved when all files are split
+ */
+typedef struct {
+    size_t file; /**< File containing link */
+    size_t offset; /**< Offset of placeholder in rewritten file */
+    size_t target; /**< Target file number */
+    char *id; /**< Target id, empty string for end of file, NULL for top of file */
+} MOBIKf8Link;
+
+/**
+ @brief KF8 writer state
+ */
+typedef struct {
+    MOBIKf8File *files; /**< Markup files */
+    size_t files_count; /**< Number of markup files */
+    const MOBIPart **flow_parts; /**< Source flows, flow number minus one is the index */
+    MOBIBuffer **flows; /**< Flows with rewritten links */
+    size_t flows_count; /**< Number of flows */
+    const MOBIPart **resources; /**< Resources indexed by uid, NULL for missing uids */
+    size_t resources_count; /**< Highest resource uid plus one */
+    MOBIKf8Fragment *frags; /**< Fragments of all files */
+    size_t frags_count; /**< Number of fragments */
+    size_t frags_size; /**< Allocated size of fragments array */
+    MOBIKf8Link *links; /**< Links to positions in markup */
+    size_t links_count; /**< Number of links */
+    size_t links_size; /**< Allocated size of links array */
+} MOBIKf8Writer;
+
+/**
+ @brief Records of written document
+ */
+typedef struct {
+    MOBIBuffer **records; /**< Records data */
+    size_t count; /**< Number of records */
+    size_t size; /**< Allocated size of records array */
+} MOBIKf8Records;
+
+/**
+ @brief Index being written
+ */
+typedef struct {
+    MOBIBuffer *entries; /**< Serialized entries */
+    size_t *offsets; /**< Offsets of entries, entries_count + 1 values */
+    size_t entries_count; /**< Number of entries */
+    size_t offsets_size; /**< Allocated size of offsets array */
+    MOBIBuffer *cncx[CNCX_RECORD_MAXCNT]; /**< CNCX records */
+    size_t cncx_count; /**< Number of CNCX records */
+    uint32_t type; /**< Index type: 0 - normal, 2 - inflection */
+    uint32_t encoding; /**< Labels encoding, MOBI_UTF16 if labels are ORDT offsets */
+    const uint16_t *ordt; /**< ORDT2 table, UTF-16 code unit of each offset, NULL if not used */
+    size_t ordt_count; /**< Number of ORDT2 entries */
+    uint32_t ordt_type; /**< ORDT offsets size: 0 - 16 bit, 1 - 8 bit */
+} MOBIIndxWriter;
+
+/**
+ @brief Text records compression job
+ */
+typedef struct {
+    const unsigned char *text; /**< Text data */
+    size_t text_length; /**< Text length */
+    MOBIBuffer **records; /**< Text records, first one at index 0 */
+    size_t first; /**< First record compressed by the job */
+    size_t last; /**< Record following last record compressed by the job */
+    MOBI_RET ret; /**< Job result */
+} MOBIKf8CompressJob;
+
+/** @brief TAGX tags of skeleton index */
+static const TAGXTags mobi_kf8_skel_tags[] = {
+    { 1, 1, 3, 0 }, /* fragments count */
+    { 6, 2, 12, 0 }, /* position, length */
+    { 0, 0, 0, 1 }
+};
+
+/** @brief TAGX tags of fragments index */
+static const TAGXTags mobi_kf8_frag_tags[] = {
+    { 2, 1, 1, 0 }, /* aid cncx offset */
+    { 3, 1, 2, 0 }, /* file number */
+    { 4, 1, 4, 0 }, /* sequence number */
+    { 6, 2, 8, 0 }, /* position, length */
+    { 0, 0, 0, 1 }
+};
+
+/** @brief TAGX tags of guide index */
+static const TAGXTags mobi_kf8_guide_tags[] = {
+    { 1, 1, 1, 0 }, /* title cncx offset */
+    { 6, 2, 2, 0 }, /* pos fid, pos off */
+    { 0, 0, 0, 1 }
+};
+
+/** @brief TAGX tags of ncx index */
+static const TAGXTags mobi_kf8_ncx_tags[] = {
+    { 1, 1, 1, 0 }, /* offset */
+    { 2, 1, 2, 0 }, /* length */
+    { 3, 1, 4, 0 }, /* label cncx offset */
+    { 4, 1, 8, 0 }, /* depth */
+    { 21, 1, 16, 0 }, /* parent */
+    { 22, 1, 32, 0 }, /* first child */
+    { 23, 1, 64, 0 }, /* last child */
+    { 6, 2, 128, 0 }, /* pos fid, pos off */
+    { 0, 0, 0, 1 }
+};
+
+#define ARRAYSIZE(arr) (sizeof(arr) / sizeof((arr)[0])) /**< Number of elements in static array */
+
+/**
+ @brief Encode value as base32 string of given length, as used in kindle: links
+
+ @param[out] out Output, not null terminated
+ @param[in] value Value
+ @param[in] digits Number of digits
+ */
+static void mobi_kf8_base32(char *out, uint32_t value, size_t digits) {
+    const char alphabet[] = "0123456789ABCDEFGHIJKLMNOPQRSTUV";
+    while (digits--) {
+        out[digits] = alphabet[value & 0x1f];
+        value >>= 5;
+    }
+}
+
+/**
+ @brief Get data of a part, decompress it if needed
+
+ @param[out] data Part data, allocated if part is compressed, see mobi_kf8_part_data_free()
+ @param[in] part Part
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_part_data(unsigned char **data, const MOBIPart *part) {
+    *data = part->data;
+    if (part->data != NULL || part->size == 0) {
+        return MOBI_SUCCESS;
+    }
+    unsigned char *copy = malloc(part->size);
+    if (copy == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t size = part->size;
+    const MOBI_RET ret = mobi_part_read(part, copy, 0, &size);
+    if (ret != MOBI_SUCCESS || size != part->size) {
+        free(copy);
+        return ret != MOBI_SUCCESS ? ret : MOBI_DATA_CORRUPT;
+    }
+    *data = copy;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free data returned by mobi_kf8_part_data()
+
+ @param[in] data Part data
+ @param[in] part Part
+ */
+static void mobi_kf8_part_data_free(unsigned char *data, const MOBIPart *part) {
+    if (data != part->data) {
+        free(data);
+    }
+}
+
+/**
+ @brief Add record to records list, takes ownership of the buffer
+
+ @param[in,out] records Records list
+ @param[in] buf Record data, freed on failure
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_add_record(MOBIKf8Records *records, MOBIBuffer *buf) {
     if (buf == NULL) {
-        return NULL;
+        return MOBI_MALLOC_FAILED;
     }
-    buffer_addstring(buf, title);
-    buffer_addzeros(buf, PALMDB_NAME_SIZE_MAX - len);
-    buffer_add16(buf, PALMDB_ATTRIBUTE_DEFAULT);
-    buffer_add16(buf, PALMDB_VERSION_DEFAULT);
-    buffer_add32(buf, curtime); /* ctime */
-    buffer_add32(buf, curtime); /* mtime */
-    buffer_add32(buf, 0); /* btime */
-    buffer_add32(buf, PALMDB_MODNUM_DEFAULT);
-    buffer_add32(buf, PALMDB_APPINFO_DEFAULT);
-    buffer_add32(buf, PALMDB_SORTINFO_DEFAULT);
-    buffer_addstring(buf, PALMDB_TYPE_DEFAULT);
-    buffer_addstring(buf, PALMDB_CREATOR_DEFAULT);
-    buffer_add32(buf, uid);
-    buffer_add32(buf, PALMDB_NEXTREC_DEFAULT);
-    buffer_add16(buf, rec_count);
-    return buf;
+    if (buf->error != MOBI_SUCCESS) {
+        const MOBI_RET ret = buf->error;
+        buffer_free(buf);
+        return ret;
+    }
+    if (records->count == records->size) {
+        const size_t new_size = records->size ? 2 * records->size : 64;
+        MOBIBuffer **tmp = realloc(records->records, new_size * sizeof(MOBIBuffer *));
+        if (tmp == NULL) {
+            buffer_free(buf);
+            debug_print("%s", "Memory allocation failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        records->records = tmp;
+        records->size = new_size;
+    }
+    records->records[records->count++] = buf;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free records list
+
+ @param[in,out] records Records list
+ */
+static void mobi_kf8_free_records(MOBIKf8Records *records) {
+    for (size_t i = 0; i < records->count; i++) {
+        if (records->records[i]) {
+            buffer_free(records->records[i]);
+        }
+    }
+    free(records->records);
+    records->records = NULL;
+    records->count = records->size = 0;
+}
+
+/**
+ @brief Pad buffer with zeroes to multiple of four bytes
+
+ @param[in,out] buf Buffer
+ */
+static void mobi_kf8_pad4(MOBIBuffer *buf) {
+    const size_t padding = (4 - (buf->offset & 3)) & 3;
+    buffer_reserve(buf, padding);
+    buffer_addzeros(buf, padding);
+}
+
+/**
+ @brief Overwrite 32-bit value at given offset of buffer
+
+ @param[in,out] buf Buffer
+ @param[in] offset Offset of value
+ @param[in] value Value
+ */
+static void mobi_kf8_set32(MOBIBuffer *buf, const size_t offset, const uint32_t value) {
+    const size_t saved = buf->offset;
+    buf->offset = offset;
+    buffer_add32(buf, value);
+    buf->offset = saved;
+}
+
+/**
+ @brief Initialize index writer
+
+ @param[in,out] indx Index writer
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_indx_writer_init(MOBIIndxWriter *indx) {
+    memset(indx, 0, sizeof(MOBIIndxWriter));
+    indx->encoding = MOBI_UTF8;
+    indx->entries = buffer_init(RECORD0_TEXT_SIZE_MAX);
+    if (indx->entries == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free index writer
+
+ @param[in,out] indx Index writer
+ */
+static void mobi_indx_writer_free(MOBIIndxWriter *indx) {
+    if (indx->entries) {
+        buffer_free(indx->entries);
+    }
+    free(indx->offsets);
+    for (size_t i = 0; i < indx->cncx_count; i++) {
+        if (indx->cncx[i]) {
+            buffer_free(indx->cncx[i]);
+        }
+    }
+    memset(indx, 0, sizeof(MOBIIndxWriter));
+}
+
+/**
+ @brief Add string to CNCX records of the index
+
+ Upper 16 bits of the offset select CNCX record, see mobi_get_cncx_string().
+
+ @param[in,out] indx Index writer
+ @param[out] offset Offset of the string
+ @param[in] string String
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_indx_add_cncx(MOBIIndxWriter *indx, uint32_t *offset, const char *string) {
+    size_t length = strlen(string);
+    if (length > CNCX_RECORD_SIZEMAX - 8) {
+        length = CNCX_RECORD_SIZEMAX - 8;
+    }
+    const size_t needed = length + 4;
+    MOBIBuffer *cncx = indx->cncx_count ? indx->cncx[indx->cncx_count - 1] : NULL;
+    if (cncx == NULL || cncx->offset + needed > CNCX_RECORD_SIZEMAX) {
+        if (indx->cncx_count == CNCX_RECORD_MAXCNT) {
+            debug_print("%s", "Too many CNCX records\n");
+            return MOBI_PARAM_ERR;
+        }
+        cncx = buffer_init(needed > 1024 ? needed : 1024);
+        if (cncx == NULL) {
+            return MOBI_MALLOC_FAILED;
+        }
+        indx->cncx[indx->cncx_count++] = cncx;
+    }
+    *offset = (uint32_t) ((indx->cncx_count - 1) << 16 | cncx->offset);
+    buffer_reserve(cncx, needed);
+    buffer_add_varlen(cncx, (uint32_t) length);
+    buffer_addraw(cncx, (const unsigned char *) string, length);
+    return cncx->error;
+}
+
+/**
+ @brief Add entry to the index
+
+ Each present tag is stored once, with its values_count values taken from values array.
+
+ @param[in,out] indx Index writer
+ @param[in] tags TAGX tags of the index, single control byte
+ @param[in] tags_count Number of tags
+ @param[in] label Entry label
+ @param[in] values Values of all tags in TAGX order, including absent ones
+ @param[in] present Array of flags for each tag, NULL if all tags are present
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_indx_add_entry(MOBIIndxWriter *indx, const TAGXTags *tags, const size_t tags_count, const char *label, const uint32_t *values, const bool *present) {
+    const size_t label_length = strlen(label);
+    if (label_length == 0 || label_length > INDX_ENTRY_LABEL_MAX) {
+        debug_print("Wrong index label length (%zu)\n", label_length);
+        return MOBI_PARAM_ERR;
+    }
+    if (indx->entries_count + 2 > indx->offsets_size) {
+        const size_t new_size = indx->offsets_size ? 2 * indx->offsets_size : 256;
+        size_t *tmp = realloc(indx->offsets, new_size * sizeof(size_t));
+        if (tmp == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        indx->offsets = tmp;
+        indx->offsets_size = new_size;
+    }
+    MOBIBuffer *buf = indx->entries;
+    indx->offsets[indx->entries_count] = buf->offset;
+    uint8_t control_byte = 0;
+    size_t values_count = 0;
+    for (size_t i = 0; i < tags_count; i++) {
+        if (tags[i].control_byte == 0 && (present == NULL || present[i])) {
+            /* lowest bit of the mask, tag is present once */
+            control_byte |= tags[i].bitmask & (uint8_t) -tags[i].bitmask;
+        }
+        values_count += tags[i].values_count;
+    }
+    buffer_reserve(buf, 2 + label_length + 4 * values_count);
+    buffer_add8(buf, (uint8_t) label_length);
+    buffer_addraw(buf, (const unsigned char *) label, label_length);
+    buffer_add8(buf, control_byte);
+    size_t v = 0;
+    for (size_t i = 0; i < tags_count; i++) {
+        for (size_t j = 0; j < tags[i].values_count; j++) {
+            if (present == NULL || present[i]) {
+                buffer_add_varlen(buf, values[v]);
+            }
+            v++;
+        }
+    }
+    if (buf->error != MOBI_SUCCESS) {
+        return buf->error;
+    }
+    indx->entries_count++;
+    indx->offsets[indx->entries_count] = buf->offset;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Size of index data record with given entries
+
+ @param[in] entries_size Size of entries
+ @param[in] entries_count Number of entries
+ @return Record size
+ */
+static size_t mobi_indx_record_size(const size_t entries_size, const size_t entries_count) {
+    return INDX_HEADER_LEN + entries_size + 4 + 2 * entries_count + 3;
 }
 
-/* FIXME test */
-MOBIBuffer * serialize_record0_header(void) {
-    uint32_t text_length = 0;
-    uint16_t record_count = 0;
-    MOBIBuffer *buf = buffer_init(RECORD0_HEADER_LEN);
+/**
+ @brief Serialize index into records: header record with TAGX, data records and CNCX records
+
+ @param[in,out] records Records list
+ @param[in,out] indx Index writer, CNCX records are moved to records list
+ @param[in] tags TAGX tags of the index
+ @param[in] tags_count Number of tags
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_indx_write(MOBIKf8Records *records, MOBIIndxWriter *indx, const TAGXTags *tags, const size_t tags_count) {
+    if (indx->entries_count == 0) {
+        return MOBI_PARAM_ERR;
+    }
+    /* split entries into data records */
+    size_t *first_entries = malloc((indx->entries_count + 1) * sizeof(size_t));
+    if (first_entries == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t data_count = 0;
+    size_t first = 0;
+    first_entries[data_count++] = 0;
+    for (size_t i = 0; i < indx->entries_count; i++) {
+        const size_t size = indx->offsets[i + 1] - indx->offsets[first];
+        const size_t count = i + 1 - first;
+        if (count > 1 && (count > INDX_RECORD_MAXCNT || mobi_indx_record_size(size, count) > INDX_RECORD_SIZEMAX)) {
+            first = i;
+            first_entries[data_count++] = i;
+        }
+    }
+    first_entries[data_count] = indx->entries_count;
+    /* header record */
+    MOBIBuffer *buf = buffer_init(INDX_RECORD_SIZEMAX);
     if (buf == NULL) {
-        return NULL;
+        free(first_entries);
+        return MOBI_MALLOC_FAILED;
     }
-    buffer_add16(buf, RECORD0_NO_COMPRESSION);
-    buffer_add16(buf, 0);
-    buffer_add32(buf, text_length);
-    buffer_add16(buf, record_count);
-    buffer_add16(buf, RECORD0_TEXT_SIZE_MAX);
-    buffer_add16(buf, RECORD0_NO_ENCRYPTION);
-    buffer_add16(buf, 0);
-    return buf;
+    buffer_addstring(buf, INDX_MAGIC);
+    buffer_add32(buf, INDX_HEADER_LEN);
+    buffer_add32(buf, 0);
+    buffer_add32(buf, indx->type);
+    buffer_add32(buf, 0);
+    buffer_add32(buf, 0); /* IDXT offset, set below */
+    buffer_add32(buf, (uint32_t) data_count);
+    buffer_add32(buf, indx->encoding);
+    buffer_add32(buf, MOBI_NOTSET);
+    buffer_add32(buf, (uint32_t) indx->entries_count);
+    buffer_add32(buf, 0); /* ORDT offset */
+    buffer_add32(buf, 0); /* LIGT offset */
+    buffer_add32(buf, 0); /* LIGT entries count */
+    buffer_add32(buf, (uint32_t) indx->cncx_count);
+    buffer_addzeros(buf, INDX_HEADER_LEN - buf->offset);
+    size_t control_bytes = 0;
+    for (size_t i = 0; i < tags_count; i++) {
+        control_bytes += tags[i].control_byte;
+    }
+    buffer_addstring(buf, TAGX_MAGIC);
+    buffer_add32(buf, (uint32_t) (12 + 4 * tags_count));
+    buffer_add32(buf, (uint32_t) control_bytes);
+    for (size_t i = 0; i < tags_count; i++) {
+        buffer_add8(buf, tags[i].tag);
+        buffer_add8(buf, tags[i].values_count);
+        buffer_add8(buf, tags[i].bitmask);
+        buffer_add8(buf, tags[i].control_byte);
+    }
+    /* geometry: last label and entries count of each data record */
+    uint16_t *geometry = malloc(data_count * sizeof(uint16_t));
+    if (geometry == NULL) {
+        buffer_free(buf);
+        free(first_entries);
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t r = 0; r < data_count; r++) {
+        const size_t last = first_entries[r + 1] - 1;
+        const unsigned char *entry = indx->entries->data + indx->offsets[last];
+        geometry[r] = (uint16_t) buf->offset;
+        buffer_reserve(buf, 1 + entry[0] + 2);
+        buffer_addraw(buf, entry, 1 + (size_t) entry[0]);
+        buffer_add16(buf, (uint16_t) (first_entries[r + 1] - first_entries[r]));
+    }
+    mobi_kf8_pad4(buf);
+    mobi_kf8_set32(buf, 20, (uint32_t) buf->offset);
+    buffer_reserve(buf, 4 + 2 * data_count + 3);
+    buffer_addstring(buf, IDXT_MAGIC);
+    for (size_t r = 0; r < data_count; r++) {
+        buffer_add16(buf, geometry[r]);
+    }
+    mobi_kf8_pad4(buf);
+    free(geometry);
+    if (indx->ordt) {
+        /* ORDT2 only, reader does not use ORDT1 */
+        mobi_kf8_set32(buf, 164, indx->ordt_type);
+        mobi_kf8_set32(buf, 168, (uint32_t) indx->ordt_count);
+        mobi_kf8_set32(buf, 176, (uint32_t) buf->offset);
+        buffer_reserve(buf, 4 + 2 * indx->ordt_count + 3);
+        buffer_addstring(buf, ORDT_MAGIC);
+        for (size_t i = 0; i < indx->ordt_count; i++) {
+            buffer_add16(buf, indx->ordt[i]);
+        }
+        mobi_kf8_pad4(buf);
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (buf->offset > INDX_RECORD_SIZEMAX) {
+        /* geometry offsets are 16-bit */
+        debug_print("Index header record too long (%zu)\n", buf->offset);
+        buffer_free(buf);
+        ret = MOBI_PARAM_ERR;
+    } else {
+        ret = mobi_kf8_add_record(records, buf);
+    }
+    /* data records */
+    for (size_t r = 0; ret == MOBI_SUCCESS && r < data_count; r++) {
+        const size_t entry_first = first_entries[r];
+        const size_t entry_last = first_entries[r + 1];
+        const size_t count = entry_last - entry_first;
+        const size_t size = indx->offsets[entry_last] - indx->offsets[entry_first];
+        buf = buffer_init(mobi_indx_record_size(size, count));
+        if (buf == NULL) {
+            ret = MOBI_MALLOC_FAILED;
+            break;
+        }
+        buffer_addstring(buf, INDX_MAGIC);
+        buffer_add32(buf, INDX_HEADER_LEN);
+        buffer_add32(buf, 0);
+        buffer_add32(buf, 1);
+        buffer_add32(buf, 0);
+        buffer_add32(buf, (uint32_t) (INDX_HEADER_LEN + size)); /* IDXT offset */
+        buffer_add32(buf, (uint32_t) count);
+        buffer_add32(buf, MOBI_NOTSET);
+        buffer_add32(buf, MOBI_NOTSET);
+        buffer_addzeros(buf, INDX_HEADER_LEN - buf->offset);
+        buffer_addraw(buf, indx->entries->data + indx->offsets[entry_first], size);
+        buffer_addstring(buf, IDXT_MAGIC);
+        for (size_t i = entry_first; i < entry_last; i++) {
+            buffer_add16(buf, (uint16_t) (INDX_HEADER_LEN + indx->offsets[i] - indx->offsets[entry_first]));
+        }
+        mobi_kf8_pad4(buf);
+        ret = mobi_kf8_add_record(records, buf);
+    }
+    free(first_entries);
+    /* CNCX records */
+    for (size_t i = 0; i < indx->cncx_count; i++) {
+        MOBIBuffer *cncx = indx->cncx[i];
+        indx->cncx[i] = NULL;
+        if (ret == MOBI_SUCCESS) {
+            mobi_kf8_pad4(cncx);
+            ret = mobi_kf8_add_record(records, cncx);
+        } else {
+            buffer_free(cncx);
+        }
+    }
+    indx->cncx_count = 0;
+    return ret;
 }
 
-void buffer_output(FILE *file, MOBIBuffer *buf) {
-    if (file) {
-        fwrite(buf->data, 1, buf->offset, file);
-        printf("Buffer length %zu bytes\n", buf->offset);
+/**
+ @brief Compare id attributes by value, then by offset
+
+ @param[in] a First MOBIKf8Id
+ @param[in] b Second MOBIKf8Id
+ @return Comparison result as in qsort()
+ */
+static int mobi_kf8_id_compare(const void *a, const void *b) {
+    const MOBIKf8Id *id1 = a;
+    const MOBIKf8Id *id2 = b;
+    const size_t length = id1->length < id2->length ? id1->length : id2->length;
+    const int cmp = memcmp(id1->value, id2->value, length);
+    if (cmp) {
+        return cmp;
     }
-    buffer_free(buf);
+    if (id1->length != id2->length) {
+        return id1->length < id2->length ? -1 : 1;
+    }
+    return (id1->offset > id2->offset) - (id1->offset < id2->offset);
+}
+
+/**
+ @brief Build sorted array of id attributes of a markup file
+
+ Attribute must be preceded by white space and quoted,
+ the same way as it is searched by reader in mobi_get_attribute_value().
+
+ @param[in,out] file Markup file
+ @param[in] data File data
+ @param[in] size File size
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_build_ids(MOBIKf8File *file, const unsigned char *data, const size_t size) {
+    free(file->ids);
+    file->ids = NULL;
+    file->ids_count = 0;
+    size_t ids_size = 0;
+    for (size_t i = 1; i + 4 < size; i++) {
+        if (data[i] != 'i' || data[i + 1] != 'd' || data[i + 2] != '=' || !isspace(data[i - 1])) {
+            continue;
+        }
+        const unsigned char separator = data[i + 3];
+        if (separator != '"' && separator != '\'') {
+            continue;
+        }
+        size_t end = i + 4;
+        while (end < size && data[end] != separator && data[end] != '>') {
+            end++;
+        }
+        if (file->ids_count == ids_size) {
+            ids_size = ids_size ? 2 * ids_size : 64;
+            MOBIKf8Id *tmp = realloc(file->ids, ids_size * sizeof(MOBIKf8Id));
+            if (tmp == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
+            file->ids = tmp;
+        }
+        MOBIKf8Id *id = &file->ids[file->ids_count++];
+        id->value = data + i + 4;
+        id->length = end - (i + 4);
+        id->offset = i;
+        i = end;
+    }
+    if (file->ids_count > 1) {
+        qsort(file->ids, file->ids_count, sizeof(MOBIKf8Id), mobi_kf8_id_compare);
+    }
+    file->ids_ready = true;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Find offset of the first id attribute with given value
+
+ @param[in,out] file Markup file, ids array is built on first call
+ @param[in] value Attribute value
+ @param[out] offset Offset of "id=" string in file data
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_DATA_CORRUPT if not found
+ */
+static MOBI_RET mobi_kf8_find_id(MOBIKf8File *file, const char *value, size_t *offset) {
+    if (!file->ids_ready) {
+        const unsigned char *data = file->buf ? file->buf->data : file->source;
+        const size_t size = file->buf ? file->buf->offset : file->source_size;
+        const MOBI_RET ret = mobi_kf8_build_ids(file, data, size);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    const MOBIKf8Id key = { (const unsigned char *) value, strlen(value), 0 };
+    /* lower bound, first occurrence of the value */
+    size_t low = 0;
+    size_t high = file->ids_count;
+    while (low < high) {
+        const size_t mid = low + (high - low) / 2;
+        if (mobi_kf8_id_compare(&file->ids[mid], &key) < 0) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low == file->ids_count || file->ids[low].length != key.length ||
+        memcmp(file->ids[low].value, key.value, key.length) != 0) {
+        return MOBI_DATA_CORRUPT;
+    }
+    *offset = file->ids[low].offset;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Case insensitive comparison of data with lower case string
+
+ @param[in] data Data, at least as long as the string
+ @param[in] lower Lower case string
+ @return True if data matches the string
+ */
+static bool mobi_kf8_match_nocase(const unsigned char *data, const char *lower) {
+    for (size_t i = 0; lower[i]; i++) {
+        if (tolower(data[i]) != lower[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/**
+ @brief Find body element boundaries, skeleton consists of data outside of them
+
+ @param[out] body_start Offset of "<body" tag or zero if not found
+ @param[out] body_end Offset of "</body" tag or size if not found
+ @param[in] data Markup data
+ @param[in] size Markup size
+ */
+static void mobi_kf8_find_body(size_t *body_start, size_t *body_end, const unsigned char *data, const size_t size) {
+    size_t start = SIZE_MAX;
+    size_t end = SIZE_MAX;
+    for (size_t i = 0; i + 6 <= size; i++) {
+        if (data[i] != '<') {
+            continue;
+        }
+        if (start == SIZE_MAX && mobi_kf8_match_nocase(data + i + 1, "body")) {
+            const unsigned char next = data[i + 5];
+            if (isspace(next) || next == '>' || next == '/') {
+                start = i;
+            }
+        } else if (start != SIZE_MAX && i + 7 <= size && mobi_kf8_match_nocase(data + i + 1, "/body")) {
+            end = i;
+        }
+    }
+    if (start == SIZE_MAX || end == SIZE_MAX) {
+        *body_start = 0;
+        *body_end = size;
+        return;
+    }
+    *body_start = start;
+    *body_end = end;
+}
+
+/**
+ @brief Parse reconstructed part file name, like "resource00000.jpg"
+
+ @param[out] uid Part number
+ @param[in] name Name, not null terminated
+ @param[in] length Name length
+ @param[in] prefix Expected prefix
+ @return Length of parsed name, including extension, zero if name does not match
+ */
+static size_t mobi_kf8_parse_filename(size_t *uid, const unsigned char *name, const size_t length, const char *prefix) {
+    const size_t prefix_length = strlen(prefix);
+    if (length < prefix_length || memcmp(name, prefix, prefix_length) != 0) {
+        return 0;
+    }
+    size_t i = prefix_length;
+    size_t value = 0;
+    while (i < length && isdigit(name[i])) {
+        if (value > 0xfffffff) {
+            return 0;
+        }
+        value = 10 * value + (size_t) (name[i++] - '0');
+    }
+    if (i - prefix_length < 5 || i == length || name[i] != '.') {
+        return 0;
+    }
+    const size_t extension_start = ++i;
+    while (i < length && isalnum(name[i])) {
+        i++;
+    }
+    if (i == extension_start) {
+        return 0;
+    }
+    *uid = value;
+    return i;
+}
+
+/**
+ @brief Write link to buffer, optionally enclosed in quotation marks
+
+ @param[in,out] out Output buffer
+ @param[in] link Link
+ @param[in] suffix Appended to link, may be NULL
+ @param[in] quoted Enclose in quotation marks if true
+ */
+static void mobi_kf8_add_string(MOBIBuffer *out, const char *link, const char *suffix, const bool quoted) {
+    const size_t link_length = strlen(link);
+    const size_t suffix_length = suffix ? strlen(suffix) : 0;
+    buffer_reserve(out, link_length + suffix_length + 2);
+    if (quoted) {
+        buffer_add8(out, '"');
+    }
+    buffer_addraw(out, (const unsigned char *) link, link_length);
+    if (suffix_length) {
+        buffer_addraw(out, (const unsigned char *) suffix, suffix_length);
+    }
+    if (quoted) {
+        buffer_add8(out, '"');
+    }
+}
+
+/**
+ @brief Check if target of link to markup file exists
+
+ @param[in,out] w Writer
+ @param[in] target Target file number
+ @param[in] id Target id or NULL
+ @return True if link can be resolved
+ */
+static bool mobi_kf8_target_exists(MOBIKf8Writer *w, const size_t target, const char *id) {
+    if (target >= w->files_count) {
+        return false;
+    }
+    MOBIKf8File *file = &w->files[target];
+    size_t body_start, body_end;
+    mobi_kf8_find_body(&body_start, &body_end, file->source, file->source_size);
+    if (body_start == body_end) {
+        /* no fragments */
+        return false;
+    }
+    if (id == NULL || *id == '\0') {
+        return true;
+    }
+    size_t offset;
+    return mobi_kf8_find_id(file, id, &offset) == MOBI_SUCCESS;
+}
+
+/**
+ @brief Replace link to reconstructed part with kindle: link
+
+ Links to markup files are written as placeholders, see mobi_kf8_resolve_links().
+
+ @param[in,out] w Writer
+ @param[in,out] out Output buffer
+ @param[in] token Attribute value, may be quoted
+ @param[in] length Value length
+ @param[in] file Number of markup file containing the link, SIZE_MAX for flows
+ @param[in] is_url True if value is part of css url(), written without quotation marks
+ @param[out] replaced Set to true if link was written
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_add_link(MOBIKf8Writer *w, MOBIBuffer *out, const unsigned char *token, size_t length, const size_t file, const bool is_url, bool *replaced) {
+    *replaced = false;
+    if (length >= 2 && (token[0] == '"' || token[0] == '\'') && token[length - 1] == token[0]) {
+        token++;
+        length -= 2;
+    }
+    if (length < sizeof("flow00000.x") - 1) {
+        return MOBI_SUCCESS;
+    }
+    size_t uid;
+    size_t name_length;
+    char link[MOBI_ATTRNAME_MAXSIZE + 1];
+    if (token[0] == 'p') {
+        name_length = mobi_kf8_parse_filename(&uid, token, length, "part");
+        if (file == SIZE_MAX || name_length < sizeof(".html") || memcmp(token + name_length - 5, ".html", 5) != 0 ||
+            (name_length < length && token[name_length] != '#')) {
+            return MOBI_SUCCESS;
+        }
+        char *id = NULL;
+        if (name_length < length) {
+            const size_t id_length = length - name_length - 1;
+            id = malloc(id_length + 1);
+            if (id == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
+            memcpy(id, token + name_length + 1, id_length);
+            id[id_length] = '\0';
+        }
+        if (!mobi_kf8_target_exists(w, uid, id)) {
+            debug_print("Skipping unresolved link: part%05zu.html#%s\n", uid, id ? id : "");
+            free(id);
+            return MOBI_SUCCESS;
+        }
+        if (w->links_count == w->links_size) {
+            const size_t new_size = w->links_size ? 2 * w->links_size : 256;
+            MOBIKf8Link *tmp = realloc(w->links, new_size * sizeof(MOBIKf8Link));
+            if (tmp == NULL) {
+                free(id);
+                debug_print("%s", "Memory allocation failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
+            w->links = tmp;
+            w->links_size = new_size;
+        }
+        MOBIKf8Link *pos_link = &w->links[w->links_count++];
+        pos_link->file = file;
+        pos_link->offset = out->offset + !is_url;
+        pos_link->target = uid;
+        pos_link->id = id;
+        mobi_kf8_add_string(out, KF8_POSFID_LINK, NULL, !is_url);
+    } else if (token[0] == 'f') {
+        name_length = mobi_kf8_parse_filename(&uid, token, length, "flow");
+        if (name_length != length || uid == 0 || uid > w->flows_count) {
+            return MOBI_SUCCESS;
+        }
+        const MOBIFileMeta meta = mobi_get_filemeta_by_type(w->flow_parts[uid - 1]->type);
+        strcpy(link, "kindle:flow:0000?mime=");
+        mobi_kf8_base32(link + sizeof("kindle:flow:") - 1, (uint32_t) uid, 4);
+        mobi_kf8_add_string(out, link, meta.mime_type, !is_url);
+    } else if (token[0] == 'r') {
+        name_length = mobi_kf8_parse_filename(&uid, token, length, "resource");
+        if (name_length != length || uid >= w->resources_count || w->resources[uid] == NULL) {
+            return MOBI_SUCCESS;
+        }
+        const MOBIFiletype type = w->resources[uid]->type;
+        const MOBIFileMeta meta = mobi_get_filemeta_by_type(type);
+        strcpy(link, "kindle:embed:0000");
+        mobi_kf8_base32(link + sizeof("kindle:embed:") - 1, (uint32_t) (uid + 1), 4);
+        if (type == T_JPG || type == T_GIF || type == T_PNG || type == T_BMP) {
+            strcat(link, "?mime=");
+            mobi_kf8_add_string(out, link, meta.mime_type, !is_url);
+        } else {
+            mobi_kf8_add_string(out, link, NULL, !is_url);
+        }
+    } else {
+        return MOBI_SUCCESS;
+    }
+    if (out->error != MOBI_SUCCESS) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    *replaced = true;
+    return MOBI_SUCCESS;
 }
 
-/* FIXME test */
-MOBIPdbRecord * build_pdbrecord(uint32_t offset) {
-    MOBIPdbRecord *record = NULL;
-    record = malloc(sizeof(MOBIPdbRecord));
-    record->data = malloc(RECORD0_TEXT_SIZE_MAX);
-    char test[] = "<html><body>test</body></html>";
-    memcpy(record->data, test, strlen(test));
-    if (record->data == NULL) {
-		free(record);
-		return NULL;
-	}
-    record->offset = offset;
-    record->size = offset;
-    record->attributes = 0;
-    record->uid = 0;
-    return record;
-}
-
-MOBIBuffer * serialize_record_info(MOBIPdbRecord *rec) {
-    MOBIBuffer *buf = buffer_init(8);
+/**
+ @brief Replace links to reconstructed parts with kindle: links
+
+ Attribute values are found the same way as kindle: links are found by mobi_find_attrvalue()
+
+ @param[in,out] w Writer
+ @param[out] out Buffer with rewritten data, allocated by the function
+ @param[in] data Source data
+ @param[in] size Source data size
+ @param[in] type Part type
+ @param[in] file Number of markup file, SIZE_MAX for flows
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_rewrite_links(MOBIKf8Writer *w, MOBIBuffer **out, const unsigned char *data, const size_t size, const MOBIFiletype type, const size_t file) {
+    MOBIBuffer *buf = buffer_init(size + MOBI_ATTRVALUE_MAXSIZE);
     if (buf == NULL) {
-        return NULL;
+        return MOBI_MALLOC_FAILED;
     }
-    buffer_add32(buf, rec->offset);
-    /* skip attributes, always 0; */
-    buffer_add32(buf, rec->uid);
-    return buf;
+    unsigned char tag_open = '<';
+    unsigned char tag_close = '>';
+    if (type == T_CSS) {
+        tag_open = '{';
+        tag_close = '}';
+    }
+    unsigned char last_border = tag_close;
+    size_t copied = 0;
+    size_t i = 0;
+    while (i < size) {
+        const unsigned char c = data[i];
+        if (c == tag_open || c == tag_close) {
+            last_border = c;
+        } else if (last_border == tag_open && (c == '=' || c == '(' || isspace(c))) {
+            const size_t start = i + 1;
+            size_t end = start;
+            while (end < size && !isspace(data[end]) && data[end] != tag_close && data[end] != ')') {
+                end++;
+            }
+            /* self closing tag '/>' */
+            if (end > start && end < size && data[end - 1] == '/' && data[end] == '>') {
+                end--;
+            }
+            if (end - start >= sizeof("flow00000.x") - 1) {
+                buffer_reserve(buf, start - copied);
+                buffer_addraw(buf, data + copied, start - copied);
+                copied = start;
+                bool replaced;
+                const MOBI_RET ret = mobi_kf8_add_link(w, buf, data + start, end - start, file, c == '(', &replaced);
+                if (ret != MOBI_SUCCESS) {
+                    buffer_free(buf);
+                    return ret;
+                }
+                if (replaced) {
+                    copied = i = end;
+                    continue;
+                }
+            }
+        }
+        i++;
+    }
+    buffer_reserve(buf, size - copied);
+    buffer_addraw(buf, data + copied, size - copied);
+    if (buf->error != MOBI_SUCCESS) {
+        buffer_free(buf);
+        return MOBI_MALLOC_FAILED;
+    }
+    *out = buf;
+    return MOBI_SUCCESS;
 }
 
-MOBIBuffer * serialize_pdbrecord(MOBIPdbRecord *rec) {
-    MOBIBuffer *buf = buffer_init(RECORD0_TEXT_SIZE_MAX);
-    if (buf) {
-        buffer_addraw(buf, rec->data, rec->size);
+/**
+ @brief Split body of rewritten markup file into fragments
+
+ Fragments start at tag opening character, after at least KF8_FRAGMENT_SIZE bytes.
+
+ @param[in,out] w Writer
+ @param[in] file_number File number
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_split_file(MOBIKf8Writer *w, const size_t file_number) {
+    MOBIKf8File *file = &w->files[file_number];
+    const unsigned char *data = file->buf->data;
+    mobi_kf8_find_body(&file->body_start, &file->body_end, data, file->buf->offset);
+    file->frag_first = w->frags_count;
+    size_t start = file->body_start;
+    while (start < file->body_end) {
+        size_t end = start + KF8_FRAGMENT_SIZE;
+        if (end >= file->body_end) {
+            end = file->body_end;
+        } else {
+            const unsigned char *next = memchr(data + end, '<', file->body_end - end);
+            end = next ? (size_t) (next - data) : file->body_end;
+        }
+        if (w->frags_count == w->frags_size) {
+            const size_t new_size = w->frags_size ? 2 * w->frags_size : 256;
+            MOBIKf8Fragment *tmp = realloc(w->frags, new_size * sizeof(MOBIKf8Fragment));
+            if (tmp == NULL) {
+                debug_print("%s", "Memory allocation failed\n");
+                return MOBI_MALLOC_FAILED;
+            }
+            w->frags = tmp;
+            w->frags_size = new_size;
+        }
+        MOBIKf8Fragment *frag = &w->frags[w->frags_count++];
+        frag->file = file_number;
+        frag->start = start;
+        frag->size = end - start;
+        start = end;
     }
-    return buf;
+    file->frag_count = w->frags_count - file->frag_first;
+    return MOBI_SUCCESS;
 }
 
-MOBIBuffer * serialize_file_end(void) {
-    const unsigned char end[4] = EOF_MAGIC;
-    MOBIBuffer *buf = buffer_init(4);
-    if (buf) {
-        buffer_addraw(buf, end, 4);
+/**
+ @brief Find fragment and offset of position in markup file
+
+ @param[in,out] w Writer
+ @param[out] pos_fid Fragment index
+ @param[out] pos_off Offset from fragment start
+ @param[in] target Target file number
+ @param[in] id Target id, empty string for end of file, NULL for top of file
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_DATA_CORRUPT if target is not found
+ */
+static MOBI_RET mobi_kf8_resolve(MOBIKf8Writer *w, uint32_t *pos_fid, uint32_t *pos_off, const size_t target, const char *id) {
+    if (target >= w->files_count || w->files[target].frag_count == 0) {
+        return MOBI_DATA_CORRUPT;
     }
-    return buf;
+    MOBIKf8File *file = &w->files[target];
+    *pos_fid = (uint32_t) file->frag_first;
+    *pos_off = 0;
+    if (id == NULL) {
+        return MOBI_SUCCESS;
+    }
+    size_t offset = file->buf->offset;
+    if (*id != '\0') {
+        const MOBI_RET ret = mobi_kf8_find_id(file, id, &offset);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    if (offset <= file->body_start) {
+        debug_print("Target in skeleton, linking to file start: part%05zu.html#%s\n", target, id);
+        return MOBI_SUCCESS;
+    }
+    /* last fragment starting before the target */
+    size_t low = file->frag_first;
+    size_t high = file->frag_first + file->frag_count;
+    while (high - low > 1) {
+        const size_t mid = low + (high - low) / 2;
+        if (w->frags[mid].start <= offset) {
+            low = mid;
+        } else {
+            high = mid;
+        }
+    }
+    *pos_fid = (uint32_t) low;
+    *pos_off = (uint32_t) (offset - w->frags[low].start);
+    return MOBI_SUCCESS;
 }
 
+/**
+ @brief Resolve placeholders of links to positions in markup files
 
-/* FIXME test */
-void write_mobi(void) {
-    FILE *file = fopen("test.mobi","wb");
-    if (file == NULL) {
-        printf("Could not open file for writing\n");
+ @param[in,out] w Writer
+ */
+static void mobi_kf8_resolve_links(MOBIKf8Writer *w) {
+    for (size_t i = 0; i < w->links_count; i++) {
+        const MOBIKf8Link *link = &w->links[i];
+        uint32_t pos_fid;
+        uint32_t pos_off;
+        if (mobi_kf8_resolve(w, &pos_fid, &pos_off, link->target, link->id) != MOBI_SUCCESS) {
+            /* id value was changed by rewriting, link to file start */
+            debug_print("Link target not found: part%05zu.html#%s\n", link->target, link->id);
+            pos_fid = (uint32_t) w->files[link->target].frag_first;
+            pos_off = 0;
+        }
+        char *placeholder = (char *) w->files[link->file].buf->data + link->offset;
+        mobi_kf8_base32(placeholder + KF8_POSFID_FID_OFFSET, pos_fid, 4);
+        mobi_kf8_base32(placeholder + KF8_POSFID_OFF_OFFSET, pos_off, 10);
+    }
+}
+
+/**
+ @brief Resolve target of table of contents or guide entry
+
+ Falls back to the start of the file or to the first fragment of the text if target is not found.
+
+ @param[in,out] w Writer
+ @param[out] pos_fid Fragment index
+ @param[out] pos_off Offset from fragment start
+ @param[in] target Target, "part00000.html" or "part00000.html#id"
+ */
+static void mobi_kf8_resolve_target(MOBIKf8Writer *w, uint32_t *pos_fid, uint32_t *pos_off, const char *target) {
+    *pos_fid = 0;
+    *pos_off = 0;
+    if (target == NULL) {
         return;
     }
-    MOBIBuffer *buf = serialize_palmdb_header();
-    printf("Writing palmdb header\n");
-    buffer_output(file, buf);
-    MOBIPdbRecord *rec = build_pdbrecord(PALMDB_HEADER_LEN + PALMDB_RECORD_INFO_SIZE + 2);
-    buf = serialize_record_info(rec);
-    buf->maxlen += 2;
-    buffer_addzeros(buf, 2);
-    printf("Writing record info + 2 zeros\n");
-    buffer_output(file, buf);
-    buf = serialize_record0_header();
-    printf("Writing record0 header\n");
-    buffer_output(file, buf);
-    buf = serialize_pdbrecord(rec);
-    /* TODO: improve freeing of rec buffer, see buffer_free */
-    free(rec->data);
-    free(rec);
-    printf("Writing pdb record\n");
-    buffer_output(file, buf);
-    buf = serialize_file_end();
-    printf("Writing 4 end chars\n");
-    buffer_output(file, buf);
-    
-    fclose(file);
+    size_t uid;
+    const size_t length = strlen(target);
+    const size_t name_length = mobi_kf8_parse_filename(&uid, (const unsigned char *) target, length, "part");
+    if (name_length == 0 || uid >= w->files_count || w->files[uid].frag_count == 0) {
+        debug_print("Target not found: %s\n", target);
+        return;
+    }
+    const char *id = (name_length < length && target[name_length] == '#') ? target + name_length + 1 : NULL;
+    if (mobi_kf8_resolve(w, pos_fid, pos_off, uid, id) != MOBI_SUCCESS) {
+        debug_print("Target id not found: %s\n", target);
+        *pos_fid = (uint32_t) w->files[uid].frag_first;
+        *pos_off = 0;
+    }
+}
+
+/**
+ @brief Absolute position in text of fragment and offset pair
+
+ @param[in] w Writer
+ @param[in] pos_fid Fragment index
+ @param[in] pos_off Offset from fragment start
+ @return Position in text
+ */
+static uint32_t mobi_kf8_text_position(const MOBIKf8Writer *w, const uint32_t pos_fid, const uint32_t pos_off) {
+    if (pos_fid >= w->frags_count) {
+        return 0;
+    }
+    const MOBIKf8Fragment *frag = &w->frags[pos_fid];
+    return (uint32_t) (w->files[frag->file].position + frag->start + pos_off);
+}
+
+/**
+ @brief Free writer data
+
+ @param[in,out] w Writer
+ */
+static void mobi_kf8_writer_free(MOBIKf8Writer *w) {
+    for (size_t i = 0; i < w->files_count; i++) {
+        MOBIKf8File *file = &w->files[i];
+        free(file->source_copy);
+        if (file->buf) {
+            buffer_free(file->buf);
+        }
+        free(file->ids);
+    }
+    free(w->files);
+    for (size_t i = 0; i < w->flows_count; i++) {
+        if (w->flows[i]) {
+            buffer_free(w->flows[i]);
+        }
+    }
+    free(w->flows);
+    free(w->flow_parts);
+    free(w->resources);
+    free(w->frags);
+    for (size_t i = 0; i < w->links_count; i++) {
+        free(w->links[i].id);
+    }
+    free(w->links);
+    memset(w, 0, sizeof(MOBIKf8Writer));
+}
+
+/**
+ @brief Load source parts into writer
+
+ @param[in,out] w Writer
+ @param[in] book Source document
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_writer_init(MOBIKf8Writer *w, const MOBIKf8Book *book) {
+    memset(w, 0, sizeof(MOBIKf8Writer));
+    const MOBIPart *part;
+    for (part = book->markup; part; part = part->next) {
+        w->files_count++;
+    }
+    for (part = book->flow; part; part = part->next) {
+        w->flows_count++;
+    }
+    for (part = book->resources; part; part = part->next) {
+        if (part->type != T_NCX && part->type != T_OPF && part->uid + 1 > w->resources_count) {
+            w->resources_count = part->uid + 1;
+        }
+    }
+    w->files = calloc(w->files_count, sizeof(MOBIKf8File));
+    w->flows = calloc(w->flows_count + 1, sizeof(MOBIBuffer *));
+    w->flow_parts = calloc(w->flows_count + 1, sizeof(MOBIPart *));
+    w->resources = calloc(w->resources_count + 1, sizeof(MOBIPart *));
+    if (w->files == NULL || w->flows == NULL || w->flow_parts == NULL || w->resources == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t i = 0;
+    for (part = book->markup; part; part = part->next) {
+        MOBIKf8File *file = &w->files[i++];
+        unsigned char *data;
+        const MOBI_RET ret = mobi_kf8_part_data(&data, part);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        if (data != part->data) {
+            file->source_copy = data;
+        }
+        file->source = data;
+        file->source_size = part->size;
+    }
+    i = 0;
+    for (part = book->flow; part; part = part->next) {
+        w->flow_parts[i++] = part;
+    }
+    for (part = book->resources; part; part = part->next) {
+        if (part->type == T_NCX || part->type == T_OPF) {
+            continue;
+        }
+        if (w->resources[part->uid]) {
+            debug_print("Duplicate resource uid: %zu\n", part->uid);
+            return MOBI_PARAM_ERR;
+        }
+        w->resources[part->uid] = part;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Rewrite links in all markup files and flows, split markup files into fragments
+
+ @param[in,out] w Writer
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_prepare_parts(MOBIKf8Writer *w) {
+    MOBI_RET ret;
+    for (size_t i = 0; i < w->files_count; i++) {
+        MOBIKf8File *file = &w->files[i];
+        ret = mobi_kf8_rewrite_links(w, &file->buf, file->source, file->source_size, T_HTML, i);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    for (size_t i = 0; i < w->flows_count; i++) {
+        const MOBIPart *part = w->flow_parts[i];
+        unsigned char *data;
+        ret = mobi_kf8_part_data(&data, part);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        ret = mobi_kf8_rewrite_links(w, &w->flows[i], data, part->size, part->type, SIZE_MAX);
+        mobi_kf8_part_data_free(data, part);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    /* source data is no longer needed, ids will be searched in rewritten files */
+    size_t position = 0;
+    for (size_t i = 0; i < w->files_count; i++) {
+        MOBIKf8File *file = &w->files[i];
+        free(file->source_copy);
+        file->source_copy = NULL;
+        file->source = NULL;
+        file->source_size = 0;
+        free(file->ids);
+        file->ids = NULL;
+        file->ids_count = 0;
+        file->ids_ready = false;
+        ret = mobi_kf8_split_file(w, i);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        file->position = position;
+        position += file->buf->offset;
+    }
+    if (w->frags_count == 0) {
+        debug_print("%s", "Document has no text\n");
+        return MOBI_PARAM_ERR;
+    }
+    mobi_kf8_resolve_links(w);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build text of the document: main flow followed by css and svg flows
+
+ Main flow contains for each file its skeleton followed by its fragments.
+
+ @param[in] w Writer
+ @param[out] fdst FDST record
+ @return Text buffer or NULL on failure
+ */
+static MOBIBuffer * mobi_kf8_build_text(const MOBIKf8Writer *w, MOBIBuffer **fdst) {
+    size_t length = 0;
+    for (size_t i = 0; i < w->files_count; i++) {
+        length += w->files[i].buf->offset;
+    }
+    for (size_t i = 0; i < w->flows_count; i++) {
+        length += w->flows[i]->offset;
+    }
+    if (length > RAWTEXT_SIZEMAX || (length + RECORD0_TEXT_SIZE_MAX - 1) / RECORD0_TEXT_SIZE_MAX > KF8_TEXT_RECORDS_MAX) {
+        debug_print("Text too long (%zu)\n", length);
+        return NULL;
+    }
+    MOBIBuffer *text = buffer_init(length + 1);
+    *fdst = buffer_init(12 + 8 * (w->flows_count + 1));
+    if (text == NULL || *fdst == NULL) {
+        if (text) {
+            buffer_free(text);
+        }
+        if (*fdst) {
+            buffer_free(*fdst);
+            *fdst = NULL;
+        }
+        return NULL;
+    }
+    for (size_t i = 0; i < w->files_count; i++) {
+        const MOBIKf8File *file = &w->files[i];
+        const unsigned char *data = file->buf->data;
+        buffer_addraw(text, data, file->body_start);
+        buffer_addraw(text, data + file->body_end, file->buf->offset - file->body_end);
+        buffer_addraw(text, data + file->body_start, file->body_end - file->body_start);
+    }
+    buffer_addstring(*fdst, FDST_MAGIC);
+    buffer_add32(*fdst, 12);
+    buffer_add32(*fdst, (uint32_t) (w->flows_count + 1));
+    buffer_add32(*fdst, 0);
+    buffer_add32(*fdst, (uint32_t) text->offset);
+    for (size_t i = 0; i < w->flows_count; i++) {
+        buffer_add32(*fdst, (uint32_t) text->offset);
+        buffer_addraw(text, w->flows[i]->data, w->flows[i]->offset);
+        buffer_add32(*fdst, (uint32_t) text->offset);
+    }
+    return text;
+}
+
+/**
+ @brief Compress range of text records
+
+ Each record is followed by the multibyte trailing entry:
+ continuation bytes of the character split at record boundary and their count.
+
+ @param[in,out] job Compression job
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_compress_range(MOBIKf8CompressJob *job) {
+    for (size_t i = job->first; i < job->last; i++) {
+        const size_t start = i * RECORD0_TEXT_SIZE_MAX;
+        size_t size = job->text_length - start;
+        if (size > RECORD0_TEXT_SIZE_MAX) {
+            size = RECORD0_TEXT_SIZE_MAX;
+        }
+        MOBIBuffer *buf = job->records[i];
+        size_t compressed_size = buf->maxlen - 4;
+        const MOBI_RET ret = mobi_compress_lz77(buf->data, &compressed_size, job->text + start, size);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        buf->offset = compressed_size;
+        const size_t end = start + size;
+        uint8_t overlap = 0;
+        while (overlap < 3 && end + overlap < job->text_length && (job->text[end + overlap] & 0xc0) == 0x80) {
+            overlap++;
+        }
+        buffer_addraw(buf, job->text + end, overlap);
+        buffer_add8(buf, overlap);
+        if (buf->error != MOBI_SUCCESS) {
+            return buf->error;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Thread entry point of text compression
+
+ @param[in,out] arg MOBIKf8CompressJob structure
+ @return NULL
+ */
+static void * mobi_kf8_compress_thread(void *arg) {
+    MOBIKf8CompressJob *job = arg;
+    job->ret = mobi_kf8_compress_range(job);
+    return NULL;
+}
+
+/**
+ @brief Split text into records and compress them
+
+ Records are independent, so ranges of records are compressed in parallel.
+ If threads can't be started, ranges are compressed in calling thread.
+
+ @param[in,out] records Records list, text records are appended
+ @param[in] text Text data
+ @param[in] length Text length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_compress_text(MOBIKf8Records *records, const unsigned char *text, const size_t length) {
+    const size_t count = (length + RECORD0_TEXT_SIZE_MAX - 1) / RECORD0_TEXT_SIZE_MAX;
+    const size_t first = records->count;
+    MOBI_RET ret;
+    for (size_t i = 0; i < count; i++) {
+        ret = mobi_kf8_add_record(records, buffer_init(KF8_TEXT_RECORD_SIZEMAX));
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    /* small ranges are not worth a thread */
+    const size_t jobs_count = mobi_jobs_count(count, 8);
+    MOBIKf8CompressJob *jobs = calloc(jobs_count, sizeof(MOBIKf8CompressJob));
+    if (jobs == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t t = 0; t < jobs_count; t++) {
+        jobs[t].text = text;
+        jobs[t].text_length = length;
+        jobs[t].records = records->records + first;
+        jobs[t].first = count * t / jobs_count;
+        jobs[t].last = count * (t + 1) / jobs_count;
+        jobs[t].ret = MOBI_SUCCESS;
+    }
+    mobi_run_jobs(jobs, sizeof(MOBIKf8CompressJob), jobs_count, mobi_kf8_compress_thread);
+    ret = MOBI_SUCCESS;
+    for (size_t t = 0; t < jobs_count; t++) {
+        if (jobs[t].ret != MOBI_SUCCESS) {
+            ret = jobs[t].ret;
+        }
+    }
+    free(jobs);
+    return ret;
+}
+
+/**
+ @brief Build skeleton and fragments indices
+
+ @param[in,out] records Records list
+ @param[in] w Writer
+ @param[out] frag_index Number of first fragments index record
+ @param[out] skel_index Number of first skeleton index record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_build_parts_indx(MOBIKf8Records *records, const MOBIKf8Writer *w, size_t *frag_index, size_t *skel_index) {
+    MOBIIndxWriter indx;
+    MOBI_RET ret = mobi_indx_writer_init(&indx);
+    char label[INDX_ENTRY_LABEL_MAX + 1];
+    for (size_t i = 0; ret == MOBI_SUCCESS && i < w->frags_count; i++) {
+        const MOBIKf8Fragment *frag = &w->frags[i];
+        const MOBIKf8File *file = &w->files[frag->file];
+        char aid[5] = "0000";
+        mobi_kf8_base32(aid, (uint32_t) i, 4);
+        uint32_t aid_offset;
+        ret = mobi_indx_add_cncx(&indx, &aid_offset, aid);
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        /* position of fragment data relative to skeleton start */
+        const size_t skel_length = file->buf->offset - (file->body_end - file->body_start);
+        const uint32_t values[] = {
+            aid_offset,
+            (uint32_t) frag->file,
+            (uint32_t) i,
+            (uint32_t) (skel_length + frag->start - file->body_start),
+            (uint32_t) frag->size
+        };
+        snprintf(label, sizeof(label), "%010zu", file->position + frag->start);
+        ret = mobi_indx_add_entry(&indx, mobi_kf8_frag_tags, ARRAYSIZE(mobi_kf8_frag_tags), label, values, NULL);
+    }
+    if (ret == MOBI_SUCCESS) {
+        *frag_index = records->count;
+        ret = mobi_indx_write(records, &indx, mobi_kf8_frag_tags, ARRAYSIZE(mobi_kf8_frag_tags));
+    }
+    mobi_indx_writer_free(&indx);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    ret = mobi_indx_writer_init(&indx);
+    for (size_t i = 0; ret == MOBI_SUCCESS && i < w->files_count; i++) {
+        const MOBIKf8File *file = &w->files[i];
+        const uint32_t values[] = {
+            (uint32_t) file->frag_count,
+            (uint32_t) file->position,
+            (uint32_t) (file->buf->offset - (file->body_end - file->body_start))
+        };
+        snprintf(label, sizeof(label), "SKEL%010zu", i);
+        ret = mobi_indx_add_entry(&indx, mobi_kf8_skel_tags, ARRAYSIZE(mobi_kf8_skel_tags), label, values, NULL);
+    }
+    if (ret == MOBI_SUCCESS) {
+        *skel_index = records->count;
+        ret = mobi_indx_write(records, &indx, mobi_kf8_skel_tags, ARRAYSIZE(mobi_kf8_skel_tags));
+    }
+    mobi_indx_writer_free(&indx);
+    return ret;
+}
+
+/**
+ @brief Build ncx index from table of contents entries
+
+ Entries are stored breadth first, so that children of each entry are stored contiguously.
+
+ @param[in,out] records Records list
+ @param[in,out] w Writer
+ @param[in] book Source document
+ @param[out] ncx_index Number of first ncx index record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_build_ncx(MOBIKf8Records *records, MOBIKf8Writer *w, const MOBIKf8Book *book, size_t *ncx_index) {
+    const size_t count = book->toc_count;
+    /* per entry in document order: level, parent, breadth first index, first and last child */
+    size_t *level = malloc(count * sizeof(size_t));
+    size_t *parent = malloc(count * sizeof(size_t));
+    size_t *bfs_index = malloc(count * sizeof(size_t));
+    size_t *order = malloc(count * sizeof(size_t));
+    size_t *child_first = malloc(count * sizeof(size_t));
+    size_t *child_last = malloc(count * sizeof(size_t));
+    size_t *stack = malloc(count * sizeof(size_t));
+    uint32_t *position = malloc(2 * count * sizeof(uint32_t));
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (!level || !parent || !bfs_index || !order || !child_first || !child_last || !stack || !position) {
+        debug_print("%s", "Memory allocation failed\n");
+        ret = MOBI_MALLOC_FAILED;
+        goto cleanup;
+    }
+    size_t depth = 0;
+    size_t max_level = 0;
+    for (size_t i = 0; i < count; i++) {
+        /* level may grow by one at most */
+        level[i] = book->toc[i].level > depth ? depth : book->toc[i].level;
+        depth = level[i];
+        parent[i] = depth ? stack[depth - 1] : SIZE_MAX;
+        stack[depth] = i;
+        depth++;
+        if (level[i] > max_level) {
+            max_level = level[i];
+        }
+        child_first[i] = child_last[i] = SIZE_MAX;
+    }
+    /* breadth first order: by level, then by document order */
+    size_t n = 0;
+    for (size_t l = 0; l <= max_level; l++) {
+        for (size_t i = 0; i < count; i++) {
+            if (level[i] == l) {
+                bfs_index[i] = n;
+                order[n++] = i;
+            }
+        }
+    }
+    for (size_t j = 0; j < count; j++) {
+        const size_t i = order[j];
+        if (parent[i] != SIZE_MAX) {
+            const size_t p = parent[i];
+            if (child_first[p] == SIZE_MAX) {
+                child_first[p] = j;
+            }
+            child_last[p] = j;
+        }
+    }
+    for (size_t i = 0; i < count; i++) {
+        mobi_kf8_resolve_target(w, &position[2 * i], &position[2 * i + 1], book->toc[i].target);
+    }
+    MOBIIndxWriter indx;
+    ret = mobi_indx_writer_init(&indx);
+    char label[INDX_ENTRY_LABEL_MAX + 1];
+    for (size_t j = 0; ret == MOBI_SUCCESS && j < count; j++) {
+        const size_t i = order[j];
+        uint32_t label_offset;
+        ret = mobi_indx_add_cncx(&indx, &label_offset, book->toc[i].label ? book->toc[i].label : "");
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        const uint32_t offset = mobi_kf8_text_position(w, position[2 * i], position[2 * i + 1]);
+        /* length up to next entry in document order */
+        uint32_t length = 0;
+        if (i + 1 < count) {
+            const uint32_t next = mobi_kf8_text_position(w, position[2 * i + 2], position[2 * i + 3]);
+            length = next > offset ? next - offset : 0;
+        }
+        const uint32_t values[] = {
+            offset,
+            length,
+            label_offset,
+            (uint32_t) level[i],
+            parent[i] != SIZE_MAX ? (uint32_t) bfs_index[parent[i]] : 0,
+            child_first[i] != SIZE_MAX ? (uint32_t) child_first[i] : 0,
+            child_last[i] != SIZE_MAX ? (uint32_t) child_last[i] : 0,
+            position[2 * i],
+            position[2 * i + 1]
+        };
+        const bool present[] = {
+            true, true, true, true,
+            parent[i] != SIZE_MAX,
+            child_first[i] != SIZE_MAX,
+            child_last[i] != SIZE_MAX,
+            true, false
+        };
+        snprintf(label, sizeof(label), "%zX", j);
+        ret = mobi_indx_add_entry(&indx, mobi_kf8_ncx_tags, ARRAYSIZE(mobi_kf8_ncx_tags), label, values, present);
+    }
+    if (ret == MOBI_SUCCESS) {
+        *ncx_index = records->count;
+        ret = mobi_indx_write(records, &indx, mobi_kf8_ncx_tags, ARRAYSIZE(mobi_kf8_ncx_tags));
+    }
+    mobi_indx_writer_free(&indx);
+cleanup:
+    free(level);
+    free(parent);
+    free(bfs_index);
+    free(order);
+    free(child_first);
+    free(child_last);
+    free(stack);
+    free(position);
+    return ret;
+}
+
+/**
+ @brief Build guide index
+
+ @param[in,out] records Records list
+ @param[in,out] w Writer
+ @param[in] book Source document
+ @param[out] guide_index Number of first guide index record
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_build_guide(MOBIKf8Records *records, MOBIKf8Writer *w, const MOBIKf8Book *book, size_t *guide_index) {
+    MOBIIndxWriter indx;
+    MOBI_RET ret = mobi_indx_writer_init(&indx);
+    for (size_t i = 0; ret == MOBI_SUCCESS && i < book->guide_count; i++) {
+        const MOBIGuideEntry *entry = &book->guide[i];
+        if (entry->type == NULL || *entry->type == '\0') {
+            continue;
+        }
+        uint32_t title_offset;
+        ret = mobi_indx_add_cncx(&indx, &title_offset, entry->title ? entry->title : "");
+        if (ret != MOBI_SUCCESS) {
+            break;
+        }
+        uint32_t values[3] = { title_offset, 0, 0 };
+        mobi_kf8_resolve_target(w, &values[1], &values[2], entry->target);
+        ret = mobi_indx_add_entry(&indx, mobi_kf8_guide_tags, ARRAYSIZE(mobi_kf8_guide_tags), entry->type, values, NULL);
+    }
+    if (ret == MOBI_SUCCESS && indx.entries_count) {
+        *guide_index = records->count;
+        ret = mobi_indx_write(records, &indx, mobi_kf8_guide_tags, ARRAYSIZE(mobi_kf8_guide_tags));
+    }
+    mobi_indx_writer_free(&indx);
+    return ret;
+}
+
+/**
+ @brief Build resource record
+
+ Images are stored as they are, fonts in FONT records (zlib compressed if it helps),
+ audio and video in AUDI and VIDE records.
+
+ @param[out] out Record data
+ @param[in] part Resource part
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_build_resource(MOBIBuffer **out, const MOBIPart *part) {
+    *out = NULL;
+    if (part->size == 0) {
+        debug_print("Empty resource: %zu\n", part->uid);
+        return MOBI_PARAM_ERR;
+    }
+    unsigned char *data;
+    MOBI_RET ret = mobi_kf8_part_data(&data, part);
+    if (ret != MOBI_SUCCESS) {
+        return ret;
+    }
+    MOBIBuffer *buf = NULL;
+    switch (part->type) {
+        case T_JPG:
+        case T_GIF:
+        case T_PNG:
+        case T_BMP:
+            buf = buffer_init(part->size);
+            if (buf) {
+                buffer_addraw(buf, data, part->size);
+            }
+            break;
+        case T_OTF:
+        case T_TTF:
+        case T_FONT:
+        case T_UNKNOWN: {
+            if (part->size > FONT_SIZEMAX) {
+                ret = MOBI_PARAM_ERR;
+                break;
+            }
+            unsigned long compressed_size = m_compressBound((unsigned long) part->size);
+            unsigned char *compressed = malloc(compressed_size);
+            uint32_t flags = 0;
+            if (compressed && m_compress2(compressed, &compressed_size, data, (unsigned long) part->size, M_BEST_SPEED) == M_OK
+                && compressed_size < part->size) {
+                flags = 1; /* zlib */
+            } else {
+                compressed_size = part->size;
+            }
+            buf = buffer_init(FONT_HEADER_LEN + compressed_size);
+            if (buf) {
+                buffer_addstring(buf, FONT_MAGIC);
+                buffer_add32(buf, (uint32_t) part->size);
+                buffer_add32(buf, flags);
+                buffer_add32(buf, FONT_HEADER_LEN);
+                buffer_add32(buf, 0); /* xor key length */
+                buffer_add32(buf, 0); /* xor data offset */
+                buffer_addraw(buf, flags ? compressed : data, compressed_size);
+            }
+            free(compressed);
+            break;
+        }
+        case T_MP3:
+        case T_MPG:
+            buf = buffer_init(MEDIA_HEADER_LEN + part->size);
+            if (buf) {
+                buffer_addstring(buf, part->type == T_MP3 ? AUDI_MAGIC : VIDE_MAGIC);
+                buffer_add32(buf, MEDIA_HEADER_LEN);
+                buffer_add32(buf, 0);
+                buffer_addraw(buf, data, part->size);
+            }
+            break;
+        default:
+            debug_print("Unsupported resource type: %u\n", part->type);
+            ret = MOBI_FILE_UNSUPPORTED;
+            break;
+    }
+    mobi_kf8_part_data_free(data, part);
+    if (ret != MOBI_SUCCESS) {
+        if (buf) {
+            buffer_free(buf);
+        }
+        return ret;
+    }
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    *out = buf;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Add EXTH string record
+
+ @param[in,out] buf Buffer
+ @param[in] tag EXTH tag
+ @param[in] value String value
+ */
+static void mobi_kf8_add_exth(MOBIBuffer *buf, const MOBIExthTag tag, const char *value) {
+    const size_t length = strlen(value);
+    buffer_reserve(buf, 8 + length);
+    buffer_add32(buf, tag);
+    buffer_add32(buf, (uint32_t) (8 + length));
+    buffer_addraw(buf, (const unsigned char *) value, length);
+}
+
+/**
+ @brief Record numbers and text metadata stored in record 0
+ */
+typedef struct {
+    size_t text_length; /**< Text length */
+    size_t text_records; /**< Number of text records */
+    size_t frag_index; /**< First fragments index record */
+    size_t skel_index; /**< First skeleton index record */
+    size_t ncx_index; /**< First ncx index record or MOBI_NOTSET */
+    size_t guide_index; /**< First guide index record or MOBI_NOTSET */
+    size_t image_index; /**< First resource record */
+    size_t fdst_index; /**< FDST record */
+    size_t fdst_count; /**< Number of FDST sections */
+    size_t flis_index; /**< FLIS record */
+    size_t fcis_index; /**< FCIS record */
+} MOBIKf8Layout;
+
+/**
+ @brief Build record 0: PalmDOC header, MOBI header, EXTH header and full name
+
+ @param[in] book Source document
+ @param[in] layout Records layout
+ @param[in] uid Document unique id
+ @return Record data or NULL on failure
+ */
+static MOBIBuffer * mobi_kf8_build_record0(const MOBIKf8Book *book, const MOBIKf8Layout *layout, const uint32_t uid) {
+    const char *title = book->title ? book->title : "";
+    size_t title_length = strlen(title);
+    if (title_length > RECORD0_FULLNAME_SIZE_MAX) {
+        title_length = RECORD0_FULLNAME_SIZE_MAX;
+    }
+    MOBIBuffer *exth = buffer_init(1024);
+    if (exth == NULL) {
+        return NULL;
+    }
+    size_t exth_count = 0;
+    if (book->author && *book->author) {
+        mobi_kf8_add_exth(exth, EXTH_AUTHOR, book->author);
+        exth_count++;
+    }
+    mobi_kf8_add_exth(exth, EXTH_UPDATEDTITLE, title);
+    exth_count++;
+    if (book->language && *book->language) {
+        mobi_kf8_add_exth(exth, EXTH_LANGUAGE, book->language);
+        exth_count++;
+    }
+    mobi_kf8_add_exth(exth, EXTH_DOCTYPE, "EBOK");
+    exth_count++;
+    const size_t exth_length = 12 + exth->offset;
+    const size_t exth_padding = (4 - (exth_length & 3)) & 3;
+    const size_t fullname_offset = RECORD0_HEADER_LEN + KF8_MOBI_HEADER_LEN + exth_length + exth_padding;
+    MOBIBuffer *buf = buffer_init(fullname_offset + title_length + KF8_FULLNAME_PADDING + 4);
+    if (buf == NULL || exth->error != MOBI_SUCCESS) {
+        buffer_free(exth);
+        if (buf) {
+            buffer_free(buf);
+        }
+        return NULL;
+    }
+    /* PalmDOC header */
+    buffer_add16(buf, RECORD0_PALMDOC_COMPRESSION);
+    buffer_add16(buf, 0);
+    buffer_add32(buf, (uint32_t) layout->text_length);
+    buffer_add16(buf, (uint16_t) layout->text_records);
+    buffer_add16(buf, RECORD0_TEXT_SIZE_MAX);
+    buffer_add16(buf, RECORD0_NO_ENCRYPTION);
+    buffer_add16(buf, 0);
+    /* MOBI header */
+    buffer_addstring(buf, MOBI_MAGIC);
+    buffer_add32(buf, KF8_MOBI_HEADER_LEN);
+    buffer_add32(buf, 2); /* type: mobipocket book */
+    buffer_add32(buf, MOBI_UTF8);
+    buffer_add32(buf, uid);
+    buffer_add32(buf, KF8_MOBI_VERSION);
+    for (size_t i = 0; i < 10; i++) {
+        buffer_add32(buf, MOBI_NOTSET); /* orth, infl, names, keys, extra 0-5 */
+    }
+    buffer_add32(buf, (uint32_t) (layout->text_records + 1)); /* first non text record */
+    buffer_add32(buf, (uint32_t) fullname_offset);
+    buffer_add32(buf, (uint32_t) title_length);
+    buffer_add32(buf, (uint32_t) mobi_get_locale_number(book->language));
+    buffer_add32(buf, 0); /* dict input language */
+    buffer_add32(buf, 0); /* dict output language */
+    buffer_add32(buf, KF8_MOBI_VERSION); /* min version */
+    buffer_add32(buf, (uint32_t) layout->image_index);
+    buffer_add32(buf, 0); /* huff record */
+    buffer_add32(buf, 0); /* huff records count */
+    buffer_add32(buf, MOBI_NOTSET); /* datp record */
+    buffer_add32(buf, 0); /* datp records count */
+    buffer_add32(buf, KF8_EXTH_FLAGS);
+    buffer_addzeros(buf, 32);
+    buffer_add32(buf, MOBI_NOTSET);
+    buffer_add32(buf, MOBI_NOTSET); /* drm offset */
+    buffer_add32(buf, 0); /* drm count */
+    buffer_add32(buf, 0); /* drm size */
+    buffer_add32(buf, 0); /* drm flags */
+    buffer_addzeros(buf, 8);
+    buffer_add32(buf, (uint32_t) layout->fdst_index);
+    buffer_add32(buf, (uint32_t) layout->fdst_count);
+    buffer_add32(buf, (uint32_t) layout->fcis_index);
+    buffer_add32(buf, 1); /* fcis count */
+    buffer_add32(buf, (uint32_t) layout->flis_index);
+    buffer_add32(buf, 1); /* flis count */
+    buffer_addzeros(buf, 8);
+    buffer_add32(buf, MOBI_NOTSET); /* srcs record */
+    buffer_add32(buf, 0); /* srcs count */
+    buffer_add32(buf, MOBI_NOTSET);
+    buffer_add32(buf, MOBI_NOTSET);
+    buffer_add16(buf, 0);
+    buffer_add16(buf, 1); /* extra flags: multibyte trailing entry */
+    buffer_add32(buf, (uint32_t) layout->ncx_index);
+    buffer_add32(buf, (uint32_t) layout->frag_index);
+    buffer_add32(buf, (uint32_t) layout->skel_index);
+    buffer_add32(buf, MOBI_NOTSET); /* datp index */
+    buffer_add32(buf, (uint32_t) layout->guide_index);
+    buffer_add32(buf, MOBI_NOTSET);
+    buffer_add32(buf, 0);
+    buffer_add32(buf, MOBI_NOTSET);
+    buffer_add32(buf, 0);
+    /* EXTH header */
+    buffer_addstring(buf, EXTH_MAGIC);
+    buffer_add32(buf, (uint32_t) exth_length);
+    buffer_add32(buf, (uint32_t) exth_count);
+    buffer_addraw(buf, exth->data, exth->offset);
+    buffer_addzeros(buf, exth_padding);
+    buffer_free(exth);
+    /* full name, followed by padding as in kindlegen files */
+    buffer_addraw(buf, (const unsigned char *) title, title_length);
+    buffer_addzeros(buf, KF8_FULLNAME_PADDING);
+    mobi_kf8_pad4(buf);
+    if (buf->error != MOBI_SUCCESS) {
+        buffer_free(buf);
+        return NULL;
+    }
+    return buf;
+}
+
+/**
+ @brief Build FLIS record, constant in all known documents
+
+ @return Record data or NULL on failure
+ */
+static MOBIBuffer * mobi_kf8_build_flis(void) {
+    MOBIBuffer *buf = buffer_init(36);
+    if (buf) {
+        buffer_addstring(buf, "FLIS");
+        buffer_add32(buf, 8);
+        buffer_add16(buf, 0x41);
+        buffer_add16(buf, 0);
+        buffer_add32(buf, 0);
+        buffer_add32(buf, MOBI_NOTSET);
+        buffer_add16(buf, 1);
+        buffer_add16(buf, 3);
+        buffer_add32(buf, 3);
+        buffer_add32(buf, 1);
+        buffer_add32(buf, MOBI_NOTSET);
+    }
+    return buf;
+}
+
+/**
+ @brief Build FCIS record
+
+ @param[in] text_length Text length
+ @return Record data or NULL on failure
+ */
+static MOBIBuffer * mobi_kf8_build_fcis(const size_t text_length) {
+    MOBIBuffer *buf = buffer_init(52);
+    if (buf) {
+        buffer_addstring(buf, "FCIS");
+        buffer_add32(buf, 0x14);
+        buffer_add32(buf, 0x10);
+        buffer_add32(buf, 2);
+        buffer_add32(buf, 0);
+        buffer_add32(buf, (uint32_t) text_length);
+        buffer_add32(buf, 0);
+        buffer_add32(buf, 0x28);
+        buffer_add32(buf, 0);
+        buffer_add32(buf, 0x28);
+        buffer_add32(buf, 8);
+        buffer_add16(buf, 1);
+        buffer_add16(buf, 1);
+        buffer_add32(buf, 0);
+    }
+    return buf;
+}
+
+/**
+ @brief Write Palm database: header, records list and records data
+
+ @param[in] file File descriptor
+ @param[in] records Records
+ @param[in] title Document title, used for database name
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_write_pdb(FILE *file, const MOBIKf8Records *records, const char *title) {
+    if (records->count > UINT16_MAX) {
+        debug_print("Too many records (%zu)\n", records->count);
+        return MOBI_PARAM_ERR;
+    }
+    MOBIBuffer *buf = buffer_init(PALMDB_HEADER_LEN + records->count * PALMDB_RECORD_INFO_SIZE + 2);
+    if (buf == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    /* database name: title with non alphanumeric characters replaced */
+    char name[PALMDB_NAME_SIZE_MAX];
+    memset(name, 0, PALMDB_NAME_SIZE_MAX);
+    size_t length = 0;
+    for (const char *c = title; c && *c && length < PALMDB_NAME_SIZE_MAX - 1; c++) {
+        if (isalnum((unsigned char) *c) || *c == '-') {
+            name[length++] = *c;
+        } else if (length > 0 && name[length - 1] != '_') {
+            name[length++] = '_';
+        }
+    }
+    if (length == 0) {
+        strcpy(name, "Unknown");
+    }
+    const uint32_t curtime = (uint32_t) time(NULL);
+    buffer_addraw(buf, (const unsigned char *) name, PALMDB_NAME_SIZE_MAX);
+    buffer_add16(buf, PALMDB_ATTRIBUTE_DEFAULT);
+    buffer_add16(buf, PALMDB_VERSION_DEFAULT);
+    buffer_add32(buf, curtime); /* ctime */
+    buffer_add32(buf, curtime); /* mtime */
+    buffer_add32(buf, 0); /* btime */
+    buffer_add32(buf, PALMDB_MODNUM_DEFAULT);
+    buffer_add32(buf, PALMDB_APPINFO_DEFAULT);
+    buffer_add32(buf, PALMDB_SORTINFO_DEFAULT);
+    buffer_addstring(buf, PALMDB_TYPE_DEFAULT);
+    buffer_addstring(buf, PALMDB_CREATOR_DEFAULT);
+    buffer_add32(buf, (uint32_t) (2 * records->count - 1)); /* uid seed */
+    buffer_add32(buf, PALMDB_NEXTREC_DEFAULT);
+    buffer_add16(buf, (uint16_t) records->count);
+    size_t offset = PALMDB_HEADER_LEN + records->count * PALMDB_RECORD_INFO_SIZE + 2;
+    for (size_t i = 0; i < records->count; i++) {
+        buffer_add32(buf, (uint32_t) offset);
+        buffer_add32(buf, (uint32_t) (2 * i)); /* attributes and uid */
+        offset += records->records[i]->offset;
+    }
+    if (offset > UINT32_MAX) {
+        buffer_free(buf);
+        return MOBI_PARAM_ERR;
+    }
+    buffer_addzeros(buf, 2);
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (fwrite(buf->data, 1, buf->offset, file) != buf->offset) {
+        ret = MOBI_ERROR;
+    }
+    buffer_free(buf);
+    for (size_t i = 0; ret == MOBI_SUCCESS && i < records->count; i++) {
+        const MOBIBuffer *record = records->records[i];
+        if (fwrite(record->data, 1, record->offset, file) != record->offset) {
+            ret = MOBI_ERROR;
+        }
+    }
+    if (ret != MOBI_SUCCESS) {
+        debug_print("%s", "Writing failed\n");
+    }
+    return ret;
+}
+
+/**
+ @brief Write KF8 (azw3) document
+
+ Markup files are split into skeletons and fragments, links to reconstructed parts
+ ("part00000.html#id", "flow00001.css", "resource00000.jpg") are replaced with kindle: links.
+ Text records are compressed in parallel, if threads are available.
+ Document parsed back with mobi_parse_rawml() gives the same parts.
+
+ @param[in] book Source document
+ @param[in,out] file File descriptor opened for writing in binary mode
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_write_kf8(const MOBIKf8Book *book, FILE *file) {
+    if (book == NULL || book->markup == NULL || file == NULL) {
+        debug_print("%s", "Missing document markup or file\n");
+        return MOBI_PARAM_ERR;
+    }
+    if ((book->toc_count && book->toc == NULL) || (book->guide_count && book->guide == NULL)) {
+        return MOBI_PARAM_ERR;
+    }
+    MOBIKf8Writer w;
+    MOBIKf8Records records = { NULL, 0, 0 };
+    MOBIBuffer *text = NULL;
+    MOBIBuffer *fdst = NULL;
+    MOBI_RET ret = mobi_kf8_writer_init(&w, book);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_kf8_prepare_parts(&w);
+    }
+    if (ret == MOBI_SUCCESS) {
+        text = mobi_kf8_build_text(&w, &fdst);
+        if (text == NULL) {
+            ret = MOBI_PARAM_ERR;
+        }
+    }
+    MOBIKf8Layout layout;
+    memset(&layout, 0, sizeof(MOBIKf8Layout));
+    layout.ncx_index = MOBI_NOTSET;
+    layout.guide_index = MOBI_NOTSET;
+    if (ret == MOBI_SUCCESS) {
+        /* record 0 is built when all records are known */
+        ret = mobi_kf8_add_record(&records, buffer_init(1));
+    }
+    if (ret == MOBI_SUCCESS) {
+        layout.text_length = text->offset;
+        ret = mobi_kf8_compress_text(&records, text->data, text->offset);
+        layout.text_records = records.count - 1;
+    }
+    if (text) {
+        buffer_free(text);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_kf8_build_parts_indx(&records, &w, &layout.frag_index, &layout.skel_index);
+    }
+    if (ret == MOBI_SUCCESS && book->toc_count) {
+        ret = mobi_kf8_build_ncx(&records, &w, book, &layout.ncx_index);
+    }
+    if (ret == MOBI_SUCCESS && book->guide_count) {
+        ret = mobi_kf8_build_guide(&records, &w, book, &layout.guide_index);
+    }
+    layout.image_index = records.count;
+    for (size_t uid = 0; ret == MOBI_SUCCESS && uid < w.resources_count; uid++) {
+        MOBIBuffer *buf = NULL;
+        if (w.resources[uid]) {
+            ret = mobi_kf8_build_resource(&buf, w.resources[uid]);
+        } else {
+            /* keep numbering of resources, empty record is skipped by reader */
+            buf = buffer_init(KF8_EMPTY_RECORD_LEN);
+            if (buf) {
+                buffer_addzeros(buf, KF8_EMPTY_RECORD_LEN);
+            }
+        }
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_kf8_add_record(&records, buf);
+        }
+    }
+    if (ret == MOBI_SUCCESS) {
+        layout.fdst_index = records.count;
+        layout.fdst_count = w.flows_count + 1;
+        ret = mobi_kf8_add_record(&records, fdst);
+        fdst = NULL;
+    }
+    if (ret == MOBI_SUCCESS) {
+        layout.flis_index = records.count;
+        ret = mobi_kf8_add_record(&records, mobi_kf8_build_flis());
+    }
+    if (ret == MOBI_SUCCESS) {
+        layout.fcis_index = records.count;
+        ret = mobi_kf8_add_record(&records, mobi_kf8_build_fcis(layout.text_length));
+    }
+    if (ret == MOBI_SUCCESS) {
+        MOBIBuffer *buf = buffer_init(4);
+        if (buf) {
+            buffer_addraw(buf, (const unsigned char *) EOF_MAGIC, 4);
+        }
+        ret = mobi_kf8_add_record(&records, buf);
+    }
+    if (ret == MOBI_SUCCESS) {
+        /* unique id derived from title and text length */
+        uint32_t uid = 2166136261U ^ (uint32_t) layout.text_length;
+        for (const char *c = book->title; c && *c; c++) {
+            uid = (uid ^ (unsigned char) *c) * 16777619U;
+        }
+        MOBIBuffer *record0 = mobi_kf8_build_record0(book, &layout, uid);
+        if (record0 == NULL) {
+            ret = MOBI_MALLOC_FAILED;
+        } else {
+            buffer_free(records.records[0]);
+            records.records[0] = record0;
+        }
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_kf8_write_pdb(file, &records, book->title);
+    }
+    if (fdst) {
+        buffer_free(fdst);
+    }
+    mobi_kf8_free_records(&records);
+    mobi_kf8_writer_free(&w);
+    return ret;
+}
+
+/**
+ @brief Free table of contents entries allocated by mobi_kf8_toc_from_ncx()
+
+ @param[in] toc Entries
+ @param[in] count Number of entries
+ */
+static void mobi_kf8_free_toc(MOBITocEntry *toc, const size_t count) {
+    if (toc == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        free((char *) toc[i].label);
+        free((char *) toc[i].target);
+    }
+    free(toc);
+}
+
+/**
+ @brief Get link target of kindle:pos:fid:off position, as written by mobi_build_ncx()
+
+ @param[in] rawml MOBIRawml structure with parsed, not yet reconstructed links
+ @param[in] pos_fid Fragment index
+ @param[in] pos_off Offset from fragment start
+ @return Allocated target string or NULL on failure
+ */
+static char * mobi_kf8_posfid_target(const MOBIRawml *rawml, const uint32_t pos_fid, const uint32_t pos_off) {
+    uint32_t file_number;
+    char id[MOBI_ATTRVALUE_MAXSIZE + 1];
+    if (mobi_get_id_by_posoff(&file_number, id, rawml, pos_fid, pos_off) != MOBI_SUCCESS) {
+        return NULL;
+    }
+    char *target = malloc(MOBI_ATTRVALUE_MAXSIZE + 32);
+    if (target) {
+        if (pos_off) {
+            snprintf(target, MOBI_ATTRVALUE_MAXSIZE + 32, "part%05u.html#%s", file_number, id);
+        } else {
+            snprintf(target, MOBI_ATTRVALUE_MAXSIZE + 32, "part%05u.html", file_number);
+        }
+    }
+    return target;
+}
+
+/**
+ @brief Convert parsed ncx index into table of contents entries in document order
+
+ @param[out] toc Allocated entries
+ @param[out] count Number of entries
+ @param[in] rawml MOBIRawml structure with parsed, not yet reconstructed links
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_toc_from_ncx(MOBITocEntry **toc, size_t *count, const MOBIRawml *rawml) {
+    *toc = NULL;
+    *count = 0;
+    const MOBIIndx *ncx = rawml->ncx;
+    if (ncx == NULL || ncx->entries_count == 0 || ncx->cncx_record == NULL) {
+        return MOBI_SUCCESS;
+    }
+    const size_t entries_count = ncx->entries_count;
+    MOBITocEntry *entries = calloc(entries_count, sizeof(MOBITocEntry));
+    size_t *stack = malloc(entries_count * sizeof(size_t));
+    size_t *depth = malloc(entries_count * sizeof(size_t));
+    bool *visited = calloc(entries_count, sizeof(bool));
+    if (entries == NULL || stack == NULL || depth == NULL || visited == NULL) {
+        free(entries);
+        free(stack);
+        free(depth);
+        free(visited);
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = MOBI_SUCCESS;
+    size_t n = 0;
+    /* depth first walk from top level entries */
+    for (size_t root = 0; ret == MOBI_SUCCESS && root < entries_count; root++) {
+        uint32_t value;
+        if (visited[root] || mobi_get_indxentry_tagvalue(&value, &ncx->entries[root], INDX_TAG_NCX_PARENT) == MOBI_SUCCESS) {
+            continue;
+        }
+        size_t top = 0;
+        stack[top] = root;
+        depth[top++] = 0;
+        visited[root] = true;
+        while (ret == MOBI_SUCCESS && top) {
+            top--;
+            const size_t i = stack[top];
+            const size_t level = depth[top];
+            const MOBIIndexEntry *entry = &ncx->entries[i];
+            uint32_t cncx_offset;
+            uint32_t pos_fid;
+            uint32_t pos_off;
+            if (mobi_get_indxentry_tagvalue(&cncx_offset, entry, INDX_TAG_NCX_TEXT_CNCX) != MOBI_SUCCESS ||
+                mobi_get_indxentry_tagvalue(&pos_fid, entry, INDX_TAG_NCX_POSFID) != MOBI_SUCCESS ||
+                mobi_get_indxentry_tagvalue(&pos_off, entry, INDX_TAG_NCX_POSOFF) != MOBI_SUCCESS) {
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            entries[n].label = mobi_get_cncx_string(ncx->cncx_record, cncx_offset);
+            entries[n].target = mobi_kf8_posfid_target(rawml, pos_fid, pos_off);
+            entries[n].level = level;
+            n++;
+            if (entries[n - 1].label == NULL || entries[n - 1].target == NULL) {
+                ret = MOBI_DATA_CORRUPT;
+                break;
+            }
+            uint32_t child_first;
+            uint32_t child_last;
+            if (mobi_get_indxentry_tagvalue(&child_first, entry, INDX_TAG_NCX_CHILD_START) != MOBI_SUCCESS ||
+                mobi_get_indxentry_tagvalue(&child_last, entry, INDX_TAG_NCX_CHILD_END) != MOBI_SUCCESS ||
+                child_first > child_last || child_last >= entries_count) {
+                continue;
+            }
+            /* push children in reverse order, so that first child is visited first */
+            for (size_t c = child_last + 1; c-- > child_first;) {
+                if (!visited[c]) {
+                    visited[c] = true;
+                    stack[top] = c;
+                    depth[top++] = level + 1;
+                }
+            }
+        }
+    }
+    free(stack);
+    free(depth);
+    free(visited);
+    if (ret != MOBI_SUCCESS) {
+        mobi_kf8_free_toc(entries, n);
+        return ret;
+    }
+    *toc = entries;
+    *count = n;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Free guide entries allocated by mobi_kf8_guide_from_indx()
+
+ @param[in] guide Entries
+ @param[in] count Number of entries
+ */
+static void mobi_kf8_free_guide(MOBIGuideEntry *guide, const size_t count) {
+    if (guide == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        free((char *) guide[i].title);
+        free((char *) guide[i].target);
+    }
+    free(guide);
+}
+
+/**
+ @brief Convert parsed guide index into guide entries
+
+ Entry types point to labels of index entries, which must stay valid.
+
+ @param[out] guide Allocated entries
+ @param[out] count Number of entries
+ @param[in] rawml MOBIRawml structure with parsed index
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_kf8_guide_from_indx(MOBIGuideEntry **guide, size_t *count, const MOBIRawml *rawml) {
+    *guide = NULL;
+    *count = 0;
+    const MOBIIndx *indx = rawml->guide;
+    if (indx == NULL || indx->entries_count == 0 || indx->cncx_record == NULL || rawml->frag == NULL) {
+        return MOBI_SUCCESS;
+    }
+    MOBIGuideEntry *entries = calloc(indx->entries_count, sizeof(MOBIGuideEntry));
+    if (entries == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < indx->entries_count; i++) {
+        const MOBIIndexEntry *entry = &indx->entries[i];
+        uint32_t cncx_offset;
+        uint32_t frag_number;
+        uint32_t file_number;
+        if (mobi_get_indxentry_tagvalue(&cncx_offset, entry, INDX_TAG_GUIDE_TITLE_CNCX) != MOBI_SUCCESS ||
+            mobi_get_indxentry_tagvalue(&frag_number, entry, INDX_TAG_FRAG_POSITION) != MOBI_SUCCESS ||
+            frag_number >= rawml->frag->entries_count ||
+            mobi_get_indxentry_tagvalue(&file_number, &rawml->frag->entries[frag_number], INDX_TAG_FRAG_FILE_NR) != MOBI_SUCCESS) {
+            continue;
+        }
+        char *target = malloc(32);
+        char *title = mobi_get_cncx_string(indx->cncx_record, cncx_offset);
+        if (target == NULL || title == NULL) {
+            free(target);
+            free(title);
+            mobi_kf8_free_guide(entries, n);
+            debug_print("%s", "Memory allocation failed\n");
+            return MOBI_MALLOC_FAILED;
+        }
+        snprintf(target, 32, "part%05u.html", file_number);
+        entries[n].type = entry->label;
+        entries[n].title = title;
+        entries[n].target = target;
+        n++;
+    }
+    *guide = entries;
+    *count = n;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Write loaded KF8 document as new KF8 (azw3) document
+
+ Document is parsed into parts, which are then written with mobi_write_kf8().
+ Table of contents and guide are taken from parsed indices.
+
+ @param[in] m MOBIData structure with loaded document
+ @param[in,out] file File descriptor opened for writing in binary mode
+ @return MOBI_RET status code (on success MOBI_SUCCESS), MOBI_FILE_UNSUPPORTED if document is not KF8
+ */
+MOBI_RET mobi_rebuild_kf8(const MOBIData *m, FILE *file) {
+    if (m == NULL || file == NULL) {
+        debug_print("%s", "Mobi structure not initialized\n");
+        return MOBI_INIT_FAILED;
+    }
+    if (!mobi_is_kf8(m) || mobi_is_replica(m)) {
+        debug_print("%s", "Not a KF8 document\n");
+        return MOBI_FILE_UNSUPPORTED;
+    }
+    MOBIRawml *rawml = mobi_init_rawml(m);
+    if (rawml == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBIKf8Book book;
+    memset(&book, 0, sizeof(MOBIKf8Book));
+    MOBITocEntry *toc = NULL;
+    MOBIGuideEntry *guide = NULL;
+    char *author = NULL;
+    /* links are reconstructed after ncx and guide targets are read */
+    MOBI_RET ret = mobi_parse_rawml_opt(rawml, m, true, false, false);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_kf8_toc_from_ncx(&toc, &book.toc_count, rawml);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_kf8_guide_from_indx(&guide, &book.guide_count, rawml);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_reconstruct_links(rawml);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_iterate_txtparts(rawml, mobi_strip_mobitags);
+    }
+    if (ret == MOBI_SUCCESS) {
+        char fullname[RECORD0_FULLNAME_SIZE_MAX + 1];
+        if (mobi_get_fullname(m, fullname, RECORD0_FULLNAME_SIZE_MAX) != MOBI_SUCCESS) {
+            fullname[0] = '\0';
+        }
+        const MOBIExthHeader *exth = mobi_get_exthrecord_by_tag(m, EXTH_AUTHOR);
+        if (exth) {
+            author = mobi_decode_exthstring(m, exth->data, exth->size);
+        }
+        book.markup = rawml->markup;
+        book.flow = rawml->flow ? rawml->flow->next : NULL;
+        book.resources = rawml->resources;
+        book.title = fullname;
+        book.author = author;
+        book.language = (m->mh && m->mh->locale) ? mobi_get_locale_string(*m->mh->locale) : NULL;
+        book.toc = toc;
+        book.guide = guide;
+        ret = mobi_write_kf8(&book, file);
+    }
+    free(author);
+    mobi_kf8_free_toc(toc, book.toc_count);
+    mobi_kf8_free_guide(guide, book.guide_count);
+    mobi_free_rawml(rawml);
+    return ret;
+}
+
+/**
+ @brief Collation of written dictionary index
+ */
+typedef struct {
+    uint16_t *rank; /**< Rank of each UTF-16 code unit, ORDT offset if ORDT is used */
+    uint16_t *ordt; /**< ORDT2 table, code units in collation order, NULL for ASCII labels */
+    size_t ordt_count; /**< Number of ORDT2 entries */
+    uint32_t ordt_type; /**< ORDT offsets size: 0 - 16 bit, 1 - 8 bit */
+} MOBIDictCollation;
+
+/**
+ @brief TAGX layout of written dictionary index, derived from entries
+ */
+typedef struct {
+    TAGXTags tags[2 * (UINT8_MAX + 1)]; /**< TAGX tags with control byte terminators */
+    size_t tags_count; /**< Number of TAGX tags */
+    uint8_t control_byte[UINT8_MAX + 1]; /**< Control byte of each tag id */
+    uint8_t bitmask[UINT8_MAX + 1]; /**< Bitmask of each tag id, zero if tag is not used */
+    size_t control_bytes; /**< Number of control bytes */
+} MOBIDictTagx;
+
+/**
+ @brief Index entry being sorted
+ */
+typedef struct {
+    const unsigned char *key; /**< Collation key, ORDT encoded label if ORDT is used */
+    size_t key_length; /**< Key length */
+    size_t index; /**< Index of entry in input array */
+} MOBIDictItem;
+
+/**
+ @brief Dictionary index job, one of parallel passes over a range of entries
+ */
+typedef struct {
+    const MOBIIndexEntry *entries; /**< Input entries */
+    MOBIDictItem *items; /**< Items, in input order before sorting */
+    MOBIDictItem *sorted; /**< Merge output */
+    size_t first; /**< First entry or item of the job */
+    size_t middle; /**< Start of second run for merge job */
+    size_t last; /**< Entry or item following last one of the job */
+    const MOBIDictCollation *collation; /**< Collation */
+    const MOBIDictTagx *tagx; /**< TAGX layout */
+    uint8_t tag_usage[UINT8_MAX + 1]; /**< Scan result: 0 - not used, 1 - single value, 2 - multiple values */
+    uint8_t *units; /**< Scan result: bitmap of used UTF-16 code units */
+    bool non_ascii; /**< Scan result: true if any label is not ASCII */
+    unsigned char *keys; /**< Keys of the range */
+    MOBIBuffer *buf; /**< Encoded entries of the range */
+    size_t *offsets; /**< End offsets of encoded entries, relative to job buffer */
+    MOBI_RET ret; /**< Job result */
+} MOBIDictJob;
+
+/**
+ @brief Decode UTF-8 character
+
+ @param[out] codepoint Decoded code point
+ @param[in] s String
+ @return Number of bytes of the character, zero if sequence is invalid
+ */
+static size_t mobi_dict_utf8_next(uint32_t *codepoint, const unsigned char *s) {
+    static const uint32_t min_value[] = { 0, 0, 0x80, 0x800, 0x10000 };
+    size_t length;
+    uint32_t cp;
+    if (s[0] < 0x80) {
+        *codepoint = s[0];
+        return 1;
+    } else if ((s[0] & 0xe0) == 0xc0) {
+        length = 2;
+        cp = s[0] & 0x1f;
+    } else if ((s[0] & 0xf0) == 0xe0) {
+        length = 3;
+        cp = s[0] & 0x0f;
+    } else if ((s[0] & 0xf8) == 0xf0) {
+        length = 4;
+        cp = s[0] & 0x07;
+    } else {
+        return 0;
+    }
+    for (size_t i = 1; i < length; i++) {
+        if ((s[i] & 0xc0) != 0x80) {
+            return 0;
+        }
+        cp = (cp << 6) | (s[i] & 0x3f);
+    }
+    if (cp < min_value[length] || cp > 0x10ffff || (cp >= 0xd800 && cp <= 0xdfff)) {
+        return 0;
+    }
+    *codepoint = cp;
+    return length;
+}
+
+/**
+ @brief Convert code point into UTF-16 code units
+
+ @param[out] units Code units
+ @param[in] codepoint Code point
+ @return Number of code units
+ */
+static size_t mobi_dict_utf16(uint16_t units[2], const uint32_t codepoint) {
+    if (codepoint < 0x10000) {
+        units[0] = (uint16_t) codepoint;
+        return 1;
+    }
+    units[0] = (uint16_t) (0xd800 + ((codepoint - 0x10000) >> 10));
+    units[1] = (uint16_t) (0xdc00 + ((codepoint - 0x10000) & 0x3ff));
+    return 2;
+}
+
+/**
+ @brief Case folded UTF-16 code unit, used as primary collation key
+
+ Folds basic Latin, Latin-1, Greek and Cyrillic capital letters.
+
+ @param[in] unit Code unit
+ @return Folded code unit
+ */
+static uint16_t mobi_dict_fold(const uint16_t unit) {
+    if ((unit >= 'A' && unit <= 'Z') || (unit >= 0xc0 && unit <= 0xde && unit != 0xd7)
+        || (unit >= 0x391 && unit <= 0x3a9) || (unit >= 0x410 && unit <= 0x42f)) {
+        return unit + 0x20;
+    }
+    if (unit >= 0x400 && unit <= 0x40f) {
+        return unit + 0x50;
+    }
+    return unit;
+}
+
+/**
+ @brief Compare code units by collation order: case folded first, then by value
+
+ @param[in] a First code unit
+ @param[in] b Second code unit
+ @return Comparison result as in qsort()
+ */
+static int mobi_dict_unit_compare(const void *a, const void *b) {
+    const uint16_t u1 = *(const uint16_t *) a;
+    const uint16_t u2 = *(const uint16_t *) b;
+    const uint16_t f1 = mobi_dict_fold(u1);
+    const uint16_t f2 = mobi_dict_fold(u2);
+    if (f1 != f2) {
+        return f1 < f2 ? -1 : 1;
+    }
+    return (u1 > u2) - (u1 < u2);
+}
+
+/**
+ @brief Compare items by key, then by input position, so that equal labels keep input order
+
+ @param[in] a First MOBIDictItem
+ @param[in] b Second MOBIDictItem
+ @return Comparison result as in qsort()
+ */
+static int mobi_dict_item_compare(const void *a, const void *b) {
+    const MOBIDictItem *item1 = a;
+    const MOBIDictItem *item2 = b;
+    const size_t length = item1->key_length < item2->key_length ? item1->key_length : item2->key_length;
+    const int cmp = memcmp(item1->key, item2->key, length);
+    if (cmp) {
+        return cmp;
+    }
+    if (item1->key_length != item2->key_length) {
+        return item1->key_length < item2->key_length ? -1 : 1;
+    }
+    return (item1->index > item2->index) - (item1->index < item2->index);
+}
+
+/**
+ @brief Validate range of entries, collect used tags and characters
+
+ @param[in,out] arg MOBIDictJob structure
+ @return NULL
+ */
+static void * mobi_dict_scan_thread(void *arg) {
+    MOBIDictJob *job = arg;
+    job->ret = MOBI_SUCCESS;
+    for (size_t i = job->first; i < job->last; i++) {
+        const MOBIIndexEntry *entry = &job->entries[i];
+        const unsigned char *label = (const unsigned char *) entry->label;
+        if (label == NULL || *label == '\0' || (entry->tags_count && entry->tags == NULL)) {
+            debug_print("Invalid index entry: %zu\n", i);
+            job->ret = MOBI_PARAM_ERR;
+            return NULL;
+        }
+        while (*label) {
+            uint32_t codepoint;
+            const size_t length = mobi_dict_utf8_next(&codepoint, label);
+            /* code points up to 5 are ligature markers, others would be replaced by reader */
+            if (length == 0 || codepoint <= 5 || (codepoint >= 0xfdd0 && codepoint <= 0xfdef) || (codepoint & 0xfffe) == 0xfffe) {
+                debug_print("Invalid character in index label: %zu\n", i);
+                job->ret = MOBI_PARAM_ERR;
+                return NULL;
+            }
+            uint16_t units[2];
+            const size_t units_count = mobi_dict_utf16(units, codepoint);
+            for (size_t u = 0; u < units_count; u++) {
+                job->units[units[u] >> 3] |= (uint8_t) (1 << (units[u] & 7));
+            }
+            job->non_ascii |= codepoint >= 0x80;
+            label += length;
+        }
+        for (size_t t = 0; t < entry->tags_count; t++) {
+            const MOBIIndexTag *tag = &entry->tags[t];
+            if (tag->tagvalues_count == 0) {
+                continue;
+            }
+            if (tag->tagid == 0 || tag->tagid > UINT8_MAX || tag->tagvalues_count > INDX_TAGVALUES_MAX || tag->tagvalues == NULL) {
+                debug_print("Invalid tag %zu in index entry: %zu\n", tag->tagid, i);
+                job->ret = MOBI_PARAM_ERR;
+                return NULL;
+            }
+            for (size_t t2 = 0; t2 < t; t2++) {
+                if (entry->tags[t2].tagid == tag->tagid && entry->tags[t2].tagvalues_count) {
+                    debug_print("Duplicate tag %zu in index entry: %zu\n", tag->tagid, i);
+                    job->ret = MOBI_PARAM_ERR;
+                    return NULL;
+                }
+            }
+            for (size_t v = 0; v < tag->tagvalues_count; v++) {
+                if (tag->tagvalues[v] > INDX_TAGVALUE_MAX) {
+                    debug_print("Tag value too large in index entry: %zu\n", i);
+                    job->ret = MOBI_PARAM_ERR;
+                    return NULL;
+                }
+            }
+            const uint8_t usage = tag->tagvalues_count > 1 ? 2 : 1;
+            if (job->tag_usage[tag->tagid] < usage) {
+                job->tag_usage[tag->tagid] = usage;
+            }
+        }
+    }
+    return NULL;
+}
+
+/**
+ @brief Build collation keys of range of entries
+
+ @param[in,out] arg MOBIDictJob structure
+ @return NULL
+ */
+static void * mobi_dict_key_thread(void *arg) {
+    MOBIDictJob *job = arg;
+    const MOBIDictCollation *collation = job->collation;
+    const size_t unit_size = (collation->ordt && collation->ordt_type == 0) ? 2 : 1;
+    size_t size = 0;
+    for (size_t i = job->first; i < job->last; i++) {
+        size += strlen(job->entries[i].label);
+    }
+    job->keys = malloc(size * unit_size + 1);
+    if (job->keys == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        job->ret = MOBI_MALLOC_FAILED;
+        return NULL;
+    }
+    unsigned char *key = job->keys;
+    for (size_t i = job->first; i < job->last; i++) {
+        const unsigned char *label = (const unsigned char *) job->entries[i].label;
+        MOBIDictItem *item = &job->items[i];
+        item->key = key;
+        item->index = i;
+        while (*label) {
+            uint32_t codepoint;
+            label += mobi_dict_utf8_next(&codepoint, label);
+            uint16_t units[2];
+            const size_t units_count = mobi_dict_utf16(units, codepoint);
+            for (size_t u = 0; u < units_count; u++) {
+                const uint16_t rank = collation->rank[units[u]];
+                if (unit_size == 2) {
+                    *key++ = (unsigned char) (rank >> 8);
+                }
+                *key++ = (unsigned char) rank;
+            }
+        }
+        item->key_length = (size_t) (key - item->key);
+        const size_t label_length = collation->ordt ? item->key_length : (size_t) (label - (const unsigned char *) job->entries[i].label);
+        if (label_length > INDX_ENTRY_LABEL_MAX) {
+            debug_print("Index label too long: %s\n", job->entries[i].label);
+            job->ret = MOBI_PARAM_ERR;
+            return NULL;
+        }
+    }
+    job->ret = MOBI_SUCCESS;
+    return NULL;
+}
+
+/**
+ @brief Sort range of items
+
+ @param[in,out] arg MOBIDictJob structure
+ @return NULL
+ */
+static void * mobi_dict_sort_thread(void *arg) {
+    MOBIDictJob *job = arg;
+    qsort(job->items + job->first, job->last - job->first, sizeof(MOBIDictItem), mobi_dict_item_compare);
+    return NULL;
+}
+
+/**
+ @brief Merge two sorted runs of items: [first, middle) and [middle, last)
+
+ @param[in,out] arg MOBIDictJob structure
+ @return NULL
+ */
+static void * mobi_dict_merge_thread(void *arg) {
+    MOBIDictJob *job = arg;
+    size_t i = job->first;
+    size_t j = job->middle;
+    size_t k = job->first;
+    while (i < job->middle && j < job->last) {
+        if (mobi_dict_item_compare(&job->items[j], &job->items[i]) < 0) {
+            job->sorted[k++] = job->items[j++];
+        } else {
+            job->sorted[k++] = job->items[i++];
+        }
+    }
+    while (i < job->middle) {
+        job->sorted[k++] = job->items[i++];
+    }
+    while (j < job->last) {
+        job->sorted[k++] = job->items[j++];
+    }
+    return NULL;
+}
+
+/**
+ @brief Size of value encoded with buffer_add_varlen()
+
+ @param[in] value Value
+ @return Encoded size
+ */
+static size_t mobi_dict_varlen_size(const uint32_t value) {
+    size_t size = 1;
+    while (value >> (7 * size) && size < 4) {
+        size++;
+    }
+    return size;
+}
+
+/**
+ @brief Encode range of sorted entries
+
+ Entry: label length, label, control bytes, byte counts of multi value tags, tag values.
+
+ @param[in,out] arg MOBIDictJob structure
+ @return NULL
+ */
+static void * mobi_dict_encode_thread(void *arg) {
+    MOBIDictJob *job = arg;
+    const MOBIDictTagx *tagx = job->tagx;
+    job->buf = buffer_init(64 * (job->last - job->first) + 1);
+    if (job->buf == NULL) {
+        job->ret = MOBI_MALLOC_FAILED;
+        return NULL;
+    }
+    MOBIBuffer *buf = job->buf;
+    for (size_t i = job->first; i < job->last; i++) {
+        const MOBIDictItem *item = &job->items[i];
+        const MOBIIndexEntry *entry = &job->entries[item->index];
+        const unsigned char *label = item->key;
+        size_t label_length = item->key_length;
+        if (job->collation->ordt == NULL) {
+            label = (const unsigned char *) entry->label;
+        }
+        /* tags with values, in TAGX order */
+        const MOBIIndexTag *tags[UINT8_MAX + 1];
+        size_t tags_count = 0;
+        size_t size = 1 + label_length + tagx->control_bytes;
+        uint8_t control_bytes[UINT8_MAX + 1];
+        memset(control_bytes, 0, tagx->control_bytes);
+        for (size_t t = 0; t < entry->tags_count; t++) {
+            const MOBIIndexTag *tag = &entry->tags[t];
+            if (tag->tagvalues_count == 0) {
+                continue;
+            }
+            size_t j = tags_count++;
+            while (j > 0 && tags[j - 1]->tagid > tag->tagid) {
+                tags[j] = tags[j - 1];
+                j--;
+            }
+            tags[j] = tag;
+            const uint8_t mask = tagx->bitmask[tag->tagid];
+            uint8_t shift = 0;
+            while (((mask >> shift) & 1) == 0) {
+                shift++;
+            }
+            if ((mask >> shift) == 1 || tag->tagvalues_count < 3) {
+                /* count stored in control byte */
+                control_bytes[tagx->control_byte[tag->tagid]] |= (uint8_t) (tag->tagvalues_count << shift);
+            } else {
+                /* all bits set, byte count of values follows control bytes */
+                control_bytes[tagx->control_byte[tag->tagid]] |= mask;
+            }
+            size += 4 + 4 * tag->tagvalues_count;
+        }
+        buffer_reserve(buf, size);
+        buffer_add8(buf, (uint8_t) label_length);
+        buffer_addraw(buf, label, label_length);
+        buffer_addraw(buf, control_bytes, tagx->control_bytes);
+        for (size_t t = 0; t < tags_count; t++) {
+            const uint8_t mask = tagx->bitmask[tags[t]->tagid];
+            if (tags[t]->tagvalues_count >= 3 && (mask & (mask - 1))) {
+                size_t bytes = 0;
+                for (size_t v = 0; v < tags[t]->tagvalues_count; v++) {
+                    bytes += mobi_dict_varlen_size(tags[t]->tagvalues[v]);
+                }
+                buffer_add_varlen(buf, (uint32_t) bytes);
+            }
+        }
+        for (size_t t = 0; t < tags_count; t++) {
+            for (size_t v = 0; v < tags[t]->tagvalues_count; v++) {
+                buffer_add_varlen(buf, tags[t]->tagvalues[v]);
+            }
+        }
+        job->offsets[i + 1] = buf->offset;
+    }
+    job->ret = buf->error;
+    return NULL;
+}
+
+/**
+ @brief Run parallel pass over ranges of entries
+
+ @param[in,out] jobs Jobs, ranges are set by the function
+ @param[in] jobs_count Number of jobs
+ @param[in] count Number of entries
+ @param[in] func Job function
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_dict_run_pass(MOBIDictJob *jobs, const size_t jobs_count, const size_t count, MOBIThreadFunc func) {
+    for (size_t t = 0; t < jobs_count; t++) {
+        jobs[t].first = count * t / jobs_count;
+        jobs[t].last = count * (t + 1) / jobs_count;
+        jobs[t].ret = MOBI_SUCCESS;
+    }
+    mobi_run_jobs(jobs, sizeof(MOBIDictJob), jobs_count, func);
+    for (size_t t = 0; t < jobs_count; t++) {
+        if (jobs[t].ret != MOBI_SUCCESS) {
+            return jobs[t].ret;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build collation from used UTF-16 code units
+
+ ASCII labels are stored as they are, other labels as offsets into ORDT2 table.
+ Table holds used code units in collation order, so that comparing offsets gives collation order.
+
+ @param[out] collation Collation, rank array is allocated by the function
+ @param[in] units Bitmap of used code units
+ @param[in] non_ascii True if any label is not ASCII
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_dict_build_collation(MOBIDictCollation *collation, const uint8_t *units, const bool non_ascii) {
+    memset(collation, 0, sizeof(MOBIDictCollation));
+    collation->rank = calloc(UINT16_MAX + 1, sizeof(uint16_t));
+    uint16_t *table = malloc((UINT16_MAX + 1) * sizeof(uint16_t));
+    if (collation->rank == NULL || table == NULL) {
+        free(table);
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    size_t count = 0;
+    for (size_t u = 0; u <= UINT16_MAX; u++) {
+        if (units[u >> 3] & (1 << (u & 7))) {
+            table[count++] = (uint16_t) u;
+        }
+    }
+    qsort(table, count, sizeof(uint16_t), mobi_dict_unit_compare);
+    for (size_t i = 0; i < count; i++) {
+        collation->rank[table[i]] = (uint16_t) i;
+    }
+    if (!non_ascii) {
+        free(table);
+        return MOBI_SUCCESS;
+    }
+    if (count > ORDT_RECORD_MAXCNT) {
+        debug_print("Too many distinct characters in index labels (%zu)\n", count);
+        free(table);
+        return MOBI_PARAM_ERR;
+    }
+    collation->ordt = table;
+    collation->ordt_count = count;
+    collation->ordt_type = count <= UINT8_MAX + 1 ? 1 : 0;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build TAGX layout from used tags
+
+ Tag with single value uses one bit of control byte, tag with multiple values uses two bits.
+ Counts above two are stored as number of bytes of values.
+
+ @param[out] tagx TAGX layout
+ @param[in] tag_usage Usage of each tag id: 0 - not used, 1 - single value, 2 - multiple values
+ */
+static void mobi_dict_build_tagx(MOBIDictTagx *tagx, const uint8_t *tag_usage) {
+    memset(tagx, 0, sizeof(MOBIDictTagx));
+    size_t bit = 0;
+    for (size_t id = 1; id <= UINT8_MAX; id++) {
+        if (tag_usage[id] == 0) {
+            continue;
+        }
+        const size_t bits = tag_usage[id];
+        if (bit + bits > 8) {
+            tagx->tags[tagx->tags_count++] = (TAGXTags) { 0, 0, 0, 1 };
+            tagx->control_bytes++;
+            bit = 0;
+        }
+        const uint8_t mask = (uint8_t) (((1 << bits) - 1) << bit);
+        tagx->tags[tagx->tags_count++] = (TAGXTags) { (uint8_t) id, 1, mask, 0 };
+        tagx->control_byte[id] = (uint8_t) tagx->control_bytes;
+        tagx->bitmask[id] = mask;
+        bit += bits;
+    }
+    if (tagx->tags_count) {
+        tagx->tags[tagx->tags_count++] = (TAGXTags) { 0, 0, 0, 1 };
+        tagx->control_bytes++;
+    }
+}
+
+/**
+ @brief Sort items in parallel: sort ranges, then merge pairs of runs
+
+ @param[in,out] items Items
+ @param[in] count Number of items
+ @param[in,out] jobs Jobs
+ @param[in] jobs_count Number of jobs
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET mobi_dict_sort(MOBIDictItem *items, const size_t count, MOBIDictJob *jobs, const size_t jobs_count) {
+    MOBI_RET ret = mobi_dict_run_pass(jobs, jobs_count, count, mobi_dict_sort_thread);
+    if (ret != MOBI_SUCCESS || jobs_count == 1) {
+        return ret;
+    }
+    MOBIDictItem *tmp = malloc(count * sizeof(MOBIDictItem));
+    size_t *bounds = malloc((jobs_count + 1) * sizeof(size_t));
+    if (tmp == NULL || bounds == NULL) {
+        free(tmp);
+        free(bounds);
+        debug_print("%s", "Memory allocation failed\n");
+        return MOBI_MALLOC_FAILED;
+    }
+    for (size_t t = 0; t < jobs_count; t++) {
+        bounds[t] = jobs[t].first;
+    }
+    bounds[jobs_count] = count;
+    size_t runs = jobs_count;
+    MOBIDictItem *src = items;
+    MOBIDictItem *dst = tmp;
+    while (runs > 1) {
+        const size_t merges = (runs + 1) / 2;
+        for (size_t m = 0; m < merges; m++) {
+            jobs[m].items = src;
+            jobs[m].sorted = dst;
+            jobs[m].first = bounds[2 * m];
+            jobs[m].middle = bounds[2 * m + 1];
+            /* odd run is copied */
+            jobs[m].last = 2 * m + 2 <= runs ? bounds[2 * m + 2] : bounds[2 * m + 1];
+        }
+        mobi_run_jobs(jobs, sizeof(MOBIDictJob), merges, mobi_dict_merge_thread);
+        for (size_t m = 0; m <= merges; m++) {
+            bounds[m] = bounds[2 * m <= runs ? 2 * m : runs];
+        }
+        runs = merges;
+        MOBIDictItem *swap = src;
+        src = dst;
+        dst = swap;
+    }
+    if (src != items) {
+        memcpy(items, src, count * sizeof(MOBIDictItem));
+    }
+    for (size_t t = 0; t < jobs_count; t++) {
+        jobs[t].items = items;
+    }
+    free(tmp);
+    free(bounds);
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build index records of a dictionary, like orth or infl index
+
+ Entries are sorted by labels. ASCII labels are stored as they are, other labels
+ are encoded as offsets into ORDT table holding used characters in collation order:
+ case folded Latin, Greek and Cyrillic letters first, then code point order.
+ Entries with equal labels keep their input order.
+ TAGX section is derived from tags used by entries, tags without values are omitted.
+ Validation, sorting and encoding are done in parallel, if threads are available.
+
+ Records parsed back with mobi_parse_index() give the same entries in sorted order,
+ with tags in ascending tag id order.
+
+ @param[out] records List of records: header record, data records, to be freed with mobi_free_records()
+ @param[in] entries Entries, labels in UTF-8
+ @param[in] entries_count Number of entries
+ @param[in] type Index type: 0 - normal, 2 - inflection
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+MOBI_RET mobi_build_index(MOBIPdbRecord **records, const MOBIIndexEntry *entries, const size_t entries_count, const uint32_t type) {
+    if (records == NULL || entries == NULL || entries_count == 0 || entries_count > INDX_TOTAL_MAXCNT) {
+        debug_print("%s", "Invalid index entries\n");
+        return MOBI_PARAM_ERR;
+    }
+    *records = NULL;
+    const size_t jobs_count = mobi_jobs_count(entries_count, MOBI_DICT_JOB_MIN);
+    MOBIDictJob *jobs = calloc(jobs_count, sizeof(MOBIDictJob));
+    MOBIDictItem *items = malloc(entries_count * sizeof(MOBIDictItem));
+    size_t *offsets = malloc((entries_count + 1) * sizeof(size_t));
+    MOBIDictTagx *tagx = malloc(sizeof(MOBIDictTagx));
+    MOBIDictCollation collation;
+    memset(&collation, 0, sizeof(MOBIDictCollation));
+    MOBIKf8Records output = { NULL, 0, 0 };
+    MOBI_RET ret = MOBI_SUCCESS;
+    if (jobs == NULL || items == NULL || offsets == NULL || tagx == NULL) {
+        debug_print("%s", "Memory allocation failed\n");
+        ret = MOBI_MALLOC_FAILED;
+        goto cleanup;
+    }
+    for (size_t t = 0; t < jobs_count; t++) {
+        jobs[t].entries = entries;
+        jobs[t].items = items;
+        jobs[t].offsets = offsets;
+        jobs[t].collation = &collation;
+        jobs[t].tagx = tagx;
+        jobs[t].units = calloc((UINT16_MAX + 1) / 8, 1);
+        if (jobs[t].units == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            ret = MOBI_MALLOC_FAILED;
+            goto cleanup;
+        }
+    }
+    /* validate, collect tags and characters */
+    ret = mobi_dict_run_pass(jobs, jobs_count, entries_count, mobi_dict_scan_thread);
+    if (ret != MOBI_SUCCESS) {
+        goto cleanup;
+    }
+    bool non_ascii = false;
+    for (size_t t = 1; t < jobs_count; t++) {
+        for (size_t i = 0; i <= UINT8_MAX; i++) {
+            if (jobs[0].tag_usage[i] < jobs[t].tag_usage[i]) {
+                jobs[0].tag_usage[i] = jobs[t].tag_usage[i];
+            }
+        }
+        for (size_t i = 0; i < (UINT16_MAX + 1) / 8; i++) {
+            jobs[0].units[i] |= jobs[t].units[i];
+        }
+    }
+    for (size_t t = 0; t < jobs_count; t++) {
+        non_ascii |= jobs[t].non_ascii;
+    }
+    mobi_dict_build_tagx(tagx, jobs[0].tag_usage);
+    ret = mobi_dict_build_collation(&collation, jobs[0].units, non_ascii);
+    if (ret != MOBI_SUCCESS) {
+        goto cleanup;
+    }
+    /* collation keys, sorting, encoding */
+    ret = mobi_dict_run_pass(jobs, jobs_count, entries_count, mobi_dict_key_thread);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_dict_sort(items, entries_count, jobs, jobs_count);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_dict_run_pass(jobs, jobs_count, entries_count, mobi_dict_encode_thread);
+    }
+    if (ret != MOBI_SUCCESS) {
+        goto cleanup;
+    }
+    /* join encoded ranges */
+    size_t total = 0;
+    for (size_t t = 0; t < jobs_count; t++) {
+        total += jobs[t].buf->offset;
+    }
+    MOBIIndxWriter indx;
+    memset(&indx, 0, sizeof(MOBIIndxWriter));
+    indx.entries = buffer_init(total + 1);
+    if (indx.entries == NULL) {
+        ret = MOBI_MALLOC_FAILED;
+        goto cleanup;
+    }
+    offsets[0] = 0;
+    for (size_t t = 0; t < jobs_count; t++) {
+        const size_t base = indx.entries->offset;
+        for (size_t i = jobs[t].first; i < jobs[t].last; i++) {
+            offsets[i + 1] += base;
+        }
+        buffer_addraw(indx.entries, jobs[t].buf->data, jobs[t].buf->offset);
+    }
+    indx.offsets = offsets;
+    indx.entries_count = entries_count;
+    indx.type = type;
+    indx.encoding = collation.ordt ? MOBI_UTF16 : MOBI_UTF8;
+    indx.ordt = collation.ordt;
+    indx.ordt_count = collation.ordt_count;
+    indx.ordt_type = collation.ordt_type;
+    ret = mobi_indx_write(&output, &indx, tagx->tags, tagx->tags_count);
+    /* offsets are freed below */
+    indx.offsets = NULL;
+    mobi_indx_writer_free(&indx);
+    /* move records to list */
+    MOBIPdbRecord **next = records;
+    for (size_t i = 0; ret == MOBI_SUCCESS && i < output.count; i++) {
+        MOBIPdbRecord *record = calloc(1, sizeof(MOBIPdbRecord));
+        if (record == NULL) {
+            debug_print("%s", "Memory allocation failed\n");
+            ret = MOBI_MALLOC_FAILED;
+            break;
+        }
+        record->data = output.records[i]->data;
+        record->size = output.records[i]->offset;
+        record->uid = (uint32_t) (2 * i);
+        output.records[i]->data = NULL;
+        *next = record;
+        next = &record->next;
+    }
+    if (ret != MOBI_SUCCESS) {
+        mobi_free_records(*records);
+        *records = NULL;
+    }
+cleanup:
+    if (jobs) {
+        for (size_t t = 0; t < jobs_count; t++) {
+            free(jobs[t].units);
+            free(jobs[t].keys);
+            if (jobs[t].buf) {
+                buffer_free(jobs[t].buf);
+            }
+        }
+    }
+    mobi_kf8_free_records(&output);
+    free(jobs);
+    free(items);
+    free(offsets);
+    free(tagx);
+    free(collation.rank);
+    free(collation.ordt);
+    return ret;
 }
@@ -1,4 +1,5 @@
-/*
+/** @file write.h
+ *
  * Copyright (c) 2014 Bartek Fabiszewski
  * http://www.fabiszewski.net
  *
@@ -14,5 +15,33 @@
 #include "mobi.h"
 #include "buffer.h"
 
+/**
+ @defgroup mobi_kf8_write Params for written KF8 document
+ @{
+ */
+#define KF8_MOBI_HEADER_LEN 264 /**< Length of written MOBI header, including magic */
+#define KF8_MOBI_VERSION 8 /**< Written MOBI header version */
+#define KF8_EXTH_FLAGS 0x50 /**< EXTH flags of KF8 document */
+#define KF8_FULLNAME_PADDING 8192 /**< Zero padding following full name in record 0, as in kindlegen files */
+#define KF8_FRAGMENT_SIZE 8192 /**< Approximate size of markup fragment */
+#define KF8_TEXT_RECORD_SIZEMAX (RECORD0_TEXT_SIZE_MAX + RECORD0_TEXT_SIZE_MAX / 8 + 8) /**< Max size of compressed text record with trailing entry */
+#define KF8_POSFID_LINK "kindle:pos:fid:0000:off:0000000000" /**< Placeholder of link to position in text */
+#define KF8_POSFID_FID_OFFSET 15 /**< Offset of fid value in placeholder */
+#define KF8_POSFID_OFF_OFFSET 24 /**< Offset of off value in placeholder */
+#define KF8_TEXT_RECORDS_MAX 0xffff /**< Max number of text records, count is stored as 16-bit value */
+#define KF8_EMPTY_RECORD_LEN 8 /**< Length of empty record used as placeholder for missing resource */
+/** @} */
+
+/**
+ @defgroup mobi_indx_write Params for written INDX records
+ @{
+ */
+#define INDX_HEADER_LEN 192 /**< Length of written INDX record header */
+#define INDX_RECORD_SIZEMAX 0x10000 /**< Max size of written INDX record, IDXT offsets are 16-bit */
+#define CNCX_RECORD_SIZEMAX 0xfc00 /**< Max size of written CNCX record, offsets within record are 16-bit */
+#define INDX_ENTRY_LABEL_MAX 0xff /**< Max length of index entry label */
+#define INDX_TAGVALUE_MAX 0xfffffff /**< Max tag value, values are stored in at most 4 bytes of 7 bits */
+#define MOBI_DICT_JOB_MIN 4096 /**< Min number of dictionary entries worth a separate thread */
+/** @} */
 
 #endif
@@ -0,0 +1,1512 @@
+/** @file check_samples.c
+ *
+ * @brief Checks of library routines on sample documents
+ *
+ * Routines that have no counterpart in mobitool output, and so are not
+ * covered by md5 checksums of test.sh, are checked here against
+ * properties that must hold for every sample document:
+ *
+ *   check_samples sample_file...
+ *
+ * Program fails if any check fails.
+ * It is linked with libmobi_check, a copy of the library
+ * with internal symbols visible.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "mobi.h"
+#include "fingerprint.h"
+#include "scratch.h"
+#include "thread.h"
+#include "util.h"
+#ifdef USE_LIBXML2
+# include <libxml/parser.h>
+#endif
+
+/** @brief Check signature, called once for every sample document */
+typedef void (*CheckFunc)(const char *input, const MOBIData *m, const MOBIRawml *rawml);
+
+#define CHECK_READ_CHUNK 777 /**< Length of ranges read from compressed parts, odd so that ranges cross block boundaries */
+#define CHECK_READ_RANGES 257 /**< Max number of ranges read from every compressed part */
+#define CHECK_UNRELATED_SIMILARITY 0.1 /**< Max fingerprint similarity of unrelated documents */
+#define CHECK_UNRELATED_DISTANCE 16 /**< Min simhash distance of unrelated documents, out of 64 bits */
+#define CHECK_REPLICA_PDF_START 100 /**< Offset of pdf in text of synthetic Print Replica document */
+#define CHECK_REPLICA_PDF_LENGTH 9000 /**< Length of pdf in synthetic Print Replica document */
+#define CHECK_REPLICA_TEXT_LENGTH (CHECK_REPLICA_PDF_START + CHECK_REPLICA_PDF_LENGTH + 50) /**< Length of text of synthetic Print Replica document */
+#define CHECK_REPLICA_FILE_MAX (2 * CHECK_REPLICA_TEXT_LENGTH + 256) /**< Max size of synthetic Print Replica document */
+
+static size_t failures = 0; /**< Number of failed checks */
+static size_t checks = 0; /**< Number of checks made */
+
+/**
+ @brief Report failed check
+
+ @param[in] check Name of the check
+ @param[in] input Description of input
+ @param[in] format Printf-style format of details
+ */
+static void check_fail(const char *check, const char *input, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "%s: %s: ", check, input);
+    vfprintf(stderr, format, args);
+    fprintf(stderr, "\n");
+    va_end(args);
+    failures++;
+}
+
+#ifdef USE_LIBXML2
+/**
+ @brief Silence libxml2 error output, errors are reported by check_fail()
+ */
+static void xml_error_ignore(void *ctx, const char *msg, ...) {
+    (void) ctx;
+    (void) msg;
+}
+
+/**
+ @brief Check that document is well-formed and namespace-well-formed xml
+
+ @param[in] data Document
+ @param[in] size Document size
+ @return Error message, NULL if document is well-formed
+ */
+static const char * xml_wellformed(const unsigned char *data, const size_t size) {
+    static char message[256];
+    xmlDocPtr doc = xmlReadMemory((const char *) data, (int) size, NULL, NULL, XML_PARSE_NONET);
+    const xmlError *error = xmlGetLastError();
+    if (doc && error == NULL) {
+        xmlFreeDoc(doc);
+        return NULL;
+    }
+    snprintf(message, sizeof(message), "line %i: %s", error ? error->line : 0, error && error->message ? error->message : "parse failed\n");
+    /* drop trailing newline of libxml2 message */
+    message[strcspn(message, "\n")] = '\0';
+    xmlFreeDoc(doc);
+    xmlResetLastError();
+    return message;
+}
+#endif
+
+/**
+ @brief Check that mobi_fix_xhtml() output of every html part is well-formed xml,
+        and that fixing it again does not change it
+ */
+static void check_fix_xhtml(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    (void) m;
+    for (const MOBIPart *part = rawml->markup; part != NULL; part = part->next) {
+        if (part->type != T_HTML) {
+            continue;
+        }
+        checks++;
+        unsigned char *fixed = NULL;
+        size_t fixed_size = 0;
+        MOBI_RET ret = mobi_fix_xhtml(&fixed, &fixed_size, part);
+        if (ret != MOBI_SUCCESS) {
+            check_fail("fix_xhtml", input, "part %zu: error (%i)", part->uid, ret);
+            continue;
+        }
+#ifdef USE_LIBXML2
+        const char *error = xml_wellformed(fixed, fixed_size);
+        if (error) {
+            check_fail("fix_xhtml", input, "part %zu: %s", part->uid, error);
+        }
+#endif
+        const MOBIPart fixed_part = { .uid = part->uid, .type = T_HTML, .size = fixed_size, .data = fixed };
+        unsigned char *refixed = NULL;
+        size_t refixed_size = 0;
+        ret = mobi_fix_xhtml(&refixed, &refixed_size, &fixed_part);
+        if (ret != MOBI_SUCCESS || refixed_size != fixed_size || memcmp(refixed, fixed, fixed_size) != 0) {
+            check_fail("fix_xhtml", input, "part %zu: repeated fix changes output", part->uid);
+        }
+        free(refixed);
+        free(fixed);
+    }
+}
+
+/**
+ @brief Compare parts list with reference list, reading part data with mobi_part_read()
+
+ @param[in] check Name of the check
+ @param[in] input Description of input
+ @param[in] variant Description of checked variant
+ @param[in] part Checked parts list
+ @param[in] reference Reference parts list
+ */
+static void compare_parts(const char *check, const char *input, const char *variant, const MOBIPart *part, const MOBIPart *reference) {
+    for (; reference != NULL; reference = reference->next, part = part->next) {
+        checks++;
+        if (part == NULL || part->uid != reference->uid || part->size != reference->size) {
+            check_fail(check, input, "%s: part %zu: different part list", variant, reference->uid);
+            return;
+        }
+        unsigned char *data = malloc(reference->size + 1);
+        if (data == NULL) {
+            check_fail(check, input, "memory allocation failed");
+            return;
+        }
+        /* whole part, then short ranges spread over the part, including one crossing part end */
+        size_t size = reference->size + 1;
+        MOBI_RET ret = mobi_part_read(part, data, 0, &size);
+        if (ret != MOBI_SUCCESS || size != reference->size || (size && memcmp(data, reference->data, size) != 0)) {
+            check_fail(check, input, "%s: part %zu: whole part read differs (%i)", variant, reference->uid, ret);
+        }
+        const size_t step = reference->size / CHECK_READ_RANGES + CHECK_READ_CHUNK;
+        for (size_t offset = 0; offset < reference->size; offset += step) {
+            if (offset + step >= reference->size && reference->size > CHECK_READ_CHUNK / 2) {
+                /* last range crosses part end */
+                offset = reference->size - CHECK_READ_CHUNK / 2;
+            }
+            size = CHECK_READ_CHUNK;
+            const size_t expected = (reference->size - offset < size) ? reference->size - offset : size;
+            ret = mobi_part_read(part, data, offset, &size);
+            if (ret != MOBI_SUCCESS || size != expected || memcmp(data, reference->data + offset, size) != 0) {
+                check_fail(check, input, "%s: part %zu: read at offset %zu differs (%i)", variant, reference->uid, offset, ret);
+                break;
+            }
+        }
+        free(data);
+    }
+    if (part != NULL) {
+        check_fail(check, input, "%s: more parts than in reference", variant);
+    }
+}
+
+/**
+ @brief Check that parts compressed with mobi_compress_rawml() read back with mobi_part_read()
+        and restored with mobi_decompress_rawml() equal original data
+ */
+static void check_compress_rawml(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    /* default block size and small one, not aligned to anything */
+    static const struct { const char *name; size_t block_size; } variants[] = {
+        { "default blocks", 0 },
+        { "4099 byte blocks", 4099 },
+    };
+    MOBIRawml *compressed = mobi_init_rawml(m);
+    if (compressed == NULL) {
+        check_fail("compress_rawml", input, "memory allocation failed");
+        return;
+    }
+    MOBI_RET ret = mobi_parse_rawml(compressed, m);
+    /* decompressed parts are compressed again with next block size */
+    for (size_t i = 0; ret == MOBI_SUCCESS && i < sizeof(variants) / sizeof(variants[0]); i++) {
+        ret = mobi_compress_rawml(compressed, variants[i].block_size);
+        if (ret != MOBI_SUCCESS) {
+            check_fail("compress_rawml", input, "%s: error (%i)", variants[i].name, ret);
+            break;
+        }
+        compare_parts("compress_rawml", input, variants[i].name, compressed->markup, rawml->markup);
+        compare_parts("compress_rawml", input, variants[i].name, compressed->flow, rawml->flow);
+        ret = mobi_decompress_rawml(compressed);
+        if (ret != MOBI_SUCCESS) {
+            check_fail("compress_rawml", input, "%s: decompression error (%i)", variants[i].name, ret);
+            break;
+        }
+        compare_parts("compress_rawml", input, variants[i].name, compressed->markup, rawml->markup);
+        compare_parts("compress_rawml", input, variants[i].name, compressed->flow, rawml->flow);
+    }
+    mobi_free_rawml(compressed);
+}
+
+/**
+ @brief Check that buffers mapped from temporary files give the same rawml and parts as heap buffers
+
+ Threshold of one byte maps every scratch buffer, reference parts come from the default heap run.
+ */
+static void check_scratch(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    if (mobi_set_scratch_threshold(1) != MOBI_SUCCESS) {
+        return;
+    }
+    checks++;
+    MOBIScratch scratch;
+    if (mobi_scratch_alloc(&scratch, 16) != MOBI_SUCCESS || !scratch.mapped) {
+        check_fail("scratch", input, "buffer not mapped from temporary file");
+    }
+    mobi_scratch_free(&scratch);
+    const size_t maxsize = mobi_get_text_maxsize(m);
+    char *text = NULL;
+    char *mapped_text = NULL;
+    MOBIRawml *mapped = NULL;
+    if (maxsize == MOBI_NOTSET) {
+        check_fail("scratch", input, "text size unknown");
+        goto cleanup;
+    }
+    text = malloc(maxsize + 1);
+    mapped_text = malloc(maxsize + 1);
+    mapped = mobi_init_rawml(m);
+    if (text == NULL || mapped_text == NULL || mapped == NULL) {
+        check_fail("scratch", input, "memory allocation failed");
+        goto cleanup;
+    }
+    size_t length = maxsize + 1;
+    size_t mapped_length = maxsize + 1;
+    MOBI_RET ret = mobi_get_rawml(m, mapped_text, &mapped_length);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("scratch", input, "mapped rawml error (%i)", ret);
+        goto cleanup;
+    }
+    mobi_set_scratch_threshold(0);
+    ret = mobi_get_rawml(m, text, &length);
+    if (ret != MOBI_SUCCESS || length != mapped_length || memcmp(text, mapped_text, length) != 0) {
+        check_fail("scratch", input, "rawml differs from heap run (%i)", ret);
+    }
+    mobi_set_scratch_threshold(1);
+    ret = mobi_parse_rawml(mapped, m);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("scratch", input, "mapped parse error (%i)", ret);
+        goto cleanup;
+    }
+    compare_parts("scratch", input, "mapped buffers", mapped->markup, rawml->markup);
+    compare_parts("scratch", input, "mapped buffers", mapped->flow, rawml->flow);
+cleanup:
+    mobi_set_scratch_threshold(0);
+    mobi_free_rawml(mapped);
+    free(mapped_text);
+    free(text);
+}
+
+/**
+ @brief Store big-endian 32-bit value
+
+ @param[out] data Output, at least 4 bytes
+ @param[in] value Value
+ */
+static void put32(unsigned char *data, const uint32_t value) {
+    data[0] = (unsigned char) (value >> 24);
+    data[1] = (unsigned char) (value >> 16);
+    data[2] = (unsigned char) (value >> 8);
+    data[3] = (unsigned char) value;
+}
+
+/**
+ @brief Check that location map loaded from serialized data equals saved one,
+        and that truncated or corrupted data is rejected and leaves map empty
+
+ @param[in] input Description of input
+ @param[in] map Location map built from the document
+ */
+static void check_locationmap_saved(const char *input, const MOBILocationMap *map) {
+    checks++;
+    size_t size = 0;
+    MOBI_RET ret = mobi_save_locationmap(map, NULL, &size);
+    unsigned char *saved = malloc(size);
+    unsigned char *corrupt = malloc(size);
+    MOBILocationMap *loaded = mobi_init_locationmap();
+    if (ret != MOBI_SUCCESS || saved == NULL || corrupt == NULL || loaded == NULL) {
+        check_fail("locationmap_saved", input, "memory allocation failed (%i)", ret);
+        goto cleanup;
+    }
+    ret = mobi_save_locationmap(map, saved, &size);
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_load_locationmap(loaded, saved, size);
+    }
+    if (ret != MOBI_SUCCESS) {
+        check_fail("locationmap_saved", input, "error (%i)", ret);
+        goto cleanup;
+    }
+    if (loaded->text_length != map->text_length || loaded->markup_length != map->markup_length
+        || loaded->location_size != map->location_size || loaded->first_record != map->first_record
+        || loaded->records_count != map->records_count || loaded->segments_count != map->segments_count
+        || memcmp(loaded->record_starts, map->record_starts, (map->records_count + 1) * sizeof(*map->record_starts)) != 0
+        || (map->segments_count && memcmp(loaded->segments, map->segments, map->segments_count * sizeof(*map->segments)) != 0)) {
+        check_fail("locationmap_saved", input, "loaded map differs from saved one");
+    }
+    /* header, then each table cut short */
+    const size_t header_size = 32;
+    const size_t truncated_sizes[] = { 0, 3, header_size - 1, header_size, header_size + 4 * map->records_count, size - 1 };
+    for (size_t i = 0; i < sizeof(truncated_sizes) / sizeof(truncated_sizes[0]); i++) {
+        ret = mobi_load_locationmap(loaded, saved, truncated_sizes[i]);
+        if (ret != MOBI_DATA_CORRUPT || loaded->records_count || loaded->segments_count) {
+            check_fail("locationmap_saved", input, "map truncated to %zu bytes not rejected (%i)", truncated_sizes[i], ret);
+        }
+    }
+    /* header fields and table order, one at a time */
+    const size_t segments_offset = header_size + 4 * (map->records_count + 1);
+    const struct { const char *name; size_t offset; uint32_t value; bool applies; } corruptions[] = {
+        { "magic", 0, 0x4c4d4150 ^ 0x20, true },
+        { "version", 4, 2, true },
+        { "text length", 8, map->text_length + 1, true },
+        { "location size", 16, 0, true },
+        { "records count", 24, UINT32_MAX, true },
+        { "segments count", 28, UINT32_MAX, true },
+        { "record order", header_size + 4, map->text_length + 1, map->records_count > 1 },
+        { "segment order", segments_offset + 12, map->segments_count ? map->segments[0].start : 0, map->segments_count > 1 },
+    };
+    for (size_t i = 0; i < sizeof(corruptions) / sizeof(corruptions[0]); i++) {
+        if (!corruptions[i].applies) {
+            continue;
+        }
+        memcpy(corrupt, saved, size);
+        put32(corrupt + corruptions[i].offset, corruptions[i].value);
+        ret = mobi_load_locationmap(loaded, corrupt, size);
+        if (ret != MOBI_DATA_CORRUPT || loaded->records_count || loaded->segments_count) {
+            check_fail("locationmap_saved", input, "corrupted %s not rejected (%i)", corruptions[i].name, ret);
+        }
+    }
+cleanup:
+    mobi_free_locationmap(loaded);
+    free(corrupt);
+    free(saved);
+}
+
+/**
+ @brief Check that raw text segments mapped by mobi_build_locationmap() equal markup at mapped part offsets,
+        and that text record starts map to record offset zero
+
+ Markup of cp1252 documents is converted to utf-8 after reassembly, while map offsets refer
+ to raw text, so such markup is compared with converted raw text of the whole part.
+ */
+static void check_locationmap(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    (void) rawml;
+    checks++;
+    MOBILocationMap *map = mobi_init_locationmap();
+    MOBIRawml *raw = mobi_init_rawml(m);
+    const size_t maxsize = mobi_get_text_maxsize(m);
+    char *text = malloc(maxsize + 1);
+    char *converted = malloc(3 * maxsize + 1);
+    if (map == NULL || raw == NULL || text == NULL || converted == NULL) {
+        check_fail("locationmap", input, "memory allocation failed");
+        goto cleanup;
+    }
+    size_t text_length = maxsize + 1;
+    MOBI_RET ret = mobi_get_rawml(m, text, &text_length);
+    if (ret == MOBI_SUCCESS) {
+        /* markup reassembled from skeleton and fragments, without links reconstruction */
+        ret = mobi_parse_rawml_opt(raw, m, false, false, false);
+    }
+    if (ret == MOBI_SUCCESS) {
+        ret = mobi_build_locationmap(map, m);
+    }
+    if (ret != MOBI_SUCCESS) {
+        check_fail("locationmap", input, "error (%i)", ret);
+        goto cleanup;
+    }
+    if (map->text_length != text_length) {
+        check_fail("locationmap", input, "text length %u, expected %zu", map->text_length, text_length);
+        goto cleanup;
+    }
+    check_locationmap_saved(input, map);
+    for (size_t i = 0; i < map->records_count; i++) {
+        size_t seqnumber;
+        size_t record_offset;
+        if (map->record_starts[i] == map->record_starts[i + 1]) {
+            continue;
+        }
+        ret = mobi_locationmap_record(map, map->record_starts[i], &seqnumber, &record_offset);
+        if (ret != MOBI_SUCCESS || seqnumber != map->first_record + i || record_offset != 0) {
+            check_fail("locationmap", input, "record %zu: start maps to record %zu at %zu (%i)", i, seqnumber, record_offset, ret);
+            goto cleanup;
+        }
+    }
+    const bool cp1252 = mobi_is_cp1252(m);
+    for (size_t i = 0; i < map->segments_count; i++) {
+        const size_t start = map->segments[i].start;
+        const size_t end = (i + 1 < map->segments_count) ? map->segments[i + 1].start : map->markup_length;
+        size_t part_uid;
+        size_t part_offset;
+        /* first and last position of segment */
+        ret = mobi_locationmap_position(map, end - 1, &part_uid, &part_offset);
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_locationmap_position(map, start, &part_uid, &part_offset);
+        }
+        const MOBIPart *part = mobi_get_part_by_uid(raw, part_uid);
+        if (ret != MOBI_SUCCESS || part == NULL) {
+            check_fail("locationmap", input, "position %zu: no markup part (%i)", start, ret);
+            break;
+        }
+        const unsigned char *expected = (const unsigned char *) text + start;
+        size_t expected_length = end - start;
+        if (cp1252) {
+            if (map->segments_count != 1 || part_offset != 0) {
+                check_fail("locationmap", input, "cp1252 markup split into segments");
+                break;
+            }
+            expected_length = 3 * maxsize + 1;
+            ret = mobi_cp1252_to_utf8(converted, (const char *) expected, &expected_length, end - start);
+            if (ret != MOBI_SUCCESS || expected_length != part->size) {
+                check_fail("locationmap", input, "part %zu: converted text length %zu, expected %zu (%i)", part_uid, expected_length, part->size, ret);
+                break;
+            }
+            expected = (const unsigned char *) converted;
+        }
+        if (part_offset + expected_length > part->size || memcmp(part->data + part_offset, expected, expected_length) != 0) {
+            check_fail("locationmap", input, "position %zu: text differs from part %zu at offset %zu", start, part_uid, part_offset);
+            break;
+        }
+    }
+cleanup:
+    free(converted);
+    free(text);
+    mobi_free_rawml(raw);
+    mobi_free_locationmap(map);
+}
+
+/**
+ @brief Check that mobi_compute_stats() result does not depend on number of threads,
+        and that it gives known character counts
+ */
+static void check_stats(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    (void) rawml;
+    /* counts verified independently */
+    static const struct { const char *input; size_t characters; } expected[] = {
+        { "textread_prc.mobi", 955338 },
+    };
+    static const size_t threads[] = { 1, 2, 3, 8 };
+    checks++;
+    MOBIStats stats;
+    MOBI_RET ret = mobi_compute_stats(m, &stats);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("stats", input, "error (%i)", ret);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        if (strcmp(input, expected[i].input) == 0 && stats.characters != expected[i].characters) {
+            check_fail("stats", input, "%zu characters, expected %zu", stats.characters, expected[i].characters);
+        }
+    }
+    if (!mobi_threads_available()) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(threads) / sizeof(threads[0]); i++) {
+        MOBIStats threaded;
+        mobi_set_threads_count(threads[i]);
+        ret = mobi_compute_stats(m, &threaded);
+        if (ret != MOBI_SUCCESS || memcmp(&threaded, &stats, sizeof(stats)) != 0) {
+            check_fail("stats", input, "%zu threads: result differs (%i)", threads[i], ret);
+        }
+    }
+    mobi_set_threads_count(0);
+}
+
+/**
+ @brief Check whether type of resource part reconstructed by mobi_parse_rawml() matches probed type
+
+ Fonts and media are decoded by mobi_parse_rawml(), font of unrecognized format keeps font type.
+
+ @param[in] probed Type returned by mobi_probe_resources()
+ @param[in] decoded Type of resource part
+ @return True if types match
+ */
+static bool resource_type_matches(const MOBIFiletype probed, const MOBIFiletype decoded) {
+    switch (probed) {
+        case T_FONT:
+            return decoded == T_OTF || decoded == T_TTF || decoded == T_FONT;
+        case T_AUDIO:
+            return decoded == T_MP3;
+        case T_VIDEO:
+            return decoded == T_MPG;
+        default:
+            return decoded == probed;
+    }
+}
+
+/**
+ @brief Check that mobi_probe_resources() finds all resource parts with their types,
+        and that probed image dimensions equal known ones and mobi_get_image_size() of parts
+ */
+static void check_resources(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    /* dimensions verified with file(1) on extracted resources */
+    static const struct { const char *input; size_t uid; MOBIFiletype type; uint32_t width; uint32_t height; } expected[] = {
+        { "embedded-mpeg.mobi", 2, T_JPG, 376, 500 },
+        { "embedded-mpeg.mobi", 5, T_JPG, 375, 500 },
+        { "embedded-mpeg.mobi", 6, T_JPG, 48, 48 },
+        { "embedded-mpeg.mobi", 8, T_JPG, 180, 240 },
+        { "obfuscated_fonts.mobi", 0, T_JPG, 993, 1406 },
+        { "obfuscated_fonts.mobi", 1, T_JPG, 169, 240 },
+    };
+    checks++;
+    MOBIResourceInfo *info = NULL;
+    size_t count = 0;
+    MOBI_RET ret = mobi_probe_resources(m, &info, &count);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("resources", input, "error (%i)", ret);
+        return;
+    }
+    for (size_t i = 0; i < sizeof(expected) / sizeof(expected[0]); i++) {
+        if (strcmp(input, expected[i].input) != 0) {
+            continue;
+        }
+        size_t j = 0;
+        while (j < count && info[j].uid != expected[i].uid) {
+            j++;
+        }
+        if (j == count || info[j].type != expected[i].type
+            || info[j].width != expected[i].width || info[j].height != expected[i].height) {
+            check_fail("resources", input, "resource %zu: not probed as %ux%u image", expected[i].uid, expected[i].width, expected[i].height);
+        }
+    }
+    /* resource records come first, generated opf and ncx parts are appended to them */
+    const MOBIPart *part = rawml->resources;
+    for (size_t j = 0; j < count; j++, part = part->next) {
+        if (part == NULL || part->type == T_OPF || part->type == T_NCX) {
+            check_fail("resources", input, "%zu resources probed, %zu parts", count, j);
+            break;
+        }
+        if (part->uid != info[j].uid || !resource_type_matches(info[j].type, part->type)) {
+            check_fail("resources", input, "resource %zu: probed type %i, part %zu type %i", info[j].uid, info[j].type, part->uid, part->type);
+            continue;
+        }
+        size_t width;
+        size_t height;
+        ret = mobi_get_image_size(part, &width, &height);
+        if (info[j].type >= T_JPG && info[j].type <= T_BMP) {
+            if (ret != MOBI_SUCCESS || width != info[j].width || height != info[j].height) {
+                check_fail("resources", input, "resource %zu: part size %zux%zu, probed %ux%u (%i)", part->uid, width, height, info[j].width, info[j].height, ret);
+            }
+        } else if (ret != MOBI_PARAM_ERR || info[j].width || info[j].height) {
+            check_fail("resources", input, "resource %zu: non-image resource has size (%i)", part->uid, ret);
+        }
+    }
+    if (part != NULL && part->type != T_OPF && part->type != T_NCX) {
+        check_fail("resources", input, "resource %zu: part not probed", part->uid);
+    }
+    mobi_free_resources_info(info);
+}
+
+/**
+ @brief Find literal byte in given range in PalmDOC LZ77 compressed data
+
+ Literal found in a run may be replaced with any byte, single literal (0x09-0x7f) only with other single literal,
+ without changing decompressed length.
+
+ @param[in] data Compressed data
+ @param[in] size Size of data
+ @param[in] low Lowest value of literal
+ @param[in] high Highest value of literal
+ @return Offset of literal, size if not found
+ */
+static size_t lz77_find_literal(const unsigned char *data, const size_t size, const unsigned char low, const unsigned char high) {
+    size_t offset = 0;
+    while (offset < size) {
+        const unsigned char c = data[offset];
+        if (c >= 1 && c <= 8) {
+            /* run of literals */
+            for (size_t k = offset + 1; k <= offset + c && k < size; k++) {
+                if (data[k] >= low && data[k] <= high) {
+                    return k;
+                }
+            }
+            offset += 1 + c;
+        } else if (c >= 0x80 && c <= 0xbf) {
+            /* distance and length pair */
+            offset += 2;
+        } else if (c >= 0x09 && c <= 0x7f && c >= low && c <= high) {
+            return offset;
+        } else {
+            offset++;
+        }
+    }
+    return size;
+}
+
+/**
+ @brief Check records and markup parts reported by mobi_diff() for edited copy of KF8 document
+
+ Copy of embedded-mpeg.mobi has one letter changed in fifth text record, which holds text of parts 6 and 7,
+ new resource inserted before sixth resource and ninth resource dropped, so that following records keep their positions.
+ Records of copy share data with original, except edited ones.
+ */
+static void check_diff_edited(const char *input, const MOBIData *m) {
+    static const MOBIRecordDiff expected_records[] = {
+        { MOBI_SECTION_TEXT, MOBI_DIFF_CHANGED, 30, 30 },
+        { MOBI_SECTION_RESOURCE, MOBI_DIFF_ADDED, MOBI_NOTSET, 16 },
+        { MOBI_SECTION_RESOURCE, MOBI_DIFF_REMOVED, 19, MOBI_NOTSET },
+    };
+    static const size_t expected_parts[] = { 6, 7 };
+    const size_t text_seqnumber = 30;
+    const size_t inserted_seqnumber = 16;
+    const size_t dropped_seqnumber = 19;
+    MOBIPdbRecord *records = NULL;
+    MOBIPdbRecord **last = &records;
+    unsigned char *text = NULL;
+    unsigned char *resource = NULL;
+    size_t seqnumber = 0;
+    for (const MOBIPdbRecord *curr = m->rec; curr != NULL; curr = curr->next, seqnumber++) {
+        if (seqnumber == dropped_seqnumber) {
+            continue;
+        }
+        for (int copy = (seqnumber == inserted_seqnumber); copy >= 0; copy--) {
+            MOBIPdbRecord *record = malloc(sizeof(MOBIPdbRecord));
+            if (record == NULL) {
+                check_fail("diff", input, "memory allocation failed");
+                goto cleanup;
+            }
+            *record = *curr;
+            record->next = NULL;
+            *last = record;
+            last = &record->next;
+            if (copy == 1) {
+                /* new resource, same type as following one */
+                resource = malloc(curr->size);
+                if (resource == NULL) {
+                    check_fail("diff", input, "memory allocation failed");
+                    goto cleanup;
+                }
+                memcpy(resource, curr->data, curr->size);
+                resource[curr->size - 1] ^= 0xff;
+                record->data = resource;
+            } else if (seqnumber == text_seqnumber) {
+                const size_t letter = lz77_find_literal(curr->data, curr->size, 'a', 'y');
+                text = malloc(curr->size);
+                if (letter == curr->size || text == NULL) {
+                    check_fail("diff", input, "text record %zu could not be edited", seqnumber);
+                    goto cleanup;
+                }
+                memcpy(text, curr->data, curr->size);
+                text[letter]++;
+                record->data = text;
+            }
+        }
+    }
+    MOBIData edited = *m;
+    edited.rec = records;
+    MOBIDiff *diff = mobi_init_diff();
+    if (diff == NULL) {
+        check_fail("diff", input, "memory allocation failed");
+        goto cleanup;
+    }
+    const MOBI_RET ret = mobi_diff(diff, m, &edited);
+    const size_t expected_count = sizeof(expected_records) / sizeof(expected_records[0]);
+    const size_t parts_count = sizeof(expected_parts) / sizeof(expected_parts[0]);
+    if (ret != MOBI_SUCCESS || diff->records_count != expected_count || diff->parts_count != parts_count) {
+        check_fail("diff", input, "edited copy: %zu records, %zu parts changed, expected %zu and %zu (%i)",
+                   diff->records_count, diff->parts_count, expected_count, parts_count, ret);
+    } else {
+        for (size_t i = 0; i < expected_count; i++) {
+            const MOBIRecordDiff *change = &diff->records[i];
+            if (change->section != expected_records[i].section || change->status != expected_records[i].status
+                || change->seqnumber_a != expected_records[i].seqnumber_a || change->seqnumber_b != expected_records[i].seqnumber_b) {
+                check_fail("diff", input, "edited copy: change %zu differs", i);
+            }
+        }
+        if (memcmp(diff->parts, expected_parts, sizeof(expected_parts)) != 0) {
+            check_fail("diff", input, "edited copy: affected parts differ");
+        }
+    }
+    mobi_free_diff(diff);
+cleanup:
+    while (records) {
+        MOBIPdbRecord *next = records->next;
+        free(records);
+        records = next;
+    }
+    free(text);
+    free(resource);
+}
+
+/**
+ @brief Check that mobi_diff() finds no changes between document and itself,
+        and that it refuses second document which is encrypted without key
+ */
+static void check_diff(const char *input, const MOBIData *m, const MOBIRawml *rawml) {
+    (void) rawml;
+    checks++;
+    MOBIDiff *diff = mobi_init_diff();
+    if (diff == NULL) {
+        check_fail("diff", input, "memory allocation failed");
+        return;
+    }
+    MOBI_RET ret = mobi_diff(diff, m, m);
+    if (ret != MOBI_SUCCESS || diff->records_count != 0 || diff->parts_count != 0) {
+        check_fail("diff", input, "self diff: %zu records, %zu parts changed (%i)", diff->records_count, diff->parts_count, ret);
+    }
+    if (mobi_is_mobipocket(m) && m->rh) {
+        /* same document marked as encrypted, records are shared */
+        MOBIRecord0Header header = *m->rh;
+        header.encryption_type = RECORD0_MOBI_ENCRYPTION;
+        MOBIData encrypted = *m;
+        encrypted.rh = &header;
+        encrypted.drm_key = NULL;
+        ret = mobi_diff(diff, m, &encrypted);
+        if (ret != MOBI_FILE_ENCRYPTED || diff->records_count != 0) {
+            check_fail("diff", input, "encrypted second document: %zu records changed (%i)", diff->records_count, ret);
+        }
+    }
+    mobi_free_diff(diff);
+    if (strcmp(input, "embedded-mpeg.mobi") == 0) {
+        check_diff_edited(input, m);
+    }
+}
+
+/** @brief Checks run on every sample */
+static const struct { const char *name; CheckFunc func; } sample_checks[] = {
+    { "fix_xhtml", check_fix_xhtml },
+    { "compress_rawml", check_compress_rawml },
+    { "scratch", check_scratch },
+    { "locationmap", check_locationmap },
+    { "stats", check_stats },
+    { "resources", check_resources },
+    { "diff", check_diff },
+};
+
+/**
+ @brief Compare records of document loaded into reused structure with records of freshly loaded one
+
+ @param[in] input Description of input
+ @param[in] m Document loaded into structure reset with mobi_reset()
+ @param[in] path Path to the document
+ */
+static void compare_reused(const char *input, const MOBIData *m, const char *path) {
+    MOBIData *fresh = mobi_init();
+    if (fresh == NULL || mobi_load_filename(fresh, path) != MOBI_SUCCESS) {
+        check_fail("reuse", input, "fresh load failed");
+        mobi_free(fresh);
+        return;
+    }
+    const MOBIPdbRecord *rec = m->rec;
+    const MOBIPdbRecord *reference = fresh->rec;
+    for (; reference != NULL; reference = reference->next, rec = rec->next) {
+        if (rec == NULL || rec->offset != reference->offset || rec->uid != reference->uid
+            || rec->attributes != reference->attributes || rec->size != reference->size
+            || memcmp(rec->data, reference->data, reference->size) != 0) {
+            check_fail("reuse", input, "record %u differs from fresh load", reference->uid);
+            break;
+        }
+    }
+    if (reference == NULL && rec != NULL) {
+        check_fail("reuse", input, "more records than in fresh load");
+    }
+    if ((m->rh == NULL) != (fresh->rh == NULL) || mobi_get_fileversion(m) != mobi_get_fileversion(fresh)
+        || mobi_is_encrypted(m) != mobi_is_encrypted(fresh) || mobi_get_kf8offset(m) != mobi_get_kf8offset(fresh)) {
+        check_fail("reuse", input, "headers differ from fresh load");
+    }
+    mobi_free(fresh);
+}
+
+/**
+ @brief Load documents one after another into structure reused with mobi_reset(),
+        interleaved with failing loads of truncated documents, and compare them with fresh loads
+
+ Documents are loaded in given order and then in reverse, so that records
+ of larger documents are reused for smaller ones and the other way round.
+
+ @param[in] paths Paths to the samples
+ @param[in] count Number of samples
+ */
+static void check_reuse(char *paths[], const size_t count) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        check_fail("reuse", "", "memory allocation failed");
+        return;
+    }
+    for (size_t i = 0; i < 2 * count; i++) {
+        const char *path = paths[i < count ? i : 2 * count - 1 - i];
+        const char *input = strrchr(path, '/');
+        input = input ? input + 1 : path;
+        checks++;
+        /* truncated inside record list, then inside record data */
+        FILE *file = fopen(path, "rb");
+        unsigned char header[4096];
+        const size_t header_size = file ? fread(header, 1, sizeof(header), file) : 0;
+        if (file) {
+            fclose(file);
+        }
+        const size_t truncated_sizes[] = { 100, header_size };
+        for (size_t j = 0; j < sizeof(truncated_sizes) / sizeof(truncated_sizes[0]); j++) {
+            FILE *truncated = tmpfile();
+            if (truncated == NULL || truncated_sizes[j] > header_size) {
+                if (truncated) {
+                    fclose(truncated);
+                }
+                continue;
+            }
+            fwrite(header, 1, truncated_sizes[j], truncated);
+            rewind(truncated);
+            const MOBI_RET ret = mobi_load_file(m, truncated);
+            fclose(truncated);
+            for (const MOBIPdbRecord *rec = m->rec; ret != MOBI_SUCCESS && rec != NULL; rec = rec->next) {
+                if (rec->data && rec->offset + rec->size > truncated_sizes[j]) {
+                    check_fail("reuse", input, "%zu bytes: failed load left record %u with stale data", truncated_sizes[j], rec->uid);
+                    break;
+                }
+            }
+            mobi_reset(m);
+        }
+        MOBI_RET ret = mobi_load_filename(m, path);
+        if (ret != MOBI_SUCCESS) {
+            check_fail("reuse", input, "load error (%i)", ret);
+        } else {
+            compare_reused(input, m, path);
+        }
+        mobi_reset(m);
+    }
+    mobi_free(m);
+}
+
+/**
+ @brief Compare EXTH records of document loaded with immutable records with a normal load,
+        records data must point into loaded records
+
+ @param[in] input Description of input
+ @param[in] eh EXTH records of document loaded with immutable records
+ @param[in] reference EXTH records of normally loaded document
+ @param[in] records Records of document loaded with immutable records
+ @return True if records match
+ */
+static bool compare_immutable_exth(const char *input, const MOBIExthHeader *eh, const MOBIExthHeader *reference, const MOBIPdbRecord *records) {
+    for (; reference != NULL; reference = reference->next, eh = eh->next) {
+        if (eh == NULL || eh->tag != reference->tag || eh->size != reference->size
+            || (eh->size && memcmp(eh->data, reference->data, eh->size) != 0)) {
+            check_fail("immutable", input, "EXTH record %u differs from normal load", reference->tag);
+            return false;
+        }
+        if (eh->size == 0) {
+            continue;
+        }
+        const MOBIPdbRecord *rec = records;
+        while (rec && !(rec->data && (const unsigned char *) eh->data >= rec->data
+                        && (const unsigned char *) eh->data + eh->size <= rec->data + rec->size)) {
+            rec = rec->next;
+        }
+        if (rec == NULL) {
+            check_fail("immutable", input, "EXTH record %u data is not in records", eh->tag);
+            return false;
+        }
+    }
+    if (eh != NULL) {
+        check_fail("immutable", input, "more EXTH records than in normal load");
+        return false;
+    }
+    return true;
+}
+
+/**
+ @brief Load documents with immutable records and compare their EXTH records with normal loads
+
+ EXTH data then points into record 0, so structure is also reset and reloaded
+ before it is freed, both must leave the aliased data alone (best checked with sanitizers).
+
+ @param[in] paths Paths to the samples
+ @param[in] count Number of samples
+ */
+static void check_immutable(char *paths[], const size_t count) {
+    MOBIData *m = mobi_init();
+    if (m == NULL || mobi_set_records_immutable(m, true) != MOBI_SUCCESS) {
+        check_fail("immutable", "", "initialization failed");
+        mobi_free(m);
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        const char *input = strrchr(paths[i], '/');
+        input = input ? input + 1 : paths[i];
+        checks++;
+        MOBIData *reference = mobi_init();
+        if (reference == NULL || mobi_load_filename(reference, paths[i]) != MOBI_SUCCESS) {
+            check_fail("immutable", input, "normal load failed");
+            mobi_free(reference);
+            continue;
+        }
+        /* second load reuses structure reset after the first one */
+        for (size_t pass = 0; pass < 2; pass++) {
+            MOBI_RET ret = mobi_load_filename(m, paths[i]);
+            if (ret != MOBI_SUCCESS) {
+                check_fail("immutable", input, "load error (%i)", ret);
+            } else if (!m->records_immutable || (m->next && !m->next->records_immutable)) {
+                check_fail("immutable", input, "setting not preserved");
+            } else if (compare_immutable_exth(input, m->eh, reference->eh, m->rec)
+                       && (m->next == NULL) != (reference->next == NULL)) {
+                check_fail("immutable", input, "hybrid part differs from normal load");
+            } else if (m->next) {
+                compare_immutable_exth(input, m->next->eh, reference->next->eh, m->rec);
+            }
+            mobi_reset(m);
+        }
+        mobi_free(reference);
+    }
+    /* last document stays loaded, so that mobi_free() releases it */
+    if (count > 0 && mobi_load_filename(m, paths[count - 1]) != MOBI_SUCCESS) {
+        check_fail("immutable", "", "final load failed");
+    }
+    mobi_free(m);
+}
+
+/**
+ @brief Pdf data received from mobi_extract_replica_pdf()
+ */
+typedef struct {
+    const unsigned char *file; /**< Source document */
+    size_t file_size; /**< Size of source document */
+    unsigned char out[CHECK_REPLICA_TEXT_LENGTH]; /**< Received pdf */
+    size_t size; /**< Size of received pdf */
+    size_t write_calls; /**< Number of write callback calls */
+    size_t offset_calls; /**< Number of write_offset callback calls */
+} ReplicaSink;
+
+/**
+ @brief Append pdf data, write callback of ReplicaSink
+ */
+static MOBI_RET replica_write(void *context, const unsigned char *data, const size_t size) {
+    ReplicaSink *sink = context;
+    sink->write_calls++;
+    if (size > sizeof(sink->out) - sink->size) {
+        return MOBI_ERROR;
+    }
+    memcpy(sink->out + sink->size, data, size);
+    sink->size += size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Append pdf data copied from source document, write_offset callback of ReplicaSink
+ */
+static MOBI_RET replica_write_offset(void *context, const size_t offset, const size_t size) {
+    ReplicaSink *sink = context;
+    sink->offset_calls++;
+    if (offset > sink->file_size || size > sink->file_size - offset || size > sizeof(sink->out) - sink->size) {
+        return MOBI_ERROR;
+    }
+    memcpy(sink->out + sink->size, sink->file + offset, size);
+    sink->size += size;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Build palmdoc database with Print Replica text
+
+ Text records are 12 bytes long, so that replica header spans two records, then 4096 bytes long.
+ Palmdoc compression only uses literal runs, which is valid compressed data for any text.
+
+ @param[out] file Output, at least CHECK_REPLICA_FILE_MAX bytes
+ @param[in] text Text, CHECK_REPLICA_TEXT_LENGTH bytes
+ @param[in] compression RECORD0_NO_COMPRESSION or RECORD0_PALMDOC_COMPRESSION
+ @return Size of document
+ */
+static size_t replica_build(unsigned char *file, const unsigned char *text, const uint16_t compression) {
+    const size_t records_count = 1 + 1 + (CHECK_REPLICA_TEXT_LENGTH - 12 + 4095) / 4096;
+    const size_t list_end = 78 + 8 * records_count + 2;
+    memset(file, 0, list_end);
+    memcpy(file, "replica", 7);
+    memcpy(file + 60, "TEXtREAd", 8);
+    file[76] = (unsigned char) (records_count >> 8);
+    file[77] = (unsigned char) records_count;
+    /* record 0: palmdoc header */
+    size_t size = list_end;
+    unsigned char *record0 = file + size;
+    memset(record0, 0, 16);
+    record0[0] = (unsigned char) (compression >> 8);
+    record0[1] = (unsigned char) compression;
+    put32(record0 + 4, CHECK_REPLICA_TEXT_LENGTH);
+    record0[8] = (unsigned char) ((records_count - 1) >> 8);
+    record0[9] = (unsigned char) (records_count - 1);
+    record0[10] = 4096 >> 8;
+    put32(file + 78, (uint32_t) size);
+    size += 16;
+    size_t text_pos = 0;
+    for (size_t i = 1; i < records_count; i++) {
+        put32(file + 78 + 8 * i, (uint32_t) size);
+        file[78 + 8 * i + 7] = (unsigned char) i;
+        size_t length = (i == 1) ? 12 : 4096;
+        if (length > CHECK_REPLICA_TEXT_LENGTH - text_pos) {
+            length = CHECK_REPLICA_TEXT_LENGTH - text_pos;
+        }
+        if (compression == RECORD0_NO_COMPRESSION) {
+            memcpy(file + size, text + text_pos, length);
+            size += length;
+        } else {
+            for (size_t j = 0; j < length; j += 8) {
+                const size_t run = (length - j < 8) ? length - j : 8;
+                file[size++] = (unsigned char) run;
+                memcpy(file + size, text + text_pos + j, run);
+                size += run;
+            }
+        }
+        text_pos += length;
+    }
+    return size;
+}
+
+/**
+ @brief Load synthetic Print Replica document, check its detection and extract pdf
+
+ @param[in] variant Description of variant
+ @param[in] file Document
+ @param[in] size Size of document
+ @param[in] offsets True if sink has write_offset callback, it must be used only for uncompressed text
+ @param[in] expected Expected pdf, or NULL if extraction is expected to fail
+ @param[in] detected True if document is expected to be detected as Print Replica
+ */
+static void check_replica_variant(const char *variant, const unsigned char *file, const size_t size, const bool offsets, const unsigned char *expected, const bool detected) {
+    checks++;
+    FILE *stream = fmemopen((void *) file, size, "rb");
+    MOBIData *m = mobi_init();
+    ReplicaSink *context = calloc(1, sizeof(ReplicaSink));
+    if (stream == NULL || m == NULL || context == NULL) {
+        check_fail("replica", variant, "initialization failed");
+        goto cleanup;
+    }
+    MOBI_RET ret = mobi_load_file(m, stream);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("replica", variant, "load error (%i)", ret);
+        goto cleanup;
+    }
+    context->file = file;
+    context->file_size = size;
+    MOBISink sink = { replica_write, offsets ? replica_write_offset : NULL, context };
+    const bool zero_copy = offsets && m->rh->compression_type == RECORD0_NO_COMPRESSION;
+    ret = mobi_extract_replica_pdf(m, &sink);
+    if (mobi_is_replica(m) != detected) {
+        check_fail("replica", variant, "%s as Print Replica", detected ? "not detected" : "detected");
+    } else if (expected == NULL) {
+        if (ret != MOBI_DATA_CORRUPT) {
+            check_fail("replica", variant, "corrupt document not rejected (%i)", ret);
+        }
+    } else if (ret != MOBI_SUCCESS || context->size != CHECK_REPLICA_PDF_LENGTH
+               || memcmp(context->out, expected, CHECK_REPLICA_PDF_LENGTH) != 0) {
+        check_fail("replica", variant, "extracted %zu bytes differ from pdf (%i)", context->size, ret);
+    } else if (zero_copy && (context->offset_calls == 0 || context->write_calls != 0)) {
+        check_fail("replica", variant, "pdf not passed by offsets");
+    } else if (!zero_copy && context->offset_calls != 0) {
+        check_fail("replica", variant, "pdf passed by offsets");
+    }
+cleanup:
+    free(context);
+    mobi_free(m);
+    if (stream) {
+        fclose(stream);
+    }
+}
+
+/**
+ @brief Check Print Replica detection and pdf extraction on synthetic documents
+
+ Pdf spans several text records and is passed by offsets only from uncompressed document.
+ */
+static void check_replica(void) {
+    unsigned char *text = malloc(CHECK_REPLICA_TEXT_LENGTH);
+    unsigned char *file = malloc(CHECK_REPLICA_FILE_MAX);
+    if (text == NULL || file == NULL) {
+        check_fail("replica", "", "memory allocation failed");
+        free(text);
+        free(file);
+        return;
+    }
+    memset(text, 'x', CHECK_REPLICA_TEXT_LENGTH);
+    memcpy(text, "%MOP", 4);
+    memset(text + 4, 0, 8);
+    put32(text + 12, CHECK_REPLICA_PDF_START);
+    put32(text + 16, CHECK_REPLICA_PDF_LENGTH);
+    unsigned char *pdf = text + CHECK_REPLICA_PDF_START;
+    for (size_t i = 0; i < CHECK_REPLICA_PDF_LENGTH; i++) {
+        pdf[i] = (unsigned char) (i * 31 + i / 253);
+    }
+    memcpy(pdf, "%PDF-1.4\n", 9);
+    size_t size = replica_build(file, text, RECORD0_NO_COMPRESSION);
+    check_replica_variant("uncompressed, by offsets", file, size, true, pdf, true);
+    check_replica_variant("uncompressed", file, size, false, pdf, true);
+    size = replica_build(file, text, RECORD0_PALMDOC_COMPRESSION);
+    check_replica_variant("palmdoc", file, size, true, pdf, true);
+    /* pdf range past text end */
+    put32(text + 16, CHECK_REPLICA_TEXT_LENGTH);
+    size = replica_build(file, text, RECORD0_PALMDOC_COMPRESSION);
+    check_replica_variant("palmdoc, pdf too long", file, size, false, NULL, true);
+    put32(text + 16, CHECK_REPLICA_PDF_LENGTH);
+    text[3] = 'Q';
+    size = replica_build(file, text, RECORD0_NO_COMPRESSION);
+    check_replica_variant("uncompressed, wrong magic", file, size, true, NULL, false);
+    free(file);
+    free(text);
+}
+
+/**
+ @brief Compute fingerprint of sample document with default options
+
+ @param[in,out] fingerprint MOBIFingerprint structure
+ @param[in] path Path to the sample
+ @param[in] threads Number of threads, 0 for default
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET fingerprint_sample(MOBIFingerprint *fingerprint, const char *path, const size_t threads) {
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = mobi_load_filename(m, path);
+    if (ret == MOBI_SUCCESS) {
+        mobi_set_threads_count(threads);
+        ret = mobi_fingerprint(fingerprint, m, NULL);
+        mobi_set_threads_count(0);
+    }
+    mobi_free(m);
+    return ret;
+}
+
+/**
+ @brief Find sample by file name
+
+ @param[in] paths Paths to the samples
+ @param[in] count Number of samples
+ @param[in] name File name of the sample
+ @return Path to the sample or NULL if not given
+ */
+static const char * find_sample(char *paths[], const size_t count, const char *name) {
+    for (size_t i = 0; i < count; i++) {
+        const char *input = strrchr(paths[i], '/');
+        input = input ? input + 1 : paths[i];
+        if (strcmp(input, name) == 0) {
+            return paths[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ @brief Check fingerprints of pairs of samples with known relation
+
+ huffdic.mobi and windows-1252.mobi contain the same text, compressed differently.
+
+ @param[in] paths Paths to the samples
+ @param[in] count Number of samples
+ */
+static void check_fingerprints(char *paths[], const size_t count) {
+    static const struct { const char *input_a; const char *input_b; bool same; } pairs[] = {
+        { "huffdic.mobi", "windows-1252.mobi", true },
+        { "huffdic.mobi", "textread_prc.mobi", false },
+        { "windows-1252.mobi", "dict_orth_infl2.mobi", false },
+    };
+    for (size_t i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+        const char *path_a = find_sample(paths, count, pairs[i].input_a);
+        const char *path_b = find_sample(paths, count, pairs[i].input_b);
+        if (path_a == NULL || path_b == NULL) {
+            continue;
+        }
+        checks++;
+        char input[64];
+        snprintf(input, sizeof(input), "%s and %s", pairs[i].input_a, pairs[i].input_b);
+        MOBIFingerprint *a = mobi_init_fingerprint();
+        MOBIFingerprint *b = mobi_init_fingerprint();
+        if (a == NULL || b == NULL) {
+            check_fail("fingerprint", input, "memory allocation failed");
+        } else {
+            MOBI_RET ret = fingerprint_sample(a, path_a, 0);
+            if (ret == MOBI_SUCCESS) {
+                ret = fingerprint_sample(b, path_b, 0);
+            }
+            if (ret != MOBI_SUCCESS) {
+                check_fail("fingerprint", input, "error (%i)", ret);
+            } else {
+                const double similarity = mobi_fingerprint_similarity(a, b);
+                const size_t distance = mobi_fingerprint_distance(a, b);
+                if (pairs[i].same && (similarity != 1.0 || distance != 0)) {
+                    check_fail("fingerprint", input, "same text: similarity %.3f, distance %zu", similarity, distance);
+                } else if (!pairs[i].same && (similarity > CHECK_UNRELATED_SIMILARITY || distance < CHECK_UNRELATED_DISTANCE)) {
+                    check_fail("fingerprint", input, "unrelated text: similarity %.3f, distance %zu", similarity, distance);
+                }
+            }
+        }
+        mobi_free_fingerprint(b);
+        mobi_free_fingerprint(a);
+    }
+}
+
+/**
+ @brief Check that fingerprint computed with several threads equals single thread result
+
+ Samples have enough text records to be split into jobs for every checked number of threads,
+ so that the check holds regardless of the number of processors.
+
+ @param[in] paths Paths to the samples
+ @param[in] count Number of samples
+ */
+static void check_fingerprint_threads(char *paths[], const size_t count) {
+    static const char *inputs[] = { "textread_prc.mobi", "dict_orth_infl2.mobi" };
+    static const size_t threads[] = { 3, 7 };
+    if (!mobi_threads_available()) {
+        return;
+    }
+    for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); i++) {
+        const char *path = find_sample(paths, count, inputs[i]);
+        if (path == NULL) {
+            continue;
+        }
+        MOBIFingerprint *single = mobi_init_fingerprint();
+        if (single == NULL) {
+            check_fail("fingerprint_threads", inputs[i], "memory allocation failed");
+            continue;
+        }
+        MOBI_RET ret = fingerprint_sample(single, path, 1);
+        if (ret != MOBI_SUCCESS) {
+            check_fail("fingerprint_threads", inputs[i], "error (%i)", ret);
+            mobi_free_fingerprint(single);
+            continue;
+        }
+        for (size_t j = 0; j < sizeof(threads) / sizeof(threads[0]); j++) {
+            checks++;
+            mobi_set_threads_count(threads[j]);
+            const size_t jobs_count = mobi_jobs_count(single->records_count, MOBI_FINGERPRINT_JOB_MIN);
+            mobi_set_threads_count(0);
+            if (jobs_count != threads[j]) {
+                check_fail("fingerprint_threads", inputs[i], "%zu text records give %zu jobs for %zu threads", single->records_count, jobs_count, threads[j]);
+                continue;
+            }
+            MOBIFingerprint *threaded = mobi_init_fingerprint();
+            if (threaded == NULL) {
+                check_fail("fingerprint_threads", inputs[i], "memory allocation failed");
+                continue;
+            }
+            ret = fingerprint_sample(threaded, path, threads[j]);
+            if (ret != MOBI_SUCCESS || threaded->records_count != single->records_count
+                || threaded->words != single->words || threaded->shingles != single->shingles
+                || threaded->simhash != single->simhash || threaded->minhash_count != single->minhash_count
+                || memcmp(threaded->minhash, single->minhash, single->minhash_count * sizeof(*single->minhash)) != 0
+                || memcmp(threaded->record_hashes, single->record_hashes, single->records_count * sizeof(*single->record_hashes)) != 0) {
+                check_fail("fingerprint_threads", inputs[i], "%zu threads: result differs from single thread (%i)", threads[j], ret);
+            }
+            mobi_free_fingerprint(threaded);
+        }
+        mobi_free_fingerprint(single);
+    }
+}
+
+/**
+ @brief Check that markup and flow parts are valid utf-8 and count U+FFFD replacement characters in them
+
+ @param[in] rawml Parsed document
+ @param[out] replacements Number of replacement characters
+ @return True if all parts are valid
+ */
+static bool utf8_parts_valid(const MOBIRawml *rawml, size_t *replacements) {
+    const MOBIPart *lists[] = { rawml->markup, rawml->flow };
+    bool valid = true;
+    *replacements = 0;
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        for (const MOBIPart *part = lists[i]; part != NULL; part = part->next) {
+            if (part->type != T_HTML && part->type != T_CSS) {
+                continue;
+            }
+            if (mobi_utf8_validate(part->data, part->size) != part->size) {
+                valid = false;
+            }
+            for (size_t j = 0; j + 2 < part->size; j++) {
+                if (part->data[j] == 0xef && part->data[j + 1] == 0xbf && part->data[j + 2] == 0xbd) {
+                    (*replacements)++;
+                }
+            }
+        }
+    }
+    return valid;
+}
+
+/**
+ @brief Parse document and check its parts
+
+ @param[in] input Description of input
+ @param[in] m Document
+ @param[out] replacements Number of replacement characters in parts
+ @param[out] valid True if all parts are valid utf-8
+ @return True if document was parsed
+ */
+static bool utf8_parse(const char *input, const MOBIData *m, size_t *replacements, bool *valid) {
+    MOBIRawml *rawml = mobi_init_rawml(m);
+    if (rawml == NULL) {
+        check_fail("utf8_repair", input, "memory allocation failed");
+        return false;
+    }
+    const MOBI_RET ret = mobi_parse_rawml(rawml, m);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("utf8_repair", input, "parse error (%i)", ret);
+    } else {
+        *valid = utf8_parts_valid(rawml, replacements);
+    }
+    mobi_free_rawml(rawml);
+    return ret == MOBI_SUCCESS;
+}
+
+/**
+ @brief Check repair of invalid utf-8 sequences in hybrid document with multibyte character corrupted in text record
+
+ Repair is enabled before loading, so that it is also set for the other part of hybrid document.
+ Text records are tried in turn until the corrupted byte reaches parsed parts without repair,
+ then all parts parsed with repair must be valid and hold one more replacement character.
+
+ @param[in] paths Paths to the samples
+ @param[in] count Number of samples
+ */
+static void check_utf8_repair(char *paths[], const size_t count) {
+    const char *input = "windows-1252.mobi";
+    const size_t max_attempts = 8;
+    const char *path = find_sample(paths, count, input);
+    if (path == NULL) {
+        return;
+    }
+    checks++;
+    MOBIPdbRecord *records = NULL;
+    unsigned char *text = NULL;
+    MOBIData *m = mobi_init();
+    if (m == NULL || mobi_set_utf8_repair(m, true) != MOBI_SUCCESS) {
+        check_fail("utf8_repair", input, "initialization failed");
+        goto cleanup;
+    }
+    MOBI_RET ret = mobi_load_filename(m, path);
+    if (ret != MOBI_SUCCESS) {
+        check_fail("utf8_repair", input, "load error (%i)", ret);
+        goto cleanup;
+    }
+    if (!m->repair_utf8 || m->next == NULL || !m->next->repair_utf8 || m->rh->compression_type != RECORD0_PALMDOC_COMPRESSION) {
+        check_fail("utf8_repair", input, "repair not set for both parts of palmdoc compressed hybrid document");
+        goto cleanup;
+    }
+    size_t original_replacements = 0;
+    bool valid = false;
+    if (!utf8_parse(input, m, &original_replacements, &valid)) {
+        goto cleanup;
+    }
+    if (!valid) {
+        check_fail("utf8_repair", input, "repaired parts of original document invalid");
+        goto cleanup;
+    }
+    /* copy of record list, with copy of corrupted text record data */
+    MOBIPdbRecord **last = &records;
+    for (const MOBIPdbRecord *curr = m->rec; curr != NULL; curr = curr->next) {
+        MOBIPdbRecord *record = malloc(sizeof(MOBIPdbRecord));
+        if (record == NULL) {
+            check_fail("utf8_repair", input, "memory allocation failed");
+            goto cleanup;
+        }
+        *record = *curr;
+        record->next = NULL;
+        *last = record;
+        last = &record->next;
+    }
+    const uint16_t extra_flags = (m->mh && m->mh->extra_flags) ? *m->mh->extra_flags : 0;
+    const size_t first_text = 1 + mobi_get_kf8offset(m);
+    MOBIPdbRecord *record = records;
+    for (size_t i = 0; i < first_text && record; i++) {
+        record = record->next;
+    }
+    MOBIData edited = *m;
+    edited.rec = records;
+    bool corrupted = false;
+    for (size_t i = 0; i < m->rh->text_record_count && i < max_attempts && record; i++, record = record->next) {
+        const size_t extra_size = mobi_get_record_extrasize(record, extra_flags);
+        if (extra_size == MOBI_NOTSET || extra_size >= record->size) {
+            continue;
+        }
+        /* byte of multibyte character */
+        const size_t offset = lz77_find_literal(record->data, record->size - extra_size, 0x80, 0xff);
+        if (offset == record->size - extra_size) {
+            continue;
+        }
+        unsigned char *data = malloc(record->size);
+        if (data == NULL) {
+            check_fail("utf8_repair", input, "memory allocation failed");
+            goto cleanup;
+        }
+        memcpy(data, record->data, record->size);
+        data[offset] = 0xff;
+        const unsigned char *saved = record->data;
+        record->data = data;
+        size_t replacements;
+        edited.repair_utf8 = false;
+        const bool parsed = utf8_parse(input, &edited, &replacements, &valid);
+        if (parsed && !valid) {
+            text = data;
+            corrupted = true;
+            break;
+        }
+        record->data = (unsigned char *) saved;
+        free(data);
+        if (!parsed) {
+            goto cleanup;
+        }
+    }
+    if (!corrupted) {
+        check_fail("utf8_repair", input, "no corrupted text record reached parsed parts");
+        goto cleanup;
+    }
+    edited.repair_utf8 = true;
+    size_t replacements = 0;
+    if (utf8_parse(input, &edited, &replacements, &valid)) {
+        if (!valid) {
+            check_fail("utf8_repair", input, "repaired parts invalid");
+        } else if (replacements <= original_replacements) {
+            check_fail("utf8_repair", input, "%zu replacement characters, expected more than %zu", replacements, original_replacements);
+        }
+    }
+cleanup:
+    while (records) {
+        MOBIPdbRecord *next = records->next;
+        free(records);
+        records = next;
+    }
+    free(text);
+    mobi_free(m);
+}
+
+/**
+ @brief Load and parse sample document, run checks on it
+
+ @param[in] path Path to the sample
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET check_sample(const char *path) {
+    const char *input = strrchr(path, '/');
+    input = input ? input + 1 : path;
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    MOBI_RET ret = mobi_load_filename(m, path);
+    if (ret != MOBI_SUCCESS) {
+        mobi_free(m);
+        return ret;
+    }
+    MOBIRawml *rawml = mobi_init_rawml(m);
+    if (rawml == NULL) {
+        mobi_free(m);
+        return MOBI_MALLOC_FAILED;
+    }
+    ret = mobi_parse_rawml(rawml, m);
+    if (ret == MOBI_SUCCESS) {
+        for (size_t i = 0; i < sizeof(sample_checks) / sizeof(sample_checks[0]); i++) {
+            sample_checks[i].func(input, m, rawml);
+        }
+    }
+    mobi_free_rawml(rawml);
+    mobi_free(m);
+    return ret;
+}
+
+/**
+ @brief Main
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s sample_file...\n", argv[0]);
+        return 1;
+    }
+#ifdef USE_LIBXML2
+    xmlSetGenericErrorFunc(NULL, xml_error_ignore);
+#endif
+    for (int i = 1; i < argc; i++) {
+        MOBI_RET ret = check_sample(argv[i]);
+        if (ret != MOBI_SUCCESS) {
+            fprintf(stderr, "%s: could not be checked (%i)\n", argv[i], ret);
+            failures++;
+        }
+    }
+    check_reuse(argv + 1, (size_t) argc - 1);
+    check_immutable(argv + 1, (size_t) argc - 1);
+    check_fingerprints(argv + 1, (size_t) argc - 1);
+    check_fingerprint_threads(argv + 1, (size_t) argc - 1);
+    check_utf8_repair(argv + 1, (size_t) argc - 1);
+    check_replica();
+#ifdef USE_LIBXML2
+    xmlCleanupParser();
+#endif
+    printf("%zu checks, %zu failures\n", checks, failures);
+    return failures ? 1 : 0;
+}
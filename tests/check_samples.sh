@@ -0,0 +1,14 @@
+#!/bin/bash
+# check_samples.sh
+# Copyright (c) 2014 Bartek Fabiszewski
+# http://www.fabiszewski.net
+#
+# This file is part of libmobi.
+# Licensed under LGPL, either version 3, or any later.
+# See <http://www.gnu.org/licenses/>
+
+# Check library routines not covered by test.sh on sample documents.
+
+skip=77
+[[ -x ./check_samples ]] || { echo "Missing check_samples"; exit $skip; }
+exec ./check_samples "${srcdir:-.}"/samples/*.mobi
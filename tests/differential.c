@@ -0,0 +1,1826 @@
+/** @file differential.c
+ *
+ * @brief Differential tests of library routines against reference implementations
+ *
+ * Each checked routine has a plain reference implementation here, written
+ * for clarity rather than speed, and a table of library variants
+ * that must give byte-identical results: PalmDOC LZ77 and huff/cdic
+ * decompressors, markup attribute scanner, fragment list assembly,
+ * cp1252 to utf-8 conversion, utf-8 repair and PK1 decryption. Optimised variants of these
+ * routines should be added to the tables next to the current implementations.
+ * Huff/cdic decompressors are checked both with plain tables
+ * and with tables whose symbols are expanded.
+ * Dictionary indices built by the writer are parsed back and compared
+ * with their input entries, ordered by reference collation.
+ * Links written by KF8 link resolver are compared with links
+ * built by reference routines without lookup tables.
+ *
+ * Inputs are text records and markup of sample documents,
+ * as well as synthetic data generated from a fixed seed:
+ *
+ *   differential [-s seed] [-n iterations] sample_file...
+ *
+ * With -b option decryption variants are timed instead:
+ *
+ *   differential -b records
+ *
+ * Program fails if any variant diverges from the reference.
+ * It is linked with libmobi_check, a copy of the library
+ * with internal symbols visible.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <ctype.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "buffer.h"
+#include "compression.h"
+#include "index.h"
+#include "memory.h"
+#include "parse_rawml.h"
+#include "read.h"
+#include "structure.h"
+#include "util.h"
+#include "write.h"
+#ifdef USE_ENCRYPTION
+# include "encryption.h"
+#endif
+
+#define DIFF_ITERATIONS 2000 /**< Default number of synthetic inputs per routine */
+#define DIFF_SYNTH_MAXLEN 4096 /**< Max length of synthetic input */
+#define DIFF_FRAGMENTS_MAX 64 /**< Max number of fragments inserted into synthetic list */
+#define DIFF_FRAGMENT_MAXLEN 16 /**< Max length of fragment inserted into synthetic list */
+#define DIFF_GUARD 16 /**< Guard bytes around scanned markup, attribute scanner may read one byte past its range */
+#define DIFF_KEYSIZE 16 /**< Size of PK1 key */
+#define DIFF_DECRYPT_MAXCOUNT 40 /**< Max number of buffers decrypted together */
+#define DIFF_BENCH_ROUNDS 5 /**< Number of timed rounds of each variant in benchmark, best one is reported */
+#define DIFF_INDEX_ENTRIES 50000 /**< Number of entries of synthetic dictionary index for every alphabet */
+#define DIFF_INDEX_LARGE 1000000 /**< Number of entries of large synthetic dictionary index */
+#define DIFF_LABEL_MAXLEN 12 /**< Max number of characters in synthetic index label */
+#define DIFF_TAG_MAXVALUES 5 /**< Max number of values of synthetic index tag */
+
+/** @brief Decompressor signature, as mobi_decompress_lz77() */
+typedef MOBI_RET (*DiffLz77Func)(unsigned char *out, const unsigned char *in, size_t *len_out, const size_t len_in);
+/** @brief Decompressor signature, as mobi_decompress_huffman() */
+typedef MOBI_RET (*DiffHuffFunc)(unsigned char *out, const unsigned char *in, size_t *len_out, size_t len_in, const MOBIHuffCdic *huffcdic);
+/** @brief Attribute scanner signature, as mobi_find_attrvalue() */
+typedef MOBI_RET (*DiffAttrFunc)(MOBIResult *result, const unsigned char *data_start, const unsigned char *data_end, const MOBIFiletype type, const char *needle);
+/** @brief Fragment insertion signature, as mobi_list_insert() */
+typedef MOBIFragment * (*DiffInsertFunc)(MOBIFragment *curr, size_t raw_offset, unsigned char *fragment, const size_t size, const bool is_malloc, const size_t offset);
+/** @brief Converter signature, as mobi_cp1252_to_utf8() */
+typedef MOBI_RET (*DiffCp1252Func)(char *output, const char *input, size_t *outsize, const size_t insize);
+/** @brief Utf-8 repair signature, as mobi_utf8_repair() */
+typedef MOBI_RET (*DiffUtf8Func)(unsigned char **data, size_t *length);
+#ifdef USE_ENCRYPTION
+/** @brief Multiple buffers decryptor signature, as mobi_decrypt_multi() */
+typedef MOBI_RET (*DiffDecryptFunc)(unsigned char **out, const unsigned char **in, const size_t *length, const size_t count, const MOBIData *m);
+
+/**
+ @brief Decrypt buffers one by one with mobi_decrypt()
+ */
+static MOBI_RET decrypt_single(unsigned char **out, const unsigned char **in, const size_t *length, const size_t count, const MOBIData *m) {
+    for (size_t i = 0; i < count; i++) {
+        MOBI_RET ret = mobi_decrypt(out[i], in[i], length[i], m);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+#endif
+
+/**
+ @defgroup diff_variants Library variants checked against reference
+ @{
+ */
+static const struct { const char *name; DiffLz77Func func; } lz77_variants[] = {
+    { "mobi_decompress_lz77", mobi_decompress_lz77 },
+};
+static const struct { const char *name; DiffHuffFunc func; } huff_variants[] = {
+    { "mobi_decompress_huffman", mobi_decompress_huffman },
+};
+static const struct { const char *name; DiffAttrFunc func; } attr_variants[] = {
+    { "mobi_find_attrvalue", mobi_find_attrvalue },
+};
+static const struct { const char *name; DiffInsertFunc func; } insert_variants[] = {
+    { "mobi_list_insert", mobi_list_insert },
+};
+static const struct { const char *name; DiffCp1252Func func; } cp1252_variants[] = {
+    { "mobi_cp1252_to_utf8", mobi_cp1252_to_utf8 },
+};
+static const struct { const char *name; DiffUtf8Func func; } utf8_variants[] = {
+    { "mobi_utf8_repair", mobi_utf8_repair },
+};
+#ifdef USE_ENCRYPTION
+static const struct { const char *name; DiffDecryptFunc func; } decrypt_variants[] = {
+    { "mobi_decrypt", decrypt_single },
+    { "mobi_decrypt_multi", mobi_decrypt_multi },
+};
+#endif
+/** @} */
+
+#define ARRAYSIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ULL; /**< Random generator state */
+static size_t failures = 0; /**< Number of divergences found */
+static size_t comparisons = 0; /**< Number of comparisons made */
+
+/**
+ @brief Xorshift pseudo-random generator
+ @return Random value
+ */
+static uint64_t rng_next(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+/**
+ @brief Random value in range [0, max)
+ @param[in] max Upper bound, must be positive
+ @return Random value
+ */
+static size_t rng_below(const size_t max) {
+    return (size_t) (rng_next() % max);
+}
+
+/**
+ @brief Report divergence
+ @param[in] routine Checked routine
+ @param[in] variant Name of diverging variant
+ @param[in] input Input description
+ @param[in] details What differs
+ */
+static void diff_report(const char *routine, const char *variant, const char *input, const char *details) {
+    fprintf(stderr, "DIVERGENCE %s: %s on %s: %s\n", routine, variant, input, details);
+    failures++;
+}
+
+/**
+ @brief Compare results of reference and variant
+
+ Output is compared only if reference succeeded,
+ on failure it is enough that variant fails too.
+
+ @param[in] routine Checked routine
+ @param[in] variant Name of variant
+ @param[in] input Input description
+ @param[in] ref_ret Reference status
+ @param[in] ref Reference output
+ @param[in] ref_len Reference output length
+ @param[in] ret Variant status
+ @param[in] out Variant output
+ @param[in] len Variant output length
+ */
+static void diff_compare(const char *routine, const char *variant, const char *input,
+                         const MOBI_RET ref_ret, const unsigned char *ref, const size_t ref_len,
+                         const MOBI_RET ret, const unsigned char *out, const size_t len) {
+    comparisons++;
+    char details[128];
+    if ((ref_ret == MOBI_SUCCESS) != (ret == MOBI_SUCCESS)) {
+        snprintf(details, sizeof(details), "status %i, reference status %i", ret, ref_ret);
+        diff_report(routine, variant, input, details);
+    } else if (ref_ret == MOBI_SUCCESS) {
+        if (len != ref_len) {
+            snprintf(details, sizeof(details), "length %zu, reference length %zu", len, ref_len);
+            diff_report(routine, variant, input, details);
+        } else if (len && memcmp(out, ref, len) != 0) {
+            size_t i = 0;
+            while (out[i] == ref[i]) { i++; }
+            snprintf(details, sizeof(details), "data differs at offset %zu", i);
+            diff_report(routine, variant, input, details);
+        }
+    }
+}
+
+/**
+ @brief Reference PalmDOC LZ77 decompressor
+
+ Pair with zero distance refers to the byte being written,
+ output buffer should be zeroed for deterministic results.
+
+ @param[out] out Output buffer
+ @param[in,out] len_out Output buffer size, on return decompressed length
+ @param[in] in Compressed data
+ @param[in] len_in Compressed data length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET ref_lz77(unsigned char *out, size_t *len_out, const unsigned char *in, const size_t len_in) {
+    const size_t out_max = *len_out;
+    size_t i = 0;
+    size_t o = 0;
+    *len_out = 0;
+    while (i < len_in) {
+        const unsigned char c = in[i++];
+        if (c == 0 || c >= 0x09) {
+            if (c >= 0xc0) {
+                /* space followed by character */
+                if (o + 2 > out_max) { return MOBI_BUFFER_END; }
+                out[o++] = ' ';
+                out[o++] = c ^ 0x80;
+            } else if (c >= 0x80) {
+                /* 11 bits of distance, 3 bits of length minus 3 */
+                if (i >= len_in) { return MOBI_BUFFER_END; }
+                const unsigned pair = (unsigned) c << 8 | in[i++];
+                const size_t distance = (pair >> 3) & 0x7ff;
+                const size_t length = (pair & 0x7) + 3;
+                for (size_t k = 0; k < length; k++) {
+                    if (distance > o || o >= out_max) { return MOBI_BUFFER_END; }
+                    out[o] = out[o - distance];
+                    o++;
+                }
+            } else {
+                /* literal */
+                if (o >= out_max) { return MOBI_BUFFER_END; }
+                out[o++] = c;
+            }
+        } else {
+            /* 1 to 8 following bytes copied verbatim */
+            if (i + c > len_in || o + c > out_max) { return MOBI_BUFFER_END; }
+            memcpy(out + o, in + i, c);
+            i += c;
+            o += c;
+        }
+        *len_out = o;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Get 32 bits of big-endian bit stream at given bit position, zero padded past end
+
+ @param[in] data Data
+ @param[in] size Data size
+ @param[in] bitpos Bit position
+ @return 32-bit value
+ */
+static uint32_t ref_peek32(const unsigned char *data, const size_t size, const size_t bitpos) {
+    uint32_t value = 0;
+    for (size_t bit = bitpos; bit < bitpos + 32; bit++) {
+        const size_t byte = bit / 8;
+        const uint32_t b = (byte < size) ? (data[byte] >> (7 - bit % 8)) & 1 : 0;
+        value = value << 1 | b;
+    }
+    return value;
+}
+
+/**
+ @brief Reference huff/cdic decompressor
+
+ Iterative, with explicit stack of compressed symbols being expanded.
+ Unlike library decompressor it rejects malformed code tables.
+
+ @param[out] out Output buffer
+ @param[in,out] len_out Output buffer size, on return decompressed length
+ @param[in] in Compressed data
+ @param[in] len_in Compressed data length
+ @param[in] huffcdic Parsed huff/cdic tables
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET ref_huffman(unsigned char *out, size_t *len_out, const unsigned char *in, const size_t len_in, const MOBIHuffCdic *huffcdic) {
+    struct {
+        const unsigned char *data;
+        size_t size;
+        size_t bitpos;
+    } stack[MOBI_HUFFMAN_MAXDEPTH + 1];
+    const size_t out_max = *len_out;
+    size_t o = 0;
+    size_t depth = 0;
+    stack[0].data = in;
+    stack[0].size = len_in;
+    stack[0].bitpos = 0;
+    *len_out = 0;
+    while (true) {
+        const uint32_t code = ref_peek32(stack[depth].data, stack[depth].size, stack[depth].bitpos);
+        const uint32_t t1 = huffcdic->table1[code >> 24];
+        size_t code_length = t1 & 0x1f;
+        if (code_length == 0) {
+            return MOBI_DATA_CORRUPT;
+        }
+        uint32_t maxcode = (uint32_t) ((((uint64_t) (t1 >> 8) + 1) << (32 - code_length)) - 1);
+        if (!(t1 & 0x80)) {
+            /* code is longer than 8 bits */
+            while (code < huffcdic->mincode_table[code_length]) {
+                if (++code_length > 32) {
+                    return MOBI_DATA_CORRUPT;
+                }
+            }
+            maxcode = huffcdic->maxcode_table[code_length];
+        }
+        if (stack[depth].bitpos + code_length > stack[depth].size * 8) {
+            /* end of symbol */
+            if (depth == 0) {
+                break;
+            }
+            depth--;
+            continue;
+        }
+        stack[depth].bitpos += code_length;
+        const uint32_t index = (maxcode - code) >> (32 - code_length);
+        if (index >= huffcdic->index_count) {
+            return MOBI_DATA_CORRUPT;
+        }
+        const unsigned char *symbol = huffcdic->symbols[index >> huffcdic->code_length] + huffcdic->symbol_offsets[index];
+        const size_t symbol_length = (size_t) (symbol[0] & 0x7f) << 8 | symbol[1];
+        if (symbol[0] & 0x80) {
+            /* plain symbol */
+            if (o + symbol_length > out_max) {
+                return MOBI_BUFFER_END;
+            }
+            memcpy(out + o, symbol + 2, symbol_length);
+            o += symbol_length;
+            *len_out = o;
+        } else {
+            /* compressed symbol, expand it first */
+            if (depth == MOBI_HUFFMAN_MAXDEPTH) {
+                return MOBI_DATA_CORRUPT;
+            }
+            depth++;
+            stack[depth].data = symbol + 2;
+            stack[depth].size = symbol_length;
+            stack[depth].bitpos = 0;
+        }
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Reference markup attribute scanner
+
+ Finds first occurrence of needle inside a tag (or css block)
+ and reports the whole attribute value containing it.
+ Range is inclusive, data_end points to last byte.
+
+ @param[in,out] result MOBIResult structure will be filled with found data
+ @param[in] data Beginning of the memory area to search in
+ @param[in] data_end Last byte of the memory area
+ @param[in] type Type of data (T_HTML or T_CSS)
+ @param[in] needle String to find
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET ref_find_attrvalue(MOBIResult *result, const unsigned char *data, const unsigned char *data_end, const MOBIFiletype type, const char *needle) {
+    result->start = result->end = NULL;
+    result->value[0] = '\0';
+    const size_t needle_length = strlen(needle);
+    if (needle_length > MOBI_ATTRNAME_MAXSIZE) {
+        return MOBI_PARAM_ERR;
+    }
+    if (data + needle_length > data_end) {
+        return MOBI_SUCCESS;
+    }
+    const size_t last = (size_t) (data_end - data);
+    const unsigned char open = (type == T_CSS) ? '{' : '<';
+    const unsigned char close = (type == T_CSS) ? '}' : '>';
+    bool inside = false;
+    size_t pos = 0;
+    while (pos <= last) {
+        if (data[pos] == open) {
+            inside = true;
+        } else if (data[pos] == close) {
+            inside = false;
+        }
+        if (pos + needle_length > last || memcmp(data + pos, needle, needle_length) != 0) {
+            pos++;
+            continue;
+        }
+        if (!inside) {
+            /* matched text is not scanned for tag borders */
+            pos += needle_length;
+            continue;
+        }
+        /* value starts after whitespace, tag opening, '=' or '(' */
+        ptrdiff_t start = (ptrdiff_t) pos;
+        while (start >= 0) {
+            const unsigned char c = data[start];
+            if (isspace(c) || c == open || c == '=' || c == '(') {
+                break;
+            }
+            start--;
+        }
+        result->is_url = (data[start] == '(');
+        start++;
+        size_t end = (size_t) start;
+        size_t i = 0;
+        while (end <= last && i < MOBI_ATTRVALUE_MAXSIZE) {
+            const unsigned char c = data[end];
+            if (isspace(c) || c == close || c == ')') {
+                break;
+            }
+            result->value[i++] = (char) c;
+            end++;
+        }
+        /* value does not include slash of self closing tag */
+        if (data[end - 1] == '/' && data[end] == '>') {
+            end--;
+            i--;
+        }
+        result->value[i] = '\0';
+        result->start = (unsigned char *) data + start;
+        result->end = (unsigned char *) data + end;
+        return MOBI_SUCCESS;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Reference cp1252 to utf-8 converter
+
+ Conversion stops at null character. Undefined cp1252 characters
+ are replaced with U+FFFD.
+
+ @param[out] out Output buffer, at least 3 * insize + 1 bytes
+ @param[in,out] len_out Output buffer size, on return output length
+ @param[in] in Input data
+ @param[in] insize Input length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET ref_cp1252(unsigned char *out, size_t *len_out, const unsigned char *in, const size_t insize) {
+    /* unicode code points of cp1252 characters 0x80-0x9f, zero if undefined */
+    static const uint16_t table[32] = {
+        0x20ac, 0, 0x201a, 0x0192, 0x201e, 0x2026, 0x2020, 0x2021,
+        0x02c6, 0x2030, 0x0160, 0x2039, 0x0152, 0, 0x017d, 0,
+        0, 0x2018, 0x2019, 0x201c, 0x201d, 0x2022, 0x2013, 0x2014,
+        0x02dc, 0x2122, 0x0161, 0x203a, 0x0153, 0, 0x017e, 0x0178
+    };
+    size_t o = 0;
+    for (size_t i = 0; i < insize && in[i]; i++) {
+        uint32_t cp = in[i];
+        if (cp >= 0x80 && cp < 0xa0) {
+            cp = table[cp - 0x80] ? table[cp - 0x80] : 0xfffd;
+        }
+        if (cp < 0x80) {
+            out[o++] = (unsigned char) cp;
+        } else if (cp < 0x800) {
+            out[o++] = (unsigned char) (0xc0 | cp >> 6);
+            out[o++] = (unsigned char) (0x80 | (cp & 0x3f));
+        } else {
+            out[o++] = (unsigned char) (0xe0 | cp >> 12);
+            out[o++] = (unsigned char) (0x80 | ((cp >> 6) & 0x3f));
+            out[o++] = (unsigned char) (0x80 | (cp & 0x3f));
+        }
+    }
+    out[o] = '\0';
+    *len_out = o;
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Check whether utf-8 sequence prefix may be completed to a valid sequence
+
+ Range of code points of all completions must overlap with range
+ of valid code points of sequence length, excluding surrogates.
+
+ @param[in] in Sequence prefix, continuation bytes already checked
+ @param[in] n Prefix length
+ @param[in] length Sequence length, 2 to 4
+ @return True if prefix may be completed
+ */
+static bool ref_utf8_prefix(const unsigned char *in, const size_t n, const size_t length) {
+    static const uint32_t min[5] = { 0, 0, 0x80, 0x800, 0x10000 };
+    uint32_t lo = in[0] & (0x7f >> length);
+    for (size_t i = 1; i < n; i++) {
+        lo = lo << 6 | (in[i] & 0x3f);
+    }
+    const unsigned bits = (unsigned) (6 * (length - n));
+    lo <<= bits;
+    const uint32_t hi = lo | ((1U << bits) - 1);
+    const uint32_t a = lo > min[length] ? lo : min[length];
+    const uint32_t b = hi < 0x10ffff ? hi : 0x10ffff;
+    if (a > b) {
+        return false;
+    }
+    return !(a >= 0xd800 && b <= 0xdfff);
+}
+
+/**
+ @brief Reference utf-8 repair
+
+ Maximal prefix of ill-formed sequence that may be completed
+ to a valid sequence, or single byte if there is no such prefix,
+ is replaced with U+FFFD.
+
+ @param[out] out Output buffer, at least 3 * insize bytes
+ @param[out] len_out Output length
+ @param[out] invalid Offset of first invalid sequence, insize if input is valid
+ @param[in] in Input data
+ @param[in] insize Input length
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET ref_utf8(unsigned char *out, size_t *len_out, size_t *invalid, const unsigned char *in, const size_t insize) {
+    size_t o = 0;
+    size_t i = 0;
+    *invalid = insize;
+    while (i < insize) {
+        const unsigned char c = in[i];
+        if (c < 0x80) {
+            out[o++] = c;
+            i++;
+            continue;
+        }
+        size_t length = 0;
+        if (c >= 0xc0 && c < 0xe0) { length = 2; }
+        else if (c >= 0xe0 && c < 0xf0) { length = 3; }
+        else if (c >= 0xf0 && c < 0xf8) { length = 4; }
+        size_t valid = 0;
+        for (size_t n = 1; n <= length && i + n <= insize; n++) {
+            if (n > 1 && (in[i + n - 1] & 0xc0) != 0x80) {
+                break;
+            }
+            if (!ref_utf8_prefix(in + i, n, length)) {
+                break;
+            }
+            valid = n;
+        }
+        if (length && valid == length) {
+            memcpy(out + o, in + i, length);
+            o += length;
+            i += length;
+        } else {
+            if (*invalid == insize) {
+                *invalid = i;
+            }
+            out[o++] = 0xef;
+            out[o++] = 0xbf;
+            out[o++] = 0xbd;
+            i += valid ? valid : 1;
+        }
+    }
+    *len_out = o;
+    return MOBI_SUCCESS;
+}
+
+#ifdef USE_ENCRYPTION
+/**
+ @brief Reference PK1 decryptor, as in original PC1 code
+
+ @param[out] out Decrypted data
+ @param[in] in Encrypted data
+ @param[in] length Data length
+ @param[in] key Key
+ */
+static void ref_pk1(unsigned char *out, const unsigned char *in, const size_t length, const unsigned char key[DIFF_KEYSIZE]) {
+    unsigned char k[DIFF_KEYSIZE];
+    memcpy(k, key, DIFF_KEYSIZE);
+    uint16_t si = 0;
+    uint16_t x1a2 = 0;
+    uint16_t x1a0[DIFF_KEYSIZE / 2];
+    for (size_t n = 0; n < length; n++) {
+        uint16_t inter = 0;
+        for (uint16_t i = 0; i < DIFF_KEYSIZE / 2; i++) {
+            const uint16_t word = (uint16_t) ((k[i * 2] << 8) | k[i * 2 + 1]);
+            x1a0[i] = i ? (uint16_t) (x1a0[i - 1] ^ word) : word;
+            const uint16_t bx = 0x4e35;
+            uint16_t dx = (uint16_t) (x1a2 + i);
+            uint16_t ax = x1a0[i];
+            uint16_t cx = 0x015a;
+            uint16_t tmp = ax; ax = si; si = tmp;
+            tmp = ax; ax = dx; dx = tmp;
+            if (ax) { ax = (uint16_t) (ax * bx); }
+            tmp = ax; ax = cx; cx = tmp;
+            if (ax) {
+                ax = (uint16_t) (ax * si);
+                cx = (uint16_t) (cx + ax);
+            }
+            tmp = ax; ax = si; si = tmp;
+            ax = (uint16_t) (ax * bx + 1);
+            dx = (uint16_t) (dx + cx);
+            x1a2 = dx;
+            x1a0[i] = ax;
+            inter ^= ax ^ dx;
+        }
+        const unsigned char c = (unsigned char) (in[n] ^ (inter >> 8) ^ (inter & 0xff));
+        for (size_t i = 0; i < DIFF_KEYSIZE; i++) {
+            k[i] ^= c;
+        }
+        out[n] = c;
+    }
+}
+#endif
+
+/**
+ @brief Reference skeleton assembly, fragment is inserted into flat buffer at given position
+
+ @param[in,out] text Assembled text, must have room for fragment
+ @param[in,out] length Length of text
+ @param[in] fragment Fragment data
+ @param[in] size Fragment size
+ @param[in] position Insert position
+ */
+static void ref_insert(unsigned char *text, size_t *length, const unsigned char *fragment, const size_t size, const size_t position) {
+    memmove(text + position + size, text + position, *length - position);
+    memcpy(text + position, fragment, size);
+    *length += size;
+}
+
+/**
+ @brief Concatenate fragments of the list
+
+ @param[out] out Output buffer
+ @param[in] out_max Output buffer size
+ @param[in] first First fragment
+ @return Total length of fragments, SIZE_MAX if output buffer is too small
+ */
+static size_t list_join(unsigned char *out, const size_t out_max, const MOBIFragment *first) {
+    size_t length = 0;
+    while (first) {
+        if (length + first->size > out_max) {
+            return SIZE_MAX;
+        }
+        memcpy(out + length, first->fragment, first->size);
+        length += first->size;
+        first = first->next;
+    }
+    return length;
+}
+
+/**
+ @brief Check decompressors on a text record
+
+ Record is decompressed with ample output space, with output space
+ one byte short of decompressed length and with random shorter output space.
+ Huff/cdic tables with expanded symbols are checked as separate routine.
+
+ @param[in] input Input description
+ @param[in] data Compressed data
+ @param[in] size Compressed data size
+ @param[in] huffcdic Huff/cdic tables, NULL for LZ77
+ */
+static void check_record(const char *input, const unsigned char *data, const size_t size, const MOBIHuffCdic *huffcdic) {
+    const size_t out_max = 8 * size + 8192;
+    unsigned char *ref = malloc(out_max);
+    unsigned char *out = malloc(out_max);
+    if (ref == NULL || out == NULL) {
+        free(ref);
+        free(out);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(ref, 0, out_max);
+    size_t ref_len = out_max;
+    MOBI_RET ref_ret = huffcdic ? ref_huffman(ref, &ref_len, data, size, huffcdic) : ref_lz77(ref, &ref_len, data, size);
+    const size_t full_len = ref_len;
+    for (int pass = 0; pass < 3; pass++) {
+        size_t capacity = out_max;
+        if (pass > 0) {
+            if (ref_ret != MOBI_SUCCESS || full_len == 0 || (pass == 2 && full_len == 1)) {
+                break;
+            }
+            /* output space too short, both must fail */
+            capacity = (pass == 1) ? full_len - 1 : rng_below(full_len - 1);
+            size_t short_len = capacity;
+            ref_ret = huffcdic ? ref_huffman(ref, &short_len, data, size, huffcdic) : ref_lz77(ref, &short_len, data, size);
+        }
+        if (huffcdic) {
+            const char *routine = huffcdic->expanded ? "huffman, expanded symbols" : "huffman";
+            for (size_t v = 0; v < ARRAYSIZE(huff_variants); v++) {
+                size_t len = capacity;
+                MOBI_RET ret = huff_variants[v].func(out, data, &len, size, huffcdic);
+                diff_compare(routine, huff_variants[v].name, input, ref_ret, ref, ref_len, ret, out, len);
+            }
+        } else {
+            for (size_t v = 0; v < ARRAYSIZE(lz77_variants); v++) {
+                size_t len = capacity;
+                memset(out, 0, out_max);
+                MOBI_RET ret = lz77_variants[v].func(out, data, &len, size);
+                diff_compare("lz77", lz77_variants[v].name, input, ref_ret, ref, ref_len, ret, out, len);
+            }
+        }
+    }
+    free(ref);
+    free(out);
+}
+
+/**
+ @brief Check cp1252 converters
+
+ @param[in] input Input description
+ @param[in] data Input data
+ @param[in] size Input size
+ */
+static void check_cp1252(const char *input, const unsigned char *data, const size_t size) {
+    const size_t out_max = 3 * size + 1;
+    unsigned char *ref = malloc(out_max);
+    unsigned char *out = malloc(out_max);
+    if (ref == NULL || out == NULL) {
+        free(ref);
+        free(out);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t ref_len = out_max;
+    MOBI_RET ref_ret = ref_cp1252(ref, &ref_len, data, size);
+    for (size_t v = 0; v < ARRAYSIZE(cp1252_variants); v++) {
+        size_t len = out_max;
+        MOBI_RET ret = cp1252_variants[v].func((char *) out, (const char *) data, &len, size);
+        diff_compare("cp1252", cp1252_variants[v].name, input, ref_ret, ref, ref_len, ret, out, len);
+    }
+    free(ref);
+    free(out);
+}
+
+/**
+ @brief Check utf-8 validator and repair variants, repair works on exactly sized copy of input
+
+ @param[in] input Input description
+ @param[in] data Input data
+ @param[in] size Input size
+ */
+static void check_utf8(const char *input, const unsigned char *data, const size_t size) {
+    unsigned char *ref = malloc(3 * size + 1);
+    if (ref == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t ref_len;
+    size_t ref_invalid;
+    MOBI_RET ref_ret = ref_utf8(ref, &ref_len, &ref_invalid, data, size);
+    comparisons++;
+    const size_t invalid = mobi_utf8_validate(data, size);
+    if (invalid != ref_invalid) {
+        char details[128];
+        snprintf(details, sizeof(details), "invalid offset %zu, reference offset %zu", invalid, ref_invalid);
+        diff_report("utf8", "mobi_utf8_validate", input, details);
+    }
+    for (size_t v = 0; v < ARRAYSIZE(utf8_variants); v++) {
+        unsigned char *out = malloc(size ? size : 1);
+        if (out == NULL) {
+            free(ref);
+            fprintf(stderr, "Memory allocation failed\n");
+            exit(1);
+        }
+        memcpy(out, data, size);
+        size_t len = size;
+        MOBI_RET ret = utf8_variants[v].func(&out, &len);
+        diff_compare("utf8", utf8_variants[v].name, input, ref_ret, ref, ref_len, ret, out, len);
+        free(out);
+    }
+    free(ref);
+}
+
+/**
+ @brief Check attribute scanners, all occurrences of needle are found the way links are reconstructed
+
+ @param[in] input Input description
+ @param[in] data Markup data
+ @param[in] size Markup size
+ @param[in] type Type of markup (T_HTML or T_CSS)
+ @param[in] needle String to find
+ */
+static void check_attrvalue(const char *input, const unsigned char *data, const size_t size, const MOBIFiletype type, const char *needle) {
+    if (size == 0) {
+        return;
+    }
+    /* scanner may look one byte beyond its range */
+    unsigned char *guarded = malloc(size + 2 * DIFF_GUARD);
+    if (guarded == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memset(guarded, ' ', size + 2 * DIFF_GUARD);
+    memcpy(guarded + DIFF_GUARD, data, size);
+    const unsigned char *data_start = guarded + DIFF_GUARD;
+    const unsigned char *data_end = data_start + size - 1;
+    for (size_t v = 0; v < ARRAYSIZE(attr_variants); v++) {
+        const unsigned char *ref_start = data_start;
+        const unsigned char *start = data_start;
+        while (true) {
+            MOBIResult ref;
+            MOBIResult result;
+            MOBI_RET ref_ret = ref_find_attrvalue(&ref, ref_start, data_end, type, needle);
+            MOBI_RET ret = attr_variants[v].func(&result, start, data_end, type, needle);
+            char details[128];
+            comparisons++;
+            if (ret != ref_ret) {
+                snprintf(details, sizeof(details), "status %i, reference status %i", ret, ref_ret);
+                diff_report("attrvalue", attr_variants[v].name, input, details);
+                break;
+            }
+            if (ret != MOBI_SUCCESS || ref.start == NULL) {
+                if (result.start != NULL) {
+                    snprintf(details, sizeof(details), "match at %zu, reference has none", (size_t) (result.start - data_start));
+                    diff_report("attrvalue", attr_variants[v].name, input, details);
+                }
+                break;
+            }
+            if (result.start != ref.start || result.end != ref.end
+                || result.is_url != ref.is_url || strcmp(result.value, ref.value) != 0) {
+                snprintf(details, sizeof(details), "match at %zd \"%.32s\", reference at %zu \"%.32s\"",
+                         result.start ? result.start - data_start : -1, result.value,
+                         (size_t) (ref.start - data_start), ref.value);
+                diff_report("attrvalue", attr_variants[v].name, input, details);
+                break;
+            }
+            if (result.end > data_end) {
+                break;
+            }
+            /* continue after found value */
+            ref_start = start = (result.end > result.start) ? result.end : result.start + 1;
+        }
+    }
+    free(guarded);
+}
+
+/**
+ @brief Check list assembly of synthetic text with random inserts
+
+ Three insertion patterns used by the library are checked:
+ fragments inserted at any position with search starting at list head,
+ at non-decreasing positions with search resuming at last inserted fragment,
+ both shifting following offsets, and fragments not present in raw markup
+ (raw offset SIZE_MAX) inserted at non-decreasing positions of original markup.
+
+ @param[in] pool Random data to take fragments from
+ @param[in] pool_size Size of data
+ */
+static void check_list_synthetic(unsigned char *pool, const size_t pool_size) {
+    const size_t out_max = pool_size + DIFF_FRAGMENTS_MAX * DIFF_FRAGMENT_MAXLEN;
+    unsigned char *ref = malloc(out_max);
+    unsigned char *out = malloc(out_max);
+    if (ref == NULL || out == NULL) {
+        free(ref);
+        free(out);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    const size_t skel_length = rng_below(pool_size);
+    const size_t count = 1 + rng_below(DIFF_FRAGMENTS_MAX);
+    for (int pattern = 0; pattern < 3; pattern++) {
+        for (size_t v = 0; v < ARRAYSIZE(insert_variants); v++) {
+            char input[64];
+            snprintf(input, sizeof(input), "synthetic list (pattern %i, %zu inserts)", pattern, count);
+            MOBIFragment *first = mobi_list_add(NULL, 0, pool, skel_length, false);
+            MOBIFragment *curr = first;
+            memcpy(ref, pool, skel_length);
+            size_t ref_len = skel_length;
+            size_t position = 0;
+            size_t raw_position = 0;
+            for (size_t i = 0; i < count && curr; i++) {
+                const size_t size = 1 + rng_below(pool_size < DIFF_FRAGMENT_MAXLEN ? pool_size : DIFF_FRAGMENT_MAXLEN);
+                unsigned char *fragment = pool + rng_below(pool_size - size + 1);
+                if (pattern == 0) {
+                    position = rng_below(ref_len + 1);
+                    curr = insert_variants[v].func(first, position, fragment, size, false, position);
+                    ref_insert(ref, &ref_len, fragment, size, position);
+                } else if (pattern == 1) {
+                    position += rng_below(ref_len - position + 1);
+                    curr = insert_variants[v].func(curr, position, fragment, size, false, position);
+                    ref_insert(ref, &ref_len, fragment, size, position);
+                } else {
+                    /* position in original markup, shifted by fragments inserted so far */
+                    if (i > 0 && raw_position == skel_length) {
+                        /* such fragments are not searched, there is nothing to resume from at markup end */
+                        break;
+                    }
+                    const size_t step = rng_below(skel_length - raw_position + 1);
+                    raw_position += step;
+                    position += step;
+                    curr = insert_variants[v].func(curr, SIZE_MAX, fragment, size, false, raw_position);
+                    ref_insert(ref, &ref_len, fragment, size, position);
+                    position += size;
+                }
+            }
+            const size_t len = list_join(out, out_max, first);
+            mobi_list_del_all(first);
+            diff_compare("list", insert_variants[v].name, input, MOBI_SUCCESS, ref, ref_len,
+                         curr && len != SIZE_MAX ? MOBI_SUCCESS : MOBI_DATA_CORRUPT, out, len);
+        }
+    }
+    free(ref);
+    free(out);
+}
+
+/**
+ @brief Check list assembly of KF8 skeleton parts against flat reference assembly
+
+ Markup parts are reassembled by library from flow, skeleton and fragment indices
+ and compared with text built by inserting fragments into flat buffer.
+
+ @param[in] input Input description
+ @param[in] rawml Parsed rawml structure, without reconstructed links
+ */
+static void check_list_skeleton(const char *input, MOBIRawml *rawml) {
+    if (rawml->skel == NULL || rawml->frag == NULL || rawml->flow == NULL) {
+        return;
+    }
+    const unsigned char *flow = rawml->flow->data;
+    const size_t flow_size = rawml->flow->size;
+    unsigned char *ref = malloc(flow_size);
+    if (ref == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    size_t j = 0;
+    size_t curr_position = 0;
+    const MOBIPart *part = rawml->markup;
+    for (size_t i = 0; i < rawml->skel->entries_count; i++) {
+        const MOBIIndexEntry *entry = &rawml->skel->entries[i];
+        uint32_t fragments_count;
+        uint32_t skel_position;
+        uint32_t skel_length;
+        if (mobi_get_indxentry_tagvalue(&fragments_count, entry, INDX_TAG_SKEL_COUNT) != MOBI_SUCCESS
+            || mobi_get_indxentry_tagvalue(&skel_position, entry, INDX_TAG_SKEL_POSITION) != MOBI_SUCCESS
+            || mobi_get_indxentry_tagvalue(&skel_length, entry, INDX_TAG_SKEL_LENGTH) != MOBI_SUCCESS
+            || skel_position + skel_length > flow_size) {
+            break;
+        }
+        memcpy(ref, flow + skel_position, skel_length);
+        size_t ref_len = skel_length;
+        size_t frag_position = skel_position + skel_length;
+        while (fragments_count-- && j < rawml->frag->entries_count) {
+            entry = &rawml->frag->entries[j++];
+            size_t insert_position = strtoul(entry->label, NULL, 10) - curr_position;
+            uint32_t frag_length;
+            if (mobi_get_indxentry_tagvalue(&frag_length, entry, INDX_TAG_FRAG_LENGTH) != MOBI_SUCCESS
+                || frag_position + frag_length > flow_size) {
+                break;
+            }
+            if (insert_position > ref_len) {
+                insert_position = ref_len;
+            }
+            ref_insert(ref, &ref_len, flow + frag_position, frag_length, insert_position);
+            frag_position += frag_length;
+        }
+        if (part == NULL) {
+            diff_report("list", "mobi_list_insert", input, "missing markup part");
+            break;
+        }
+        for (size_t v = 0; v < ARRAYSIZE(insert_variants); v++) {
+            char part_input[64];
+            snprintf(part_input, sizeof(part_input), "%s, part %zu", input, i);
+            diff_compare("list", insert_variants[v].name, part_input, MOBI_SUCCESS, ref, ref_len, MOBI_SUCCESS, part->data, part->size);
+        }
+        curr_position += ref_len;
+        part = part->next;
+    }
+    free(ref);
+}
+
+/**
+ @brief Reference builder of html link replacing kindle: link, resolved without lookup tables and cache
+
+ @param[out] link Link in quotation marks, empty if link is skipped, buffer of MOBI_ATTRVALUE_MAXSIZE + 1 bytes
+ @param[in] rawml MOBIRawml structure
+ @param[in] value Attribute value containing kindle: link
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET ref_kindle_link(char *link, const MOBIRawml *rawml, const char *value) {
+    *link = '\0';
+    const char *target;
+    char str_fid[4 + 1];
+    if ((target = strstr(value, "kindle:pos:fid:")) != NULL) {
+        /* "kindle:pos:fid:0000:off:0000000000" */
+        if (strlen(target) < sizeof("kindle:pos:fid:0000:off:0000000000") - 1) {
+            return MOBI_SUCCESS;
+        }
+        target += sizeof("kindle:pos:fid:") - 1;
+        if (target[4] != ':') {
+            return MOBI_SUCCESS;
+        }
+        memcpy(str_fid, target, 4);
+        str_fid[4] = '\0';
+        char str_off[10 + 1];
+        memcpy(str_off, target + sizeof("0000:off:") - 1, 10);
+        str_off[10] = '\0';
+        uint32_t pos_off;
+        uint32_t pos_fid;
+        MOBI_RET ret = mobi_base32_decode(&pos_off, str_off);
+        if (ret == MOBI_SUCCESS) {
+            ret = mobi_base32_decode(&pos_fid, str_fid);
+        }
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        uint32_t part_id;
+        char id[MOBI_ATTRVALUE_MAXSIZE + 1];
+        ret = mobi_get_id_by_posoff(&part_id, id, rawml, pos_fid, pos_off);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        if (pos_off) {
+            snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"part%05u.html#%s\"", part_id, id);
+        } else {
+            snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"part%05u.html\"", part_id);
+        }
+    } else if ((target = strstr(value, "kindle:flow:")) != NULL) {
+        /* "kindle:flow:0000?mime=" */
+        if (strlen(target) < sizeof("kindle:flow:0000?mime=") - 1) {
+            return MOBI_SUCCESS;
+        }
+        target += sizeof("kindle:flow:") - 1;
+        if (target[4] != '?') {
+            return MOBI_SUCCESS;
+        }
+        memcpy(str_fid, target, 4);
+        str_fid[4] = '\0';
+        const MOBIPart *flow = mobi_get_flow_by_fid(rawml, str_fid);
+        if (flow == NULL) {
+            return MOBI_DATA_CORRUPT;
+        }
+        snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"flow%05zu.%s\"", flow->uid, mobi_get_filemeta_by_type(flow->type).extension);
+    } else if ((target = strstr(value, "kindle:embed:")) != NULL) {
+        /* "kindle:embed:0000[?mime=]" */
+        if (strlen(target) < sizeof("kindle:embed:0000") - 1) {
+            return MOBI_SUCCESS;
+        }
+        target += sizeof("kindle:embed:") - 1;
+        memcpy(str_fid, target, 4);
+        str_fid[4] = '\0';
+        uint32_t part_id;
+        MOBI_RET ret = mobi_base32_decode(&part_id, str_fid);
+        if (ret != MOBI_SUCCESS) {
+            return ret;
+        }
+        part_id--;
+        const MOBIPart *resource = mobi_get_resource_by_uid(rawml, part_id);
+        if (resource == NULL) {
+            return MOBI_DATA_CORRUPT;
+        }
+        snprintf(link, MOBI_ATTRVALUE_MAXSIZE + 1, "\"resource%05u.%s\"", part_id, mobi_get_filemeta_by_type(resource->type).extension);
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Compare links written by link resolver with reference builder for every kindle: link in KF8 markup and flow parts
+
+ Every part is scanned twice, so that the second pass gives links from resolver cache.
+
+ @param[in] input Input description
+ @param[in] rawml MOBIRawml structure parsed without links reconstruction
+ */
+static void check_links(const char *input, const MOBIRawml *rawml) {
+    MOBILinkResolver resolver;
+    if (rawml->version < 8 || rawml->flow == NULL || mobi_linkresolver_init(&resolver, rawml) != MOBI_SUCCESS) {
+        return;
+    }
+    MOBIBuffer *buf = buffer_init(MOBI_ATTRVALUE_MAXSIZE + 1);
+    if (buf == NULL) {
+        mobi_linkresolver_free(&resolver);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    const MOBIPart *lists[] = { rawml->markup, rawml->markup, rawml->flow->next };
+    for (size_t i = 0; i < ARRAYSIZE(lists); i++) {
+        for (const MOBIPart *part = lists[i]; part != NULL; part = part->next) {
+            if (part->size == 0) {
+                continue;
+            }
+            MOBIResult result;
+            result.start = part->data;
+            const unsigned char *data_end = part->data + part->size - 1;
+            while (true) {
+                mobi_search_links_kf8(&result, result.start, data_end, part->type);
+                if (result.start == NULL) {
+                    break;
+                }
+                char link[MOBI_ATTRVALUE_MAXSIZE + 1];
+                const MOBI_RET ref_ret = ref_kindle_link(link, rawml, result.value);
+                /* strip quotes if is_url */
+                const size_t link_length = *link ? strlen(link) - 2 * result.is_url : 0;
+                buf->offset = 0;
+                bool replaced;
+                const MOBI_RET ret = mobi_linkresolver_add_link(buf, &resolver, result.value, result.is_url, &replaced);
+                diff_compare("link resolver", "mobi_linkresolver_add_link", input, ref_ret, (const unsigned char *) link + result.is_url, link_length,
+                             ret, buf->data, buf->offset);
+                if (ret == MOBI_SUCCESS && replaced != (link_length > 0)) {
+                    diff_report("link resolver", "mobi_linkresolver_add_link", input, "wrong replaced flag");
+                }
+                result.start = result.end;
+            }
+        }
+    }
+    buffer_free(buf);
+    mobi_linkresolver_free(&resolver);
+}
+
+/**
+ @brief Free list of markup parts
+
+ @param[in] part First part
+ */
+static void free_parts(MOBIPart *part) {
+    while (part) {
+        MOBIPart *next = part->next;
+        free(part->data);
+        free(part);
+        part = next;
+    }
+}
+
+/**
+ @brief Check routines on a sample document
+
+ @param[in] path Path to document
+ @return MOBI_RET status code (on success MOBI_SUCCESS)
+ */
+static MOBI_RET check_sample(const char *path) {
+    const char *basename = strrchr(path, '/');
+    basename = basename ? basename + 1 : path;
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        return MOBI_MALLOC_FAILED;
+    }
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        mobi_free(m);
+        return MOBI_FILE_NOT_FOUND;
+    }
+    MOBI_RET ret = mobi_load_file(m, file);
+    fclose(file);
+    if (ret != MOBI_SUCCESS || m->rh == NULL || mobi_is_encrypted(m)) {
+        printf("%s: skipped\n", basename);
+        mobi_free(m);
+        return MOBI_SUCCESS;
+    }
+    /* text records */
+    uint16_t extra_flags = 0;
+    if (m->mh && m->mh->extra_flags) {
+        extra_flags = *m->mh->extra_flags;
+    }
+    /* tables as parsed, and tables with expanded symbols cached in document */
+    MOBIHuffCdic *huffcdic = NULL;
+    const MOBIHuffCdic *expanded = NULL;
+    if (m->rh->compression_type == RECORD0_HUFF_COMPRESSION) {
+        huffcdic = mobi_init_huffcdic();
+        if (huffcdic == NULL || mobi_parse_huffdic(m, huffcdic) != MOBI_SUCCESS
+            || mobi_get_huffcdic(m, &expanded) != MOBI_SUCCESS) {
+            mobi_free_huffcdic(huffcdic);
+            mobi_free(m);
+            return MOBI_DATA_CORRUPT;
+        }
+        if (expanded->expanded == NULL) {
+            diff_report("huffman", "mobi_get_huffcdic", basename, "symbols not expanded");
+        }
+    }
+    const bool is_cp1252 = mobi_is_cp1252(m);
+    const MOBIPdbRecord *record = mobi_get_record_by_seqnumber(m, 1 + mobi_get_kf8offset(m));
+    size_t records = 0;
+    for (size_t i = 0; i < m->rh->text_record_count && record; i++, record = record->next) {
+        size_t extra_size = extra_flags ? mobi_get_record_extrasize(record, extra_flags) : 0;
+        if (extra_size == MOBI_NOTSET || extra_size >= record->size) {
+            continue;
+        }
+        const size_t size = record->size - extra_size;
+        char input[128];
+        snprintf(input, sizeof(input), "%s, record %zu", basename, i + 1);
+        if (m->rh->compression_type == RECORD0_PALMDOC_COMPRESSION || huffcdic) {
+            check_record(input, record->data, size, huffcdic);
+            /* truncated record */
+            check_record(input, record->data, rng_below(size), huffcdic);
+            if (expanded) {
+                check_record(input, record->data, size, expanded);
+                check_record(input, record->data, rng_below(size), expanded);
+            }
+        }
+        if (is_cp1252) {
+            size_t text_size = mobi_get_textrecord_maxsize(m);
+            unsigned char *text = malloc(text_size);
+            if (text && m->rh->compression_type == RECORD0_PALMDOC_COMPRESSION
+                && mobi_decompress_lz77(text, record->data, &text_size, size) == MOBI_SUCCESS) {
+                check_cp1252(input, text, text_size);
+            }
+            free(text);
+        }
+        records++;
+    }
+    mobi_free_huffcdic(huffcdic);
+    /* markup */
+    MOBIRawml *rawml = mobi_init_rawml(m);
+    if (rawml && mobi_parse_rawml_opt(rawml, m, false, false, false) == MOBI_SUCCESS) {
+        check_links(basename, rawml);
+        /* reassemble parts, they may have been converted to utf-8 */
+        free_parts(rawml->markup);
+        rawml->markup = NULL;
+        if (mobi_reconstruct_parts(rawml) == MOBI_SUCCESS) {
+            check_list_skeleton(basename, rawml);
+            const MOBIPart *part = rawml->markup;
+            while (part) {
+                check_attrvalue(basename, part->data, part->size, T_HTML, "kindle:");
+                check_attrvalue(basename, part->data, part->size, T_HTML, "filepos");
+                check_utf8(basename, part->data, part->size);
+                part = part->next;
+            }
+            part = rawml->flow ? rawml->flow->next : NULL;
+            while (part) {
+                if (part->type == T_CSS) {
+                    check_attrvalue(basename, part->data, part->size, T_CSS, "kindle:");
+                }
+                part = part->next;
+            }
+        }
+    }
+    mobi_free_rawml(rawml);
+    mobi_free(m);
+    printf("%s: %zu text records checked\n", basename, records);
+    return MOBI_SUCCESS;
+}
+
+#ifdef USE_ENCRYPTION
+/**
+ @brief Random buffers to be decrypted together, lengths like text records with shorter last one
+
+ @param[out] data Buffers data, count * DIFF_SYNTH_MAXLEN bytes
+ @param[out] in Buffers
+ @param[out] length Buffers lengths
+ @param[in] count Number of buffers
+ */
+static void random_records(unsigned char *data, const unsigned char **in, size_t *length, const size_t count) {
+    const size_t common = rng_below(DIFF_SYNTH_MAXLEN + 1);
+    for (size_t i = 0; i < count; i++) {
+        in[i] = data + i * DIFF_SYNTH_MAXLEN;
+        /* some lengths random, including empty buffers */
+        length[i] = (i + 1 == count || rng_below(4) == 0) ? rng_below(DIFF_SYNTH_MAXLEN + 1) : common;
+        for (size_t j = 0; j < length[i]; j++) {
+            data[i * DIFF_SYNTH_MAXLEN + j] = (unsigned char) rng_next();
+        }
+    }
+}
+
+/**
+ @brief Check decryptors of multiple buffers, with separate output and in place
+
+ @param[in] input Input description
+ @param[in] in Buffers
+ @param[in] length Buffers lengths
+ @param[in] count Number of buffers
+ @param[in] key Key
+ */
+static void check_decrypt(const char *input, const unsigned char **in, const size_t *length, const size_t count, const unsigned char key[DIFF_KEYSIZE]) {
+    MOBIData *m = mobi_init();
+    unsigned char *ref = malloc(count * DIFF_SYNTH_MAXLEN);
+    unsigned char *out = malloc(count * DIFF_SYNTH_MAXLEN);
+    if (m == NULL || ref == NULL || out == NULL) {
+        mobi_free(m);
+        free(ref);
+        free(out);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    m->drm_key = malloc(DIFF_KEYSIZE);
+    if (m->drm_key == NULL) {
+        mobi_free(m);
+        free(ref);
+        free(out);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    memcpy(m->drm_key, key, DIFF_KEYSIZE);
+    for (size_t i = 0; i < count; i++) {
+        ref_pk1(ref + i * DIFF_SYNTH_MAXLEN, in[i], length[i], key);
+    }
+    unsigned char *outs[DIFF_DECRYPT_MAXCOUNT];
+    const unsigned char *ins[DIFF_DECRYPT_MAXCOUNT];
+    for (size_t v = 0; v < ARRAYSIZE(decrypt_variants); v++) {
+        for (int in_place = 0; in_place < 2; in_place++) {
+            for (size_t i = 0; i < count; i++) {
+                outs[i] = out + i * DIFF_SYNTH_MAXLEN;
+                ins[i] = in[i];
+                if (in_place) {
+                    memcpy(outs[i], in[i], length[i]);
+                    ins[i] = outs[i];
+                }
+            }
+            MOBI_RET ret = decrypt_variants[v].func(outs, ins, length, count, m);
+            for (size_t i = 0; i < count; i++) {
+                char buffer_input[96];
+                snprintf(buffer_input, sizeof(buffer_input), "%s, buffer %zu of %zu%s", input, i, count, in_place ? ", in place" : "");
+                diff_compare("decrypt", decrypt_variants[v].name, buffer_input, MOBI_SUCCESS, ref + i * DIFF_SYNTH_MAXLEN, length[i],
+                             ret, outs[i], length[i]);
+            }
+        }
+    }
+    mobi_free(m);
+    free(ref);
+    free(out);
+}
+
+/**
+ @brief Time decryption variants on text records of maximal size
+
+ @param[in] count Number of records
+ @return 0 on success, 1 on failure
+ */
+static int bench_decrypt(const size_t count) {
+    MOBIData *m = mobi_init();
+    unsigned char *data = malloc(count * RECORD0_TEXT_SIZE_MAX);
+    unsigned char *out = malloc(count * RECORD0_TEXT_SIZE_MAX);
+    unsigned char **outs = malloc(count * sizeof(*outs));
+    const unsigned char **ins = malloc(count * sizeof(*ins));
+    size_t *length = malloc(count * sizeof(*length));
+    if (m) {
+        m->drm_key = malloc(DIFF_KEYSIZE);
+    }
+    if (m == NULL || m->drm_key == NULL || data == NULL || out == NULL || outs == NULL || ins == NULL || length == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        mobi_free(m);
+        free(data);
+        free(out);
+        free(outs);
+        free(ins);
+        free(length);
+        return 1;
+    }
+    for (size_t i = 0; i < DIFF_KEYSIZE; i++) {
+        m->drm_key[i] = (unsigned char) rng_next();
+    }
+    for (size_t i = 0; i < count * RECORD0_TEXT_SIZE_MAX; i++) {
+        data[i] = (unsigned char) rng_next();
+    }
+    for (size_t i = 0; i < count; i++) {
+        outs[i] = out + i * RECORD0_TEXT_SIZE_MAX;
+        ins[i] = data + i * RECORD0_TEXT_SIZE_MAX;
+        length[i] = RECORD0_TEXT_SIZE_MAX;
+    }
+    const double megabytes = (double) (count * RECORD0_TEXT_SIZE_MAX) / (1024 * 1024);
+    printf("Decrypting %zu records of %u bytes\n", count, RECORD0_TEXT_SIZE_MAX);
+    for (size_t v = 0; v < ARRAYSIZE(decrypt_variants); v++) {
+        double best = 0;
+        for (size_t round = 0; round < DIFF_BENCH_ROUNDS; round++) {
+            struct timespec start;
+            struct timespec stop;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            decrypt_variants[v].func(outs, ins, length, count, m);
+            clock_gettime(CLOCK_MONOTONIC, &stop);
+            const double seconds = (double) (stop.tv_sec - start.tv_sec) + (double) (stop.tv_nsec - start.tv_nsec) / 1e9;
+            if (round == 0 || seconds < best) {
+                best = seconds;
+            }
+        }
+        printf("%-20s %10.3f ms %10.2f MB/s\n", decrypt_variants[v].name, best * 1000, megabytes / best);
+    }
+    mobi_free(m);
+    free(data);
+    free(out);
+    free(outs);
+    free(ins);
+    free(length);
+    return 0;
+}
+#endif
+
+/**
+ @brief Fill buffer with random markup-like data
+
+ @param[out] data Buffer
+ @param[in] size Buffer size
+ */
+static void random_markup(unsigned char *data, const size_t size) {
+    static const char *tokens[] = {
+        "<", ">", "{", "}", "(", ")", "=", "\"", "/", " ", "\n", "a", "p",
+        "kindle:", "kindle:pos:fid:0001:off:0000000000", "filepos", "=000123",
+        "url(", "/>", "<img src=", "\x92", "\x81", "\xe9", "\x80"
+    };
+    size_t i = 0;
+    while (i < size) {
+        const char *token = tokens[rng_below(ARRAYSIZE(tokens))];
+        for (size_t k = 0; token[k] && i < size; k++) {
+            data[i++] = (unsigned char) token[k];
+        }
+    }
+}
+
+/**
+ @brief Fill buffer with random utf-8 text with invalid sequences
+
+ Code points are picked near boundaries of sequence lengths and surrogates,
+ some sequences are truncated or have stray bytes.
+
+ @param[out] data Buffer
+ @param[in] size Buffer size
+ */
+static void random_utf8(unsigned char *data, const size_t size) {
+    static const uint32_t bounds[] = {
+        0x0, 0x7f, 0x80, 0x7ff, 0x800, 0xd7ff, 0xd800, 0xdfff,
+        0xe000, 0xfffd, 0xffff, 0x10000, 0x10ffff, 0x110000, 0x1fffff
+    };
+    size_t i = 0;
+    while (i < size) {
+        uint32_t cp = bounds[rng_below(ARRAYSIZE(bounds))];
+        if (rng_below(2)) {
+            cp = (uint32_t) (cp + rng_below(64)) - 32;
+        }
+        cp &= 0x1fffff;
+        unsigned char seq[4];
+        size_t length;
+        if (cp < 0x80 && rng_below(8)) {
+            seq[0] = (unsigned char) cp;
+            length = 1;
+        } else if (cp < 0x800) {
+            /* overlong if code point is ascii */
+            seq[0] = (unsigned char) (0xc0 | cp >> 6);
+            seq[1] = (unsigned char) (0x80 | (cp & 0x3f));
+            length = 2;
+        } else if (cp < 0x10000) {
+            seq[0] = (unsigned char) (0xe0 | cp >> 12);
+            seq[1] = (unsigned char) (0x80 | ((cp >> 6) & 0x3f));
+            seq[2] = (unsigned char) (0x80 | (cp & 0x3f));
+            length = 3;
+        } else {
+            seq[0] = (unsigned char) (0xf0 | cp >> 18);
+            seq[1] = (unsigned char) (0x80 | ((cp >> 12) & 0x3f));
+            seq[2] = (unsigned char) (0x80 | ((cp >> 6) & 0x3f));
+            seq[3] = (unsigned char) (0x80 | (cp & 0x3f));
+            length = 4;
+        }
+        switch (rng_below(16)) {
+            case 0:
+                /* truncated */
+                length = rng_below(length) + 1;
+                break;
+            case 1:
+                /* stray byte */
+                seq[rng_below(length)] = (unsigned char) rng_next();
+                break;
+            default:
+                break;
+        }
+        for (size_t k = 0; k < length && i < size; k++) {
+            data[i++] = seq[k];
+        }
+        /* ascii runs of various lengths */
+        if (rng_below(4) == 0) {
+            for (size_t k = rng_below(80); k > 0 && i < size; k--) {
+                data[i++] = (unsigned char) ('a' + rng_below(26));
+            }
+        }
+    }
+}
+
+/** @brief Character ranges of synthetic index labels, mixed labels take characters from all of them */
+static const struct { const char *name; uint32_t first; uint32_t count; } label_alphabets[] = {
+    { "ascii", 'A', 'z' - 'A' + 1 },
+    { "cyrillic", 0x400, 0x60 },
+    { "cjk", 0x4e00, 500 },
+    { "emoji", 0x1f600, 80 },
+};
+
+/**
+ @brief Reference collation of index labels
+
+ Labels are compared as UTF-16 code units: case folded Latin, Greek and Cyrillic letters first, then code unit value.
+
+ @param[in] label1 First label in UTF-8
+ @param[in] label2 Second label in UTF-8
+ @return Comparison result as in strcmp()
+ */
+static int ref_label_compare(const char *label1, const char *label2) {
+    uint16_t units[2][2 * INDX_LABEL_SIZEMAX];
+    size_t count[2] = { 0, 0 };
+    const char *labels[2] = { label1, label2 };
+    for (size_t n = 0; n < 2; n++) {
+        const unsigned char *c = (const unsigned char *) labels[n];
+        while (*c) {
+            uint32_t codepoint = *c;
+            size_t length = 1;
+            if (*c >= 0xf0) {
+                codepoint = *c & 0x07;
+                length = 4;
+            } else if (*c >= 0xe0) {
+                codepoint = *c & 0x0f;
+                length = 3;
+            } else if (*c >= 0xc0) {
+                codepoint = *c & 0x1f;
+                length = 2;
+            }
+            for (size_t k = 1; k < length; k++) {
+                codepoint = (codepoint << 6) | (c[k] & 0x3f);
+            }
+            c += length;
+            if (codepoint > 0xffff) {
+                codepoint -= 0x10000;
+                units[n][count[n]++] = (uint16_t) (0xd800 + (codepoint >> 10));
+                units[n][count[n]++] = (uint16_t) (0xdc00 + (codepoint & 0x3ff));
+            } else {
+                units[n][count[n]++] = (uint16_t) codepoint;
+            }
+        }
+    }
+    for (size_t i = 0; i < count[0] && i < count[1]; i++) {
+        uint16_t folded[2];
+        for (size_t n = 0; n < 2; n++) {
+            const uint16_t u = units[n][i];
+            folded[n] = u;
+            if ((u >= 'A' && u <= 'Z') || (u >= 0xc0 && u <= 0xde && u != 0xd7)
+                || (u >= 0x391 && u <= 0x3a9) || (u >= 0x410 && u <= 0x42f)) {
+                folded[n] = u + 0x20;
+            } else if (u >= 0x400 && u <= 0x40f) {
+                folded[n] = u + 0x50;
+            }
+        }
+        if (folded[0] != folded[1]) {
+            return folded[0] < folded[1] ? -1 : 1;
+        }
+        if (units[0][i] != units[1][i]) {
+            return units[0][i] < units[1][i] ? -1 : 1;
+        }
+    }
+    return (count[0] > count[1]) - (count[0] < count[1]);
+}
+
+/**
+ @brief Random index label
+
+ About every eighth label repeats one of previous labels, so that ordering of equal labels is checked.
+
+ @param[out] label Label buffer of at least 4 * DIFF_LABEL_MAXLEN + 1 bytes
+ @param[in] alphabet Index of label_alphabets item, ARRAYSIZE(label_alphabets) for mixed labels
+ @param[in] entries Previous entries
+ @param[in] count Number of previous entries
+ */
+static void random_label(char *label, const size_t alphabet, const MOBIIndexEntry *entries, const size_t count) {
+    if (count && rng_below(8) == 0) {
+        strcpy(label, entries[rng_below(count)].label);
+        return;
+    }
+    unsigned char *c = (unsigned char *) label;
+    for (size_t length = 1 + rng_below(DIFF_LABEL_MAXLEN); length > 0; length--) {
+        const size_t a = alphabet < ARRAYSIZE(label_alphabets) ? alphabet : rng_below(ARRAYSIZE(label_alphabets));
+        const uint32_t codepoint = label_alphabets[a].first + (uint32_t) rng_below(label_alphabets[a].count);
+        if (codepoint < 0x80) {
+            *c++ = (unsigned char) codepoint;
+        } else if (codepoint < 0x800) {
+            *c++ = (unsigned char) (0xc0 | (codepoint >> 6));
+            *c++ = (unsigned char) (0x80 | (codepoint & 0x3f));
+        } else if (codepoint < 0x10000) {
+            *c++ = (unsigned char) (0xe0 | (codepoint >> 12));
+            *c++ = (unsigned char) (0x80 | ((codepoint >> 6) & 0x3f));
+            *c++ = (unsigned char) (0x80 | (codepoint & 0x3f));
+        } else {
+            *c++ = (unsigned char) (0xf0 | (codepoint >> 18));
+            *c++ = (unsigned char) (0x80 | ((codepoint >> 12) & 0x3f));
+            *c++ = (unsigned char) (0x80 | ((codepoint >> 6) & 0x3f));
+            *c++ = (unsigned char) (0x80 | (codepoint & 0x3f));
+        }
+    }
+    *c = '\0';
+}
+
+/**
+ @brief Check that index built with mobi_build_index() is parsed back by mobi_parse_index()
+        into the same entries, ordered by reference collation
+
+ Every entry has tag 1 holding its input position, some have tag 2 with multiple values and tag 6 with single value.
+
+ @param[in] count Number of entries
+ @param[in] alphabet Index of label_alphabets item, ARRAYSIZE(label_alphabets) for mixed labels
+ */
+static void check_index(const size_t count, const size_t alphabet) {
+    const char *routine = "mobi_build_index";
+    char input[64];
+    snprintf(input, sizeof(input), "%zu %s labels", count, alphabet < ARRAYSIZE(label_alphabets) ? label_alphabets[alphabet].name : "mixed");
+    MOBIIndexEntry *entries = calloc(count, sizeof(MOBIIndexEntry));
+    MOBIIndexTag *tags = calloc(3 * count, sizeof(MOBIIndexTag));
+    uint32_t *values = calloc((DIFF_TAG_MAXVALUES + 2) * count, sizeof(uint32_t));
+    char *labels = malloc(count * (4 * DIFF_LABEL_MAXLEN + 1));
+    bool *seen = calloc(count, sizeof(bool));
+    if (entries == NULL || tags == NULL || values == NULL || labels == NULL || seen == NULL) {
+        free(entries);
+        free(tags);
+        free(values);
+        free(labels);
+        free(seen);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < count; i++) {
+        MOBIIndexEntry *entry = &entries[i];
+        entry->label = labels + i * (4 * DIFF_LABEL_MAXLEN + 1);
+        random_label(entry->label, alphabet, entries, i);
+        entry->tags = &tags[3 * i];
+        uint32_t *value = &values[(DIFF_TAG_MAXVALUES + 2) * i];
+        entry->tags[0] = (MOBIIndexTag) { 1, 1, value };
+        *value++ = (uint32_t) i;
+        entry->tags_count = 1;
+        if (rng_below(2)) {
+            const size_t values_count = 1 + rng_below(DIFF_TAG_MAXVALUES);
+            entry->tags[entry->tags_count++] = (MOBIIndexTag) { 2, values_count, value };
+            for (size_t k = 0; k < values_count; k++) {
+                *value++ = (uint32_t) rng_below(INDX_TAGVALUE_MAX + 1);
+            }
+        }
+        if (rng_below(4) == 0) {
+            entry->tags[entry->tags_count++] = (MOBIIndexTag) { 6, 1, value };
+            *value = (uint32_t) rng_below(1000);
+        }
+    }
+    MOBIPdbRecord *records = NULL;
+    MOBI_RET ret = mobi_build_index(&records, entries, count, 0);
+    MOBIData *m = mobi_init();
+    MOBIIndx *indx = mobi_init_indx();
+    if (m == NULL || indx == NULL) {
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    if (ret == MOBI_SUCCESS) {
+        m->rec = records;
+        ret = mobi_parse_index(m, indx, 0);
+    }
+    comparisons++;
+    char details[128];
+    if (ret != MOBI_SUCCESS || indx->entries_count != count) {
+        snprintf(details, sizeof(details), "status %i, %zu entries parsed", ret, ret == MOBI_SUCCESS ? indx->entries_count : 0);
+        diff_report(routine, "mobi_parse_index", input, details);
+    } else {
+        for (size_t i = 0; i < count; i++) {
+            const MOBIIndexEntry *parsed = &indx->entries[i];
+            const size_t position = (parsed->tags_count && parsed->tags[0].tagid == 1 && parsed->tags[0].tagvalues_count == 1) ? parsed->tags[0].tagvalues[0] : count;
+            if (position >= count || seen[position]) {
+                snprintf(details, sizeof(details), "entry %zu: missing or repeated position tag", i);
+                diff_report(routine, "mobi_parse_index", input, details);
+                break;
+            }
+            seen[position] = true;
+            const MOBIIndexEntry *entry = &entries[position];
+            bool equal = strcmp(parsed->label, entry->label) == 0 && parsed->tags_count == entry->tags_count;
+            for (size_t t = 0; equal && t < entry->tags_count; t++) {
+                equal = parsed->tags[t].tagid == entry->tags[t].tagid
+                    && parsed->tags[t].tagvalues_count == entry->tags[t].tagvalues_count
+                    && memcmp(parsed->tags[t].tagvalues, entry->tags[t].tagvalues, entry->tags[t].tagvalues_count * sizeof(uint32_t)) == 0;
+            }
+            if (!equal) {
+                snprintf(details, sizeof(details), "entry %zu: differs from input entry %zu", i, position);
+                diff_report(routine, "mobi_parse_index", input, details);
+                break;
+            }
+            if (i > 0) {
+                /* equal labels keep input order */
+                const MOBIIndexEntry *previous = &indx->entries[i - 1];
+                const int order = ref_label_compare(previous->label, parsed->label);
+                if (order > 0 || (order == 0 && previous->tags[0].tagvalues[0] > position)) {
+                    snprintf(details, sizeof(details), "entry %zu: wrong order", i);
+                    diff_report(routine, "mobi_parse_index", input, details);
+                    break;
+                }
+            }
+        }
+    }
+    mobi_free_indx(indx);
+    /* records are freed with document */
+    mobi_free(m);
+    free(entries);
+    free(tags);
+    free(values);
+    free(labels);
+    free(seen);
+}
+
+/**
+ @brief Check routines on synthetic inputs
+
+ @param[in] iterations Number of inputs per routine
+ */
+static void check_synthetic(const size_t iterations) {
+    unsigned char *data = malloc(DIFF_SYNTH_MAXLEN);
+    unsigned char *compressed = malloc(2 * DIFF_SYNTH_MAXLEN);
+    if (data == NULL || compressed == NULL) {
+        free(data);
+        free(compressed);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    for (size_t n = 0; n < iterations; n++) {
+        const size_t size = 1 + rng_below(DIFF_SYNTH_MAXLEN);
+        random_markup(data, size);
+        /* mix of markup and binary data */
+        if (n % 4 == 0) {
+            for (size_t i = rng_below(size); i < size; i += 1 + rng_below(64)) {
+                data[i] = (unsigned char) rng_next();
+            }
+        }
+        char input[64];
+        snprintf(input, sizeof(input), "synthetic input %zu", n);
+        /* round trip of library compressor */
+        size_t compressed_size = 2 * DIFF_SYNTH_MAXLEN;
+        if (mobi_compress_lz77(compressed, &compressed_size, data, size) == MOBI_SUCCESS) {
+            check_record(input, compressed, compressed_size, NULL);
+            /* random corruption */
+            const size_t flips = rng_below(4);
+            for (size_t i = 0; i < flips; i++) {
+                compressed[rng_below(compressed_size)] ^= (unsigned char) (1 << rng_below(8));
+            }
+            check_record(input, compressed, compressed_size, NULL);
+        }
+        /* raw data as lz77 stream */
+        check_record(input, data, size, NULL);
+        check_cp1252(input, data, size);
+        check_utf8(input, data, size);
+        check_attrvalue(input, data, size, T_HTML, "kindle:");
+        check_attrvalue(input, data, size, T_CSS, "kindle:");
+        check_attrvalue(input, data, size, T_HTML, "filepos");
+        check_list_synthetic(data, size);
+        random_utf8(data, size);
+        snprintf(input, sizeof(input), "synthetic utf-8 %zu", n);
+        check_utf8(input, data, size);
+    }
+    /* every single cp1252 character */
+    for (unsigned c = 1; c < 256; c++) {
+        const unsigned char byte = (unsigned char) c;
+        char input[32];
+        snprintf(input, sizeof(input), "character 0x%02x", c);
+        check_cp1252(input, &byte, 1);
+    }
+    /* every two byte sequence, three and four byte sequences around continuation range */
+    static const unsigned char tail[] = { 0x41, 0x80, 0xbf, 0xc2 };
+    for (unsigned c = 0x80; c < 0x100; c++) {
+        for (unsigned d = 0; d < 0x100; d++) {
+            unsigned char seq[4] = { (unsigned char) c, (unsigned char) d, 0, 0 };
+            char input[48];
+            snprintf(input, sizeof(input), "sequence 0x%02x 0x%02x", c, d);
+            check_utf8(input, seq, 2);
+            if (c < 0xe0 || c > 0xf7) {
+                continue;
+            }
+            for (size_t t = 0; t < ARRAYSIZE(tail) * ARRAYSIZE(tail); t++) {
+                seq[2] = tail[t / ARRAYSIZE(tail)];
+                seq[3] = tail[t % ARRAYSIZE(tail)];
+                check_utf8(input, seq, c < 0xf0 ? 3 : 4);
+            }
+        }
+    }
+#ifdef USE_ENCRYPTION
+    unsigned char *records = malloc(DIFF_DECRYPT_MAXCOUNT * DIFF_SYNTH_MAXLEN);
+    if (records == NULL) {
+        free(data);
+        free(compressed);
+        fprintf(stderr, "Memory allocation failed\n");
+        exit(1);
+    }
+    /* buffers decrypted together, fewer iterations as each covers many buffers */
+    for (size_t n = 0; n < iterations / 20 + 1; n++) {
+        const unsigned char *in[DIFF_DECRYPT_MAXCOUNT];
+        size_t length[DIFF_DECRYPT_MAXCOUNT];
+        const size_t count = 1 + rng_below(DIFF_DECRYPT_MAXCOUNT);
+        random_records(records, in, length, count);
+        unsigned char key[DIFF_KEYSIZE];
+        for (size_t i = 0; i < DIFF_KEYSIZE; i++) {
+            key[i] = (unsigned char) rng_next();
+        }
+        char input[64];
+        snprintf(input, sizeof(input), "synthetic records %zu", n);
+        check_decrypt(input, in, length, count, key);
+    }
+    free(records);
+#endif
+    free(data);
+    free(compressed);
+}
+
+/**
+ @brief Main
+ */
+int main(int argc, char *argv[]) {
+    size_t iterations = DIFF_ITERATIONS;
+    size_t bench_records = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "b:n:s:")) != -1) {
+        switch (opt) {
+            case 'b':
+                bench_records = strtoul(optarg, NULL, 10);
+                break;
+            case 'n':
+                iterations = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                rng_state = strtoull(optarg, NULL, 10) | 1;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-s seed] [-n iterations] sample_file...\n       %s -b records\n", argv[0], argv[0]);
+                return 1;
+        }
+    }
+    if (bench_records) {
+#ifdef USE_ENCRYPTION
+        return bench_decrypt(bench_records);
+#else
+        fprintf(stderr, "Library built without encryption support\n");
+        return 1;
+#endif
+    }
+    for (int i = optind; i < argc; i++) {
+        MOBI_RET ret = check_sample(argv[i]);
+        if (ret != MOBI_SUCCESS) {
+            fprintf(stderr, "%s: could not be checked (%i)\n", argv[i], ret);
+            failures++;
+        }
+    }
+    check_synthetic(iterations);
+    for (size_t alphabet = 0; alphabet <= ARRAYSIZE(label_alphabets); alphabet++) {
+        check_index(DIFF_INDEX_ENTRIES, alphabet);
+    }
+    check_index(DIFF_INDEX_LARGE, ARRAYSIZE(label_alphabets));
+    printf("%zu comparisons, %zu divergences\n", comparisons, failures);
+    return failures ? 1 : 0;
+}
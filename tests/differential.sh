@@ -0,0 +1,14 @@
+#!/bin/bash
+# differential.sh
+# Copyright (c) 2014 Bartek Fabiszewski
+# http://www.fabiszewski.net
+#
+# This file is part of libmobi.
+# Licensed under LGPL, either version 3, or any later.
+# See <http://www.gnu.org/licenses/>
+
+# Check that internal routines give the same results as their reference implementations.
+
+skip=77
+[[ -x ./differential ]] || { echo "Missing differential"; exit $skip; }
+exec ./differential "${srcdir:-.}"/samples/*.mobi
@@ -0,0 +1,16 @@
+#!/bin/bash
+# perf_check.sh
+# Copyright (c) 2014 Bartek Fabiszewski
+# http://www.fabiszewski.net
+#
+# This file is part of libmobi.
+# Licensed under LGPL, either version 3, or any later.
+# See <http://www.gnu.org/licenses/>
+
+# Check that inputs which used to be pathologically slow are parsed within their time budgets.
+# Budgets are relative to the time taken by a reference sample, so they need no scaling
+# for slow machines or sanitizer builds. PERF_BUDGET_SCALE may still be used to relax them.
+
+skip=77
+[[ -x ./perf_fuzz ]] || { echo "Missing perf_fuzz"; exit $skip; }
+exec ./perf_fuzz -check "${srcdir:-.}/slow/budgets.txt" "${srcdir:-.}/samples/windows-1252.mobi"
@@ -0,0 +1,538 @@
+/** @file perf_fuzz.c
+ *
+ * @brief Performance fuzzer of document loading and parsing
+ *
+ * Looks for inputs which make mobi_load_file() and mobi_parse_rawml()
+ * do disproportionate amount of work, like quadratic list walks
+ * or deep huffman recursion. Cost of input is number of instructions
+ * (CPU time if hardware counters are not available) per input byte.
+ * Size used for the ratio is increased by a constant, so that fixed cost
+ * of loading a document doesn't make tiny inputs win.
+ *
+ * Built with -DMOBI_LIBFUZZER it provides only LLVMFuzzerTestOneInput(),
+ * to be used with libFuzzer, e.g. with -fsanitize=fuzzer and -timeout option.
+ * Otherwise it has its own driver:
+ *
+ *   perf_fuzz -fuzz [-t seconds] [-l max_length] [-s seed] [-o dir] seed_file...
+ *     mutates seed files, keeps inputs with highest cost per byte
+ *     and saves each new worst input to dir
+ *
+ *   perf_fuzz -check list reference
+ *     runs regression inputs listed in file, one "file budget" pair per line,
+ *     file paths relative to list location, fails if any input exceeds its budget;
+ *     budget is a multiple of the time taken by the reference document,
+ *     measured in the same run, so that it holds on slow machines and in
+ *     sanitizer or debug builds; budgets may be further scaled
+ *     with PERF_BUDGET_SCALE environment variable
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <mobi.h>
+
+/**
+ @brief Load and parse document from memory
+ @param[in] data Document data
+ @param[in] size Document size
+ */
+static void fuzz_run(const uint8_t *data, const size_t size) {
+    if (size == 0) {
+        return;
+    }
+    FILE *file = fmemopen((void *) data, size, "rb");
+    if (file == NULL) {
+        return;
+    }
+    MOBIData *m = mobi_init();
+    if (m && mobi_load_file(m, file) == MOBI_SUCCESS) {
+        MOBIRawml *rawml = mobi_init_rawml(m);
+        if (rawml) {
+            mobi_parse_rawml(rawml, m);
+            mobi_free_rawml(rawml);
+        }
+    }
+    mobi_free(m);
+    fclose(file);
+}
+
+/**
+ @brief libFuzzer entry point
+ */
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    fuzz_run(data, size);
+    return 0;
+}
+
+#ifndef MOBI_LIBFUZZER
+
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include "perfcount.h"
+
+#define FUZZ_CORPUS_MAX 64 /**< Number of kept inputs */
+#define FUZZ_TIMEOUT 10 /**< Seconds after which input is saved as hang */
+#define FUZZ_MAX_LENGTH (256 * 1024) /**< Default max input length */
+#define FUZZ_SIZE_OFFSET 4096 /**< Added to input size when computing cost per byte, so that fixed setup cost doesn't favour tiny inputs */
+
+/**
+ @brief Fuzzed input
+ */
+typedef struct {
+    uint8_t *data; /**< Input data */
+    size_t size; /**< Input size */
+    double score; /**< Cost per byte */
+} FuzzInput;
+
+static PerfCounters fuzz_counters;
+static bool fuzz_use_counters = false;
+static uint64_t fuzz_random_state = 0x2545f4914f6cdd1dULL;
+static const char *fuzz_outdir = ".";
+static const uint8_t *fuzz_current_data = NULL;
+static size_t fuzz_current_size = 0;
+
+/**
+ @brief Pseudo random number, xorshift64
+ @return Random value
+ */
+static uint64_t fuzz_random(void) {
+    fuzz_random_state ^= fuzz_random_state << 13;
+    fuzz_random_state ^= fuzz_random_state >> 7;
+    fuzz_random_state ^= fuzz_random_state << 17;
+    return fuzz_random_state;
+}
+
+/**
+ @brief Random value below limit
+ @param[in] limit Limit, greater than zero
+ @return Random value
+ */
+static size_t fuzz_below(const size_t limit) {
+    return (size_t) (fuzz_random() % limit);
+}
+
+/**
+ @brief CPU time of process
+ @return Time in seconds
+ */
+static double fuzz_cputime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ @brief Wall time
+ @return Time in seconds
+ */
+static double fuzz_walltime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+}
+
+/**
+ @brief Write input to file
+ @param[in] prefix File name prefix
+ @param[in] data Input data
+ @param[in] size Input size
+ @param[in] score Input score
+ */
+static void fuzz_save(const char *prefix, const uint8_t *data, const size_t size, const double score) {
+    char path[FILENAME_MAX];
+    snprintf(path, sizeof(path), "%s/%s-%.0f-%zu.mobi", fuzz_outdir, prefix, score, size);
+    FILE *file = fopen(path, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not save %s: %s\n", path, strerror(errno));
+        return;
+    }
+    fwrite(data, 1, size, file);
+    fclose(file);
+    printf("saved %s\n", path);
+    fflush(stdout);
+}
+
+/**
+ @brief Save input which exceeded time limit or crashed and exit
+ @param[in] sig Signal number
+ */
+static void fuzz_abort(int sig) {
+    /* not async-signal-safe, but process is going to exit anyway */
+    fuzz_save(sig == SIGALRM ? "hang" : "crash", fuzz_current_data, fuzz_current_size, 0);
+    _exit(EXIT_FAILURE);
+}
+
+/**
+ @brief Run input and measure its cost
+ @param[in] data Input data
+ @param[in] size Input size
+ @return Number of instructions, or CPU time in nanoseconds if counters are not available
+ */
+static double fuzz_measure(const uint8_t *data, const size_t size) {
+    fuzz_current_data = data;
+    fuzz_current_size = size;
+    alarm(FUZZ_TIMEOUT);
+    double cost;
+    if (fuzz_use_counters) {
+        uint64_t start[PERF_COUNTERS_COUNT];
+        uint64_t end[PERF_COUNTERS_COUNT];
+        perf_counters_read(&fuzz_counters, start);
+        fuzz_run(data, size);
+        perf_counters_read(&fuzz_counters, end);
+        cost = (double) (end[PERF_INSTRUCTIONS] - start[PERF_INSTRUCTIONS]);
+    } else {
+        const double start = fuzz_cputime();
+        fuzz_run(data, size);
+        cost = (fuzz_cputime() - start) * 1e9;
+    }
+    alarm(0);
+    return cost;
+}
+
+/**
+ @brief Read whole file
+ @param[in] path File path
+ @param[out] size File size, truncated to max_length
+ @param[in] max_length Max number of bytes read
+ @return File data, NULL on failure
+ */
+static uint8_t * fuzz_read(const char *path, size_t *size, const size_t max_length) {
+    FILE *file = fopen(path, "rb");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    uint8_t *data = malloc(max_length);
+    if (data == NULL) {
+        fclose(file);
+        return NULL;
+    }
+    *size = fread(data, 1, max_length, file);
+    fclose(file);
+    return data;
+}
+
+/**
+ @brief Mutate input in place
+ @param[in,out] data Input data, allocated with max_length bytes
+ @param[in,out] size Input size
+ @param[in] max_length Max input size
+ */
+static void fuzz_mutate(uint8_t *data, size_t *size, const size_t max_length) {
+    static const uint32_t interesting[] = {
+        0, 1, 2, 0x7f, 0x80, 0xff, 0x100, 0x7fff, 0x8000, 0xffff,
+        0x10000, 0x7fffffff, 0x80000000, 0xfffffffe, 0xffffffff
+    };
+    const size_t count = 1 + fuzz_below(8);
+    for (size_t i = 0; i < count && *size > 0; i++) {
+        const size_t pos = fuzz_below(*size);
+        switch (fuzz_below(7)) {
+            case 0:
+                /* flip bit */
+                data[pos] ^= (uint8_t) (1 << fuzz_below(8));
+                break;
+            case 1:
+                /* random byte */
+                data[pos] = (uint8_t) fuzz_random();
+                break;
+            case 2: {
+                /* interesting big-endian value, as used in headers and indices */
+                const uint32_t value = interesting[fuzz_below(sizeof(interesting) / sizeof(*interesting))];
+                const size_t width = (size_t) 1 << fuzz_below(3);
+                for (size_t b = 0; b < width && pos + b < *size; b++) {
+                    data[pos + b] = (uint8_t) (value >> (8 * (width - b - 1)));
+                }
+                break;
+            }
+            case 3: {
+                /* copy chunk over other place */
+                const size_t from = fuzz_below(*size);
+                size_t length = 1 + fuzz_below(64);
+                if (from + length > *size) {
+                    length = *size - from;
+                }
+                if (pos + length > *size) {
+                    length = *size - pos;
+                }
+                memmove(data + pos, data + from, length);
+                break;
+            }
+            case 4: {
+                /* insert copy of chunk, repeating markup and tags */
+                const size_t from = fuzz_below(*size);
+                size_t length = 1 + fuzz_below(256);
+                if (from + length > *size) {
+                    length = *size - from;
+                }
+                if (*size + length > max_length) {
+                    break;
+                }
+                uint8_t chunk[256];
+                memcpy(chunk, data + from, length);
+                memmove(data + pos + length, data + pos, *size - pos);
+                memcpy(data + pos, chunk, length);
+                *size += length;
+                break;
+            }
+            case 5: {
+                /* erase chunk */
+                size_t length = 1 + fuzz_below(256);
+                if (pos + length > *size) {
+                    length = *size - pos;
+                }
+                if (length < *size) {
+                    memmove(data + pos, data + pos + length, *size - pos - length);
+                    *size -= length;
+                }
+                break;
+            }
+            default:
+                /* truncate */
+                if (pos > 0) {
+                    *size = pos;
+                }
+                break;
+        }
+    }
+}
+
+/**
+ @brief Fuzz loop
+ @param[in] seeds Seed file paths
+ @param[in] seeds_count Number of seed files
+ @param[in] seconds Run time
+ @param[in] max_length Max input length
+ @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int fuzz_loop(char **seeds, const size_t seeds_count, const double seconds, const size_t max_length) {
+    FuzzInput corpus[FUZZ_CORPUS_MAX];
+    size_t corpus_count = 0;
+    double best = 0;
+    for (size_t i = 0; i < seeds_count && corpus_count < FUZZ_CORPUS_MAX; i++) {
+        size_t size;
+        uint8_t *data = fuzz_read(seeds[i], &size, max_length);
+        if (data == NULL || size == 0) {
+            free(data);
+            continue;
+        }
+        corpus[corpus_count].data = data;
+        corpus[corpus_count].size = size;
+        corpus[corpus_count].score = fuzz_measure(data, size) / (double) (size + FUZZ_SIZE_OFFSET);
+        if (corpus[corpus_count].score > best) {
+            best = corpus[corpus_count].score;
+        }
+        corpus_count++;
+    }
+    if (corpus_count == 0) {
+        fprintf(stderr, "No seed inputs\n");
+        return EXIT_FAILURE;
+    }
+    printf("%zu seeds, best %.1f %s per byte\n", corpus_count, best, fuzz_use_counters ? "instructions" : "ns");
+    uint8_t *input = malloc(max_length);
+    if (input == NULL) {
+        return EXIT_FAILURE;
+    }
+    const double end = fuzz_walltime() + seconds;
+    size_t runs = 0;
+    while (fuzz_walltime() < end) {
+        /* prefer costly inputs: best of two random picks */
+        size_t pick = fuzz_below(corpus_count);
+        const size_t other = fuzz_below(corpus_count);
+        if (corpus[other].score > corpus[pick].score) {
+            pick = other;
+        }
+        size_t size = corpus[pick].size;
+        memcpy(input, corpus[pick].data, size);
+        fuzz_mutate(input, &size, max_length);
+        const double score = fuzz_measure(input, size) / (double) (size + FUZZ_SIZE_OFFSET);
+        runs++;
+        if (score > best * 1.1) {
+            /* noticeably worse than anything seen */
+            best = score;
+            fuzz_save("slow", input, size, score);
+        }
+        size_t worst = 0;
+        for (size_t i = 1; i < corpus_count; i++) {
+            if (corpus[i].score < corpus[worst].score) {
+                worst = i;
+            }
+        }
+        if (corpus_count < FUZZ_CORPUS_MAX || score > corpus[worst].score) {
+            uint8_t *data = malloc(size);
+            if (data == NULL) {
+                continue;
+            }
+            memcpy(data, input, size);
+            size_t slot = worst;
+            if (corpus_count < FUZZ_CORPUS_MAX) {
+                slot = corpus_count++;
+            } else {
+                free(corpus[slot].data);
+            }
+            corpus[slot].data = data;
+            corpus[slot].size = size;
+            corpus[slot].score = score;
+        }
+    }
+    printf("%zu runs, best %.1f %s per byte\n", runs, best, fuzz_use_counters ? "instructions" : "ns");
+    for (size_t i = 0; i < corpus_count; i++) {
+        free(corpus[i].data);
+    }
+    free(input);
+    return EXIT_SUCCESS;
+}
+
+/**
+ @brief Best wall time of several runs of input, so that scheduling noise doesn't fail the check
+ @param[in] data Input data
+ @param[in] size Input size
+ @param[in] runs Number of runs
+ @return Time in milliseconds
+ */
+static double fuzz_best_time(const uint8_t *data, const size_t size, const size_t runs) {
+    double best = 0;
+    for (size_t i = 0; i < runs; i++) {
+        const double start = fuzz_walltime();
+        fuzz_run(data, size);
+        const double time = (fuzz_walltime() - start) * 1000;
+        if (i == 0 || time < best) {
+            best = time;
+        }
+    }
+    return best;
+}
+
+/**
+ @brief Run regression inputs and check their time budgets
+ @param[in] list Path to list of inputs with budgets
+ @param[in] reference Path to document which time is the budget unit
+ @return EXIT_SUCCESS or EXIT_FAILURE
+ */
+static int fuzz_check(const char *list, const char *reference) {
+    size_t size;
+    uint8_t *data = fuzz_read(reference, &size, FUZZ_MAX_LENGTH);
+    if (data == NULL) {
+        return EXIT_FAILURE;
+    }
+    const double unit = fuzz_best_time(data, size, 5);
+    free(data);
+    printf("%-40s %10.3f ms (budget unit)\n", reference, unit);
+    FILE *file = fopen(list, "r");
+    if (file == NULL) {
+        fprintf(stderr, "Could not open %s: %s\n", list, strerror(errno));
+        return EXIT_FAILURE;
+    }
+    double scale = 1;
+    const char *scale_env = getenv("PERF_BUDGET_SCALE");
+    if (scale_env && strtod(scale_env, NULL) > 0) {
+        scale = strtod(scale_env, NULL);
+    }
+    char dir[FILENAME_MAX];
+    snprintf(dir, sizeof(dir), "%s", list);
+    char *slash = strrchr(dir, '/');
+    if (slash) {
+        *slash = '\0';
+    } else {
+        strcpy(dir, ".");
+    }
+    int ret = EXIT_SUCCESS;
+    char line[FILENAME_MAX];
+    while (fgets(line, sizeof(line), file)) {
+        char name[FILENAME_MAX];
+        double budget;
+        if (line[0] == '#' || sscanf(line, "%s %lf", name, &budget) != 2) {
+            continue;
+        }
+        char path[2 * FILENAME_MAX];
+        snprintf(path, sizeof(path), "%s/%s", dir, name);
+        data = fuzz_read(path, &size, FUZZ_MAX_LENGTH);
+        if (data == NULL) {
+            ret = EXIT_FAILURE;
+            continue;
+        }
+        const double best = fuzz_best_time(data, size, 3);
+        free(data);
+        const double limit = budget * scale * unit;
+        const bool passed = best <= limit;
+        printf("%-40s %10.3f ms (%.1f units, budget %.0f, %.3f ms) %s\n", name, best, best / unit, budget * scale, limit, passed ? "ok" : "FAILED");
+        if (!passed) {
+            ret = EXIT_FAILURE;
+        }
+    }
+    fclose(file);
+    return ret;
+}
+
+/**
+ @brief Print usage info
+ @param[in] progname Executed program name
+ */
+static void usage(const char *progname) {
+    printf("usage: %s -fuzz [-t seconds] [-l max_length] [-s seed] [-o dir] seed_file...\n", progname);
+    printf("       %s -check list reference\n", progname);
+    exit(EXIT_FAILURE);
+}
+
+/**
+ @brief Main
+ */
+int main(int argc, char *argv[]) {
+    if (argc < 3) {
+        usage(argv[0]);
+    }
+    if (strcmp(argv[1], "-check") == 0) {
+        if (argc != 4) {
+            usage(argv[0]);
+        }
+        return fuzz_check(argv[2], argv[3]);
+    }
+    if (strcmp(argv[1], "-fuzz") != 0) {
+        usage(argv[0]);
+    }
+    double seconds = 60;
+    size_t max_length = FUZZ_MAX_LENGTH;
+    int i = 2;
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-t") == 0) {
+            seconds = strtod(argv[i + 1], NULL);
+        } else if (strcmp(argv[i], "-l") == 0) {
+            max_length = (size_t) strtoul(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "-s") == 0) {
+            fuzz_random_state = strtoull(argv[i + 1], NULL, 10) | 1;
+        } else if (strcmp(argv[i], "-o") == 0) {
+            fuzz_outdir = argv[i + 1];
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (i >= argc || max_length == 0) {
+        usage(argv[0]);
+    }
+    const char *error;
+    fuzz_use_counters = perf_counters_open(&fuzz_counters, &error)
+        && perf_counter_available(&fuzz_counters, PERF_INSTRUCTIONS);
+    if (!fuzz_use_counters) {
+        printf("Instruction counter not available (%s), using CPU time\n", error);
+    }
+    /* with sanitizers use ASAN_OPTIONS=abort_on_error=1, so that crashing input is saved */
+    signal(SIGALRM, fuzz_abort);
+    signal(SIGABRT, fuzz_abort);
+    signal(SIGSEGV, fuzz_abort);
+    signal(SIGBUS, fuzz_abort);
+    signal(SIGFPE, fuzz_abort);
+    const int ret = fuzz_loop(argv + i, (size_t) (argc - i), seconds, max_length);
+    perf_counters_close(&fuzz_counters);
+    return ret;
+}
+
+#endif
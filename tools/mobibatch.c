@@ -0,0 +1,307 @@
+/** @file mobibatch.c
+ *
+ * @brief mobibatch
+ *
+ * @example mobibatch.c
+ * Compares fresh and reused structures in batch processing
+ *
+ * Loads, parses and walks all given documents in passes, once creating
+ * new MOBIData and MOBIRawml structures for each file, and once reusing
+ * them with mobi_reset() and mobi_rawml_reset() and with pooled scratch
+ * buffers. Median pass times and allocation counts are printed.
+ * Allocations are counted if library is configured with --enable-alloc-stats.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#ifdef _WIN32
+# include <windows.h>
+#endif
+#include <mobi.h>
+
+/* return codes */
+#define ERROR 1
+#define SUCCESS 0
+
+/* largest scratch buffer kept in pool */
+#define POOL_MAX_SIZE (64 * 1024 * 1024)
+
+/**
+ @brief Measurements of single pass
+ */
+typedef struct {
+    double time; /**< Wall time in seconds */
+    double allocs; /**< Number of allocations */
+    double bytes; /**< Number of allocated bytes */
+} Pass;
+
+/**
+ @brief Get monotonic time
+ @return Time in seconds
+ */
+static double now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/**
+ @brief Consume parts data, so that parsing can't be optimized out
+ @param[in] rawml Parsed document
+ @return Checksum
+ */
+static uint64_t walk(const MOBIRawml *rawml) {
+    uint64_t sum = 0;
+    const MOBIPart *lists[] = { rawml->markup, rawml->flow, rawml->resources };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        for (const MOBIPart *part = lists[i]; part != NULL; part = part->next) {
+            for (size_t j = 0; j < part->size; j += 64) {
+                sum = sum * 31 + part->data[j];
+            }
+            sum += part->size;
+        }
+    }
+    return sum;
+}
+
+/**
+ @brief Load, parse and walk all files with new structures for each file
+ @param[in] paths File paths
+ @param[in] count Number of files
+ @param[in,out] sum Checksum of all files
+ @return SUCCESS or ERROR
+ */
+static int pass_fresh(char **paths, const int count, uint64_t *sum) {
+    for (int i = 0; i < count; i++) {
+        MOBIData *m = mobi_init();
+        if (m == NULL) {
+            return ERROR;
+        }
+        if (mobi_load_filename(m, paths[i]) != MOBI_SUCCESS) {
+            printf("Error loading document: %s\n", paths[i]);
+            mobi_free(m);
+            return ERROR;
+        }
+        MOBIRawml *rawml = mobi_init_rawml(m);
+        if (rawml == NULL || mobi_parse_rawml(rawml, m) != MOBI_SUCCESS) {
+            printf("Error parsing document: %s\n", paths[i]);
+            mobi_free_rawml(rawml);
+            mobi_free(m);
+            return ERROR;
+        }
+        *sum += walk(rawml);
+        mobi_free_rawml(rawml);
+        mobi_free(m);
+    }
+    return SUCCESS;
+}
+
+/**
+ @brief Load, parse and walk all files reusing structures
+ @param[in,out] m MOBIData structure kept between passes
+ @param[in,out] rawml MOBIRawml structure kept between passes
+ @param[in] paths File paths
+ @param[in] count Number of files
+ @param[in,out] sum Checksum of all files
+ @return SUCCESS or ERROR
+ */
+static int pass_reused(MOBIData *m, MOBIRawml *rawml, char **paths, const int count, uint64_t *sum) {
+    for (int i = 0; i < count; i++) {
+        if (mobi_load_filename(m, paths[i]) != MOBI_SUCCESS) {
+            printf("Error loading document: %s\n", paths[i]);
+            mobi_reset(m);
+            return ERROR;
+        }
+        mobi_rawml_reset(rawml, m);
+        if (mobi_parse_rawml(rawml, m) != MOBI_SUCCESS) {
+            printf("Error parsing document: %s\n", paths[i]);
+            mobi_rawml_reset(rawml, m);
+            mobi_reset(m);
+            return ERROR;
+        }
+        *sum += walk(rawml);
+        /* resources point to records data, so rawml goes first */
+        mobi_rawml_reset(rawml, m);
+        mobi_reset(m);
+    }
+    return SUCCESS;
+}
+
+/**
+ @brief Start measuring pass
+ @param[out] pass Pass measurements
+ @param[out] stats Allocation counters at start
+ */
+static void pass_start(Pass *pass, MOBIAllocStats *stats) {
+    mobi_get_alloc_stats(stats);
+    pass->time = now();
+}
+
+/**
+ @brief Stop measuring pass
+ @param[in,out] pass Pass measurements
+ @param[in] start Allocation counters at start
+ */
+static void pass_stop(Pass *pass, const MOBIAllocStats *start) {
+    pass->time = now() - pass->time;
+    MOBIAllocStats stats;
+    mobi_get_alloc_stats(&stats);
+    pass->allocs = (double) (stats.allocs + stats.reallocs - start->allocs - start->reallocs);
+    pass->bytes = (double) (stats.bytes - start->bytes);
+}
+
+/**
+ @brief Compare doubles for qsort()
+ */
+static int compare(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ @brief Median of values, sorts values in place
+ @param[in,out] values Values
+ @param[in] count Number of values
+ @return Median
+ */
+static double median(double *values, const size_t count) {
+    qsort(values, count, sizeof(*values), compare);
+    return (count % 2) ? values[count / 2] : (values[count / 2 - 1] + values[count / 2]) / 2;
+}
+
+/**
+ @brief Print medians of passes
+ @param[in] name Variant name
+ @param[in,out] passes Pass measurements
+ @param[in] count Number of passes
+ @param[in] files Number of files in each pass
+ @param[in] have_allocs True if allocation counts are available
+ */
+static void print_passes(const char *name, Pass *passes, const size_t count, const int files, const bool have_allocs) {
+    double *values = malloc(count * sizeof(*values));
+    if (values == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < count; i++) {
+        values[i] = passes[i].time;
+    }
+    const double time = median(values, count);
+    printf("%-8s %12.3f %12.3f", name, time * 1000, time * 1000 / files);
+    if (have_allocs) {
+        for (size_t i = 0; i < count; i++) {
+            values[i] = passes[i].allocs;
+        }
+        const double allocs = median(values, count);
+        for (size_t i = 0; i < count; i++) {
+            values[i] = passes[i].bytes;
+        }
+        const double bytes = median(values, count);
+        printf(" %12.0f %14.0f", allocs, bytes);
+    }
+    printf("\n");
+    free(values);
+}
+
+/**
+ @brief Main
+ */
+int main(int argc, char *argv[]) {
+    size_t iterations = 10;
+    int first = 1;
+    if (first + 1 < argc && strcmp(argv[first], "-n") == 0) {
+        const long n = strtol(argv[first + 1], NULL, 10);
+        if (n < 1) {
+            printf("Invalid number of passes: %s\n", argv[first + 1]);
+            return ERROR;
+        }
+        iterations = (size_t) n;
+        first += 2;
+    }
+    if (first >= argc) {
+        printf("usage: %s [-n passes] filename...\n", argv[0]);
+        return ERROR;
+    }
+    char **paths = argv + first;
+    const int count = argc - first;
+    MOBIAllocStats probe;
+    const bool have_allocs = (mobi_get_alloc_stats(&probe) == MOBI_SUCCESS);
+    Pass *fresh = calloc(iterations, sizeof(Pass));
+    Pass *reused = calloc(iterations, sizeof(Pass));
+    MOBIData *m = mobi_init();
+    MOBIRawml *rawml = m ? mobi_init_rawml(m) : NULL;
+    if (fresh == NULL || reused == NULL || rawml == NULL) {
+        printf("Memory allocation failed\n");
+        free(fresh);
+        free(reused);
+        mobi_free_rawml(rawml);
+        mobi_free(m);
+        return ERROR;
+    }
+    uint64_t sum_fresh = 0;
+    uint64_t sum_reused = 0;
+    /* warmup fills spare records and scratch pool */
+    int ret = pass_fresh(paths, count, &sum_fresh);
+    if (ret == SUCCESS) {
+        mobi_set_scratch_pool(POOL_MAX_SIZE);
+        ret = pass_reused(m, rawml, paths, count, &sum_reused);
+        mobi_set_scratch_pool(0);
+    }
+    if (ret == SUCCESS && sum_fresh != sum_reused) {
+        printf("Checksum mismatch between fresh and reused structures\n");
+        ret = ERROR;
+    }
+    /* alternate variants, so that both see the same system state */
+    for (size_t i = 0; ret == SUCCESS && i < iterations; i++) {
+        MOBIAllocStats stats;
+        pass_start(&fresh[i], &stats);
+        ret = pass_fresh(paths, count, &sum_fresh);
+        pass_stop(&fresh[i], &stats);
+        if (ret != SUCCESS) {
+            break;
+        }
+        mobi_set_scratch_pool(POOL_MAX_SIZE);
+        pass_start(&reused[i], &stats);
+        ret = pass_reused(m, rawml, paths, count, &sum_reused);
+        pass_stop(&reused[i], &stats);
+        mobi_set_scratch_pool(0);
+    }
+    if (ret == SUCCESS) {
+        printf("Batch: %i files, %zu passes after warmup\n", count, iterations);
+        printf("%-8s %12s %12s", "variant", "pass ms", "file ms");
+        if (have_allocs) {
+            printf(" %12s %14s", "allocs", "alloc bytes");
+        }
+        printf("\n");
+        print_passes("fresh", fresh, iterations, count, have_allocs);
+        print_passes("reused", reused, iterations, count, have_allocs);
+        if (!have_allocs) {
+            printf("Allocation counts not available, configure library with --enable-alloc-stats\n");
+        }
+    }
+    free(fresh);
+    free(reused);
+    mobi_free_rawml(rawml);
+    mobi_free(m);
+    return ret;
+}
@@ -0,0 +1,297 @@
+/** @file mobibench.cpp
+ *
+ * @brief mobibench
+ *
+ * @example mobibench.cpp
+ * Compares libmobi C API with C++ wrappers from mobi.hpp
+ *
+ * Loads, parses and walks all parts of given documents, once with plain
+ * C calls and once with mobi.hpp wrappers, and prints median times.
+ * Both variants should take the same time, wrappers add no copies.
+ * With --perf hardware counters of both variants are printed too (Linux).
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <mobi.hpp>
+#include "perfcount.h"
+
+/* return codes */
+#define ERROR 1
+#define SUCCESS 0
+
+namespace {
+
+    using Clock = std::chrono::steady_clock;
+
+    /* hardware counters, used if opened */
+    PerfCounters counters;
+    bool use_perf = false;
+
+    /**
+     @brief Single measurement
+     */
+    struct Sample {
+        double ms; /**< Wall time in milliseconds */
+        uint64_t counters[PERF_COUNTERS_COUNT]; /**< Hardware counter deltas */
+    };
+
+    /**
+     @brief Consume part data, so that walking parts can't be optimized out
+     */
+    inline uint64_t checksum(uint64_t sum, const unsigned char *data, size_t size) {
+        /* sample bytes, touching every byte would dwarf the iteration itself */
+        for (size_t i = 0; i < size; i += 64) {
+            sum = sum * 31 + data[i];
+        }
+        return sum + size;
+    }
+
+    /**
+     @brief Walk parts with C API
+     */
+    uint64_t walk_c(const MOBIRawml *rawml) {
+        uint64_t sum = 0;
+        const MOBIPart *lists[] = { rawml->markup, rawml->flow, rawml->resources };
+        for (const MOBIPart *part : lists) {
+            while (part != NULL) {
+                sum = checksum(sum, part->data, part->size);
+                part = part->next;
+            }
+        }
+        return sum;
+    }
+
+    /**
+     @brief Walk parts with C++ wrappers
+     */
+    uint64_t walk_cpp(const mobi::Rawml &rawml) {
+        uint64_t sum = 0;
+        for (const mobi::PartRange &range : { rawml.markup(), rawml.flow(), rawml.resources() }) {
+            for (const mobi::Part part : range) {
+                const std::string_view data = part.data();
+                sum = checksum(sum, reinterpret_cast<const unsigned char *>(data.data()), data.size());
+            }
+        }
+        return sum;
+    }
+
+    /**
+     @brief Load, parse and walk document with C API
+     */
+    bool run_c(const char *path, uint64_t &sum) {
+        MOBIData *m = mobi_init();
+        if (m == NULL) {
+            return false;
+        }
+        if (mobi_load_filename(m, path) != MOBI_SUCCESS) {
+            mobi_free(m);
+            return false;
+        }
+        MOBIRawml *rawml = mobi_init_rawml(m);
+        if (rawml == NULL || mobi_parse_rawml(rawml, m) != MOBI_SUCCESS) {
+            mobi_free_rawml(rawml);
+            mobi_free(m);
+            return false;
+        }
+        sum = walk_c(rawml);
+        mobi_free_rawml(rawml);
+        mobi_free(m);
+        return true;
+    }
+
+    /**
+     @brief Load, parse and walk document with C++ wrappers
+     */
+    bool run_cpp(const char *path, uint64_t &sum) {
+        std::error_code ec;
+        const mobi::Document doc = mobi::Document::load(path, ec);
+        if (ec) {
+            return false;
+        }
+        const mobi::Rawml rawml = mobi::Rawml::parse(doc, ec);
+        if (ec) {
+            return false;
+        }
+        sum = walk_cpp(rawml);
+        return true;
+    }
+
+    /**
+     @brief Median of values
+     */
+    double median(std::vector<double> values) {
+        std::sort(values.begin(), values.end());
+        const size_t n = values.size();
+        return (n % 2) ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2;
+    }
+
+    /**
+     @brief Median of measured times in milliseconds
+     */
+    double median_ms(const std::vector<Sample> &samples) {
+        std::vector<double> values;
+        for (const Sample &sample : samples) {
+            values.push_back(sample.ms);
+        }
+        return median(values);
+    }
+
+    /**
+     @brief Median of hardware counter
+     */
+    double median_counter(const std::vector<Sample> &samples, int counter) {
+        std::vector<double> values;
+        for (const Sample &sample : samples) {
+            values.push_back(static_cast<double>(sample.counters[counter]));
+        }
+        return median(values);
+    }
+
+    /**
+     @brief Measure single call
+     */
+    template <typename Func>
+    Sample measure(Func func) {
+        Sample sample = {};
+        uint64_t start_counters[PERF_COUNTERS_COUNT] = {};
+        if (use_perf) {
+            perf_counters_read(&counters, start_counters);
+        }
+        const Clock::time_point start = Clock::now();
+        func();
+        sample.ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+        if (use_perf) {
+            perf_counters_read(&counters, sample.counters);
+            for (int c = 0; c < PERF_COUNTERS_COUNT; c++) {
+                sample.counters[c] -= start_counters[c];
+            }
+        }
+        return sample;
+    }
+
+    /**
+     @brief Print medians of hardware counters of both variants
+     */
+    void print_counters(const char *name, const std::vector<Sample> &samples_c, const std::vector<Sample> &samples_cpp) {
+        for (int c = 0; c < PERF_COUNTERS_COUNT; c++) {
+            if (!perf_counter_available(&counters, c)) {
+                continue;
+            }
+            const double value_c = median_counter(samples_c, c);
+            const double value_cpp = median_counter(samples_cpp, c);
+            std::printf("  %-16s %-14s C: %14.0f  C++: %14.0f  ratio: %.3f\n", name, perf_counter_names[c],
+                        value_c, value_cpp, value_c > 0 ? value_cpp / value_c : 0);
+        }
+    }
+
+    /**
+     @brief Benchmark single document
+     */
+    int bench(const char *path, size_t iterations) {
+        uint64_t sum_c = 0;
+        uint64_t sum_cpp = 0;
+        /* warmup */
+        if (!run_c(path, sum_c) || !run_cpp(path, sum_cpp)) {
+            std::printf("Error loading or parsing document: %s\n", path);
+            return ERROR;
+        }
+        if (sum_c != sum_cpp) {
+            std::printf("Checksum mismatch: %s\n", path);
+            return ERROR;
+        }
+        std::vector<Sample> full_c;
+        std::vector<Sample> full_cpp;
+        /* alternate variants, so that both see the same system state */
+        for (size_t i = 0; i < iterations; i++) {
+            full_c.push_back(measure([&] { run_c(path, sum_c); }));
+            full_cpp.push_back(measure([&] { run_cpp(path, sum_cpp); }));
+        }
+        /* walking parts of one parsed document isolates wrapper overhead */
+        const mobi::Document doc = mobi::Document::load(path);
+        const mobi::Rawml rawml = mobi::Rawml::parse(doc);
+        std::vector<Sample> walk_times_c;
+        std::vector<Sample> walk_times_cpp;
+        const size_t walks = 1000;
+        volatile uint64_t sink = 0;
+        for (size_t i = 0; i < iterations; i++) {
+            walk_times_c.push_back(measure([&] {
+                for (size_t j = 0; j < walks; j++) { sink = sink + walk_c(rawml.get()); }
+            }));
+            walk_times_cpp.push_back(measure([&] {
+                for (size_t j = 0; j < walks; j++) { sink = sink + walk_cpp(rawml); }
+            }));
+        }
+        const double full_median_c = median_ms(full_c);
+        const double full_median_cpp = median_ms(full_cpp);
+        const double walk_median_c = median_ms(walk_times_c);
+        const double walk_median_cpp = median_ms(walk_times_cpp);
+        std::printf("%s\n", path);
+        std::printf("  load+parse+walk  C: %10.3f ms  C++: %10.3f ms  ratio: %.3f\n",
+                    full_median_c, full_median_cpp, full_median_cpp / full_median_c);
+        std::printf("  walk x%zu       C: %10.3f ms  C++: %10.3f ms  ratio: %.3f\n",
+                    walks, walk_median_c, walk_median_cpp, walk_median_cpp / walk_median_c);
+        if (use_perf) {
+            print_counters("load+parse+walk", full_c, full_cpp);
+            print_counters("walk", walk_times_c, walk_times_cpp);
+        }
+        return SUCCESS;
+    }
+}
+
+/**
+ @brief Main
+ */
+int main(int argc, char *argv[]) {
+    size_t iterations = 10;
+    int first = 1;
+    while (first < argc) {
+        const std::string arg(argv[first]);
+        if (arg == "-n" && first + 1 < argc) {
+            const long n = std::strtol(argv[first + 1], NULL, 10);
+            if (n < 1) {
+                std::printf("Invalid number of iterations: %s\n", argv[first + 1]);
+                return ERROR;
+            }
+            iterations = static_cast<size_t>(n);
+            first += 2;
+        } else if (arg == "--perf") {
+            use_perf = true;
+            first++;
+        } else {
+            break;
+        }
+    }
+    if (first >= argc) {
+        std::printf("usage: %s [-n iterations] [--perf] filename...\n", argv[0]);
+        return ERROR;
+    }
+    if (use_perf) {
+        const char *error;
+        if (!perf_counters_open(&counters, &error)) {
+            std::printf("Hardware counters not available: %s\n", error);
+            use_perf = false;
+        }
+    }
+    int ret = SUCCESS;
+    for (int i = first; i < argc; i++) {
+        if (bench(argv[i], iterations) != SUCCESS) {
+            ret = ERROR;
+        }
+    }
+    if (use_perf) {
+        perf_counters_close(&counters);
+    }
+    return ret;
+}
@@ -21,6 +21,9 @@
 #include <stdlib.h>
 #ifdef _WIN32
 #include <direct.h> // needed for _mkdir()
+#include <windows.h> // needed for QueryPerformanceCounter()
+#include <io.h> // needed for _dup()
+#include <fcntl.h> // needed for _O_BINARY
 #include "getopt.h"
 #else
 #include <unistd.h>
@@ -32,6 +35,7 @@
 /* include libmobi header */
 #include <mobi.h>
 #include "save_epub.h"
+#include "perfcount.h"
 #ifdef HAVE_CONFIG_H
 # include "../config.h"
 #endif
@@ -89,9 +93,15 @@ int print_rec_meta_opt = 0;
 int dump_rec_opt = 0;
 int parse_kf7_opt = 0;
 int dump_parts_opt = 0;
+int tar_parts_opt = 0;
 int dump_epub_opt = 0;
+int dump_pdf_opt = 0;
+int rebuild_kf8_opt = 0;
 int print_rusage_opt = 0;
 int outdir_opt = 0;
+int bench_json_opt = 0;
+int bench_perf_opt = 0;
+int repair_utf8_opt = 0;
 #ifdef USE_ENCRYPTION
 int setpid_opt = 0;
 #endif
@@ -99,6 +109,10 @@ int setpid_opt = 0;
 /* options values */
 char outdir[FILENAME_MAX];
 char* epub_fn = outdir;
+size_t bench_iterations = 0;
+char *tar_fn = NULL;
+FILE *tar_out = NULL;
+PerfCounters bench_counters;
 #ifdef USE_ENCRYPTION
 char *pid = NULL;
 #endif
@@ -582,6 +596,384 @@ int dump_rawml_parts(const MOBIRawml *rawml, const char *fullpath) {
 }
 
 
+#define TAR_BLOCK_SIZE 512 /**< Size of tar header and data block */
+#define TAR_BUFFER_SIZE (1024 * 1024) /**< Size of tar output buffer */
+
+/**
+ @brief Tar archive written to output stream with large buffered writes
+ */
+typedef struct {
+    FILE *out; /**< Output stream */
+    unsigned char *buffer; /**< Output buffer */
+    size_t used; /**< Number of bytes in output buffer */
+    time_t mtime; /**< Modification time stored in headers */
+} TarStream;
+
+/**
+ @brief Write buffered tar data to output stream
+ @param[in,out] tar Tar stream
+ @return SUCCESS or ERROR
+ */
+static int tar_flush(TarStream *tar) {
+    if (tar->used && fwrite(tar->buffer, 1, tar->used, tar->out) != tar->used) {
+        return ERROR;
+    }
+    tar->used = 0;
+    return SUCCESS;
+}
+
+/**
+ @brief Append data to tar stream, data larger than buffer is written directly
+ @param[in,out] tar Tar stream
+ @param[in] data Data
+ @param[in] size Data size
+ @return SUCCESS or ERROR
+ */
+static int tar_write(TarStream *tar, const unsigned char *data, const size_t size) {
+    if (tar->used + size > TAR_BUFFER_SIZE) {
+        if (tar_flush(tar) != SUCCESS) {
+            return ERROR;
+        }
+        if (size >= TAR_BUFFER_SIZE) {
+            return (fwrite(data, 1, size, tar->out) == size) ? SUCCESS : ERROR;
+        }
+    }
+    memcpy(tar->buffer + tar->used, data, size);
+    tar->used += size;
+    return SUCCESS;
+}
+
+/**
+ @brief Store number in tar header field as zero padded octal string
+ @param[in,out] field Header field
+ @param[in] length Field length including terminating null
+ @param[in] value Value
+ */
+static void tar_octal(unsigned char *field, const size_t length, const unsigned long long value) {
+    char octal[32];
+    snprintf(octal, sizeof(octal), "%0*llo", (int) (length - 1), value);
+    memcpy(field, octal, length - 1);
+}
+
+/**
+ @brief Add entry to tar stream
+ @param[in,out] tar Tar stream
+ @param[in] dirname Directory name, stored in ustar prefix field
+ @param[in] name File name or NULL for directory entry
+ @param[in] data Data
+ @param[in] size Data size
+ @return SUCCESS or ERROR
+ */
+static int tar_add(TarStream *tar, const char *dirname, const char *name, const unsigned char *data, const size_t size) {
+    unsigned char header[TAR_BLOCK_SIZE];
+    memset(header, 0, TAR_BLOCK_SIZE);
+    const size_t dirname_length = strlen(dirname);
+    if (name == NULL) {
+        if (dirname_length + 1 > 100) {
+            /* extractors create missing directories anyway */
+            return SUCCESS;
+        }
+        memcpy(header, dirname, dirname_length);
+        header[dirname_length] = '/';
+        tar_octal(header + 100, 8, 0755);
+        header[156] = '5';
+    } else {
+        const size_t name_length = strlen(name);
+        if (name_length > 100 || dirname_length > 155) {
+            printf("File name too long for tar archive: %s/%s\n", dirname, name);
+            return ERROR;
+        }
+        memcpy(header, name, name_length);
+        memcpy(header + 345, dirname, dirname_length);
+        tar_octal(header + 100, 8, 0644);
+        header[156] = '0';
+    }
+    tar_octal(header + 108, 8, 0);
+    tar_octal(header + 116, 8, 0);
+    tar_octal(header + 124, 12, size);
+    tar_octal(header + 136, 12, (unsigned long long) tar->mtime);
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    /* checksum is calculated with checksum field filled with spaces */
+    memset(header + 148, ' ', 8);
+    unsigned long checksum = 0;
+    for (size_t i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += header[i];
+    }
+    tar_octal(header + 148, 7, checksum);
+    if (tar_write(tar, header, TAR_BLOCK_SIZE) != SUCCESS) {
+        return ERROR;
+    }
+    if (size == 0) {
+        return SUCCESS;
+    }
+    if (tar_write(tar, data, size) != SUCCESS) {
+        return ERROR;
+    }
+    const unsigned char padding[TAR_BLOCK_SIZE] = { 0 };
+    const size_t padding_size = (TAR_BLOCK_SIZE - size % TAR_BLOCK_SIZE) % TAR_BLOCK_SIZE;
+    return tar_write(tar, padding, padding_size);
+}
+
+/**
+ @brief Add list of parts to tar stream
+ @param[in,out] tar Tar stream
+ @param[in] dirname Directory name
+ @param[in] part Linked list of parts
+ @param[in] prefix Part file name prefix
+ @param[in] skip_empty Skip parts without data
+ @return SUCCESS or ERROR
+ */
+static int tar_add_parts(TarStream *tar, const char *dirname, const MOBIPart *part, const char *prefix, const bool skip_empty) {
+    char partname[FILENAME_MAX];
+    while (part != NULL) {
+        MOBIFileMeta file_meta = mobi_get_filemeta_by_type(part->type);
+        if (file_meta.type == T_NCX) {
+            sprintf(partname, "toc.%s", file_meta.extension);
+        } else if (file_meta.type == T_OPF) {
+            sprintf(partname, "content.%s", file_meta.extension);
+        } else {
+            sprintf(partname, "%s%05zu.%s", prefix, part->uid, file_meta.extension);
+        }
+        if (part->size > 0 || !skip_empty) {
+            printf("%s\n", partname);
+            if (tar_add(tar, dirname, partname, part->data, part->size) != SUCCESS) {
+                return ERROR;
+            }
+        }
+        part = part->next;
+    }
+    return SUCCESS;
+}
+
+/**
+ @brief Write recreated source files as single uncompressed tar archive
+ 
+ Archive holds the same files as directory created by dump_rawml_parts().
+ 
+ @param[in] rawml MOBIRawml structure holding parsed records
+ @param[in] fullpath File path will be parsed to build archive directory name
+ @param[in] out Output stream
+ @return SUCCESS or ERROR
+ */
+int tar_rawml_parts(const MOBIRawml *rawml, const char *fullpath, FILE *out) {
+    if (rawml == NULL) {
+        printf("Rawml structure not initialized\n");
+        return ERROR;
+    }
+    char dirname[FILENAME_MAX];
+    char basename[FILENAME_MAX];
+    split_fullpath(fullpath, dirname, basename);
+    char newdir[FILENAME_MAX];
+    const int length = snprintf(newdir, sizeof(newdir), "%s_markup", basename);
+    if (length < 0 || (size_t) length >= sizeof(newdir)) {
+        printf("File name too long: %s\n", basename);
+        return ERROR;
+    }
+    TarStream tar;
+    tar.out = out;
+    tar.used = 0;
+    tar.mtime = time(NULL);
+    tar.buffer = malloc(TAR_BUFFER_SIZE);
+    if (tar.buffer == NULL) {
+        printf("Memory allocation failed\n");
+        return ERROR;
+    }
+    int ret = tar_add(&tar, newdir, NULL, NULL, 0);
+    if (ret == SUCCESS) {
+        ret = tar_add_parts(&tar, newdir, rawml->markup, "part", false);
+    }
+    if (ret == SUCCESS && rawml->flow != NULL) {
+        /* skip raw html file */
+        ret = tar_add_parts(&tar, newdir, rawml->flow->next, "flow", false);
+    }
+    if (ret == SUCCESS) {
+        /* empty resources are skipped, like in dump_rawml_parts() */
+        ret = tar_add_parts(&tar, newdir, rawml->resources, "resource", true);
+    }
+    if (ret == SUCCESS) {
+        /* end of archive marker */
+        const unsigned char end[2 * TAR_BLOCK_SIZE] = { 0 };
+        ret = tar_write(&tar, end, sizeof(end));
+    }
+    if (ret == SUCCESS) {
+        ret = tar_flush(&tar);
+    }
+    if (ret == SUCCESS && fflush(out) != 0) {
+        ret = ERROR;
+    }
+    if (ret != SUCCESS) {
+        printf("Error writing tar archive (%s)\n", strerror(errno));
+    }
+    free(tar.buffer);
+    return ret;
+}
+
+/**
+ @brief Open tar output stream
+ 
+ For "-" archive is written to standard output, which is then redirected to
+ standard error, so that messages don't get mixed with archive data.
+ 
+ @param[in] filename Output file name or "-"
+ @return Output stream or NULL on error
+ */
+FILE * tar_open(const char *filename) {
+    if (strcmp(filename, "-") != 0) {
+        errno = 0;
+        FILE *out = fopen(filename, "wb");
+        if (out == NULL) {
+            int errsv = errno;
+            printf("Could not open file for writing: %s (%s)\n", filename, strerror(errsv));
+        }
+        return out;
+    }
+    fflush(stdout);
+#ifdef _WIN32
+    const int fd = _dup(_fileno(stdout));
+    if (fd == -1 || _dup2(_fileno(stderr), _fileno(stdout)) == -1) {
+        return NULL;
+    }
+    _setmode(fd, _O_BINARY);
+    return _fdopen(fd, "wb");
+#else
+    const int fd = dup(STDOUT_FILENO);
+    if (fd == -1 || dup2(STDERR_FILENO, STDOUT_FILENO) == -1) {
+        return NULL;
+    }
+    return fdopen(fd, "wb");
+#endif
+}
+
+/**
+ @brief Source and destination files for streamed pdf data
+ */
+typedef struct {
+    FILE *in; /**< Source document */
+    FILE *out; /**< Output pdf file */
+} PdfSink;
+
+/**
+ @brief Write chunk of pdf data to output file, callback for mobi_extract_replica_pdf()
+ @param[in] context PdfSink structure
+ @param[in] data Pdf data
+ @param[in] size Data size
+ */
+MOBI_RET pdf_write(void *context, const unsigned char *data, const size_t size) {
+    PdfSink *sink = context;
+    if (fwrite(data, 1, size, sink->out) != size) {
+        return MOBI_ERROR;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Copy chunk of pdf data from source document to output file, callback for mobi_extract_replica_pdf()
+ @param[in] context PdfSink structure
+ @param[in] offset Offset of data in source document
+ @param[in] size Data size
+ */
+MOBI_RET pdf_write_offset(void *context, const size_t offset, const size_t size) {
+    PdfSink *sink = context;
+    unsigned char buffer[65536];
+    if (fseek(sink->in, (long) offset, SEEK_SET) != 0) {
+        return MOBI_ERROR;
+    }
+    size_t left = size;
+    while (left) {
+        const size_t chunk = left < sizeof(buffer) ? left : sizeof(buffer);
+        if (fread(buffer, 1, chunk, sink->in) != chunk ||
+            fwrite(buffer, 1, chunk, sink->out) != chunk) {
+            return MOBI_ERROR;
+        }
+        left -= chunk;
+    }
+    return MOBI_SUCCESS;
+}
+
+/**
+ @brief Extract pdf from Print Replica book without parsing whole document
+ @param[in] m MOBIData structure
+ @param[in] fullpath File path will be parsed to create a new name for saved file
+ */
+int dump_replica_pdf(const MOBIData *m, const char *fullpath) {
+    if (!mobi_is_replica(m)) {
+        printf("Not a Print Replica book\n");
+        return ERROR;
+    }
+    char dirname[FILENAME_MAX];
+    char basename[FILENAME_MAX];
+    split_fullpath(fullpath, dirname, basename);
+    char newpath[FILENAME_MAX];
+    if (outdir_opt) {
+        sprintf(newpath, "%s%s.pdf", outdir, basename);
+    } else {
+        sprintf(newpath, "%s%s.pdf", dirname, basename);
+    }
+    printf("Saving pdf to %s\n", newpath);
+    PdfSink pdf_sink;
+    errno = 0;
+    pdf_sink.in = fopen(fullpath, "rb");
+    if (pdf_sink.in == NULL) {
+        int errsv = errno;
+        printf("Error opening file: %s (%s)\n", fullpath, strerror(errsv));
+        return ERROR;
+    }
+    errno = 0;
+    pdf_sink.out = fopen(newpath, "wb");
+    if (pdf_sink.out == NULL) {
+        int errsv = errno;
+        printf("Could not open file for writing: %s (%s)\n", newpath, strerror(errsv));
+        fclose(pdf_sink.in);
+        return ERROR;
+    }
+    MOBISink sink = { pdf_write, pdf_write_offset, &pdf_sink };
+    const MOBI_RET mobi_ret = mobi_extract_replica_pdf(m, &sink);
+    fclose(pdf_sink.in);
+    fclose(pdf_sink.out);
+    if (mobi_ret != MOBI_SUCCESS) {
+        printf("Extracting pdf failed (%i)\n", mobi_ret);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
+/**
+ @brief Write KF8 book parts into new azw3 file
+ @param[in] m MOBIData structure
+ @param[in] fullpath File path will be parsed to create a new name for saved file
+ */
+int rebuild_kf8(const MOBIData *m, const char *fullpath) {
+    if (!mobi_is_kf8(m) || mobi_is_replica(m)) {
+        printf("Not a KF8 book\n");
+        return ERROR;
+    }
+    char dirname[FILENAME_MAX];
+    char basename[FILENAME_MAX];
+    split_fullpath(fullpath, dirname, basename);
+    char newpath[FILENAME_MAX];
+    const int length = snprintf(newpath, sizeof(newpath), "%s%s_rebuilt.azw3", outdir_opt ? outdir : dirname, basename);
+    if (length < 0 || (size_t) length >= sizeof(newpath)) {
+        printf("File name too long: %s\n", basename);
+        return ERROR;
+    }
+    printf("Saving KF8 book to %s\n", newpath);
+    errno = 0;
+    FILE *file = fopen(newpath, "wb");
+    if (file == NULL) {
+        int errsv = errno;
+        printf("Could not open file for writing: %s (%s)\n", newpath, strerror(errsv));
+        return ERROR;
+    }
+    const MOBI_RET mobi_ret = mobi_rebuild_kf8(m, file);
+    if (fclose(file) != 0 || mobi_ret != MOBI_SUCCESS) {
+        printf("Writing KF8 book failed (%i)\n", mobi_ret);
+        remove(newpath);
+        return ERROR;
+    }
+    return SUCCESS;
+}
+
 /**
  @brief Main routine that calls optional subroutines
  @param[in] fullpath Full file path
@@ -600,6 +992,9 @@ int loadfilename(const char *fullpath) {
         /* Force it to parse KF7 part */
         mobi_parse_kf7(m);
     }
+    if (repair_utf8_opt) {
+        mobi_set_utf8_repair(m, true);
+    }
     errno = 0;
     FILE *file = fopen(fullpath, "rb");
     if (file == NULL) {
@@ -650,7 +1045,13 @@ int loadfilename(const char *fullpath) {
         printf("\nDumping raw records...\n");
         ret = dump_records(m, fullpath);
     }
-    if (dump_rawml_opt) {
+    if (dump_pdf_opt) {
+        printf("\nExtracting pdf...\n");
+        ret = dump_replica_pdf(m, fullpath);
+    } else if (rebuild_kf8_opt) {
+        printf("\nRebuilding KF8 book...\n");
+        ret = rebuild_kf8(m, fullpath);
+    } else if (dump_rawml_opt) {
         printf("\nDumping rawml...\n");
         ret = dump_rawml(m, fullpath);
     } else if (dump_parts_opt) {
@@ -672,9 +1073,15 @@ int loadfilename(const char *fullpath) {
             mobi_free_rawml(rawml);
             return ERROR;
         }
-        printf("\ndumping resources...\n");
-        /* Save parts to files */
-        ret = dump_rawml_parts(rawml, fullpath);
+        if (tar_parts_opt) {
+            printf("\nwriting resources to tar archive...\n");
+            /* Save parts to single archive stream */
+            ret = tar_rawml_parts(rawml, fullpath, tar_out);
+        } else {
+            printf("\ndumping resources...\n");
+            /* Save parts to files */
+            ret = dump_rawml_parts(rawml, fullpath);
+        }
         if (ret != SUCCESS) {
             printf("Dumping parts failed\n");
         }
@@ -686,15 +1093,389 @@ int loadfilename(const char *fullpath) {
     return ret;
 }
 
+/**
+ @brief Benchmark stages
+ */
+enum {
+    BENCH_LOAD, /**< Load file into MOBIData structure */
+    BENCH_DECOMPRESS, /**< Decompress text records */
+    BENCH_PARSE, /**< Parse rawml into MOBIRawml structure */
+    BENCH_FREE, /**< Free MOBIRawml and MOBIData structures */
+    BENCH_TOTAL, /**< Whole iteration */
+    BENCH_STAGES_COUNT
+};
+
+static const char *bench_stage_names[BENCH_STAGES_COUNT] = { "load", "decompress", "parse", "free", "total" };
+
+/**
+ @brief Measurements of single benchmark stage, one entry per iteration
+ */
+typedef struct {
+    double *time; /**< Wall time in seconds */
+    double *allocs; /**< Number of allocations */
+    double *bytes; /**< Number of allocated bytes */
+    double *counters[PERF_COUNTERS_COUNT]; /**< Hardware counters, if enabled */
+} BenchStage;
+
+/**
+ @brief Get monotonic time
+ @return Time in seconds
+ */
+static double bench_now(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (double) counter.QuadPart / (double) frequency.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double) ts.tv_sec + (double) ts.tv_nsec / 1e9;
+#else
+    return (double) clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+/**
+ @brief Stage timer
+ */
+typedef struct {
+    double time; /**< Start time */
+    MOBIAllocStats stats; /**< Allocation counters at start */
+    uint64_t counters[PERF_COUNTERS_COUNT]; /**< Hardware counters at start */
+} BenchMark;
+
+/**
+ @brief Start measuring stage
+ @param[in,out] mark Stage timer
+ */
+static void bench_start(BenchMark *mark) {
+    mobi_get_alloc_stats(&mark->stats);
+    if (bench_perf_opt) {
+        perf_counters_read(&bench_counters, mark->counters);
+    }
+    mark->time = bench_now();
+}
+
+/**
+ @brief Stop measuring stage and store result
+ @param[in] mark Stage timer started with bench_start()
+ @param[in,out] stage Stage measurements
+ @param[in] i Iteration number
+ */
+static void bench_stop(const BenchMark *mark, BenchStage *stage, const size_t i) {
+    const double time = bench_now();
+    if (bench_perf_opt) {
+        uint64_t counters[PERF_COUNTERS_COUNT];
+        perf_counters_read(&bench_counters, counters);
+        for (size_t c = 0; c < PERF_COUNTERS_COUNT; c++) {
+            stage->counters[c][i] = (double) (counters[c] - mark->counters[c]);
+        }
+    }
+    MOBIAllocStats stats;
+    mobi_get_alloc_stats(&stats);
+    stage->time[i] = time - mark->time;
+    stage->allocs[i] = (double) (stats.allocs + stats.reallocs - mark->stats.allocs - mark->stats.reallocs);
+    stage->bytes[i] = (double) (stats.bytes - mark->stats.bytes);
+}
+
+/**
+ @brief Run single benchmark iteration
+ @param[in] fullpath Full file path
+ @param[in,out] stages Stage measurements
+ @param[in] i Iteration number
+ @param[in,out] text_length Set to decompressed text length
+ @return SUCCESS or ERROR
+ */
+static int bench_iteration(const char *fullpath, BenchStage *stages, const size_t i, size_t *text_length) {
+    BenchMark total;
+    BenchMark mark;
+    bench_start(&total);
+    /* load */
+    bench_start(&mark);
+    MOBIData *m = mobi_init();
+    if (m == NULL) {
+        printf("Memory allocation failed\n");
+        return ERROR;
+    }
+    if (parse_kf7_opt) {
+        mobi_parse_kf7(m);
+    }
+    if (repair_utf8_opt) {
+        mobi_set_utf8_repair(m, true);
+    }
+    FILE *file = fopen(fullpath, "rb");
+    if (file == NULL) {
+        printf("Error opening file: %s (%s)\n", fullpath, strerror(errno));
+        mobi_free(m);
+        return ERROR;
+    }
+    MOBI_RET mobi_ret = mobi_load_file(m, file);
+    fclose(file);
+    if (mobi_ret != MOBI_SUCCESS) {
+        printf("Error while loading document (%i)\n", mobi_ret);
+        mobi_free(m);
+        return ERROR;
+    }
+#ifdef USE_ENCRYPTION
+    if (setpid_opt && mobi_is_encrypted(m)) {
+        mobi_ret = mobi_drm_setkey(m, pid);
+        if (mobi_ret != MOBI_SUCCESS) {
+            printf("Verifying PID failed (%i)\n", mobi_ret);
+            mobi_free(m);
+            return ERROR;
+        }
+    }
+#endif
+    bench_stop(&mark, &stages[BENCH_LOAD], i);
+    /* decompress */
+    bench_start(&mark);
+    /* encrypted records are decrypted in place, so they can't be decompressed twice,
+       text is decompressed anyway by the parse stage */
+    if (!mobi_is_encrypted(m)) {
+        size_t length = mobi_get_text_maxsize(m);
+        char *text = malloc(length + 1);
+        if (text == NULL) {
+            printf("Memory allocation failed\n");
+            mobi_free(m);
+            return ERROR;
+        }
+        mobi_ret = mobi_get_rawml(m, text, &length);
+        free(text);
+        if (mobi_ret != MOBI_SUCCESS) {
+            printf("Error decompressing text (%i)\n", mobi_ret);
+            mobi_free(m);
+            return ERROR;
+        }
+        *text_length = length;
+    }
+    bench_stop(&mark, &stages[BENCH_DECOMPRESS], i);
+    /* parse */
+    bench_start(&mark);
+    MOBIRawml *rawml = mobi_init_rawml(m);
+    if (rawml == NULL) {
+        printf("Memory allocation failed\n");
+        mobi_free(m);
+        return ERROR;
+    }
+    mobi_ret = mobi_parse_rawml(rawml, m);
+    if (mobi_ret != MOBI_SUCCESS) {
+        printf("Parsing rawml failed (%i)\n", mobi_ret);
+        mobi_free_rawml(rawml);
+        mobi_free(m);
+        return ERROR;
+    }
+    bench_stop(&mark, &stages[BENCH_PARSE], i);
+    /* free */
+    bench_start(&mark);
+    mobi_free_rawml(rawml);
+    mobi_free(m);
+    bench_stop(&mark, &stages[BENCH_FREE], i);
+    bench_stop(&total, &stages[BENCH_TOTAL], i);
+    return SUCCESS;
+}
+
+/**
+ @brief Compare doubles for qsort()
+ */
+static int bench_compare(const void *a, const void *b) {
+    const double x = *(const double *) a;
+    const double y = *(const double *) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ @brief Summary of stage measurements
+ */
+typedef struct {
+    double min; /**< Minimum */
+    double median; /**< Median */
+    double p95; /**< 95th percentile */
+} BenchSummary;
+
+/**
+ @brief Summarize measurements, sorts values in place
+ @param[in,out] values Measurements
+ @param[in] count Number of measurements
+ @return Summary
+ */
+static BenchSummary bench_summarize(double *values, const size_t count) {
+    qsort(values, count, sizeof(*values), bench_compare);
+    BenchSummary summary;
+    summary.min = values[0];
+    if (count % 2) {
+        summary.median = values[count / 2];
+    } else {
+        summary.median = (values[count / 2 - 1] + values[count / 2]) / 2;
+    }
+    /* nearest rank */
+    size_t rank = (count * 95 + 99) / 100;
+    summary.p95 = values[rank - 1];
+    return summary;
+}
+
+/**
+ @brief Load and parse file repeatedly and print timings of each stage
+ @param[in] fullpath Full file path
+ @param[in] iterations Number of measured iterations, preceded by single warmup iteration
+ @return SUCCESS or ERROR
+ */
+int bench_file(const char *fullpath, const size_t iterations) {
+    struct stat st;
+    if (stat(fullpath, &st) != 0) {
+        printf("Error opening file: %s (%s)\n", fullpath, strerror(errno));
+        return ERROR;
+    }
+    MOBIAllocStats probe;
+    const bool have_allocs = (mobi_get_alloc_stats(&probe) == MOBI_SUCCESS);
+    const char *perf_error = NULL;
+    if (bench_perf_opt) {
+        const char *error;
+        if (!perf_counters_open(&bench_counters, &error)) {
+            perf_error = error;
+            bench_perf_opt = 0;
+        }
+    }
+    BenchStage stages[BENCH_STAGES_COUNT];
+    const size_t series = 3 + PERF_COUNTERS_COUNT;
+    /* slot 0 is used by warmup and overwritten by first measured iteration */
+    double *buffer = calloc(series * BENCH_STAGES_COUNT * iterations, sizeof(double));
+    if (buffer == NULL) {
+        printf("Memory allocation failed\n");
+        if (bench_perf_opt) {
+            perf_counters_close(&bench_counters);
+        }
+        return ERROR;
+    }
+    for (size_t s = 0; s < BENCH_STAGES_COUNT; s++) {
+        stages[s].time = buffer + (series * s) * iterations;
+        stages[s].allocs = buffer + (series * s + 1) * iterations;
+        stages[s].bytes = buffer + (series * s + 2) * iterations;
+        for (size_t c = 0; c < PERF_COUNTERS_COUNT; c++) {
+            stages[s].counters[c] = buffer + (series * s + 3 + c) * iterations;
+        }
+    }
+    size_t text_length = 0;
+    int ret = bench_iteration(fullpath, stages, 0, &text_length);
+    for (size_t i = 0; ret == SUCCESS && i < iterations; i++) {
+        ret = bench_iteration(fullpath, stages, i, &text_length);
+    }
+    bool have_counter[PERF_COUNTERS_COUNT];
+    for (size_t c = 0; c < PERF_COUNTERS_COUNT; c++) {
+        have_counter[c] = bench_perf_opt && perf_counter_available(&bench_counters, (int) c);
+    }
+    if (bench_perf_opt) {
+        perf_counters_close(&bench_counters);
+    }
+    if (ret != SUCCESS) {
+        free(buffer);
+        return ret;
+    }
+    BenchSummary time[BENCH_STAGES_COUNT];
+    BenchSummary allocs[BENCH_STAGES_COUNT];
+    BenchSummary bytes[BENCH_STAGES_COUNT];
+    BenchSummary counters[BENCH_STAGES_COUNT][PERF_COUNTERS_COUNT];
+    for (size_t s = 0; s < BENCH_STAGES_COUNT; s++) {
+        time[s] = bench_summarize(stages[s].time, iterations);
+        allocs[s] = bench_summarize(stages[s].allocs, iterations);
+        bytes[s] = bench_summarize(stages[s].bytes, iterations);
+        for (size_t c = 0; c < PERF_COUNTERS_COUNT; c++) {
+            counters[s][c] = bench_summarize(stages[s].counters[c], iterations);
+        }
+    }
+    free(buffer);
+    const double file_mb = (double) st.st_size / (1024 * 1024);
+    const double text_mb = (double) text_length / (1024 * 1024);
+    const double file_rate = time[BENCH_TOTAL].median > 0 ? file_mb / time[BENCH_TOTAL].median : 0;
+    const double text_rate = time[BENCH_DECOMPRESS].median > 0 ? text_mb / time[BENCH_DECOMPRESS].median : 0;
+    if (bench_json_opt) {
+        printf("{\n  \"file\": \"");
+        for (const char *c = fullpath; *c; c++) {
+            if (*c == '"' || *c == '\\') {
+                putchar('\\');
+            }
+            putchar(*c);
+        }
+        printf("\",\n  \"size\": %lld,\n  \"text_size\": %zu,\n  \"iterations\": %zu,\n  \"warmup\": 1,\n  \"stages\": {\n",
+               (long long) st.st_size, text_length, iterations);
+        for (size_t s = 0; s < BENCH_STAGES_COUNT; s++) {
+            printf("    \"%s\": { \"min_ms\": %.3f, \"median_ms\": %.3f, \"p95_ms\": %.3f",
+                   bench_stage_names[s], time[s].min * 1000, time[s].median * 1000, time[s].p95 * 1000);
+            if (have_allocs) {
+                printf(", \"allocs\": %.0f, \"alloc_bytes\": %.0f", allocs[s].median, bytes[s].median);
+            }
+            for (size_t c = 0; c < PERF_COUNTERS_COUNT; c++) {
+                if (have_counter[c]) {
+                    printf(", \"%s\": %.0f", perf_counter_names[c], counters[s][c].median);
+                }
+            }
+            printf(" }%s\n", (s + 1 < BENCH_STAGES_COUNT) ? "," : "");
+        }
+        printf("  },\n  \"throughput_mb_s\": %.2f,\n  \"text_throughput_mb_s\": %.2f\n}\n", file_rate, text_rate);
+        if (perf_error) {
+            fprintf(stderr, "Hardware counters not available: %s\n", perf_error);
+        }
+    } else {
+        printf("Benchmark: %s (%zu iterations after warmup)\n", fullpath, iterations);
+        printf("%-12s %12s %12s %12s", "stage", "min ms", "median ms", "p95 ms");
+        if (have_allocs) {
+            printf(" %12s %14s", "allocs", "alloc bytes");
+        }
+        printf("\n");
+        for (size_t s = 0; s < BENCH_STAGES_COUNT; s++) {
+            printf("%-12s %12.3f %12.3f %12.3f", bench_stage_names[s],
+                   time[s].min * 1000, time[s].median * 1000, time[s].p95 * 1000);
+            if (have_allocs) {
+                printf(" %12.0f %14.0f", allocs[s].median, bytes[s].median);
+            }
+            printf("\n");
+        }
+        if (bench_perf_opt) {
+            /* medians of each counter */
+            printf("%-12s %14s %14s %6s %14s %14s\n", "stage", "cycles", "instructions", "IPC", "cache misses", "branch misses");
+            for (size_t s = 0; s < BENCH_STAGES_COUNT; s++) {
+                printf("%-12s", bench_stage_names[s]);
+                for (size_t c = 0; c < PERF_COUNTERS_COUNT; c++) {
+                    if (have_counter[c]) {
+                        printf(" %14.0f", counters[s][c].median);
+                    } else {
+                        printf(" %14s", "-");
+                    }
+                    if (c == PERF_INSTRUCTIONS) {
+                        const double cycles = counters[s][PERF_CYCLES].median;
+                        if (have_counter[PERF_CYCLES] && have_counter[PERF_INSTRUCTIONS] && cycles > 0) {
+                            printf(" %6.2f", counters[s][PERF_INSTRUCTIONS].median / cycles);
+                        } else {
+                            printf(" %6s", "-");
+                        }
+                    }
+                }
+                printf("\n");
+            }
+        }
+        printf("Throughput: %.2f MB/s of file (%.2f MB), %.2f MB/s of decompressed text (%.2f MB)\n",
+               file_rate, file_mb, text_rate, text_mb);
+        if (perf_error) {
+            printf("Hardware counters not available: %s\n", perf_error);
+        }
+        if (!have_allocs) {
+            printf("Allocation counts not available, configure library with --enable-alloc-stats\n");
+        }
+    }
+    return SUCCESS;
+}
+
 /**
  @brief Print usage info
  @param[in] progname Executed program name
  */
 void usage(const char *progname) {
-    printf("usage: %s [-edmrs" PRINT_RUSAGE_ARG "v7] [-o dir]" PRINT_ENC_USG " filename\n", progname);
+    printf("usage: %s [-edkmrs" PRINT_RUSAGE_ARG "vx7] [-o dir]" PRINT_ENC_USG " [-t fn] [--repair-utf8] [--bench N [--json] [--perf]] filename\n", progname);
     printf("       without arguments prints document metadata and exits\n");
 	printf("       -e fn   convert to EPUB under file name fn (other dump/print options ignored)\n");
 	printf("       -d      dump rawml text record\n");
+    printf("       -k      rebuild KF8 book from its parts into new azw3 file\n");
     printf("       -m      print records metadata\n");
     printf("       -o dir  save output to dir folder\n");
 #ifdef USE_ENCRYPTION
@@ -702,11 +1483,17 @@ void usage(const char *progname) {
 #endif
     printf("       -r      dump raw records\n");
     printf("       -s      dump recreated source files\n");
+    printf("       -t fn   write recreated source files to single tar archive fn (\"-\" for stdout)\n");
 #ifdef HAVE_SYS_RESOURCE_H
     printf("       -u      show rusage\n");
 #endif
     printf("       -v      show version and exit\n");
+    printf("       -x      extract pdf from Print Replica book\n");
     printf("       -7      parse KF7 part of hybrid file (by default KF8 part is parsed)\n");
+    printf("       --repair-utf8  replace invalid utf-8 sequences in parsed text with U+FFFD\n");
+    printf("       --bench N  load and parse file N times after warmup, print timings of each stage\n");
+    printf("       --json     print benchmark results as JSON\n");
+    printf("       --perf     count cycles, instructions, cache and branch misses of each stage (Linux)\n");
     exit(0);
 }
 /**
@@ -716,13 +1503,61 @@ int main(int argc, char *argv[]) {
     if (argc < 2) {
         usage(argv[0]);
     }
+    /* long options are removed before getopt, which handles short options only */
+    int args = 1;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        const char *value = NULL;
+        if (strcmp(arg, "--") == 0) {
+            while (i < argc) {
+                argv[args++] = argv[i++];
+            }
+            break;
+        }
+        if (strcmp(arg, "--json") == 0) {
+            bench_json_opt = 1;
+            continue;
+        }
+        if (strcmp(arg, "--perf") == 0) {
+            bench_perf_opt = 1;
+            continue;
+        }
+        if (strcmp(arg, "--repair-utf8") == 0) {
+            repair_utf8_opt = 1;
+            continue;
+        }
+        if (strcmp(arg, "--bench") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Option --bench requires an argument.\n");
+                usage(argv[0]);
+            }
+            value = argv[++i];
+        } else if (strncmp(arg, "--bench=", 8) == 0) {
+            value = arg + 8;
+        } else {
+            argv[args++] = argv[i];
+            continue;
+        }
+        char *end;
+        const long iterations = strtol(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || iterations < 1) {
+            fprintf(stderr, "Invalid number of benchmark iterations: %s\n", value);
+            usage(argv[0]);
+        }
+        bench_iterations = (size_t) iterations;
+    }
+    argc = args;
+    argv[argc] = NULL;
     int opterr = 0;
     int c;
-    while((c = getopt(argc, argv, "e:dmo:" PRINT_ENC_ARG "rs" PRINT_RUSAGE_ARG "v7")) != -1)
+    while((c = getopt(argc, argv, "e:dkmo:" PRINT_ENC_ARG "rst:" PRINT_RUSAGE_ARG "vx7")) != -1)
         switch(c) {
             case 'd':
                 dump_rawml_opt = 1;
                 break;
+            case 'k':
+                rebuild_kf8_opt = 1;
+                break;
             case 'm':
                 print_rec_meta_opt = 1;
                 break;
@@ -759,6 +1594,11 @@ int main(int argc, char *argv[]) {
                 break;
             case 's':
                 dump_parts_opt = 1;
+                break;
+            case 't':
+                dump_parts_opt = 1;
+                tar_parts_opt = 1;
+                tar_fn = optarg;
                 break;
 			case 'e':
 				dump_epub_opt = 1;
@@ -778,10 +1618,17 @@ int main(int argc, char *argv[]) {
                 printf("mobitool build: " __DATE__ " " __TIME__ " (" COMPILER ")\n");
                 printf("libmobi: %s\n", mobi_version());
                 return 0;
+            case 'x':
+                dump_pdf_opt = 1;
+                break;
             case '7':
                 parse_kf7_opt = 1;
                 break;
             case '?':
+                if (optopt == 't') {
+                    fprintf(stderr, "Option -%c requires an argument.\n", optopt);
+                }
+                else
 #ifdef USE_ENCRYPTION
                 if (optopt == 'p') {
                     fprintf(stderr, "Option -%c requires an argument.\n", optopt);
@@ -806,11 +1653,23 @@ int main(int argc, char *argv[]) {
     char filename[FILENAME_MAX];
     strncpy(filename, argv[optind], FILENAME_MAX - 1);
 	
-	if (dump_epub_opt) {
+	if (bench_iterations) {
+		ret = bench_file(filename, bench_iterations);
+	}
+	else if (dump_epub_opt) {
 		ret = convertMobiToEpub(filename, epub_fn, pid, parse_kf7_opt == 1) ? 1 : 0;
 	}
 	else {
+		if (tar_parts_opt) {
+			tar_out = tar_open(tar_fn);
+			if (tar_out == NULL) {
+				return ERROR;
+			}
+		}
 		ret = loadfilename(filename);
+		if (tar_out && fclose(tar_out) != 0) {
+			ret = ERROR;
+		}
 	}
 #ifdef HAVE_SYS_RESOURCE_H
     if (print_rusage_opt) {
@@ -0,0 +1,120 @@
+/** @file perfcount.c
+ *
+ * @brief Hardware performance counters for benchmarks
+ *
+ * Counts cycles, instructions, cache misses and branch misses of the calling
+ * process, including threads it creates, with Linux perf_event_open.
+ * Each event is opened separately, so events not supported by the CPU or
+ * virtual machine are skipped. On other systems no counters are available.
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+/* syscall() */
+#define _GNU_SOURCE
+
+#include <string.h>
+#include <errno.h>
+#ifdef HAVE_CONFIG_H
+# include "../config.h"
+#endif
+#ifdef HAVE_LINUX_PERF_EVENT_H
+# include <linux/perf_event.h>
+# include <sys/syscall.h>
+# include <unistd.h>
+#endif
+#include "perfcount.h"
+
+const char *perf_counter_names[PERF_COUNTERS_COUNT] = { "cycles", "instructions", "cache_misses", "branch_misses" };
+
+/**
+ @brief Open counters
+ @param[out] counters Counters, to be closed with perf_counters_close()
+ @param[out] error Set to reason if no counter could be opened
+ @return True if at least one counter is available
+ */
+bool perf_counters_open(PerfCounters *counters, const char **error) {
+    bool available = false;
+    *error = "not supported on this system";
+    for (int i = 0; i < PERF_COUNTERS_COUNT; i++) {
+        counters->fd[i] = -1;
+    }
+#ifdef HAVE_LINUX_PERF_EVENT_H
+    static const uint64_t events[PERF_COUNTERS_COUNT] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    for (int i = 0; i < PERF_COUNTERS_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = PERF_TYPE_HARDWARE;
+        attr.config = events[i];
+        /* user space only, allowed with default perf_event_paranoid setting */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* count worker threads of the library too */
+        attr.inherit = 1;
+        const long fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+        if (fd >= 0) {
+            counters->fd[i] = (int) fd;
+            available = true;
+        } else if (errno == EACCES || errno == EPERM) {
+            *error = "access denied, check /proc/sys/kernel/perf_event_paranoid";
+        } else {
+            *error = "no PMU, or virtual machine without PMU passthrough";
+        }
+    }
+#endif
+    return available;
+}
+
+/**
+ @brief Read current values of counters
+ @param[in] counters Opened counters
+ @param[out] values Counter values, zero for counters that are not available
+ */
+void perf_counters_read(const PerfCounters *counters, uint64_t values[PERF_COUNTERS_COUNT]) {
+    for (int i = 0; i < PERF_COUNTERS_COUNT; i++) {
+        values[i] = 0;
+#ifdef HAVE_LINUX_PERF_EVENT_H
+        if (counters->fd[i] >= 0) {
+            uint64_t value;
+            if (read(counters->fd[i], &value, sizeof(value)) == (ssize_t) sizeof(value)) {
+                values[i] = value;
+            }
+        }
+#endif
+    }
+}
+
+/**
+ @brief Check whether counter is available
+ @param[in] counters Opened counters
+ @param[in] counter Counter index
+ @return True if counter is available
+ */
+bool perf_counter_available(const PerfCounters *counters, const int counter) {
+    return counters->fd[counter] >= 0;
+}
+
+/**
+ @brief Close counters
+ @param[in,out] counters Opened counters
+ */
+void perf_counters_close(PerfCounters *counters) {
+    for (int i = 0; i < PERF_COUNTERS_COUNT; i++) {
+#ifdef HAVE_LINUX_PERF_EVENT_H
+        if (counters->fd[i] >= 0) {
+            close(counters->fd[i]);
+        }
+#endif
+        counters->fd[i] = -1;
+    }
+}
@@ -0,0 +1,52 @@
+/** @file perfcount.h
+ *
+ * Copyright (c) 2014 Bartek Fabiszewski
+ * http://www.fabiszewski.net
+ *
+ * This file is part of libmobi.
+ * Licensed under LGPL, either version 3, or any later.
+ * See <http://www.gnu.org/licenses/>
+ */
+
+/** Hardware performance counters for benchmarks, Linux perf_event_open */
+
+#ifndef libmobi_perfcount_h
+#define libmobi_perfcount_h
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ @brief Counted hardware events
+ */
+enum {
+    PERF_CYCLES, /**< CPU cycles */
+    PERF_INSTRUCTIONS, /**< Retired instructions */
+    PERF_CACHE_MISSES, /**< Last level cache misses */
+    PERF_BRANCH_MISSES, /**< Mispredicted branches */
+    PERF_COUNTERS_COUNT
+};
+
+/**
+ @brief Set of opened counters
+ */
+typedef struct {
+    int fd[PERF_COUNTERS_COUNT]; /**< Counter descriptors, -1 if event is not available */
+} PerfCounters;
+
+extern const char *perf_counter_names[PERF_COUNTERS_COUNT];
+
+bool perf_counters_open(PerfCounters *counters, const char **error);
+void perf_counters_read(const PerfCounters *counters, uint64_t values[PERF_COUNTERS_COUNT]);
+bool perf_counter_available(const PerfCounters *counters, const int counter);
+void perf_counters_close(PerfCounters *counters);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif